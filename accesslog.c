@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "defines.h"
+#include "accesslog.h"
+
+/**
+ * Every worker formats its entries in its own buffer, which is written in one
+ * go when it is nearly full or when its oldest entry gets too old. The file
+ * is opened with O_APPEND so that the buffers of several workers never
+ * overwrite each other.
+ */
+
+typedef struct {
+  char buffer[ACCESSLOG_BUFFER_SIZE];
+  size_t position;
+  uint64_t oldest_ns;
+  uint64_t sampled;
+  // Formatted local time, refreshed once per second
+  time_t date_second;
+  char date[32];
+} accesslog_buffer_t;
+
+// Set from the SIGHUP handler, the file is reopened by the next tick
+volatile sig_atomic_t g_accesslog_reopen = 0;
+
+static int g_accesslog_fd = -1;
+static char *g_accesslog_filename = NULL;
+static accesslog_format_e g_accesslog_format = E_ACCESSLOG_COMBINED;
+// Log one successful request out of g_accesslog_sampling. Errors are
+// always logged
+static uint32_t g_accesslog_sampling = 1;
+static __thread accesslog_buffer_t *t_accesslog = NULL;
+
+static int open_file(const char *filename) {
+  int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) perror(filename);
+  return fd;
+}
+
+int8_t accesslog_open(const char *filename, accesslog_format_e format,
+  uint32_t sampling) {
+  if ((g_accesslog_fd = open_file(filename)) < 0) return ERROR;
+  g_accesslog_filename = strdup(filename);
+  g_accesslog_format = format;
+  g_accesslog_sampling = sampling ? sampling : 1;
+  return 0;
+}
+
+int8_t accesslog_enabled() {
+  return g_accesslog_fd >= 0;
+}
+
+static void flush(accesslog_buffer_t *log) {
+  size_t written = 0;
+  while (written < log->position) {
+    ssize_t len = write(g_accesslog_fd, log->buffer + written,
+      log->position - written);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      LOG_ERROR("cannot write access log: %s\n", strerror(errno));
+      break;
+    }
+    written += len;
+  }
+  log->position = 0;
+}
+
+/**
+ * Copy a value, escaping what could forge a log entry or end a quoted field
+ * as \xHH. Returns the length copied, truncated to fit in size.
+ */
+size_t accesslog_escape(char *dst, size_t size, const char *value) {
+  static const char hex[] = "0123456789abcdef";
+  size_t position = 0;
+  if (size == 0) return 0;
+  for (const unsigned char *s = (const unsigned char *) value;
+       *s && position + 4 < size; ++s) {
+    if (*s == '"' || *s == '\\' || *s < 0x20 || *s >= 0x7F) {
+      dst[position++] = '\\';
+      dst[position++] = 'x';
+      dst[position++] = hex[*s >> 4];
+      dst[position++] = hex[*s & 0xF];
+    } else dst[position++] = *s;
+  }
+  dst[position] = 0;
+  return position;
+}
+
+/**
+ * Copy a header value between quotes, escaped.
+ */
+static size_t escape(char *dst, size_t size, const char *value) {
+  if (value == NULL) return snprintf(dst, size, "\"-\"");
+  if (size < 3) return 0;
+  dst[0] = '"';
+  size_t position = 1 + accesslog_escape(dst + 1, size - 2, value);
+  dst[position++] = '"';
+  dst[position] = 0;
+  return position;
+}
+
+static const char *date(accesslog_buffer_t *log) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  if (ts.tv_sec != log->date_second) {
+    struct tm tm;
+    localtime_r(&ts.tv_sec, &tm);
+    strftime(log->date, sizeof (log->date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    log->date_second = ts.tv_sec;
+  }
+  return log->date;
+}
+
+void accesslog_record(client_t *client, request_t *request) {
+  if (g_accesslog_fd < 0) return;
+  if (t_accesslog == NULL && (t_accesslog = calloc(1, sizeof (accesslog_buffer_t))) == NULL) {
+    perror("calloc");
+    return;
+  }
+  accesslog_buffer_t *log = t_accesslog;
+  if (g_status_code[request->status].code < 400 &&
+      log->sampled++ % g_accesslog_sampling != 0) return;
+
+  char address[INET6_ADDRSTRLEN] = "-";
+  if (client != NULL && client->client_addr != NULL) {
+    struct sockaddr_in *in = (struct sockaddr_in *) client->client_addr;
+    inet_ntop(AF_INET, &in->sin_addr, address, sizeof (address));
+  }
+  uint64_t now = now_ns();
+  char line[ACCESSLOG_MAX_LINE];
+  size_t len;
+  if (request->path != NULL) {
+    // Decoded, it may hold anything but NUL
+    char path[ACCESSLOG_MAX_LINE];
+    accesslog_escape(path, sizeof (path), request->path);
+    len = snprintf(line, ACCESSLOG_MAX_LINE, "%s - - [%s] \"%s /%s %s\" %u %lu",
+      address, date(log), g_methods[request->method], path,
+      g_version[request->http_version], g_status_code[request->status].code,
+      request->bytes_sent);
+  } else {
+    len = snprintf(line, ACCESSLOG_MAX_LINE, "%s - - [%s] \"-\" %u %lu",
+      address, date(log), g_status_code[request->status].code, request->bytes_sent);
+  }
+  if (len >= ACCESSLOG_MAX_LINE - 1) len = ACCESSLOG_MAX_LINE - 2;
+  if (g_accesslog_format == E_ACCESSLOG_COMBINED) {
+    line[len++] = ' ';
+    len += escape(line + len, ACCESSLOG_MAX_LINE - len, request->headers[REFERER]);
+    line[len++] = ' ';
+    len += escape(line + len, ACCESSLOG_MAX_LINE - len, request->headers[USER_AGENT]);
+    // Request duration in microseconds
+    len += snprintf(line + len, ACCESSLOG_MAX_LINE - len, " %lu",
+      (now - request->start_ns) / 1000);
+    if (len >= ACCESSLOG_MAX_LINE - 1) len = ACCESSLOG_MAX_LINE - 2;
+  }
+  line[len++] = '\n';
+
+  if (log->position + len > ACCESSLOG_BUFFER_SIZE) flush(log);
+  if (log->position == 0) log->oldest_ns = now;
+  memcpy(log->buffer + log->position, line, len);
+  log->position += len;
+  if (log->position >= ACCESSLOG_FLUSH_SIZE) flush(log);
+}
+
+/**
+ * Called by the event loop at least every ACCESSLOG_FLUSH_INTERVAL_MS to
+ * write old entries and to reopen the file after a SIGHUP.
+ */
+void accesslog_tick() {
+  if (g_accesslog_fd < 0) return;
+  accesslog_buffer_t *log = t_accesslog;
+  if (g_accesslog_reopen) {
+    g_accesslog_reopen = 0;
+    if (log != NULL) flush(log);
+    // Swap the new file in place of the old one, writers keep the same fd
+    int fd = open_file(g_accesslog_filename);
+    if (fd >= 0) {
+      if (dup2(fd, g_accesslog_fd) < 0) perror("dup2");
+      close(fd);
+      LOG_MSG("access log %s reopened\n", g_accesslog_filename);
+    }
+  }
+  if (log != NULL && log->position > 0 &&
+      now_ns() - log->oldest_ns >= ACCESSLOG_FLUSH_INTERVAL_MS * 1000000ULL)
+    flush(log);
+}
+
+void accesslog_close() {
+  if (g_accesslog_fd < 0) return;
+  if (t_accesslog != NULL) {
+    flush(t_accesslog);
+    free(t_accesslog);
+    t_accesslog = NULL;
+  }
+  close(g_accesslog_fd);
+  g_accesslog_fd = -1;
+  free(g_accesslog_filename);
+  g_accesslog_filename = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "defines.h"
+
+#define ACCESSLOG_BUFFER_SIZE 65536
+// A worker writes its buffer once it holds that many bytes...
+#define ACCESSLOG_FLUSH_SIZE 49152
+// ...or once its oldest entry is that old
+#define ACCESSLOG_FLUSH_INTERVAL_MS 1000
+#define ACCESSLOG_MAX_LINE 4096
+
+typedef enum {
+  E_ACCESSLOG_COMBINED = 0,
+  E_ACCESSLOG_COMMON
+} accesslog_format_e;
+
+extern volatile sig_atomic_t g_accesslog_reopen;
+
+int8_t accesslog_open(const char *filename, accesslog_format_e format,
+  uint32_t sampling);
+int8_t accesslog_enabled();
+size_t accesslog_escape(char *dst, size_t size, const char *value);
+void accesslog_record(client_t *client, request_t *request);
+void accesslog_tick();
+void accesslog_close();
+
+#endif // __ACCESSLOG_H__
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "admission.h"
+
+/**
+ * The queue delay of a request is the time since its bytes became readable,
+ * estimated from the turns of the event loop: when poll blocked, they
+ * arrived as it returned; when it returned at once, they arrived during the
+ * previous turn, on average in its middle.
+ *
+ * As in CoDel, the loop is overloaded when even the shortest delay of an
+ * interval was above the target: a standing queue, not a burst. Requests
+ * are then shed as soon as they waited more than the target, instead of
+ * the interval otherwise (the queue timeouts of the adaptive CoDel used by
+ * RPC servers), and accepts are paused until an interval goes by below the
+ * target.
+ */
+
+// 0 for no delay target, no in flight limit
+uint64_t g_admission_target_ms = 0;
+uint32_t g_admission_max_in_flight = 0;
+
+static uint64_t g_arrival_ns = 0;
+static uint64_t g_wakeup_ns = 0;
+static uint32_t g_in_flight = 0;
+// Shortest delay since the interval started, UINT64_MAX if none was seen
+static uint64_t g_interval_end_ns = 0;
+static uint64_t g_min_delay_ns = UINT64_MAX;
+static uint8_t g_overloaded = 0;
+
+static char g_503[BUFFER_SIZE];
+static size_t g_503_len = 0;
+
+int8_t admission_init() {
+  g_503_len = snprintf(g_503, BUFFER_SIZE,
+    "HTTP/1.1 503 Service Unavailable\n"
+    "Server: shttpd/%i.%i.%i\n"
+    "Retry-After: %i\n"
+    "Content-length: 0\n"
+    "\n",
+    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, ADMISSION_RETRY_AFTER);
+  return 0;
+}
+
+static void end_interval(uint64_t now) {
+  if (now < g_interval_end_ns) return;
+  uint8_t overloaded = g_min_delay_ns != UINT64_MAX &&
+    g_min_delay_ns > g_admission_target_ms * 1000000;
+  if (overloaded && !g_overloaded) {
+    LOG_WARNING("overloaded, requests waited %lu us at least\n", g_min_delay_ns / 1000);
+    METRIC_INC(overloads);
+  }
+  g_overloaded = overloaded;
+  g_min_delay_ns = UINT64_MAX;
+  g_interval_end_ns = now + ADMISSION_INTERVAL_MS * 1000000ULL;
+}
+
+/**
+ * Called by the event loop as poll returns, poll_ns being the time it was
+ * called.
+ */
+void admission_turn(uint64_t poll_ns) {
+  if (g_admission_target_ms == 0) return;
+  uint64_t now = now_ns();
+  // Blocked for more than a millisecond: the events are fresh
+  g_arrival_ns = now - poll_ns > 1000000 || g_wakeup_ns == 0 ?
+    now : g_wakeup_ns + (poll_ns - g_wakeup_ns) / 2;
+  g_wakeup_ns = now;
+  end_interval(now);
+}
+
+/**
+ * New connections wait in the backlog while overloaded. Over the in flight
+ * limit, they are accepted to be answered 503 at once.
+ */
+uint8_t admission_paused() {
+  return g_overloaded;
+}
+
+/**
+ * Milliseconds until the end of the interval while accepts are paused, so
+ * that they resume even if no request comes, -1 otherwise.
+ */
+int admission_timeout() {
+  return admission_paused() ? ADMISSION_INTERVAL_MS : -1;
+}
+
+/**
+ * Returns 1 if the request is to be shed, otherwise counts it in flight
+ * until admission_done.
+ */
+int8_t admission_check(request_t *request) {
+  if (g_admission_max_in_flight && g_in_flight >= g_admission_max_in_flight) {
+    METRIC_INC(shed_in_flight);
+    return 1;
+  }
+  if (g_admission_target_ms) {
+    uint64_t now = now_ns();
+    uint64_t delay = now - g_arrival_ns;
+    if (delay < g_min_delay_ns) g_min_delay_ns = delay;
+    end_interval(now);
+    uint64_t timeout = g_overloaded ? g_admission_target_ms : ADMISSION_INTERVAL_MS;
+    if (delay > timeout * 1000000) {
+      METRIC_INC(shed_queue_delay);
+      return 1;
+    }
+  }
+  request->admitted = 1;
+  ++g_in_flight;
+  return 0;
+}
+
+void admission_done(request_t *request) {
+  if (!request->admitted) return;
+  request->admitted = 0;
+  --g_in_flight;
+}
+
+/**
+ * Answer a shed request.
+ */
+int8_t admission_reject(int32_t clientfd, request_t *request) {
+  request->status = _503;
+  return send_response(clientfd, g_503, g_503_len);
+}
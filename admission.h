@@ -0,0 +1,28 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <stdint.h>
+
+#include "defines.h"
+
+/**
+ * Admission control: when the requests wait longer than a target delay in
+ * the event loop, or too many are in flight, new requests are answered with
+ * a precomputed 503 and new connections left in the backlog, so that the
+ * admitted requests keep their latency.
+ */
+#define ADMISSION_INTERVAL_MS 100
+#define ADMISSION_RETRY_AFTER 1
+
+extern uint64_t g_admission_target_ms;
+extern uint32_t g_admission_max_in_flight;
+
+int8_t admission_init();
+void admission_turn(uint64_t poll_ns);
+uint8_t admission_paused();
+int admission_timeout();
+int8_t admission_check(request_t *request);
+int8_t admission_reject(int32_t clientfd, request_t *request);
+void admission_done(request_t *request);
+
+#endif // __ADMISSION_H__
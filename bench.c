@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "httpd.h"
+#include "mime.h"
+#include "bench_corpus.h"
+#include "ratelimit.h"
+#include "hpack.h"
+
+#define DEFAULT_WARMUP 200
+#define DEFAULT_ITERATIONS 2000
+#define DEFAULT_REPETITIONS 25
+#define DEFAULT_THRESHOLD 5.0
+#define MAX_REPETITIONS 1000
+
+// Keep the compiler from optimizing away the measured computation
+#define DO_NOT_OPTIMIZE(x) __asm__ volatile("" : : "g"(x) : "memory")
+
+typedef struct {
+  const char *name;
+  // Run one pass over the corpus. Returns the number of bytes processed and
+  // sets *ops to the number of calls made to the measured function.
+  size_t (*run)(size_t *ops);
+} bench_t;
+
+typedef struct {
+  double min;
+  double median;
+  double mean;
+  double stddev;
+  double max;
+  double bytes_per_cycle;
+} summary_t;
+
+typedef struct {
+  uint32_t warmup;
+  uint32_t iterations;
+  uint32_t repetitions;
+  double threshold;
+  char *output;
+  char *baseline;
+} bench_options_t;
+
+// Mutable copies of the corpus, the functions under test take char *
+static char g_requests[NB_CORPUS][BUFFER_SIZE];
+static ssize_t g_request_sizes[NB_CORPUS];
+static ssize_t g_header_offsets[NB_CORPUS];
+static char g_paths[NB_CORPUS][BUFFER_SIZE];
+static char g_targets[NB_CORPUS][BUFFER_SIZE];
+static char g_extensions[NB_CORPUS_EXTENSIONS][16];
+
+/**
+ * Reference cycles from the time stamp counter. Returns 0 on architectures
+ * without one, in which case bytes/cycle is not reported.
+ */
+static inline uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+size_t bench_next_token(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    char *head = g_requests[i];
+    char *token;
+    int16_t len;
+    while ((len = next_token(head, &token)) >= 0) {
+      DO_NOT_OPTIMIZE(token);
+      head = token + len;
+      ++*ops;
+    }
+    ++*ops;
+    bytes += g_request_sizes[i];
+  }
+  return bytes;
+}
+
+size_t bench_end_of_header(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    ssize_t eoh = end_of_header(g_requests[i], g_request_sizes[i]);
+    DO_NOT_OPTIMIZE(eoh);
+    bytes += g_request_sizes[i];
+    ++*ops;
+  }
+  return bytes;
+}
+
+size_t bench_parse_request_line(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    request_t request;
+    memset(&request, 0, sizeof (request));
+    ssize_t ret = parse_request_line(g_requests[i], &request);
+    DO_NOT_OPTIMIZE(ret);
+    free_request(request);
+    bytes += g_header_offsets[i];
+    ++*ops;
+  }
+  return bytes;
+}
+
+size_t bench_parse_headers(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    request_t request;
+    memset(&request, 0, sizeof (request));
+    ssize_t ret = parse_headers(&g_requests[i][g_header_offsets[i]], &request);
+    DO_NOT_OPTIMIZE(ret);
+    free_request(request);
+    bytes += g_request_sizes[i] - g_header_offsets[i];
+    ++*ops;
+  }
+  return bytes;
+}
+
+size_t bench_get_extension(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    size_t len = strlen(g_paths[i]);
+    char *ext = get_extension(g_paths[i], len);
+    DO_NOT_OPTIMIZE(ext);
+    bytes += len;
+    ++*ops;
+  }
+  return bytes;
+}
+
+size_t bench_normalize_path(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    char buffer[BUFFER_SIZE];
+    size_t len = strlen(g_targets[i]);
+    memcpy(buffer, g_targets[i], len + 1);
+    char *query;
+    ssize_t ret = normalize_path(buffer, len, &query);
+    DO_NOT_OPTIMIZE(ret);
+    bytes += len;
+    ++*ops;
+  }
+  return bytes;
+}
+
+size_t bench_get_mime_type(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS_EXTENSIONS; ++i) {
+    const char *type = get_mime_type(g_extensions[i]);
+    DO_NOT_OPTIMIZE(type);
+    bytes += strlen(g_extensions[i]);
+    ++*ops;
+  }
+  return bytes;
+}
+
+// Distinct clients are cycled through, more than the table has buckets
+#define BENCH_RATELIMIT_KEYS 4096
+#define BENCH_RATELIMIT_SLOTS 16384
+#define BENCH_RATELIMIT_CLIENTS (4 * BENCH_RATELIMIT_SLOTS)
+
+size_t bench_ratelimit(size_t *ops) {
+  static uint64_t client = 0;
+  static uint64_t ms = 0;
+  // The table is only made for this benchmark, on its first run
+  if (ms == 0 && ratelimit_init(100, 100, BENCH_RATELIMIT_SLOTS)) return 0;
+  ++ms;
+  for (size_t i = 0; i < BENCH_RATELIMIT_KEYS; ++i) {
+    client = (client + 1) % BENCH_RATELIMIT_CLIENTS;
+    int8_t ret = ratelimit_allow(1ULL << 32 | client, ms);
+    DO_NOT_OPTIMIZE(ret);
+    ++*ops;
+  }
+  return BENCH_RATELIMIT_KEYS * sizeof (uint64_t);
+}
+
+// The requests with Huffman coding of RFC 7541 C.4, decoded on the same table
+static const uint8_t g_hpack_blocks[][24] = {
+  { 0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0,
+    0xab, 0x90, 0xf4, 0xff },
+  { 0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf },
+  { 0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9, 0x7d,
+    0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf },
+};
+static const size_t g_hpack_sizes[] = { 17, 12, 24 };
+
+static int8_t count_header(void *context, const char *name, size_t name_len,
+  const char *value, size_t value_len) {
+  (void) name;
+  (void) value;
+  *(size_t *) context += name_len + value_len;
+  return 0;
+}
+
+size_t bench_hpack_decode(size_t *ops) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    hpack_table_t table;
+    hpack_init(&table);
+    size_t decoded = 0;
+    for (size_t j = 0; j < 3; ++j) {
+      int8_t ret = hpack_decode(&table, g_hpack_blocks[j], g_hpack_sizes[j],
+        count_header, &decoded);
+      DO_NOT_OPTIMIZE(ret);
+      bytes += g_hpack_sizes[j];
+      ++*ops;
+    }
+    DO_NOT_OPTIMIZE(decoded);
+    hpack_free(&table);
+  }
+  return bytes;
+}
+
+static const bench_t g_benchmarks[] = {
+  { "next_token", bench_next_token },
+  { "end_of_header", bench_end_of_header },
+  { "parse_request_line", bench_parse_request_line },
+  { "parse_headers", bench_parse_headers },
+  { "get_extension", bench_get_extension },
+  { "normalize_path", bench_normalize_path },
+  { "get_mime_type", bench_get_mime_type },
+  { "ratelimit", bench_ratelimit },
+  { "hpack_decode", bench_hpack_decode },
+};
+
+#define NB_BENCHMARKS (sizeof (g_benchmarks) / sizeof (g_benchmarks[0]))
+
+int8_t prepare_corpus() {
+  for (size_t i = 0; i < NB_CORPUS; ++i) {
+    size_t len = strlen(g_corpus[i].request);
+    if (len >= BUFFER_SIZE) {
+      LOG_ERROR("corpus entry %s too large\n", g_corpus[i].name);
+      return ERROR;
+    }
+    memcpy(g_requests[i], g_corpus[i].request, len + 1);
+    g_request_sizes[i] = len;
+    request_t request;
+    memset(&request, 0, sizeof (request));
+    int8_t offset = parse_request_line(g_requests[i], &request);
+    if (offset <= 0) {
+      LOG_ERROR("corpus entry %s does not parse\n", g_corpus[i].name);
+      return ERROR;
+    }
+    // parse_request_line returns an int8_t, find the headers ourselves so
+    // long request lines do not wrap around
+    char *eol = strchr(g_requests[i], '\n');
+    g_header_offsets[i] = eol - g_requests[i] + 1;
+    strncpy(g_paths[i], request.path, BUFFER_SIZE - 1);
+    // The raw request target, before normalization
+    char *target = strchr(g_requests[i], ' ') + 1;
+    memcpy(g_targets[i], target, strcspn(target, " \r\n"));
+    free_request(request);
+  }
+  for (size_t i = 0; i < NB_CORPUS_EXTENSIONS; ++i)
+    strncpy(g_extensions[i], g_corpus_extensions[i], sizeof (g_extensions[i]) - 1);
+  return 0;
+}
+
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+void summarize(double *samples, uint32_t n, summary_t *summary) {
+  qsort(samples, n, sizeof (double), compare_double);
+  double sum = 0;
+  for (uint32_t i = 0; i < n; ++i) sum += samples[i];
+  summary->min = samples[0];
+  summary->max = samples[n - 1];
+  summary->mean = sum / n;
+  summary->median = n % 2 ? samples[n / 2] :
+    (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  double variance = 0;
+  for (uint32_t i = 0; i < n; ++i)
+    variance += (samples[i] - summary->mean) * (samples[i] - summary->mean);
+  summary->stddev = n > 1 ? sqrt(variance / (n - 1)) : 0;
+}
+
+void run_benchmark(const bench_t *bench, bench_options_t *options,
+  summary_t *summary) {
+  double samples[MAX_REPETITIONS];
+  size_t ops = 0;
+  for (uint32_t i = 0; i < options->warmup; ++i) bench->run(&ops);
+  uint64_t total_bytes = 0;
+  uint64_t total_cycles = 0;
+  for (uint32_t r = 0; r < options->repetitions; ++r) {
+    ops = 0;
+    size_t bytes = 0;
+    uint64_t start_cycles = now_cycles();
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < options->iterations; ++i) bytes += bench->run(&ops);
+    uint64_t elapsed = now_ns() - start;
+    total_cycles += now_cycles() - start_cycles;
+    total_bytes += bytes;
+    samples[r] = (double) elapsed / ops;
+  }
+  summarize(samples, options->repetitions, summary);
+  summary->bytes_per_cycle = total_cycles ? (double) total_bytes / total_cycles : 0;
+}
+
+/**
+ * Find the median ns/op recorded for a benchmark in a JSON file previously
+ * written by write_json. Returns a negative value if not found.
+ */
+double baseline_value(char *json, const char *name) {
+  char key[64];
+  snprintf(key, sizeof (key), "\"name\": \"%s\"", name);
+  char *entry = strstr(json, key);
+  if (entry == NULL) return -1;
+  char *value = strstr(entry, "\"ns_per_op\":");
+  if (value == NULL) return -1;
+  double result;
+  if (sscanf(value + strlen("\"ns_per_op\":"), "%lf", &result) != 1) return -1;
+  return result;
+}
+
+char *read_file(const char *filename) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  char *content = calloc(size + 1, 1);
+  if (content == NULL || fread(content, 1, size, file) != (size_t) size) {
+    perror("read baseline");
+    free(content);
+    content = NULL;
+  }
+  fclose(file);
+  return content;
+}
+
+int8_t write_json(const char *filename, summary_t *summaries) {
+  FILE *file = fopen(filename, "w");
+  if (file == NULL) {
+    perror(filename);
+    return ERROR;
+  }
+  fprintf(file, "{\n  \"corpus_size\": %zu,\n  \"benchmarks\": [\n", NB_CORPUS);
+  for (size_t i = 0; i < NB_BENCHMARKS; ++i) {
+    fprintf(file, "    { \"name\": \"%s\", \"ns_per_op\": %.3f, \"min\": %.3f, "
+      "\"mean\": %.3f, \"stddev\": %.3f, \"max\": %.3f, \"bytes_per_cycle\": %.4f }%s\n",
+      g_benchmarks[i].name, summaries[i].median, summaries[i].min,
+      summaries[i].mean, summaries[i].stddev, summaries[i].max,
+      summaries[i].bytes_per_cycle, i + 1 < NB_BENCHMARKS ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  return 0;
+}
+
+void usage(char **argv) {
+  fprintf(stderr, "usage: %s [-w warmup] [-n iterations] [-r repetitions] "
+    "[-o output.json] [-b baseline.json] [-t threshold%%]\n", argv[0]);
+}
+
+int main(int argc, char **argv) {
+  bench_options_t options = {
+    DEFAULT_WARMUP, DEFAULT_ITERATIONS, DEFAULT_REPETITIONS, DEFAULT_THRESHOLD,
+    NULL, NULL
+  };
+  int opt;
+  while ((opt = getopt(argc, argv, "w:n:r:o:b:t:")) != -1) {
+    switch (opt) {
+    case 'w': options.warmup = strtoul(optarg, NULL, 10); break;
+    case 'n': options.iterations = strtoul(optarg, NULL, 10); break;
+    case 'r': options.repetitions = strtoul(optarg, NULL, 10); break;
+    case 'o': options.output = optarg; break;
+    case 'b': options.baseline = optarg; break;
+    case 't': options.threshold = strtod(optarg, NULL); break;
+    default:
+      usage(argv);
+      return ERROR;
+    }
+  }
+  if (options.repetitions == 0 || options.repetitions > MAX_REPETITIONS ||
+      options.iterations == 0) {
+    usage(argv);
+    return ERROR;
+  }
+  if (prepare_corpus()) return ERROR;
+  char *baseline = NULL;
+  if (options.baseline != NULL && (baseline = read_file(options.baseline)) == NULL)
+    return ERROR;
+
+  summary_t summaries[NB_BENCHMARKS];
+  uint8_t regressions = 0;
+  printf("%-20s %10s %10s %10s %10s %10s", "benchmark", "ns/op", "min",
+    "mean", "stddev", "bytes/cyc");
+  if (baseline) printf(" %10s %8s", "baseline", "delta");
+  printf("\n");
+  for (size_t i = 0; i < NB_BENCHMARKS; ++i) {
+    run_benchmark(&g_benchmarks[i], &options, &summaries[i]);
+    printf("%-20s %10.2f %10.2f %10.2f %10.2f %10.3f", g_benchmarks[i].name,
+      summaries[i].median, summaries[i].min, summaries[i].mean,
+      summaries[i].stddev, summaries[i].bytes_per_cycle);
+    if (baseline) {
+      double reference = baseline_value(baseline, g_benchmarks[i].name);
+      if (reference > 0) {
+        double delta = (summaries[i].median - reference) / reference * 100;
+        printf(" %10.2f %+7.1f%%", reference, delta);
+        if (delta > options.threshold) {
+          printf(" REGRESSION");
+          ++regressions;
+        }
+      } else printf(" %10s", "n/a");
+    }
+    printf("\n");
+  }
+  free(baseline);
+  if (options.output != NULL && write_json(options.output, summaries)) return ERROR;
+  return regressions ? 1 : 0;
+}
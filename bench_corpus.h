@@ -0,0 +1,147 @@
+#ifndef __BENCH_CORPUS_H__
+#define __BENCH_CORPUS_H__
+
+/**
+ * Request headers captured from real clients hitting a static site, kept
+ * byte-for-byte (CRLF included). Used by the microbenchmarks so parser
+ * numbers reflect what browsers, command line tools and crawlers send.
+ */
+
+typedef struct {
+  const char *name;
+  const char *request;
+} corpus_entry_t;
+
+static const corpus_entry_t g_corpus[] = {
+  { "chrome",
+    "GET /assets/js/app.3f2a9c.js HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.org/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+    "Cookie: _ga=GA1.2.1183446017.1697022071; _gid=GA1.2.1960344133.1697022071; session=9f8e7d6c5b4a\r\n"
+    "If-None-Match: \"64f1a2b3-1c4e2\"\r\n"
+    "If-Modified-Since: Fri, 01 Sep 2023 08:12:03 GMT\r\n"
+    "\r\n" },
+  { "firefox",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "DNT: 1\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "\r\n" },
+  { "safari",
+    "GET /img/hero@2x.webp HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "Accept: image/webp,image/avif,video/*;q=0.8,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: fr-FR,fr;q=0.9\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: https://www.example.org/blog/2023/10/release-notes.html\r\n"
+    "User-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 17_0_3 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Mobile/15E148 Safari/604.1\r\n"
+    "\r\n" },
+  { "curl",
+    "GET /downloads/release-0.1.0.tar.gz HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n" },
+  { "curl-head",
+    "HEAD /robots.txt HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n" },
+  { "wget",
+    "GET /docs/manual.pdf HTTP/1.1\r\n"
+    "User-Agent: Wget/1.21.3\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: identity\r\n"
+    "Host: www.example.org\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n" },
+  { "googlebot",
+    "GET /sitemap.xml HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "Connection: keep-alive\r\n"
+    "Accept: text/html,application/xhtml+xml,application/signed-exchange;v=b3,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "From: googlebot(at)googlebot.com\r\n"
+    "User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "If-Modified-Since: Mon, 09 Oct 2023 22:41:17 GMT\r\n"
+    "\r\n" },
+  { "bingbot",
+    "GET /blog/feed.rss HTTP/1.1\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Pragma: no-cache\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "From: bingbot(at)microsoft.com\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: Mozilla/5.0 (compatible; bingbot/2.0; +http://www.bing.com/bingbot.htm)\r\n"
+    "\r\n" },
+  { "python-requests",
+    "GET /api/status.json HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "User-Agent: python-requests/2.31.0\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n" },
+  { "scanner",
+    "GET /wp-login.php HTTP/1.1\r\n"
+    "Host: 203.0.113.17\r\n"
+    "User-Agent: Mozilla/5.0 zgrab/0.x\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "\r\n" },
+  { "proxied",
+    "GET /css/main.min.css HTTP/1.1\r\n"
+    "Host: www.example.org\r\n"
+    "X-Forwarded-For: 198.51.100.23, 10.0.3.12\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "X-Request-ID: 4bf92f3577b34da6a3ce929d0e0e4736\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/117.0.0.0 Safari/537.36\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Referer: https://www.example.org/about.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: de-DE,de;q=0.9,en;q=0.8\r\n"
+    "\r\n" },
+  { "http10",
+    "GET /favicon.ico HTTP/1.0\n"
+    "User-Agent: ApacheBench/2.3\n"
+    "Host: www.example.org\n"
+    "Accept: */*\n"
+    "\n" },
+};
+
+#define NB_CORPUS (sizeof (g_corpus) / sizeof (g_corpus[0]))
+
+// Extensions seen in the access logs, in rough order of frequency
+static const char *g_corpus_extensions[] = {
+  "js", "css", "html", "png", "webp", "svg", "woff2", "jpg", "ico", "json",
+  "xml", "txt", "gz", "pdf", "map", "mp4", "php", "rss", "zip", "zmm",
+};
+
+#define NB_CORPUS_EXTENSIONS \
+  (sizeof (g_corpus_extensions) / sizeof (g_corpus_extensions[0]))
+
+#endif // __BENCH_CORPUS_H__
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "defines.h"
+#include "chunked.h"
+#include "metrics.h"
+#include "pagecache.h"
+#include "sched.h"
+#include "tls.h"
+
+/**
+ * The writer of a client (client->chunked) is opened before its response
+ * head is known, so that the client waits for it out of the poll set, and
+ * started with the head, which starts a transfer of the scheduler. The
+ * scheduler sends the buffer once the head is out (see chunked_send) and
+ * the producer refills it when it is half empty: the body is generated as
+ * fast as the client takes it, never ahead of it by more than
+ * CHUNKED_BUFFER_SIZE. A writer without producer is fed by its owner, which
+ * waits for room when chunked_write returns 1.
+ */
+
+/**
+ * How the body of a response with that status code ends for a client of that
+ * HTTP version.
+ */
+chunked_mode_e chunked_mode(uint8_t http_version, uint16_t code) {
+  if (code == 204 || code == 304) return CHUNKED_BODILESS;
+  return http_version == HTTP_1_1 ? CHUNKED_FRAMED : CHUNKED_UNTIL_CLOSE;
+}
+
+// The header line telling it, without its end of line, NULL if none
+const char *chunked_header(chunked_mode_e mode) {
+  switch (mode) {
+  case CHUNKED_FRAMED:
+    return "Transfer-Encoding: chunked";
+  case CHUNKED_UNTIL_CLOSE:
+    return "Connection: close";
+  default:
+    return NULL;
+  }
+}
+
+/**
+ * Open the writer of the response of the client. Returns NULL if out of
+ * memory.
+ */
+chunked_t *chunked_open(client_t *client, int8_t (*produce)(chunked_t *writer),
+  void (*release)(chunked_t *writer, uint8_t complete), void *context) {
+  chunked_t *writer = calloc(1, sizeof (chunked_t));
+  if (writer == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  writer->client = client;
+  writer->produce = produce;
+  writer->release = release;
+  writer->context = context;
+  client->chunked = writer;
+  return writer;
+}
+
+// Whether the body is dropped rather than sent
+static uint8_t bodiless(chunked_t *writer) {
+  return writer->mode == CHUNKED_BODILESS || writer->client->request.method == HEAD;
+}
+
+/**
+ * Send the response head, its body to follow. Returns ERROR if the
+ * connection is broken, or out of memory.
+ */
+int8_t chunked_start(client_t *client, const char *head, size_t head_len,
+  chunked_mode_e mode) {
+  chunked_t *writer = client->chunked;
+  writer->mode = mode;
+  if (!bodiless(writer) && (writer->buffer = malloc(CHUNKED_BUFFER_SIZE)) == NULL) {
+    perror("malloc");
+    return ERROR;
+  }
+  writer->started = 1;
+  return sched_start(client, head, head_len, -1, 0, 0, PAGECACHE_NORMAL);
+}
+
+// Bytes of data chunked_write takes now
+size_t chunked_room(chunked_t *writer) {
+  if (bodiless(writer)) return CHUNKED_BUFFER_SIZE;
+  size_t used = writer->buffered - writer->buffer_sent + CHUNKED_OVERHEAD;
+  return used < CHUNKED_BUFFER_SIZE ? CHUNKED_BUFFER_SIZE - used : 0;
+}
+
+// Make room for needed bytes. Returns 1 if there is not enough.
+static uint8_t reserve(chunked_t *writer, size_t needed) {
+  if (writer->buffered + needed > CHUNKED_BUFFER_SIZE && writer->buffer_sent > 0) {
+    memmove(writer->buffer, writer->buffer + writer->buffer_sent,
+      writer->buffered - writer->buffer_sent);
+    writer->buffered -= writer->buffer_sent;
+    writer->buffer_sent = 0;
+  }
+  return writer->buffered + needed > CHUNKED_BUFFER_SIZE;
+}
+
+/**
+ * Write data as a chunk of the body. Returns 1 if the buffer has no room for
+ * it yet, see chunked_room.
+ */
+int8_t chunked_write(chunked_t *writer, const char *data, size_t len) {
+  if (bodiless(writer) || writer->ended || len == 0) return 0;
+  char size[16];
+  int size_len = writer->mode == CHUNKED_FRAMED ?
+    snprintf(size, sizeof (size), "%zx\r\n", len) : 0;
+  size_t needed = size_len + len + (writer->mode == CHUNKED_FRAMED ? 2 : 0);
+  if (reserve(writer, needed)) return 1;
+  char *out = writer->buffer + writer->buffered;
+  memcpy(out, size, size_len);
+  memcpy(out + size_len, data, len);
+  if (writer->mode == CHUNKED_FRAMED) memcpy(out + size_len + len, "\r\n", 2);
+  writer->buffered += needed;
+  METRIC_ADD(queued_bytes, needed);
+  return 0;
+}
+
+/**
+ * End the body with the last chunk and its trailers, header lines each ended
+ * by CRLF (dropped when the body is not chunked). Returns 1 if the buffer
+ * has no room for them yet.
+ */
+int8_t chunked_end(chunked_t *writer, const char *trailers, size_t len) {
+  if (writer->ended) return 0;
+  if (!bodiless(writer) && writer->mode == CHUNKED_FRAMED) {
+    size_t needed = 3 + len + 2;
+    if (reserve(writer, needed)) return 1;
+    char *out = writer->buffer + writer->buffered;
+    memcpy(out, "0\r\n", 3);
+    memcpy(out + 3, trailers, len);
+    memcpy(out + 3 + len, "\r\n", 2);
+    writer->buffered += needed;
+    METRIC_ADD(queued_bytes, needed);
+  }
+  writer->ended = 1;
+  return 0;
+}
+
+// Whether part of the body waits for the client
+uint8_t chunked_pending(chunked_t *writer) {
+  return writer->buffer_sent < writer->buffered;
+}
+
+// Ask the producer for more of the body once half of the buffer is free
+static void fill(chunked_t *writer) {
+  if (writer->produce == NULL || writer->failed || writer->ended || !writer->started ||
+    writer->buffered - writer->buffer_sent > CHUNKED_BUFFER_SIZE / 2) return;
+  if (writer->produce(writer) < 0) writer->failed = 1;
+}
+
+// Whether the whole body went to the client
+uint8_t chunked_done(client_t *client) {
+  chunked_t *writer = client->chunked;
+  return writer->started && (bodiless(writer) ||
+    (writer->ended && writer->buffer_sent == writer->buffered));
+}
+
+// Whether the client has something to send, or the end of the body to see
+uint8_t chunked_ready(client_t *client) {
+  chunked_t *writer = client->chunked;
+  fill(writer);
+  return writer->failed || chunked_pending(writer) || chunked_done(client);
+}
+
+/**
+ * Send up to budget bytes of the body to the client, refilling the buffer as
+ * it goes. Returns the number of bytes sent or ERROR if the connection is
+ * broken or the producer failed.
+ */
+ssize_t chunked_send(client_t *client, size_t budget) {
+  chunked_t *writer = client->chunked;
+  size_t sent = 0;
+  while (sent < budget) {
+    if (!chunked_pending(writer)) fill(writer);
+    if (writer->failed) return ERROR;
+    if (!chunked_pending(writer)) break;
+    size_t count = writer->buffered - writer->buffer_sent;
+    if (count > budget - sent) count = budget - sent;
+    ssize_t len = tls_write(client->clientfd, writer->buffer + writer->buffer_sent, count);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return ERROR;
+    }
+    if (len == 0) break;
+    if ((writer->buffer_sent += len) == writer->buffered)
+      writer->buffered = writer->buffer_sent = 0;
+    sent += len;
+  }
+  return sent;
+}
+
+/**
+ * The response of the client is over, sent or given up on: the owner of the
+ * writer is told, and the writer freed.
+ */
+void chunked_finish(client_t *client) {
+  chunked_t *writer = client->chunked;
+  if (writer == NULL) return;
+  uint8_t complete = chunked_done(client);
+  METRIC_ADD(queued_bytes, -(writer->buffered - writer->buffer_sent));
+  if (complete && writer->mode == CHUNKED_UNTIL_CLOSE) shutdown(client->clientfd, SHUT_WR);
+  client->chunked = NULL;
+  if (writer->release != NULL) writer->release(writer, complete);
+  free(writer->buffer);
+  free(writer);
+}
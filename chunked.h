@@ -0,0 +1,64 @@
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "defines.h"
+
+/**
+ * Streaming response writer: the body of a response generated as it is sent,
+ * its length unknown when the head goes out. The body is framed with the
+ * chunked transfer encoding, or ends with the connection for HTTP/1.0
+ * clients, and goes through a bounded buffer which its producer fills as the
+ * client takes it. The last chunk may carry trailers.
+ *
+ * Not for HTTP/2 streams, whose responses go through h2_respond.
+ */
+#define CHUNKED_BUFFER_SIZE 131072
+// Bytes a chunk takes around its data at most: its size in hex and two CRLF
+#define CHUNKED_OVERHEAD 20
+
+typedef enum {
+  CHUNKED_FRAMED = 0,
+  CHUNKED_UNTIL_CLOSE,
+  // HEAD requests, 204 and 304 responses
+  CHUNKED_BODILESS,
+} chunked_mode_e;
+
+typedef struct chunked_s {
+  client_t *client;
+  chunked_mode_e mode;
+  // Called when the buffer has room, to write more of the body with
+  // chunked_write and end it with chunked_end; NULL for the writers fed from
+  // elsewhere. Returns ERROR to cut the response.
+  int8_t (*produce)(struct chunked_s *writer);
+  // Called once the client is done with the writer, complete or not
+  void (*release)(struct chunked_s *writer, uint8_t complete);
+  void *context;
+  // The response head went to the scheduler, and the body ended
+  uint8_t started;
+  uint8_t ended;
+  // The producer failed, the response is cut
+  uint8_t failed;
+  char *buffer;
+  size_t buffered;
+  size_t buffer_sent;
+} chunked_t;
+
+chunked_mode_e chunked_mode(uint8_t http_version, uint16_t code);
+const char *chunked_header(chunked_mode_e mode);
+chunked_t *chunked_open(client_t *client, int8_t (*produce)(chunked_t *writer),
+  void (*release)(chunked_t *writer, uint8_t complete), void *context);
+int8_t chunked_start(client_t *client, const char *head, size_t head_len,
+  chunked_mode_e mode);
+size_t chunked_room(chunked_t *writer);
+int8_t chunked_write(chunked_t *writer, const char *data, size_t len);
+int8_t chunked_end(chunked_t *writer, const char *trailers, size_t len);
+uint8_t chunked_pending(chunked_t *writer);
+uint8_t chunked_ready(client_t *client);
+uint8_t chunked_done(client_t *client);
+ssize_t chunked_send(client_t *client, size_t budget);
+void chunked_finish(client_t *client);
+
+#endif // __CHUNKED_H__
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sys/types.h>
 
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 1
@@ -13,20 +15,35 @@
 #define ERR_ACCESS -3
 #define ERR_UNKNOWN_METHOD -4
 #define FD_CLOSED -5
+#define ERR_BAD_REQUEST -6
 #define MAX_PORT_NO 0xFFFF
 #define BUFFER_SIZE 4096
 #define SOCKET_INDEX 0
-#define MAX_CLIENT 1024
+// Descriptors left to the files being sent, the logs and the threads
+#define FD_RESERVED 256
+// Caps the connection table when RLIMIT_NOFILE is unlimited
+#define MAX_FDS (1 << 20)
+// Connections accepted per turn of the event loop
+#define ACCEPT_BATCH 64
+// How long to wait for the rest of the headers once a request started,
+// by default
+#define HEADER_WAIT_MS 10000
+// Served for the paths of directories
+#define DEFAULT_INDEX "index.html"
 
 /** Some useful macro */
 
-#define LOG_MSG(format, ...) { fprintf(stdout, format, __VA_ARGS__); }
-#define LOG_ERROR(format, ...) { fprintf(stderr, "Error:"format, __VA_ARGS__); }
-#define LOG_WARNING(format, ...) { fprintf(stderr, "Warning:"format, __VA_ARGS__); }
-#define LOG_DEBUG(format, ...) \
-  { fprintf(stderr, "%s(%d) - %s: "format, __FILE__, __LINE__, __func__, __VA_ARGS__); }
+#define CACHE_LINE_SIZE 64
 
-//#define LOG_DEBUG(format, ...) {;}
+// LOG_MSG, LOG_ERROR, LOG_WARNING and LOG_DEBUG
+#include "log.h"
+
+// Monotonic time in nanoseconds, served from the vDSO without a syscall
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 // Days of the week 3-letters abbreviations
 static const char dow[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
@@ -89,6 +106,7 @@ static const char g_methods[][5] = { "GET", "HEAD" };
 #define X_CSRF_TOKEN 43
 #define X_REQUEST_ID 44
 #define X_CORRELATION_ID 45
+#define HTTP2_SETTINGS 46
 
 #define NB_HEADERS 47
 
@@ -100,7 +118,7 @@ static const char g_headers[][31] = {
   "Accept-Datetime",
   "Access-Control-Request-Method",
   "Access-Control-Request-Headers",
-  "Authorization Authentication",
+  "Authorization",
   "Cache-Control",
   "Connection",
   "Cookie",
@@ -135,26 +153,42 @@ static const char g_headers[][31] = {
   "X-ATT-DeviceId",
   "X-Wap-Profile",
   "Proxy-Connection",
-  "Proxy-Connection",
   "X-UIDH",
   "X-Csrf-Token",
   "X-Request-ID",
   "X-Correlation-ID",
+  "HTTP2-Settings",
 };
 
 #define HTTP_1_0 0
 #define HTTP_1_1 1
+#define HTTP_2 2
+// HTTP/2 is negotiated by the connection, never in a request line
 #define NB_VERSION 2
 
-static const char g_version[][9] = { "HTTP/1.0", "HTTP/1.1" };
+static const char g_version[][9] = { "HTTP/1.0", "HTTP/1.1", "HTTP/2.0" };
 
 typedef enum {
   _200 = 0,
+  _201,
+  _204,
+  _206,
+  _301,
+  _302,
+  _304,
+  _307,
+  _308,
   _400,
+  _401,
   _403,
   _404,
+  _405,
+  _429,
   _500,
   _501,
+  _502,
+  _503,
+  _504,
 } status_code_e;
 
 typedef struct {
@@ -162,15 +196,30 @@ typedef struct {
   char *message;
 } status_code_t;
 
-#define NB_STATUS_CODE 5
+// Those of the proxied responses too, see upstream.c
+#define NB_STATUS_CODE 20
 
 static const status_code_t g_status_code[] = {
   { 200, "OK" },
+  { 201, "Created" },
+  { 204, "No Content" },
+  { 206, "Partial Content" },
+  { 301, "Moved Permanently" },
+  { 302, "Found" },
+  { 304, "Not Modified" },
+  { 307, "Temporary Redirect" },
+  { 308, "Permanent Redirect" },
   { 400, "Bad Request" },
+  { 401, "Unauthorized" },
   { 403, "Forbidden" },
   { 404, "Not Found" },
+  { 405, "Method Not Allowed" },
+  { 429, "Too Many Requests" },
   { 500, "Internal Server Error" },
   { 501, "Not Implemented" },
+  { 502, "Bad Gateway" },
+  { 503, "Service Unavailable" },
+  { 504, "Gateway Timeout" },
 };
 
 typedef enum {
@@ -185,17 +234,56 @@ typedef struct {
 
 typedef enum {
   E_HTTP_1_0 = 0,
-  E_HTTP_1_1
+  E_HTTP_1_1,
+  E_HTTP_2
 } http_version_e;
 
+// Points in the life of a request timestamped when tracing is enabled
+typedef enum {
+  TRACE_ACCEPT = 0,
+  TRACE_WAKEUP,
+  TRACE_START,
+  TRACE_READ,
+  TRACE_PARSED,
+  TRACE_OPEN,
+  TRACE_HEADERS,
+  TRACE_BODY,
+  TRACE_END,
+  NB_TRACE_POINTS
+} trace_point_e;
+
+// Phases of a request measured by the hardware counters profiling
+typedef enum {
+  PERF_PHASE_PARSE = 0,
+  PERF_PHASE_MIME,
+  PERF_PHASE_RESPONSE,
+  NB_PERF_PHASES
+} perf_phase_e;
+
+#define NB_PERF_COUNTERS 4
+
 typedef struct {
   method_e method;
+  // Normalized, relative to the docroot
   char *path;
+  // The path named a directory, DEFAULT_INDEX was appended to it
+  uint8_t directory;
+  char *query;
   http_version_e http_version;
   char *headers[NB_HEADERS];
   extra_header_t *extra_headers;
   uint32_t nb_extra_headers;
   char *body;
+  // Bookkeeping of the response, for metrics and logs
+  status_code_e status;
+  size_t bytes_sent;
+  uint64_t start_ns;
+  uint64_t trace[NB_TRACE_POINTS];
+  uint64_t perf[NB_PERF_PHASES][NB_PERF_COUNTERS];
+  // Set when the response did not need to touch the file system
+  uint8_t cache_hit;
+  // Counted in flight by the admission control
+  uint8_t admitted;
 } request_t;
 
 /** End of HTTP related */
@@ -203,11 +291,108 @@ typedef struct {
 typedef struct {
   char *address;
   uint32_t portno;
+  char *metrics_path;
+  char *accesslog;
+  uint8_t accesslog_format;
+  uint32_t accesslog_sampling;
+  char *trace_path;
+  uint64_t trace_threshold_us;
+  uint8_t perf;
+  uint64_t connection_rate;
+  uint64_t global_rate;
+  uint8_t no_negcache;
+  uint8_t fileio_threads;
+  char *archive;
+  uint8_t warmup_threads;
+  char *manifest;
+  uint8_t warmup_wait;
+  uint64_t header_timeout_ms;
+  uint64_t idle_timeout_ms;
+  uint64_t stall_timeout_ms;
+  uint64_t rate_floor;
+  uint32_t max_per_ip;
+  uint64_t request_rate;
+  uint64_t request_burst;
+  uint64_t rate_limit_slots;
+  uint64_t target_delay_ms;
+  uint32_t max_in_flight;
+  uint64_t drain_timeout_ms;
+  char *cert;
+  char *key;
+  uint64_t upstream_timeout_ms;
+  uint64_t proxy_cache_memory;
+  char *proxy_cache_store;
+  uint64_t proxy_cache_store_size;
+  uint32_t gateway_processes;
+  uint32_t gateway_concurrency;
+  uint64_t gateway_timeout_ms;
 } option_t;
 
+// Response being sent on a connection, see sched.c
+typedef struct {
+  // Headers not written yet
+  char *head;
+  size_t head_len;
+  size_t head_sent;
+  // File the body is sent from, -1 if none
+  int32_t filefd;
+  off_t offset;
+  size_t remaining;
+  // Deficit round robin credit, in bytes
+  int64_t deficit;
+  // Bandwidth cap of the connection
+  double tokens;
+  uint64_t refill_ns;
+  // Throttled until then
+  uint64_t resume_ns;
+  // Start of the transfer and last time the socket took bytes
+  uint64_t start_ns;
+  uint64_t progress_ns;
+  uint8_t active;
+  // Page cache policy of the file, see pagecache.c
+  uint8_t policy;
+  // Dropped from the page cache up to there
+  off_t dropped;
+  // Aligned buffer of the O_DIRECT reads
+  char *buffer;
+  size_t buffered;
+  size_t buffer_sent;
+} transfer_t;
+
+/**
+ * About 1KB per connection (see the soak tool), plus the kernel socket
+ * buffers and the headers of the request being served.
+ */
 typedef struct client_s {
   struct sockaddr *client_addr;
-  int16_t clientfd;
+  int32_t clientfd;
+  uint64_t accept_ns;
+  uint32_t nb_requests;
+  uint64_t id;
+  // Waiting for the file operations pool
+  uint8_t io_pending;
+  // Headers read so far, only allocated while a request is partially read
+  char *header;
+  uint16_t header_len;
+  // First byte of the headers being read
+  uint64_t header_ns;
+  // Accept or end of the last response
+  uint64_t idle_ns;
+  // TLS session (an SSL of OpenSSL), NULL for plain HTTP
+  void *tls;
+  // Length of the TLS write which would block, retried with at least as many
+  // bytes as OpenSSL requires
+  size_t tls_pending;
+  // HTTP/2 connection state, NULL for HTTP/1.x, see h2.c
+  struct h2_conn_s *h2;
+  // Connection to the backend of a proxied request, see upstream.c
+  struct upstream_conn_s *upstream;
+  // Writer of a response generated as it is sent, see chunked.c
+  struct chunked_s *chunked;
+  // Request being served, kept until its response is fully sent
+  request_t request;
+  transfer_t transfer;
+  struct client_s *prev;
   struct client_s *next;
 } client_t;
 
@@ -0,0 +1,213 @@
+// preadv2
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "resolve.h"
+#include "sched.h"
+#include "h2.h"
+#include "fileio.h"
+
+/**
+ * The event loop opens files with RESOLVE_CACHED and checks that their first
+ * page is in the page cache (preadv2 with RWF_NOWAIT). When either would
+ * block, the connection is parked, or only the stream on an HTTP/2 one, and
+ * the job handed to the pool; the loop resumes the request once the eventfd
+ * signals its completion. Files in the cache are served inline as before.
+ */
+
+uint8_t g_fileio_enabled = 0;
+
+static pthread_t g_threads[FILEIO_MAX_THREADS];
+static int g_eventfd = -1;
+
+static pthread_mutex_t g_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_queue_cond = PTHREAD_COND_INITIALIZER;
+static fileio_job_t *g_queue_head = NULL;
+static fileio_job_t *g_queue_tail = NULL;
+static uint32_t g_queue_len = 0;
+
+static pthread_mutex_t g_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fileio_job_t *g_done = NULL;
+
+static void run(fileio_job_t *job) {
+  if (job->op == FILEIO_READ) {
+    job->result = pread(job->fd, job->buffer, job->size, job->offset);
+    job->err = job->result < 0 ? errno : 0;
+    return;
+  }
+  if (job->fd < 0) {
+    job->fd = resolve_open_beneath(job->path, O_RDONLY);
+    job->err = job->fd < 0 ? errno : 0;
+  }
+  // Blocks until the pages are read
+  if (job->fd >= 0) readahead(job->fd, 0, FILEIO_READAHEAD);
+}
+
+static void *fileio_loop(void *arg) {
+  (void) arg;
+  while (1) {
+    pthread_mutex_lock(&g_queue_mutex);
+    while (g_queue_head == NULL) pthread_cond_wait(&g_queue_cond, &g_queue_mutex);
+    fileio_job_t *job = g_queue_head;
+    g_queue_head = job->next;
+    if (g_queue_head == NULL) g_queue_tail = NULL;
+    --g_queue_len;
+    pthread_mutex_unlock(&g_queue_mutex);
+    run(job);
+    pthread_mutex_lock(&g_done_mutex);
+    job->next = g_done;
+    g_done = job;
+    pthread_mutex_unlock(&g_done_mutex);
+    uint64_t one = 1;
+    if (write(g_eventfd, &one, sizeof (one)) < 0) perror("write");
+  }
+  return NULL;
+}
+
+int8_t fileio_start(uint8_t nb_threads) {
+  if (nb_threads == 0) return 0;
+  if (nb_threads > FILEIO_MAX_THREADS) nb_threads = FILEIO_MAX_THREADS;
+  if ((g_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("eventfd");
+    return ERROR;
+  }
+  for (uint8_t i = 0; i < nb_threads; ++i) {
+    int ret;
+    if ((ret = pthread_create(&g_threads[i], NULL, fileio_loop, NULL)) != 0) {
+      errno = ret;
+      perror("pthread_create");
+      // The threads started so far keep serving
+      if (i == 0) return ERROR;
+      break;
+    }
+    pthread_detach(g_threads[i]);
+  }
+  g_fileio_enabled = 1;
+  return 0;
+}
+
+int fileio_fd() {
+  return g_eventfd;
+}
+
+/**
+ * Returns 1 if the first page of the file can be read without blocking.
+ */
+uint8_t fileio_cached(int fd) {
+  char byte;
+  struct iovec iov = { &byte, 1 };
+  return preadv2(fd, &iov, 1, 0, RWF_NOWAIT) >= 0 || errno != EAGAIN;
+}
+
+static int8_t queue(fileio_job_t *job) {
+  pthread_mutex_lock(&g_queue_mutex);
+  if (g_queue_len >= FILEIO_QUEUE_SIZE) {
+    pthread_mutex_unlock(&g_queue_mutex);
+    return ERROR;
+  }
+  if (g_queue_tail == NULL) g_queue_head = job;
+  else g_queue_tail->next = job;
+  g_queue_tail = job;
+  ++g_queue_len;
+  pthread_cond_signal(&g_queue_cond);
+  pthread_mutex_unlock(&g_queue_mutex);
+  return 0;
+}
+
+/**
+ * Queue the opening of path, or the read in of fd if it is already open, for
+ * the connection or one of its HTTP/2 streams, the others going on. Returns
+ * ERROR if the queue is full, the caller then blocks.
+ */
+int8_t fileio_submit(client_t *client, uint32_t stream, const char *path, int fd) {
+  if (!g_fileio_enabled) return ERROR;
+  fileio_job_t *job = calloc(1, sizeof (fileio_job_t));
+  if (job == NULL || (fd < 0 && (job->path = strdup(path)) == NULL)) {
+    perror("malloc");
+    free(job);
+    return ERROR;
+  }
+  job->op = FILEIO_OPEN;
+  job->clientfd = client->clientfd;
+  job->client_id = client->id;
+  job->stream = stream;
+  job->fd = fd;
+  if (queue(job) < 0) {
+    free(job->path);
+    free(job);
+    return ERROR;
+  }
+  if (stream == 0) client->io_pending = 1;
+  return 0;
+}
+
+/**
+ * Queue a read of fd in buffer, which both belong to the job until it
+ * completes.
+ * Returns ERROR if the queue is full, the caller then blocks.
+ */
+int8_t fileio_submit_read(client_t *client, int fd, char *buffer, size_t size,
+  off_t offset) {
+  if (!g_fileio_enabled) return ERROR;
+  fileio_job_t *job = calloc(1, sizeof (fileio_job_t));
+  if (job == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  job->op = FILEIO_READ;
+  job->clientfd = client->clientfd;
+  job->client_id = client->id;
+  job->fd = fd;
+  job->buffer = buffer;
+  job->size = size;
+  job->offset = offset;
+  if (queue(job) < 0) {
+    free(job);
+    return ERROR;
+  }
+  client->io_pending = 1;
+  return 0;
+}
+
+/**
+ * Called by the event loop when the eventfd is readable, resumes the
+ * requests whose file operation completed.
+ */
+void fileio_complete(client_t **clients) {
+  uint64_t count;
+  if (read(g_eventfd, &count, sizeof (count)) < 0 && errno != EAGAIN) perror("read");
+  pthread_mutex_lock(&g_done_mutex);
+  fileio_job_t *job = g_done;
+  g_done = NULL;
+  pthread_mutex_unlock(&g_done_mutex);
+  while (job != NULL) {
+    fileio_job_t *next = job->next;
+    client_t *client = find_client(job->clientfd);
+    // The connection may have been closed, and its descriptor reused
+    if (client != NULL && client->id == job->client_id && job->stream != 0) {
+      h2_open_complete(client, job->stream, job->fd, job->err, clients);
+    } else if (client != NULL && client->id == job->client_id && client->io_pending) {
+      if (job->op == FILEIO_READ)
+        sched_read_complete(client, job->fd, job->buffer, job->result, job->err, clients);
+      else open_complete(client, job->fd, job->err, clients);
+    } else if (job->op == FILEIO_READ) {
+      free(job->buffer);
+      close(job->fd);
+    } else if (job->fd >= 0) close(job->fd);
+    free(job->path);
+    free(job);
+    job = next;
+  }
+}
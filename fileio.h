@@ -0,0 +1,53 @@
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <stdint.h>
+
+#include "defines.h"
+
+/**
+ * Pool of threads opening the files the event loop could not open without
+ * blocking, and reading their first pages in so that the first sendfile does
+ * not block either. It also does the O_DIRECT reads. Completions are
+ * signaled on an eventfd.
+ */
+#define FILEIO_DEFAULT_THREADS 4
+#define FILEIO_MAX_THREADS 64
+#define FILEIO_QUEUE_SIZE 1024
+// Read in by the pool before a cold file is sent
+#define FILEIO_READAHEAD 262144
+
+typedef enum {
+  FILEIO_OPEN = 0,
+  FILEIO_READ,
+} fileio_op_e;
+
+typedef struct fileio_job_s {
+  fileio_op_e op;
+  int32_t clientfd;
+  uint64_t client_id;
+  // The HTTP/2 stream waiting for the open, 0 when it is the connection
+  uint32_t stream;
+  char *path;
+  // Already opened when only the content is cold
+  int fd;
+  // Of the reads, owned by the job until it completes
+  char *buffer;
+  size_t size;
+  off_t offset;
+  ssize_t result;
+  int err;
+  struct fileio_job_s *next;
+} fileio_job_t;
+
+extern uint8_t g_fileio_enabled;
+
+int8_t fileio_start(uint8_t nb_threads);
+int fileio_fd();
+uint8_t fileio_cached(int fd);
+int8_t fileio_submit(client_t *client, uint32_t stream, const char *path, int fd);
+int8_t fileio_submit_read(client_t *client, int fd, char *buffer, size_t size,
+  off_t offset);
+void fileio_complete(client_t **clients);
+
+#endif // __FILEIO_H__
@@ -0,0 +1,774 @@
+// asprintf
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "defines.h"
+#include "chunked.h"
+#include "gateway.h"
+#include "httpd.h"
+#include "metrics.h"
+
+/**
+ * A request for a pool gets a stream, with a streaming response writer for
+ * its client (see chunked.c), and goes to the worker with the fewest
+ * requests in progress, or waits in the queue of the pool until one has a
+ * free id. The REQUEST frame is written as the socket of the worker takes
+ * it, and the client waits out of the poll set for the HEAD frame, which
+ * starts the writer. The DATA frames go to the writer as chunks; the worker
+ * is not read while one waits for room in its buffer, so a slow client slows
+ * its worker down rather than filling memory, and holds the other requests
+ * of the worker behind it. The END frame gives the last chunk its trailers.
+ *
+ * A worker that closes its socket, breaks the protocol or does not END an
+ * aborted request within the timeout is killed: the requests it had are
+ * answered with a 502, or cut if their response had started, and it is
+ * started again GATEWAY_RESPAWN_MS later.
+ */
+
+uint32_t g_gateway_processes = GATEWAY_DEFAULT_PROCESSES;
+uint32_t g_gateway_concurrency = GATEWAY_DEFAULT_CONCURRENCY;
+uint64_t g_gateway_timeout_ms = GATEWAY_TIMEOUT_MS;
+
+static gateway_pool_t g_pools[GATEWAY_MAX_POOLS];
+static uint32_t g_nb_pools = 0;
+// Workers in the order of their entries in the poll set
+static gateway_proc_t **g_polled = NULL;
+static uint64_t g_last_sweep_ns = 0;
+
+/**
+ * Add a pool from its option, prefix=command.
+ */
+int8_t gateway_add_pool(const char *spec) {
+  const char *equal = strchr(spec, '=');
+  if (equal == NULL || spec[0] != '/' || equal[1] == '\0' ||
+    g_nb_pools >= GATEWAY_MAX_POOLS) {
+    LOG_ERROR("invalid worker pool: %s\n", spec);
+    return ERROR;
+  }
+  gateway_pool_t *pool = &g_pools[g_nb_pools];
+  memset(pool, 0, sizeof (gateway_pool_t));
+  size_t len;
+  pool->command = strdup(equal + 1);
+  pool->prefix = route_prefix(spec, equal, &len);
+  if (pool->command == NULL || pool->prefix == NULL ||
+    asprintf(&pool->script, "exec %s", pool->command) < 0) {
+    perror("strdup");
+    free(pool->command);
+    free(pool->prefix);
+    return ERROR;
+  }
+  pool->prefix_len = len;
+  ++g_nb_pools;
+  return 0;
+}
+
+uint8_t gateway_enabled() {
+  return g_nb_pools > 0;
+}
+
+// Workers to poll at most
+size_t gateway_max_fds() {
+  return g_nb_pools * g_gateway_processes;
+}
+
+/**
+ * Start a worker, its socket as standard input and output. Returns ERROR if
+ * it could not be.
+ */
+static int8_t spawn(gateway_proc_t *proc) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    perror("socketpair");
+    return ERROR;
+  }
+  // Built before forking, the other threads may hold the allocator lock
+  char *argv[] = { "/bin/sh", "-c", proc->pool->script, NULL };
+  pid_t pid = fork();
+  if (pid == 0) {
+    // The copies lose close-on-exec, the standard error stays ours
+    dup2(sv[1], STDIN_FILENO);
+    dup2(sv[1], STDOUT_FILENO);
+    // Ignored signals stay ignored through exec, the worker gets the default
+    signal(SIGPIPE, SIG_DFL);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  close(sv[1]);
+  if (pid < 0) {
+    perror("fork");
+    close(sv[0]);
+    return ERROR;
+  }
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  proc->pid = pid;
+  proc->fd = sv[0];
+  proc->input_len = proc->output_len = proc->output_sent = 0;
+  proc->blocked = 0;
+  LOG_DEBUG("started worker %i for /%s\n", pid, proc->pool->prefix);
+  return 0;
+}
+
+int8_t gateway_init() {
+  if (g_nb_pools == 0) return 0;
+  if (g_gateway_processes == 0) g_gateway_processes = 1;
+  if (g_gateway_concurrency == 0) g_gateway_concurrency = 1;
+  if (g_gateway_concurrency > GATEWAY_MAX_CONCURRENCY)
+    g_gateway_concurrency = GATEWAY_MAX_CONCURRENCY;
+  if ((g_polled = calloc(gateway_max_fds(), sizeof (gateway_proc_t *))) == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  for (uint32_t i = 0; i < g_nb_pools; ++i) {
+    gateway_pool_t *pool = &g_pools[i];
+    if ((pool->procs = calloc(g_gateway_processes, sizeof (gateway_proc_t))) == NULL) {
+      perror("calloc");
+      return ERROR;
+    }
+    for (uint32_t j = 0; j < g_gateway_processes; ++j) {
+      gateway_proc_t *proc = &pool->procs[j];
+      proc->pool = pool;
+      proc->pid = proc->fd = -1;
+      proc->streams = calloc(g_gateway_concurrency, sizeof (gateway_stream_t *));
+      proc->input = malloc(GATEWAY_FRAME_HEADER + GATEWAY_MAX_FRAME);
+      if (proc->streams == NULL || proc->input == NULL) {
+        perror("malloc");
+        return ERROR;
+      }
+      if (spawn(proc) < 0) return ERROR;
+    }
+    LOG_MSG("serving /%s with %u workers: %s\n", pool->prefix, g_gateway_processes,
+      pool->command);
+  }
+  return 0;
+}
+
+static gateway_pool_t *find_pool(request_t *request, size_t len) {
+  gateway_pool_t *found = NULL;
+  for (uint32_t i = 0; i < g_nb_pools; ++i) {
+    gateway_pool_t *pool = &g_pools[i];
+    if (!route_match(request, len, pool->prefix, pool->prefix_len)) continue;
+    // The longest prefix wins
+    if (found == NULL || pool->prefix_len > found->prefix_len) found = pool;
+  }
+  return found;
+}
+
+uint8_t gateway_match(request_t *request) {
+  return g_nb_pools > 0 && request->path != NULL &&
+    find_pool(request, request_path_len(request)) != NULL;
+}
+
+void gateway_frame_header(char *out, gateway_frame_e type, uint16_t id, uint32_t length) {
+  out[0] = type;
+  out[1] = 0;
+  out[2] = id >> 8;
+  out[3] = id;
+  out[4] = length >> 24;
+  out[5] = length >> 16;
+  out[6] = length >> 8;
+  out[7] = length;
+}
+
+/**
+ * Add a frame to those to write to the worker. Returns ERROR if out of
+ * memory.
+ */
+static int8_t queue_frame(gateway_proc_t *proc, gateway_frame_e type, uint16_t id,
+  const char *payload, size_t len) {
+  if (proc->output_sent == proc->output_len) proc->output_len = proc->output_sent = 0;
+  size_t needed = proc->output_len + GATEWAY_FRAME_HEADER + len;
+  if (needed > proc->output_size) {
+    char *output = realloc(proc->output, needed);
+    if (output == NULL) {
+      perror("realloc");
+      return ERROR;
+    }
+    proc->output = output;
+    proc->output_size = needed;
+  }
+  gateway_frame_header(proc->output + proc->output_len, type, id, len);
+  if (len > 0) memcpy(proc->output + proc->output_len + GATEWAY_FRAME_HEADER, payload, len);
+  proc->output_len = needed;
+  return 0;
+}
+
+/**
+ * Write the frames queued for the worker. Returns ERROR if its socket is
+ * broken.
+ */
+static int8_t flush(gateway_proc_t *proc) {
+  while (proc->output_sent < proc->output_len) {
+    ssize_t len = send(proc->fd, proc->output + proc->output_sent,
+      proc->output_len - proc->output_sent, MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return ERROR;
+    }
+    proc->output_sent += len;
+  }
+  return 0;
+}
+
+// A NAME=value string of the REQUEST frame, with its NUL byte
+static void param(char *buffer, size_t size, size_t *position, const char *format, ...) {
+  if (*position >= size) return;
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer + *position, size - *position, format, args);
+  va_end(args);
+  if (len >= 0) *position += len + 1;
+}
+
+/**
+ * Write the CGI variables of the request of the client in buffer. Returns
+ * their length, ERROR if they do not fit in size bytes.
+ */
+static ssize_t params(client_t *client, gateway_pool_t *pool, char *buffer, size_t size) {
+  request_t *request = &client->request;
+  size_t position = 0;
+  size_t len = request_path_len(request);
+  param(buffer, size, &position, "REQUEST_METHOD=%s", g_methods[request->method]);
+  param(buffer, size, &position, "SCRIPT_NAME=%s%s", pool->prefix_len ? "/" : "",
+    pool->prefix);
+  // Starts with its slash, but for the pool of the root
+  param(buffer, size, &position, "PATH_INFO=%s%.*s", pool->prefix_len ? "" : "/",
+    (int) (len - pool->prefix_len), request->path + pool->prefix_len);
+  param(buffer, size, &position, "QUERY_STRING=%s",
+    request->query != NULL ? request->query : "");
+  param(buffer, size, &position, "SERVER_PROTOCOL=%s", g_version[request->http_version]);
+  param(buffer, size, &position, "REMOTE_ADDR=%s",
+    inet_ntoa(((struct sockaddr_in *) client->client_addr)->sin_addr));
+  if (client->tls != NULL) param(buffer, size, &position, "HTTPS=on");
+  for (uint8_t i = 0; i < NB_HEADERS; ++i) {
+    // Request bodies are not forwarded
+    if (request->headers[i] == NULL || i == CONTENT_LENGTH || i == EXPECT) continue;
+    char name[64];
+    size_t j = 0;
+    for (; g_headers[i][j] != '\0' && j < sizeof (name) - 1; ++j)
+      name[j] = g_headers[i][j] == '-' ? '_' : toupper((unsigned char) g_headers[i][j]);
+    name[j] = '\0';
+    param(buffer, size, &position, "HTTP_%s=%s", name, request->headers[i]);
+  }
+  return position <= size ? (ssize_t) position : ERROR;
+}
+
+// The worker with the fewest requests in progress that can take one more
+static gateway_proc_t *pick(gateway_pool_t *pool) {
+  gateway_proc_t *best = NULL;
+  for (uint32_t i = 0; i < g_gateway_processes; ++i) {
+    gateway_proc_t *proc = &pool->procs[i];
+    if (proc->fd < 0 || proc->busy >= g_gateway_concurrency) continue;
+    if (best == NULL || proc->busy < best->busy) best = proc;
+  }
+  return best;
+}
+
+/**
+ * Give the request of the stream to the worker, which has a free id.
+ * Returns ERROR if out of memory.
+ */
+static int8_t assign(gateway_proc_t *proc, gateway_stream_t *stream) {
+  static char payload[GATEWAY_MAX_FRAME];
+  ssize_t len = params(stream->client, stream->pool, payload, sizeof (payload));
+  uint16_t id = 0;
+  while (proc->streams[id] != NULL) ++id;
+  if (len < 0 || queue_frame(proc, GATEWAY_REQUEST, id, payload, len) < 0) return ERROR;
+  proc->streams[id] = stream;
+  ++proc->busy;
+  stream->proc = proc;
+  stream->id = id;
+  stream->deadline_ns = now_ns() + g_gateway_timeout_ms * 1000000;
+  return 0;
+}
+
+static void enqueue(gateway_pool_t *pool, gateway_stream_t *stream) {
+  stream->next = NULL;
+  if (pool->queue_tail != NULL) pool->queue_tail->next = stream;
+  else pool->queue = stream;
+  pool->queue_tail = stream;
+  ++pool->queued;
+}
+
+static void unqueue(gateway_stream_t *stream) {
+  gateway_pool_t *pool = stream->pool;
+  gateway_stream_t **link = &pool->queue;
+  gateway_stream_t *prev = NULL;
+  while (*link != stream) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  *link = stream->next;
+  if (pool->queue_tail == stream) pool->queue_tail = prev;
+  --pool->queued;
+}
+
+static void free_stream(gateway_stream_t *stream) {
+  free(stream);
+}
+
+/**
+ * The client is done with the writer of the stream: the stream is freed if
+ * its worker is too, the worker told to abort the request otherwise.
+ */
+static void released(chunked_t *writer, uint8_t complete) {
+  (void) complete;
+  gateway_stream_t *stream = writer->context;
+  stream->client = NULL;
+  if (stream->proc != NULL) {
+    // Its END is still awaited, within the timeout
+    stream->deadline_ns = now_ns() + g_gateway_timeout_ms * 1000000;
+    queue_frame(stream->proc, GATEWAY_ABORT, stream->id, NULL, 0);
+    return;
+  }
+  if (!stream->ended) unqueue(stream);
+  free_stream(stream);
+}
+
+// Answer the client of the stream, which is done with it
+static void fail(gateway_stream_t *stream, status_code_e status, client_t **clients) {
+  client_t *client = stream->client;
+  chunked_finish(client);
+  answer_later(client, status, clients);
+}
+
+// Hand the requests waiting in the queue of the pool to its free workers
+static void dispatch(gateway_pool_t *pool, client_t **clients) {
+  while (pool->queue != NULL) {
+    gateway_proc_t *proc = pick(pool);
+    if (proc == NULL) return;
+    gateway_stream_t *stream = pool->queue;
+    unqueue(stream);
+    // Back in the queue for released to take it out
+    if (assign(proc, stream) < 0) {
+      enqueue(pool, stream);
+      fail(stream, _500, clients);
+    }
+  }
+}
+
+int8_t gateway_forward(client_t *client, request_t *request) {
+  gateway_pool_t *pool = find_pool(request, request_path_len(request));
+  if (client->h2 != NULL) {
+    LOG_DEBUG("not passing %s to a worker over HTTP/2\n", request->path);
+    return answer(client->clientfd, request, _502);
+  }
+  gateway_proc_t *proc = pick(pool);
+  if (proc == NULL && pool->queued >= GATEWAY_MAX_QUEUE) {
+    LOG_DEBUG("no worker for %s, the queue is full\n", request->path);
+    return answer(client->clientfd, request, _503);
+  }
+  gateway_stream_t *stream = calloc(1, sizeof (gateway_stream_t));
+  if (stream == NULL) {
+    perror("calloc");
+    return answer(client->clientfd, request, _500);
+  }
+  if (chunked_open(client, NULL, released, stream) == NULL) {
+    free_stream(stream);
+    return answer(client->clientfd, request, _500);
+  }
+  METRIC_INC(gateway_requests);
+  stream->client = client;
+  stream->pool = pool;
+  if (proc != NULL) {
+    if (assign(proc, stream) == 0) return 0;
+    // In the queue for released to take it out
+    enqueue(pool, stream);
+    chunked_finish(client);
+    return answer(client->clientfd, request, _500);
+  }
+  METRIC_INC(gateway_queued);
+  stream->deadline_ns = now_ns() + g_gateway_timeout_ms * 1000000;
+  enqueue(pool, stream);
+  return 0;
+}
+
+static uint8_t is_header(const char *line, size_t len, const char *name) {
+  return len == strlen(name) && !strncasecmp(line, name, len);
+}
+
+// Only meaningful between a worker and us, or set from the response
+static uint8_t dropped(const char *name, size_t len) {
+  return is_header(name, len, "Status") || is_header(name, len, "Connection") ||
+    is_header(name, len, "Keep-Alive") || is_header(name, len, "Proxy-Connection") ||
+    is_header(name, len, "Transfer-Encoding") || is_header(name, len, "Content-Length") ||
+    is_header(name, len, "Upgrade") || is_header(name, len, "TE");
+}
+
+/**
+ * The header line of head at position, without its end of line, and the
+ * length of its name. Moves position to the next one. Returns ERROR if it
+ * is not a header, 0 past the end of head.
+ */
+static int8_t next_header(const char *head, size_t len, size_t *position,
+  const char **line, size_t *line_len, size_t *name_len) {
+  while (*position < len) {
+    *line = head + *position;
+    const char *eol = memchr(*line, '\n', len - *position);
+    *line_len = eol != NULL ? (size_t) (eol - *line) : len - *position;
+    *position += *line_len + (eol != NULL);
+    if (*line_len > 0 && (*line)[*line_len - 1] == '\r') --*line_len;
+    if (*line_len == 0) continue;
+    const char *colon = memchr(*line, ':', *line_len);
+    if (colon == NULL || colon == *line) return ERROR;
+    *name_len = colon - *line;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Write the response head of the HEAD frame of a worker, header lines, for
+ * the client: HTTP/1.1 with the status of its Status line, without the
+ * hop-by-hop headers nor Content-Length, and with how the body ends for a
+ * client of that HTTP version (see chunked_mode). Sets the status code.
+ * Returns the length of the head, ERROR if the frame is not a valid head.
+ */
+ssize_t gateway_response_head(const char *head, size_t len, uint8_t http_version,
+  char *out, size_t size, uint16_t *code) {
+  const char *line;
+  size_t line_len, name_len;
+  size_t position = 0;
+  int8_t ret;
+  *code = 200;
+  const char *reason = "";
+  int reason_len = 0;
+  while ((ret = next_header(head, len, &position, &line, &line_len, &name_len)) > 0) {
+    if (!is_header(line, name_len, "Status")) continue;
+    const char *value = line + name_len + 1;
+    const char *end = line + line_len;
+    while (value < end && (*value == ' ' || *value == '\t')) ++value;
+    if (end - value < 3 || !isdigit((unsigned char) value[0]) ||
+      !isdigit((unsigned char) value[1]) || !isdigit((unsigned char) value[2]) ||
+      (end - value > 3 && value[3] != ' ')) return ERROR;
+    *code = (value[0] - '0') * 100 + (value[1] - '0') * 10 + (value[2] - '0');
+    reason = end - value > 4 ? value + 4 : "";
+    reason_len = end - value > 4 ? end - value - 4 : 0;
+  }
+  // No interim response
+  if (ret < 0 || *code < 200 || *code > 599) return ERROR;
+  status_code_e known = status_of(*code);
+  if (reason_len == 0 && g_status_code[known].code == *code) {
+    reason = g_status_code[known].message;
+    reason_len = strlen(reason);
+  }
+  int written = snprintf(out, size, "HTTP/1.1 %u %.*s\r\n", *code, reason_len, reason);
+  if (written < 0 || (size_t) written >= size) return ERROR;
+  size_t out_len = written;
+  position = 0;
+  while (next_header(head, len, &position, &line, &line_len, &name_len) > 0) {
+    if (dropped(line, name_len)) continue;
+    if (out_len + line_len + 2 >= size) return ERROR;
+    memcpy(out + out_len, line, line_len);
+    memcpy(out + out_len + line_len, "\r\n", 2);
+    out_len += line_len + 2;
+  }
+  const char *framing = chunked_header(chunked_mode(http_version, *code));
+  written = snprintf(out + out_len, size - out_len, "%s%s\r\n",
+    framing != NULL ? framing : "", framing != NULL ? "\r\n" : "");
+  if (written < 0 || (size_t) written >= size - out_len) return ERROR;
+  return out_len + written;
+}
+
+/**
+ * Start the response of the client of the stream with the HEAD frame of its
+ * worker.
+ */
+static void start_response(gateway_stream_t *stream, const char *payload, size_t len,
+  client_t **clients) {
+  client_t *client = stream->client;
+  request_t *request = &client->request;
+  char head[GATEWAY_HEAD_SIZE];
+  uint16_t code;
+  ssize_t head_len = gateway_response_head(payload, len, request->http_version, head,
+    sizeof (head), &code);
+  if (head_len < 0) {
+    LOG_WARNING("invalid response head from worker %i\n", stream->proc->pid);
+    fail(stream, _502, clients);
+    return;
+  }
+  request->status = status_of(code);
+  if (chunked_start(client, head, head_len, chunked_mode(request->http_version, code)) < 0) {
+    finish_request(client);
+    delete_client(client->clientfd, clients);
+  } else if (!client->transfer.active) finish_request(client);
+}
+
+/**
+ * Write the trailers of the END frame of a worker, header lines, for the
+ * client, each ended by CRLF. Returns their length, ERROR if the frame is
+ * not valid or they do not fit.
+ */
+static ssize_t trailers(const char *payload, size_t len, char *out, size_t size) {
+  const char *line;
+  size_t line_len, name_len;
+  size_t position = 0;
+  size_t out_len = 0;
+  int8_t ret;
+  while ((ret = next_header(payload, len, &position, &line, &line_len, &name_len)) > 0) {
+    if (dropped(line, name_len)) continue;
+    if (out_len + line_len + 2 > size) return ERROR;
+    memcpy(out + out_len, line, line_len);
+    memcpy(out + out_len + line_len, "\r\n", 2);
+    out_len += line_len + 2;
+  }
+  return ret < 0 ? ERROR : (ssize_t) out_len;
+}
+
+/**
+ * Handle a frame of the worker for one of its streams. Returns 1 if it has
+ * to wait for the client to make room, ERROR if it breaks the protocol.
+ */
+static int8_t handle_frame(gateway_proc_t *proc, gateway_stream_t *stream, uint8_t type,
+  const char *payload, size_t len, client_t **clients) {
+  switch (type) {
+  case GATEWAY_HEAD:
+    if (stream->started) return ERROR;
+    stream->started = 1;
+    stream->deadline_ns = now_ns() + g_gateway_timeout_ms * 1000000;
+    // Aborted
+    if (stream->client != NULL) start_response(stream, payload, len, clients);
+    return 0;
+  case GATEWAY_DATA:
+    if (!stream->started) return ERROR;
+    stream->deadline_ns = now_ns() + g_gateway_timeout_ms * 1000000;
+    if (stream->client == NULL) return 0;
+    return chunked_write(stream->client->chunked, payload, len);
+  case GATEWAY_END:
+    if (stream->client != NULL && stream->started) {
+      char fields[GATEWAY_HEAD_SIZE];
+      ssize_t fields_len = trailers(payload, len, fields, sizeof (fields));
+      if (fields_len < 0) return ERROR;
+      if (chunked_end(stream->client->chunked, fields, fields_len)) return 1;
+    }
+    proc->streams[stream->id] = NULL;
+    --proc->busy;
+    stream->proc = NULL;
+    stream->ended = 1;
+    if (stream->client == NULL) free_stream(stream);
+    else if (!stream->started) {
+      LOG_WARNING("worker %i ended a request without response\n", proc->pid);
+      fail(stream, _502, clients);
+    }
+    dispatch(proc->pool, clients);
+    return 0;
+  default:
+    return ERROR;
+  }
+}
+
+/**
+ * Kill the worker, after it died or misbehaved: the requests it has are
+ * answered with a 502, or cut if their response started.
+ */
+static void crashed(gateway_proc_t *proc, const char *reason, client_t **clients) {
+  LOG_WARNING("worker %i for /%s %s\n", proc->pid, proc->pool->prefix, reason);
+  METRIC_INC(gateway_crashes);
+  // Reaped by gateway_tick
+  kill(proc->pid, SIGKILL);
+  close(proc->fd);
+  proc->fd = -1;
+  proc->respawn_ns = now_ns() + GATEWAY_RESPAWN_MS * 1000000ULL;
+  proc->busy = 0;
+  for (uint32_t id = 0; id < g_gateway_concurrency; ++id) {
+    gateway_stream_t *stream = proc->streams[id];
+    if (stream == NULL) continue;
+    proc->streams[id] = NULL;
+    stream->proc = NULL;
+    stream->ended = 1;
+    client_t *client = stream->client;
+    if (client == NULL) free_stream(stream);
+    else if (!stream->started) fail(stream, _502, clients);
+    else delete_client(client->clientfd, clients);
+  }
+}
+
+/**
+ * Handle the complete frames read from the worker, up to one that waits for
+ * room in its stream.
+ */
+static void handle_frames(gateway_proc_t *proc, client_t **clients) {
+  size_t position = 0;
+  proc->blocked = 0;
+  while (proc->input_len - position >= GATEWAY_FRAME_HEADER) {
+    unsigned char *header = (unsigned char *) proc->input + position;
+    uint16_t id = header[2] << 8 | header[3];
+    uint32_t len = (uint32_t) header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+    if (len > GATEWAY_MAX_FRAME || id >= g_gateway_concurrency ||
+      proc->streams[id] == NULL) {
+      crashed(proc, "broke the protocol", clients);
+      return;
+    }
+    if (proc->input_len - position < GATEWAY_FRAME_HEADER + len) break;
+    int8_t ret = handle_frame(proc, proc->streams[id], header[0],
+      proc->input + position + GATEWAY_FRAME_HEADER, len, clients);
+    if (ret < 0) {
+      crashed(proc, "broke the protocol", clients);
+      return;
+    }
+    if (ret > 0) {
+      proc->blocked = 1;
+      break;
+    }
+    position += GATEWAY_FRAME_HEADER + len;
+  }
+  memmove(proc->input, proc->input + position, proc->input_len - position);
+  proc->input_len -= position;
+}
+
+static void read_frames(gateway_proc_t *proc, client_t **clients) {
+  ssize_t len = read(proc->fd, proc->input + proc->input_len,
+    GATEWAY_FRAME_HEADER + GATEWAY_MAX_FRAME - proc->input_len);
+  if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (len <= 0) {
+    crashed(proc, len == 0 ? "exited" : strerror(errno), clients);
+    return;
+  }
+  proc->input_len += len;
+  handle_frames(proc, clients);
+}
+
+/**
+ * Fill fds with the sockets of the workers. Returns the number of entries,
+ * gateway_max_fds() at most.
+ */
+size_t gateway_fds(struct pollfd *fds) {
+  size_t n = 0;
+  for (uint32_t i = 0; i < g_nb_pools; ++i)
+    for (uint32_t j = 0; j < g_gateway_processes; ++j) {
+      gateway_proc_t *proc = &g_pools[i].procs[j];
+      short events = 0;
+      // Read while idle too, to see it exit
+      if (proc->fd >= 0 && !proc->blocked) events |= POLLIN;
+      if (proc->fd >= 0 && proc->output_sent < proc->output_len) events |= POLLOUT;
+      fds[n].fd = events ? proc->fd : -1;
+      fds[n].events = events;
+      fds[n].revents = 0;
+      g_polled[n++] = proc;
+    }
+  return n;
+}
+
+/**
+ * Handle the events of the workers, the nfds entries filled by gateway_fds,
+ * and the frames that were waiting for their clients.
+ */
+void gateway_run(struct pollfd *fds, size_t nfds, client_t **clients) {
+  for (size_t i = 0; i < nfds; ++i) {
+    gateway_proc_t *proc = g_polled[i];
+    if (fds[i].revents != 0 && fds[i].fd == proc->fd) {
+      if (fds[i].revents & POLLOUT && flush(proc) < 0) {
+        crashed(proc, strerror(errno), clients);
+        continue;
+      }
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) read_frames(proc, clients);
+    }
+    // The clients may have made room since
+    if (proc->fd >= 0 && proc->blocked) handle_frames(proc, clients);
+  }
+}
+
+/**
+ * Called by the event loop: times the requests out, reaps the workers that
+ * were killed and starts them again.
+ */
+void gateway_tick(client_t **clients) {
+  if (g_nb_pools == 0) return;
+  uint64_t now = now_ns();
+  if (now - g_last_sweep_ns < GATEWAY_SWEEP_MS * 1000000ULL) return;
+  g_last_sweep_ns = now;
+  for (uint32_t i = 0; i < g_nb_pools; ++i) {
+    gateway_pool_t *pool = &g_pools[i];
+    // Oldest first, reported once a sweep
+    uint32_t timeouts = 0;
+    while (pool->queue != NULL && now >= pool->queue->deadline_ns) {
+      METRIC_INC(gateway_timeouts);
+      fail(pool->queue, _504, clients);
+      ++timeouts;
+    }
+    if (timeouts > 0)
+      LOG_WARNING("no worker for /%s took %u requests in time\n", pool->prefix, timeouts);
+    for (uint32_t j = 0; j < g_gateway_processes; ++j) {
+      gateway_proc_t *proc = &pool->procs[j];
+      for (uint32_t id = 0; proc->fd >= 0 && id < g_gateway_concurrency; ++id) {
+        gateway_stream_t *stream = proc->streams[id];
+        if (stream == NULL || now < stream->deadline_ns) continue;
+        if (stream->client == NULL) {
+          crashed(proc, "did not end an aborted request", clients);
+          break;
+        }
+        // The wait is on the client, which has its own deadlines
+        if (stream->started && chunked_pending(stream->client->chunked)) {
+          stream->deadline_ns = now + g_gateway_timeout_ms * 1000000;
+          continue;
+        }
+        LOG_WARNING("worker %i timed out\n", proc->pid);
+        METRIC_INC(gateway_timeouts);
+        if (!stream->started) fail(stream, _504, clients);
+        else delete_client(stream->client->clientfd, clients);
+      }
+      if (proc->fd < 0 && proc->pid > 0 && waitpid(proc->pid, NULL, WNOHANG) != 0)
+        proc->pid = -1;
+      if (proc->pid < 0 && now >= proc->respawn_ns) {
+        if (spawn(proc) < 0) proc->respawn_ns = now + GATEWAY_RESPAWN_MS * 1000000ULL;
+        else dispatch(pool, clients);
+      }
+    }
+  }
+}
+
+/**
+ * Milliseconds until gateway_tick has something to do, -1 if nothing is
+ * pending.
+ */
+int gateway_timeout() {
+  for (uint32_t i = 0; i < g_nb_pools; ++i) {
+    if (g_pools[i].queued > 0) return GATEWAY_SWEEP_MS;
+    for (uint32_t j = 0; j < g_gateway_processes; ++j)
+      if (g_pools[i].procs[j].fd < 0 || g_pools[i].procs[j].busy > 0) return GATEWAY_SWEEP_MS;
+  }
+  return -1;
+}
+
+void gateway_stop() {
+  for (uint32_t i = 0; i < g_nb_pools; ++i) {
+    gateway_pool_t *pool = &g_pools[i];
+    for (uint32_t j = 0; pool->procs != NULL && j < g_gateway_processes; ++j) {
+      gateway_proc_t *proc = &pool->procs[j];
+      // The end of its input tells it to exit
+      if (proc->fd >= 0) close(proc->fd);
+      if (proc->pid > 0) {
+        kill(proc->pid, SIGTERM);
+        waitpid(proc->pid, NULL, WNOHANG);
+      }
+      for (uint32_t id = 0; proc->streams != NULL && id < g_gateway_concurrency; ++id)
+        if (proc->streams[id] != NULL) free_stream(proc->streams[id]);
+      free(proc->streams);
+      free(proc->input);
+      free(proc->output);
+    }
+    // The clients are gone, so are their queued requests
+    free(pool->procs);
+    free(pool->prefix);
+    free(pool->command);
+    free(pool->script);
+  }
+  g_nb_pools = 0;
+  free(g_polled);
+  g_polled = NULL;
+}
@@ -0,0 +1,128 @@
+#ifndef __GATEWAY_H__
+#define __GATEWAY_H__
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "defines.h"
+
+/**
+ * Application gateway: the requests under a path prefix are handed to a pool
+ * of long-lived worker processes started with a shell command, rather than
+ * served from the docroot. Each worker speaks a framed protocol on its
+ * standard input and output, a Unix socket, and takes a few requests at once;
+ * the requests no worker can take wait in a queue. Responses are streamed
+ * back to the clients with the chunked transfer encoding, see chunked.c.
+ *
+ * A frame is an 8 bytes header, its type, flags (0), the id of the request
+ * (big endian 16 bits) and the length of its payload (big endian 32 bits),
+ * then the payload:
+ * - REQUEST, to the worker: the CGI variables of the request, NAME=value
+ *   strings each ended by a NUL byte.
+ * - ABORT, to the worker: the client went away, the request still gets its
+ *   END.
+ * - HEAD, from the worker: header lines, "Status: 404 Not Found" giving the
+ *   status (200 by default).
+ * - DATA, from the worker: a piece of the body.
+ * - END, from the worker: the response is over, its id may be used again.
+ *   Header lines, the trailers of the last chunk.
+ */
+#define GATEWAY_MAX_POOLS 16
+#define GATEWAY_DEFAULT_PROCESSES 4
+// Requests a worker takes at once, by default
+#define GATEWAY_DEFAULT_CONCURRENCY 1
+#define GATEWAY_MAX_CONCURRENCY 256
+// Wait for a worker, then for the response head and between the pieces of
+// the body, at most that, by default
+#define GATEWAY_TIMEOUT_MS 30000
+// Requests waiting for a worker per pool, a 503 above
+#define GATEWAY_MAX_QUEUE 256
+#define GATEWAY_RESPAWN_MS 1000
+#define GATEWAY_SWEEP_MS 100
+#define GATEWAY_FRAME_HEADER 8
+#define GATEWAY_MAX_FRAME 65536
+#define GATEWAY_HEAD_SIZE 8192
+
+typedef enum {
+  GATEWAY_REQUEST = 1,
+  GATEWAY_ABORT,
+  GATEWAY_HEAD,
+  GATEWAY_DATA,
+  GATEWAY_END,
+} gateway_frame_e;
+
+/**
+ * A request handed to the pool, from its queue until both its client and its
+ * worker are done with it.
+ */
+typedef struct gateway_stream_s {
+  // NULL once the response is over for the client, whose writer
+  // (client->chunked) streams it
+  client_t *client;
+  struct gateway_pool_s *pool;
+  // NULL while queued
+  struct gateway_proc_s *proc;
+  uint16_t id;
+  uint64_t deadline_ns;
+  // HEAD and END frames of the worker seen
+  uint8_t started;
+  uint8_t ended;
+  struct gateway_stream_s *next;
+} gateway_stream_t;
+
+typedef struct gateway_proc_s {
+  struct gateway_pool_s *pool;
+  // Still to reap after the socket is closed, -1 then
+  pid_t pid;
+  int32_t fd;
+  uint64_t respawn_ns;
+  // Requests in progress by id, NULL for the free ids
+  gateway_stream_t **streams;
+  uint32_t busy;
+  // Frames read, not handled yet
+  char *input;
+  size_t input_len;
+  // A frame waits for room in the writer of its client
+  uint8_t blocked;
+  // Frames to write
+  char *output;
+  size_t output_len;
+  size_t output_sent;
+  size_t output_size;
+} gateway_proc_t;
+
+typedef struct gateway_pool_s {
+  // Relative to the docroot, like the request paths
+  char *prefix;
+  size_t prefix_len;
+  char *command;
+  // The command after exec, so that the shell is replaced by the worker
+  char *script;
+  gateway_proc_t *procs;
+  // Requests waiting for a worker, oldest first
+  gateway_stream_t *queue;
+  gateway_stream_t *queue_tail;
+  uint32_t queued;
+} gateway_pool_t;
+
+extern uint32_t g_gateway_processes;
+extern uint32_t g_gateway_concurrency;
+extern uint64_t g_gateway_timeout_ms;
+
+int8_t gateway_add_pool(const char *spec);
+int8_t gateway_init();
+void gateway_stop();
+uint8_t gateway_enabled();
+uint8_t gateway_match(request_t *request);
+int8_t gateway_forward(client_t *client, request_t *request);
+void gateway_frame_header(char *out, gateway_frame_e type, uint16_t id, uint32_t length);
+ssize_t gateway_response_head(const char *head, size_t len, uint8_t http_version,
+  char *out, size_t size, uint16_t *code);
+size_t gateway_max_fds();
+size_t gateway_fds(struct pollfd *fds);
+void gateway_run(struct pollfd *fds, size_t nfds, client_t **clients);
+void gateway_tick(client_t **clients);
+int gateway_timeout();
+
+#endif // __GATEWAY_H__
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "guard.h"
+#include "h2.h"
+
+/**
+ * Headers are read as they arrive (see read_header in httpd.c), so a slow
+ * client only costs its connection, which the deadlines take back: the
+ * connections are swept every second and the ones past a deadline closed.
+ * A connection is held to one deadline at a time, depending on its state:
+ * idle between requests, reading headers, or sending a response.
+ *
+ * The connections of every address are counted in an open addressing table
+ * twice the size of the connection table, so it never fills up.
+ */
+
+uint64_t g_guard_header_timeout_ms = HEADER_WAIT_MS;
+uint64_t g_guard_idle_timeout_ms = GUARD_IDLE_TIMEOUT_MS;
+uint64_t g_guard_stall_timeout_ms = GUARD_STALL_TIMEOUT_MS;
+// Bytes per second, 0 for none
+uint64_t g_guard_rate_floor = 0;
+// 0 for no cap
+uint32_t g_guard_max_per_ip = 0;
+
+static guard_entry_t *g_table = NULL;
+static uint32_t g_table_mask = 0;
+static uint64_t g_last_sweep_ns = 0;
+
+static uint32_t slot(uint32_t addr) {
+  // Fibonacci hashing, spreads the addresses of a subnet
+  return (uint32_t) ((addr * 0x9E3779B97F4A7C15ULL) >> 32) & g_table_mask;
+}
+
+static uint32_t address(const struct sockaddr *addr) {
+  return ((const struct sockaddr_in *) addr)->sin_addr.s_addr;
+}
+
+int8_t guard_init(size_t max_clients) {
+  if (g_guard_max_per_ip == 0) return 0;
+  size_t size = 1;
+  while (size < 2 * (max_clients + 1)) size <<= 1;
+  if ((g_table = calloc(size, sizeof (guard_entry_t))) == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  g_table_mask = size - 1;
+  return 0;
+}
+
+/**
+ * Count a new connection from addr. Returns ERROR if the address already has
+ * as many as allowed.
+ */
+int8_t guard_admit(const struct sockaddr *addr) {
+  if (g_table == NULL) return 0;
+  uint32_t a = address(addr);
+  uint32_t i = slot(a);
+  while (g_table[i].count != 0 && g_table[i].addr != a) i = (i + 1) & g_table_mask;
+  if (g_table[i].count >= g_guard_max_per_ip) return ERROR;
+  g_table[i].addr = a;
+  ++g_table[i].count;
+  return 0;
+}
+
+void guard_release(const struct sockaddr *addr) {
+  if (g_table == NULL) return;
+  uint32_t a = address(addr);
+  uint32_t i = slot(a);
+  while (g_table[i].count != 0 && g_table[i].addr != a) i = (i + 1) & g_table_mask;
+  if (g_table[i].count == 0 || --g_table[i].count > 0) return;
+  // Shift back the entries that probed past the freed slot
+  uint32_t j = i;
+  while (1) {
+    j = (j + 1) & g_table_mask;
+    if (g_table[j].count == 0) break;
+    uint32_t home = slot(g_table[j].addr);
+    // Moves j to i unless its home lies cyclically in (i, j]
+    if (((j - home) & g_table_mask) < ((j - i) & g_table_mask)) continue;
+    g_table[i] = g_table[j];
+    g_table[j].count = 0;
+    i = j;
+  }
+}
+
+/**
+ * The deadline the connection missed, NULL if none.
+ */
+const char *guard_expired(client_t *client, uint64_t now) {
+  // The wait is on the disk, the backend or the producer of the body, not on
+  // the client; they have their own deadlines (see upstream_tick and
+  // gateway_tick)
+  if (client->io_pending ||
+    ((client->upstream != NULL || client->chunked != NULL) && !client->transfer.active))
+    return NULL;
+  // An HTTP/2 connection is idle without streams, stalled when they stop
+  // moving; its idle_ns is the time of its last traffic
+  if (client->h2 != NULL) {
+    if (h2_idle(client))
+      return g_guard_idle_timeout_ms &&
+        now - client->idle_ns > g_guard_idle_timeout_ms * 1000000 ? "idle" : NULL;
+    return g_guard_stall_timeout_ms &&
+      now - client->idle_ns > g_guard_stall_timeout_ms * 1000000 ? "write stall" : NULL;
+  }
+  transfer_t *transfer = &client->transfer;
+  if (transfer->active) {
+    if (g_guard_stall_timeout_ms &&
+      now - transfer->progress_ns > g_guard_stall_timeout_ms * 1000000) return "write stall";
+    uint64_t elapsed = now - transfer->start_ns;
+    if (g_guard_rate_floor && elapsed > GUARD_RATE_GRACE_MS * 1000000ULL &&
+      client->request.bytes_sent * 1000000000.0 / elapsed < g_guard_rate_floor)
+      return "transfer rate";
+    return NULL;
+  }
+  if (client->header != NULL)
+    return g_guard_header_timeout_ms &&
+      now - client->header_ns > g_guard_header_timeout_ms * 1000000 ? "header read" : NULL;
+  return g_guard_idle_timeout_ms &&
+    now - client->idle_ns > g_guard_idle_timeout_ms * 1000000 ? "idle" : NULL;
+}
+
+/**
+ * Called by the event loop, closes the connections past their deadline.
+ */
+void guard_sweep(client_t **clients) {
+  uint64_t now = now_ns();
+  if (now - g_last_sweep_ns < GUARD_SWEEP_MS * 1000000ULL) return;
+  g_last_sweep_ns = now;
+  // The listening socket is first
+  client_t *client = (*clients)->next;
+  while (client != NULL) {
+    client_t *next = client->next;
+    const char *reason = guard_expired(client, now);
+    if (reason != NULL) {
+      LOG_DEBUG("closing %i: %s deadline\n", client->clientfd, reason);
+      METRIC_INC(timed_out_connections);
+      delete_client(client->clientfd, clients);
+    }
+    client = next;
+  }
+}
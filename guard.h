@@ -0,0 +1,40 @@
+#ifndef __GUARD_H__
+#define __GUARD_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "defines.h"
+
+/**
+ * Protections against the clients holding connections without using them
+ * (slowloris): deadlines to send the headers of a request, to send the next
+ * one and to take the response, a floor on the rate responses are taken at,
+ * and a cap on the connections of an address.
+ */
+#define GUARD_IDLE_TIMEOUT_MS 60000
+#define GUARD_STALL_TIMEOUT_MS 30000
+// Responses are held to the rate floor once they had that long
+#define GUARD_RATE_GRACE_MS 10000
+// Connections are checked against their deadlines that often
+#define GUARD_SWEEP_MS 1000
+
+typedef struct {
+  uint32_t addr;
+  // 0 for an empty slot
+  uint32_t count;
+} guard_entry_t;
+
+extern uint64_t g_guard_header_timeout_ms;
+extern uint64_t g_guard_idle_timeout_ms;
+extern uint64_t g_guard_stall_timeout_ms;
+extern uint64_t g_guard_rate_floor;
+extern uint32_t g_guard_max_per_ip;
+
+int8_t guard_init(size_t max_clients);
+int8_t guard_admit(const struct sockaddr *addr);
+void guard_release(const struct sockaddr *addr);
+const char *guard_expired(client_t *client, uint64_t now);
+void guard_sweep(client_t **clients);
+
+#endif // __GUARD_H__
@@ -0,0 +1,919 @@
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "trace.h"
+#include "perf.h"
+#include "sched.h"
+#include "pagecache.h"
+#include "tls.h"
+#include "hpack.h"
+#include "h2.h"
+
+/**
+ * Every stream gets a request_t and a transfer_t of its own, and is answered
+ * by respond() as an HTTP/1.1 request would be: the head it builds is turned
+ * into a HEADERS frame (see h2_respond), the body kept in memory or left in
+ * the file. Frames are queued in the output buffer of the connection, the
+ * DATA frames of the streams taking turns. The payload of a DATA frame from
+ * a file is not copied: its header is queued, then the payload is sent with
+ * sendfile before the rest of the queue.
+ *
+ * The connection is read and written by the event loop like an HTTP/1.1 one,
+ * through the scheduler for its turns and bandwidth caps. Request bodies are
+ * not used, their DATA frames are only acknowledged.
+ */
+
+static uint32_t get24(const uint8_t *p) {
+  return (uint32_t) p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static size_t pending_output(h2_conn_t *conn) {
+  return conn->output_len - conn->output_sent;
+}
+
+static int8_t append(h2_conn_t *conn, const void *data, size_t len) {
+  if (conn->output_len + len > conn->output_size) {
+    size_t size = conn->output_size ? conn->output_size : H2_FRAME_HEADER + H2_MAX_FRAME;
+    while (size < conn->output_len + len) size *= 2;
+    uint8_t *output = realloc(conn->output, size);
+    if (output == NULL) {
+      perror("realloc");
+      return ERROR;
+    }
+    conn->output = output;
+    conn->output_size = size;
+  }
+  memcpy(conn->output + conn->output_len, data, len);
+  conn->output_len += len;
+  return 0;
+}
+
+static int8_t queue_header(h2_conn_t *conn, uint8_t type, uint8_t flags, uint32_t id,
+  size_t len) {
+  uint8_t header[H2_FRAME_HEADER];
+  header[0] = len >> 16;
+  header[1] = len >> 8;
+  header[2] = len;
+  header[3] = type;
+  header[4] = flags;
+  put32(header + 5, id & H2_MAX_WINDOW);
+  return append(conn, header, H2_FRAME_HEADER);
+}
+
+static int8_t queue_frame(h2_conn_t *conn, uint8_t type, uint8_t flags, uint32_t id,
+  const void *payload, size_t len) {
+  if (queue_header(conn, type, flags, id, len) < 0) return ERROR;
+  return len > 0 ? append(conn, payload, len) : 0;
+}
+
+static int8_t queue_u32(h2_conn_t *conn, uint8_t type, uint32_t id, uint32_t value) {
+  uint8_t payload[4];
+  put32(payload, value);
+  return queue_frame(conn, type, 0, id, payload, 4);
+}
+
+static void goaway(h2_conn_t *conn, uint32_t code) {
+  if (conn->goaway) return;
+  uint8_t payload[8];
+  put32(payload, conn->last_stream_id);
+  put32(payload + 4, code);
+  queue_frame(conn, H2_GOAWAY, 0, 0, payload, 8);
+  conn->goaway = 1;
+}
+
+/**
+ * Queue a GOAWAY with the error that ends the connection. Returns ERROR, for
+ * the callers to return it.
+ */
+static int8_t connection_error(h2_conn_t *conn, uint32_t code) {
+  LOG_DEBUG("HTTP/2 connection error %u\n", code);
+  goaway(conn, code);
+  return ERROR;
+}
+
+/** Streams */
+
+static h2_stream_t *find_stream(h2_conn_t *conn, uint32_t id) {
+  for (h2_stream_t *stream = conn->streams; stream != NULL; stream = stream->next)
+    if (stream->id == id) return stream;
+  return NULL;
+}
+
+static void unlink_stream(h2_conn_t *conn, h2_stream_t *stream) {
+  h2_stream_t **link = &conn->streams;
+  while (*link != stream) link = &(*link)->next;
+  *link = stream->next;
+  stream->next = NULL;
+}
+
+static void push_stream(h2_conn_t *conn, h2_stream_t *stream) {
+  h2_stream_t **link = &conn->streams;
+  while (*link != NULL) link = &(*link)->next;
+  *link = stream;
+}
+
+static h2_stream_t *open_stream(client_t *client, uint32_t id) {
+  h2_conn_t *conn = client->h2;
+  h2_stream_t *stream = calloc(1, sizeof (h2_stream_t));
+  if (stream == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  stream->id = id;
+  stream->window = conn->initial_window;
+  stream->transfer.filefd = -1;
+  stream->request.http_version = E_HTTP_2;
+  stream->request.start_ns = now_ns();
+  trace_start_request(client, &stream->request);
+  push_stream(conn, stream);
+  ++conn->nb_streams;
+  METRIC_INC(h2_streams);
+  return stream;
+}
+
+/**
+ * Account for the request of a stream and free it, once its response was
+ * sent or given up on.
+ */
+static void close_stream(client_t *client, h2_stream_t *stream) {
+  h2_conn_t *conn = client->h2;
+  transfer_t *transfer = &stream->transfer;
+  if (conn->sending == stream) {
+    conn->sending = NULL;
+    conn->frame_left = 0;
+  }
+  pagecache_drop(transfer, 1);
+  if (transfer->filefd >= 0) close(transfer->filefd);
+  free(transfer->head);
+  if (transfer->active) TRACE_MARK(&stream->request, TRACE_BODY);
+  end_request(client, &stream->request);
+  unlink_stream(conn, stream);
+  --conn->nb_streams;
+  free(stream);
+}
+
+static uint8_t has_data(h2_stream_t *stream) {
+  return stream->transfer.head_sent < stream->transfer.head_len ||
+    stream->transfer.remaining > 0;
+}
+
+/**
+ * Stop sending a stream. A DATA frame being sent from its file is finished
+ * first, the frame boundaries of the connection depend on it.
+ */
+static void reset_stream(client_t *client, h2_stream_t *stream) {
+  h2_conn_t *conn = client->h2;
+  if (conn->sending != stream) {
+    close_stream(client, stream);
+    return;
+  }
+  stream->transfer.head_sent = stream->transfer.head_len;
+  stream->transfer.remaining = 0;
+}
+
+/** Requests */
+
+typedef struct {
+  request_t *request;
+  int8_t error;
+  uint8_t method;
+} decoder_t;
+
+static void set_header(decoder_t *d, uint8_t i, const char *value, size_t value_len) {
+  request_t *request = d->request;
+  char *old = request->headers[i];
+  // Cookies may come as several fields
+  size_t old_len = old != NULL && i == COOKIE ? strlen(old) + 2 : 0;
+  char *header = malloc(old_len + value_len + 1);
+  if (header == NULL) {
+    perror("malloc");
+    d->error = ERROR;
+    return;
+  }
+  if (old_len) {
+    memcpy(header, old, old_len - 2);
+    memcpy(header + old_len - 2, "; ", 2);
+  }
+  memcpy(header + old_len, value, value_len);
+  header[old_len + value_len] = '\0';
+  free(old);
+  request->headers[i] = header;
+}
+
+/**
+ * Fill the request of a stream with a decoded field. The fields of a refused
+ * or bad stream are still decoded, for the dynamic table.
+ */
+static int8_t on_field(void *context, const char *name, size_t name_len,
+  const char *value, size_t value_len) {
+  decoder_t *d = context;
+  request_t *request = d->request;
+  if (request == NULL || d->error) return 0;
+  if (name_len == 7 && !memcmp(name, ":method", 7)) {
+    uint8_t i;
+    for (i = 0; i < NB_METHODS; ++i)
+      if (strlen(g_methods[i]) == value_len && !memcmp(g_methods[i], value, value_len)) break;
+    if (i >= NB_METHODS) d->error = ERR_UNKNOWN_METHOD;
+    request->method = i < NB_METHODS ? i : GET;
+    d->method = 1;
+  } else if (name_len == 5 && !memcmp(name, ":path", 5)) {
+    if (request->path != NULL || value_len == 0) d->error = ERR_BAD_REQUEST;
+    else if (preprocess_path((char *) value, value_len, request) != 0) d->error = ERR_BAD_REQUEST;
+  } else if (name_len == 10 && !memcmp(name, ":authority", 10)) {
+    set_header(d, HOST, value, value_len);
+  } else if (name_len > 0 && name[0] != ':') {
+    for (uint8_t i = 0; i < NB_HEADERS; ++i)
+      if (strlen(g_headers[i]) == name_len && !strncasecmp(g_headers[i], name, name_len)) {
+        set_header(d, i, value, value_len);
+        break;
+      }
+  }
+  // :scheme is the one of the connection
+  return 0;
+}
+
+/**
+ * Account for the answer made for the stream being dispatched, unless its
+ * file is being opened by the pool (see h2_open_complete).
+ */
+static int8_t answered(client_t *client, h2_stream_t *stream, int8_t ret) {
+  h2_conn_t *conn = client->h2;
+  conn->current = NULL;
+  if (ret < 0) return connection_error(conn, H2_INTERNAL_ERROR);
+  if (stream->io_pending) return 0;
+  if (!stream->transfer.active) {
+    queue_u32(conn, H2_RST_STREAM, stream->id, H2_INTERNAL_ERROR);
+    close_stream(client, stream);
+  } else if (!has_data(stream)) close_stream(client, stream);
+  return 0;
+}
+
+/**
+ * Answer the request of a new stream, or the error found decoding it.
+ */
+static int8_t dispatch(client_t *client, h2_stream_t *stream, int8_t error) {
+  h2_conn_t *conn = client->h2;
+  request_t *request = &stream->request;
+  TRACE_MARK(request, TRACE_PARSED);
+  conn->current = stream;
+  int8_t ret;
+  switch (error) {
+  case 0:
+    ret = respond(client, request);
+    break;
+  case ERR_UNKNOWN_METHOD:
+    ret = answer(client->clientfd, request, _501);
+    break;
+  case ERR_BAD_REQUEST:
+    ret = answer(client->clientfd, request, _400);
+    break;
+  default:
+    ret = answer(client->clientfd, request, _500);
+  }
+  return answered(client, stream, ret);
+}
+
+/**
+ * Decode a complete header block: the request of a new stream, or trailers
+ * which are ignored.
+ */
+static int8_t end_headers(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  uint32_t id = conn->block_stream;
+  uint8_t opening = id > conn->last_stream_id;
+  h2_stream_t *stream = NULL;
+  conn->block_stream = 0;
+  if (opening) {
+    conn->last_stream_id = id;
+    if (conn->nb_streams < H2_MAX_STREAMS && !conn->goaway && !conn->peer_goaway)
+      stream = open_stream(client, id);
+  }
+  decoder_t d = { stream != NULL ? &stream->request : NULL, 0, 0 };
+  int8_t ret = hpack_decode(&conn->decoder, conn->block, conn->block_len, on_field, &d);
+  conn->block_len = 0;
+  if (ret < 0) {
+    if (stream != NULL) close_stream(client, stream);
+    return connection_error(conn, H2_COMPRESSION_ERROR);
+  }
+  if (!opening) return 0;
+  if (stream == NULL) return queue_u32(conn, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+  if (!d.error && (!d.method || stream->request.path == NULL)) d.error = ERR_BAD_REQUEST;
+  return dispatch(client, stream, d.error);
+}
+
+static int8_t gather(client_t *client, uint8_t flags, const uint8_t *fragment, size_t len) {
+  h2_conn_t *conn = client->h2;
+  if (conn->block_len + len > H2_MAX_HEADER_BLOCK)
+    return connection_error(conn, H2_PROTOCOL_ERROR);
+  uint8_t *block = realloc(conn->block, conn->block_len + len + 1);
+  if (block == NULL) {
+    perror("realloc");
+    return connection_error(conn, H2_INTERNAL_ERROR);
+  }
+  conn->block = block;
+  memcpy(block + conn->block_len, fragment, len);
+  conn->block_len += len;
+  return flags & H2_FLAG_END_HEADERS ? end_headers(client) : 0;
+}
+
+/** Frames */
+
+// Strip the padding of a DATA or HEADERS frame
+static int8_t unpad(h2_conn_t *conn, uint8_t flags, const uint8_t **payload, uint32_t *len) {
+  if (!(flags & H2_FLAG_PADDED)) return 0;
+  if (*len < 1 || (*payload)[0] >= *len) return connection_error(conn, H2_PROTOCOL_ERROR);
+  *len -= 1 + (*payload)[0];
+  ++*payload;
+  return 0;
+}
+
+static int8_t apply_settings(h2_conn_t *conn, const uint8_t *payload, size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    uint16_t key = payload[i] << 8 | payload[i + 1];
+    uint32_t value = get32(payload + i + 2);
+    if (key == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+      if (value > H2_MAX_WINDOW) return connection_error(conn, H2_FLOW_CONTROL_ERROR);
+      // Applies to the open streams too
+      for (h2_stream_t *stream = conn->streams; stream != NULL; stream = stream->next)
+        stream->window += (int64_t) value - conn->initial_window;
+      conn->initial_window = value;
+    } else if (key == H2_SETTINGS_MAX_FRAME_SIZE) {
+      if (value < H2_MAX_FRAME || value > 0xFFFFFF)
+        return connection_error(conn, H2_PROTOCOL_ERROR);
+      conn->max_frame = value;
+    }
+  }
+  return 0;
+}
+
+static int8_t on_data(client_t *client, uint8_t flags, uint32_t id,
+  const uint8_t *payload, uint32_t len) {
+  h2_conn_t *conn = client->h2;
+  // The window counts the whole frame, padding included; it is given back
+  // at once since bodies are dropped
+  uint32_t size = len;
+  if (id == 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+  if (unpad(conn, flags, &payload, &len) < 0) return ERROR;
+  if (size == 0) return 0;
+  if (queue_u32(conn, H2_WINDOW_UPDATE, 0, size) < 0) return ERROR;
+  if (!(flags & H2_FLAG_END_STREAM) && find_stream(conn, id) != NULL)
+    return queue_u32(conn, H2_WINDOW_UPDATE, id, size);
+  return 0;
+}
+
+static int8_t on_headers(client_t *client, uint8_t flags, uint32_t id,
+  const uint8_t *payload, uint32_t len) {
+  h2_conn_t *conn = client->h2;
+  // Client streams are odd
+  if (id == 0 || !(id & 1)) return connection_error(conn, H2_PROTOCOL_ERROR);
+  if (unpad(conn, flags, &payload, &len) < 0) return ERROR;
+  if (flags & H2_FLAG_PRIORITY) {
+    if (len < 5) return connection_error(conn, H2_PROTOCOL_ERROR);
+    payload += 5;
+    len -= 5;
+  }
+  conn->block_stream = id;
+  conn->block_len = 0;
+  return gather(client, flags, payload, len);
+}
+
+static int8_t on_window_update(client_t *client, uint32_t id, const uint8_t *payload,
+  uint32_t len) {
+  h2_conn_t *conn = client->h2;
+  if (len != 4) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+  uint32_t increment = get32(payload) & H2_MAX_WINDOW;
+  if (id == 0) {
+    if (increment == 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+    conn->window += increment;
+    if (conn->window > H2_MAX_WINDOW) return connection_error(conn, H2_FLOW_CONTROL_ERROR);
+    return 0;
+  }
+  h2_stream_t *stream = find_stream(conn, id);
+  if (stream == NULL) return 0;
+  stream->window += increment;
+  if (increment == 0 || stream->window > H2_MAX_WINDOW) {
+    reset_stream(client, stream);
+    return queue_u32(conn, H2_RST_STREAM, id,
+      increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+  }
+  return 0;
+}
+
+static int8_t on_frame(client_t *client, uint8_t type, uint8_t flags, uint32_t id,
+  const uint8_t *payload, uint32_t len) {
+  h2_conn_t *conn = client->h2;
+  // A header block is not interleaved with other frames
+  if (conn->block_stream && (type != H2_CONTINUATION || id != conn->block_stream))
+    return connection_error(conn, H2_PROTOCOL_ERROR);
+  switch (type) {
+  case H2_DATA:
+    return on_data(client, flags, id, payload, len);
+  case H2_HEADERS:
+    return on_headers(client, flags, id, payload, len);
+  case H2_CONTINUATION:
+    if (!conn->block_stream) return connection_error(conn, H2_PROTOCOL_ERROR);
+    return gather(client, flags, payload, len);
+  case H2_RST_STREAM: {
+    if (len != 4) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+    if (id == 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+    h2_stream_t *stream = find_stream(conn, id);
+    if (stream != NULL) reset_stream(client, stream);
+    return 0;
+  }
+  case H2_SETTINGS:
+    if (id != 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+    if (flags & H2_FLAG_ACK) return len ? connection_error(conn, H2_FRAME_SIZE_ERROR) : 0;
+    if (len % 6) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+    if (apply_settings(conn, payload, len) < 0) return ERROR;
+    return queue_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+  case H2_PING:
+    if (len != 8) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+    if (id != 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+    if (flags & H2_FLAG_ACK) return 0;
+    return queue_frame(conn, H2_PING, H2_FLAG_ACK, 0, payload, 8);
+  case H2_GOAWAY:
+    if (id != 0) return connection_error(conn, H2_PROTOCOL_ERROR);
+    conn->peer_goaway = 1;
+    return 0;
+  case H2_WINDOW_UPDATE:
+    return on_window_update(client, id, payload, len);
+  default:
+    // PRIORITY, and the frame types this server does not know
+    return 0;
+  }
+}
+
+/**
+ * Handle the complete frames read, after the preface of the client.
+ */
+static int8_t process(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  size_t at = 0;
+  if (!conn->preface_done) {
+    size_t len = conn->input_len < H2_PREFACE_LEN ? conn->input_len : H2_PREFACE_LEN;
+    if (memcmp(conn->input, H2_PREFACE, len)) return connection_error(conn, H2_PROTOCOL_ERROR);
+    if (len < H2_PREFACE_LEN) return 0;
+    conn->preface_done = 1;
+    at = H2_PREFACE_LEN;
+  }
+  while (conn->input_len - at >= H2_FRAME_HEADER && !conn->goaway) {
+    const uint8_t *frame = conn->input + at;
+    uint32_t len = get24(frame);
+    if (len > H2_MAX_FRAME) return connection_error(conn, H2_FRAME_SIZE_ERROR);
+    if (conn->input_len - at < H2_FRAME_HEADER + len) break;
+    if (on_frame(client, frame[3], frame[4], get32(frame + 5) & H2_MAX_WINDOW,
+      frame + H2_FRAME_HEADER, len) < 0) return ERROR;
+    at += H2_FRAME_HEADER + len;
+  }
+  memmove(conn->input, conn->input + at, conn->input_len - at);
+  conn->input_len -= at;
+  return 0;
+}
+
+/** Responses */
+
+static uint8_t hop_by_hop(const char *name, size_t len) {
+  static const char *headers[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"
+  };
+  for (uint8_t i = 0; i < sizeof (headers) / sizeof (headers[0]); ++i)
+    if (strlen(headers[i]) == len && !memcmp(headers[i], name, len)) return 1;
+  return 0;
+}
+
+/**
+ * Encode the status line and the headers of an HTTP/1.1 head. Returns the
+ * size of the block, 0 if it does not fit, and sets body_at to the end of the
+ * head.
+ */
+static size_t encode_head(const char *head, size_t head_len, uint8_t *block, size_t size,
+  size_t *body_at) {
+  const char *end = head + head_len;
+  const char *eol = memchr(head, '\n', head_len);
+  const char *code = memchr(head, ' ', head_len);
+  if (eol == NULL || code == NULL || code > eol) return 0;
+  size_t len = hpack_encode_status(block, atoi(code + 1));
+  const char *line = eol + 1;
+  while (line < end) {
+    if ((eol = memchr(line, '\n', end - line)) == NULL) eol = end;
+    const char *stop = eol > line && eol[-1] == '\r' ? eol - 1 : eol;
+    if (stop == line) {
+      line = eol + 1;
+      break;
+    }
+    const char *colon = memchr(line, ':', stop - line);
+    char name[64];
+    size_t name_len = colon != NULL ? (size_t) (colon - line) : 0;
+    if (name_len > 0 && name_len < sizeof (name)) {
+      for (size_t i = 0; i < name_len; ++i) name[i] = tolower((unsigned char) line[i]);
+      const char *value = colon + 1;
+      while (value < stop && (*value == ' ' || *value == '\t')) ++value;
+      if (!hop_by_hop(name, name_len)) {
+        size_t n = hpack_encode_header(block + len, size - len, name, name_len, value,
+          stop - value);
+        if (n == 0) return 0;
+        len += n;
+      }
+    }
+    line = eol + 1;
+  }
+  *body_at = line < end ? (size_t) (line - head) : head_len;
+  return len;
+}
+
+/**
+ * Queue a header block, in a HEADERS frame and as many CONTINUATION frames as
+ * the frame size of the client asks.
+ */
+static int8_t queue_headers(h2_conn_t *conn, uint32_t id, const uint8_t *block, size_t len,
+  uint8_t end_stream) {
+  uint8_t type = H2_HEADERS;
+  do {
+    size_t n = len < conn->max_frame ? len : conn->max_frame;
+    uint8_t flags = (n == len ? H2_FLAG_END_HEADERS : 0) |
+      (type == H2_HEADERS && end_stream ? H2_FLAG_END_STREAM : 0);
+    if (queue_frame(conn, type, flags, id, block, n) < 0) return ERROR;
+    block += n;
+    len -= n;
+    type = H2_CONTINUATION;
+  } while (len > 0);
+  return 0;
+}
+
+/**
+ * The response of the stream being dispatched, called by sched_start: head
+ * is an HTTP/1.1 head, possibly followed by a body, and size bytes of filefd
+ * from offset follow it. Takes filefd over as sched_start does.
+ */
+int8_t h2_respond(client_t *client, const char *head, size_t head_len, int32_t filefd,
+  off_t offset, size_t size, uint8_t policy) {
+  h2_conn_t *conn = client->h2;
+  h2_stream_t *stream = conn->current;
+  uint8_t block[BUFFER_SIZE * 2];
+  size_t body_at;
+  size_t block_len;
+  if (stream == NULL || stream->transfer.active ||
+    (block_len = encode_head(head, head_len, block, sizeof (block), &body_at)) == 0) {
+    if (filefd >= 0) close(filefd);
+    return ERROR;
+  }
+  transfer_t *transfer = &stream->transfer;
+  transfer->filefd = -1;
+  if (body_at < head_len) {
+    if ((transfer->head = malloc(head_len - body_at)) == NULL) {
+      perror("malloc");
+      if (filefd >= 0) close(filefd);
+      return ERROR;
+    }
+    memcpy(transfer->head, head + body_at, head_len - body_at);
+    transfer->head_len = head_len - body_at;
+  }
+  if (filefd >= 0 && size == 0) close(filefd);
+  else if (filefd >= 0) {
+    transfer->filefd = filefd;
+    transfer->offset = transfer->dropped = offset;
+    transfer->remaining = size;
+    transfer->policy = policy;
+    // Frames are sent with sendfile, which O_DIRECT does not go through
+    if (policy == PAGECACHE_DIRECT) {
+      fcntl(filefd, F_SETFL, fcntl(filefd, F_GETFL) & ~O_DIRECT);
+      transfer->policy = PAGECACHE_STREAM;
+    }
+  }
+  transfer->active = 1;
+  transfer->start_ns = transfer->progress_ns = now_ns();
+  if (queue_headers(conn, stream->id, block, block_len, !has_data(stream)) < 0) return ERROR;
+  TRACE_MARK(&stream->request, TRACE_HEADERS);
+  stream->request.bytes_sent += block_len + H2_FRAME_HEADER;
+  return 0;
+}
+
+/**
+ * Queue the next DATA frame, from the first stream with something to send
+ * within the windows, which then goes to the end of the list. Returns 0 if
+ * there was none.
+ */
+static uint8_t next_frame(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  // After an upgrade, the body of stream 1 waits for the preface: clients
+  // buffer little of what follows the 101
+  if (conn->window <= 0 || !conn->preface_done) return 0;
+  h2_stream_t *stream = conn->streams;
+  while (stream != NULL && (!has_data(stream) || stream->window <= 0)) stream = stream->next;
+  if (stream == NULL) return 0;
+  transfer_t *transfer = &stream->transfer;
+  size_t len = conn->max_frame;
+  if ((int64_t) len > conn->window) len = conn->window;
+  if ((int64_t) len > stream->window) len = stream->window;
+  uint8_t from_memory = transfer->head_sent < transfer->head_len;
+  size_t left = from_memory ? transfer->head_len - transfer->head_sent : transfer->remaining;
+  if (len > left) len = left;
+  uint8_t end_stream = len == left && (from_memory ? transfer->remaining == 0 : 1);
+  uint8_t flags = end_stream ? H2_FLAG_END_STREAM : 0;
+  if (from_memory) {
+    if (queue_frame(conn, H2_DATA, flags, stream->id, transfer->head + transfer->head_sent,
+      len) < 0) return 0;
+    transfer->head_sent += len;
+    stream->request.bytes_sent += H2_FRAME_HEADER + len;
+  } else {
+    // The payload is sent from the file once the queue reaches it
+    if (queue_header(conn, H2_DATA, flags, stream->id, len) < 0) return 0;
+    transfer->remaining -= len;
+    stream->request.bytes_sent += H2_FRAME_HEADER;
+    conn->sending = stream;
+    conn->payload_at = conn->output_len;
+    conn->frame_left = len;
+  }
+  conn->window -= len;
+  stream->window -= len;
+  unlink_stream(conn, stream);
+  push_stream(conn, stream);
+  if (!has_data(stream) && conn->sending != stream) close_stream(client, stream);
+  return 1;
+}
+
+static void cork(int32_t fd, int on) {
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof (on));
+}
+
+/**
+ * Send up to budget bytes of frames, queueing DATA frames as the queue
+ * drains. Returns the number of bytes sent or ERROR if the connection is
+ * broken. The socket is corked while DATA frames are sent from files, so
+ * that a frame header does not leave alone and wait for an ACK (Nagle)
+ * before its payload.
+ */
+ssize_t h2_send(client_t *client, size_t budget) {
+  h2_conn_t *conn = client->h2;
+  size_t sent = 0;
+  uint8_t corked = 0;
+  ssize_t ret = 0;
+  while (sent < budget) {
+    if (conn->frame_left && !corked) {
+      cork(client->clientfd, 1);
+      corked = 1;
+    }
+    size_t limit = conn->frame_left ? conn->payload_at : conn->output_len;
+    if (conn->output_sent < limit) {
+      ssize_t len = tls_write(client->clientfd, conn->output + conn->output_sent,
+        limit - conn->output_sent);
+      if (len < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        ret = ERROR;
+        break;
+      }
+      conn->output_sent += len;
+      sent += len;
+      continue;
+    }
+    if (conn->frame_left) {
+      h2_stream_t *stream = conn->sending;
+      transfer_t *transfer = &stream->transfer;
+      size_t count = conn->frame_left < budget - sent ? conn->frame_left : budget - sent;
+      ssize_t len = tls_sendfile(client->clientfd, transfer->filefd, &transfer->offset, count);
+      if (len < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        ret = ERROR;
+        break;
+      }
+      // The file shrunk under our feet
+      if (len == 0) {
+        ret = ERROR;
+        break;
+      }
+      conn->frame_left -= len;
+      sent += len;
+      stream->request.bytes_sent += len;
+      transfer->progress_ns = now_ns();
+      pagecache_sent(transfer, len);
+      if (conn->frame_left == 0) {
+        conn->sending = NULL;
+        if (!has_data(stream)) close_stream(client, stream);
+      }
+      continue;
+    }
+    conn->output_len = conn->output_sent = 0;
+    if (!next_frame(client)) break;
+  }
+  if (corked) cork(client->clientfd, 0);
+  if (sent > 0) client->idle_ns = now_ns();
+  return ret < 0 ? ret : (ssize_t) sent;
+}
+
+/**
+ * Send without waiting for a turn of the scheduler, unless the bandwidth is
+ * capped.
+ */
+static int8_t flush(client_t *client) {
+  if (g_sched_connection_rate || g_sched_global_rate) return 0;
+  return h2_send(client, SCHED_SHORT_RESPONSE) < 0 ? ERROR : 0;
+}
+
+/** Connections */
+
+/**
+ * Whether a buffer holds the client preface (1), the start of it (0), or
+ * something else (ERROR).
+ */
+int8_t h2_preface(const char *buffer, size_t len) {
+  size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+  if (memcmp(buffer, H2_PREFACE, n)) return ERROR;
+  return len >= H2_PREFACE_LEN;
+}
+
+static int8_t base64url(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '-') return 62;
+  if (c == '_') return 63;
+  return ERROR;
+}
+
+/**
+ * The SETTINGS payload of an HTTP2-Settings header, in base64url.
+ */
+static int8_t upgrade_settings(h2_conn_t *conn, const char *settings) {
+  uint8_t payload[96];
+  size_t len = 0;
+  uint32_t bits = 0;
+  uint8_t nb_bits = 0;
+  for (const char *c = settings; *c && *c != '='; ++c) {
+    int8_t value = base64url(*c);
+    if (value < 0 || len >= sizeof (payload)) return ERROR;
+    bits = bits << 6 | value;
+    nb_bits += 6;
+    if (nb_bits >= 8) {
+      nb_bits -= 8;
+      payload[len++] = bits >> nb_bits;
+    }
+  }
+  if (len % 6) return ERROR;
+  return apply_settings(conn, payload, len);
+}
+
+/**
+ * Switch a connection to HTTP/2, data being the first bytes read from the
+ * client (the preface first). After an Upgrade: h2c, upgrade is the request
+ * to answer as stream 1, and is moved there, and settings the HTTP2-Settings
+ * header. Returns ERROR if the connection is to be closed.
+ */
+int8_t h2_start(client_t *client, const char *data, size_t len, request_t *upgrade,
+  const char *settings) {
+  h2_conn_t *conn = calloc(1, sizeof (h2_conn_t));
+  if (conn == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  hpack_init(&conn->decoder);
+  conn->window = conn->initial_window = H2_DEFAULT_WINDOW;
+  conn->max_frame = H2_MAX_FRAME;
+  client->h2 = conn;
+  METRIC_INC(h2_connections);
+  uint8_t ours[6] = { 0, H2_SETTINGS_MAX_CONCURRENT_STREAMS };
+  put32(ours + 2, H2_MAX_STREAMS);
+  if (queue_frame(conn, H2_SETTINGS, 0, 0, ours, sizeof (ours)) < 0) return ERROR;
+  if (settings != NULL && upgrade_settings(conn, settings) < 0) return ERROR;
+  if (upgrade != NULL) {
+    h2_stream_t *stream = open_stream(client, 1);
+    if (stream == NULL) return ERROR;
+    stream->request = *upgrade;
+    stream->request.http_version = E_HTTP_2;
+    memset(upgrade, 0, sizeof (request_t));
+    conn->last_stream_id = 1;
+    if (dispatch(client, stream, 0) < 0) return ERROR;
+  }
+  if (len > sizeof (conn->input)) return ERROR;
+  if (len > 0) memcpy(conn->input, data, len);
+  conn->input_len = len;
+  if (process(client) < 0) {
+    h2_send(client, H2_MAX_OUTPUT);
+    return ERROR;
+  }
+  return flush(client);
+}
+
+/**
+ * Read and handle the frames that arrived. Returns ERROR if the connection
+ * is to be closed.
+ */
+int8_t h2_read(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  while (pending_output(conn) <= H2_MAX_OUTPUT) {
+    ssize_t len = tls_read(client->clientfd, conn->input + conn->input_len,
+      sizeof (conn->input) - conn->input_len);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      LOG_DEBUG("read on %i: %s\n", client->clientfd, strerror(errno));
+      return ERROR;
+    }
+    if (len == 0) return ERROR;
+    conn->input_len += len;
+    client->idle_ns = now_ns();
+    if (process(client) < 0) {
+      // The GOAWAY telling why, if the socket takes it
+      h2_send(client, H2_MAX_OUTPUT);
+      return ERROR;
+    }
+  }
+  // The client is leaving once its streams are answered
+  if (conn->peer_goaway && h2_idle(client)) return ERROR;
+  return flush(client);
+}
+
+/**
+ * Resume the stream id once the pool opened its file, as open_complete does
+ * for an HTTP/1.x connection. The file is closed if the stream was reset
+ * meanwhile.
+ */
+void h2_open_complete(client_t *client, uint32_t id, int filefd, int err,
+  client_t **clients) {
+  h2_conn_t *conn = client->h2;
+  h2_stream_t *stream = conn != NULL ? find_stream(conn, id) : NULL;
+  if (stream == NULL || !stream->io_pending) {
+    if (filefd >= 0) close(filefd);
+    return;
+  }
+  request_t *request = &stream->request;
+  stream->io_pending = 0;
+  conn->current = stream;
+  PERF_BEGIN(request, PERF_PHASE_RESPONSE);
+  int8_t ret = send_file(client, request, filefd, err);
+  PERF_END(request, PERF_PHASE_RESPONSE);
+  if (answered(client, stream, ret) < 0 || flush(client) < 0)
+    delete_client(client->clientfd, clients);
+}
+
+/**
+ * Events to poll for: the connection is read while the frames waiting for
+ * the socket stay under H2_MAX_OUTPUT, written while there are frames to send
+ * within the flow control windows.
+ */
+short h2_events(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  short events = pending_output(conn) <= H2_MAX_OUTPUT ? POLLIN : 0;
+  if (pending_output(conn) > 0 || conn->frame_left) return events | POLLOUT;
+  if (conn->window <= 0 || !conn->preface_done) return events;
+  for (h2_stream_t *stream = conn->streams; stream != NULL; stream = stream->next)
+    if (has_data(stream) && stream->window > 0) return events | POLLOUT;
+  return events;
+}
+
+/**
+ * Whether the connection has no stream open nor frame to send.
+ */
+uint8_t h2_idle(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  return conn->streams == NULL && pending_output(conn) == 0 && !conn->frame_left;
+}
+
+/**
+ * Free the HTTP/2 state of a connection being closed, after a best effort
+ * GOAWAY. The requests of its streams are accounted for.
+ */
+void h2_free(client_t *client) {
+  h2_conn_t *conn = client->h2;
+  if (conn == NULL) return;
+  // Unless a DATA frame was cut short
+  if (!conn->goaway && !conn->frame_left) {
+    goaway(conn, H2_NO_ERROR);
+    if (tls_write(client->clientfd, conn->output + conn->output_sent, pending_output(conn)) < 0)
+      LOG_DEBUG("no GOAWAY for %i\n", client->clientfd);
+  }
+  while (conn->streams != NULL) close_stream(client, conn->streams);
+  hpack_free(&conn->decoder);
+  free(conn->block);
+  free(conn->output);
+  free(conn);
+  client->h2 = NULL;
+}
@@ -0,0 +1,119 @@
+#ifndef __H2_H__
+#define __H2_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "defines.h"
+#include "hpack.h"
+
+/**
+ * HTTP/2 (RFC 9113): over TLS when the client picks h2 (ALPN), in clear text
+ * with prior knowledge or after an Upgrade: h2c. The requests of a connection
+ * are streams served concurrently by the same code as HTTP/1.1, their
+ * responses interleaved in DATA frames that are sent from the files with
+ * sendfile.
+ */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+// Largest frame accepted, the default of the protocol
+#define H2_MAX_FRAME 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7FFFFFFF
+// Streams open at once, advertised in SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_MAX_STREAMS 100
+// Header blocks split in CONTINUATION frames are gathered up to that size
+#define H2_MAX_HEADER_BLOCK 65536
+// The connection is not read while more frames than that wait for the socket
+#define H2_MAX_OUTPUT (1 << 20)
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+typedef struct h2_stream_s {
+  uint32_t id;
+  request_t request;
+  // Response, its head being the part of the body held in memory
+  transfer_t transfer;
+  // Send window of the stream
+  int64_t window;
+  // Its file is being opened by the file operations pool
+  uint8_t io_pending;
+  struct h2_stream_s *next;
+} h2_stream_t;
+
+typedef struct h2_conn_s {
+  // Frames read and not handled yet
+  uint8_t input[H2_FRAME_HEADER + H2_MAX_FRAME];
+  size_t input_len;
+  uint8_t preface_done;
+  // Header block being gathered and the stream it opens
+  uint8_t *block;
+  size_t block_len;
+  uint32_t block_stream;
+  // Frames queued for the socket
+  uint8_t *output;
+  size_t output_len;
+  size_t output_sent;
+  size_t output_size;
+  // Payload of a DATA frame sent from a file, right after the first
+  // payload_at bytes of output
+  h2_stream_t *sending;
+  size_t frame_left;
+  size_t payload_at;
+  h2_stream_t *streams;
+  uint32_t nb_streams;
+  uint32_t last_stream_id;
+  // Stream a response is being made for
+  h2_stream_t *current;
+  // Send window of the connection and settings of the peer
+  int64_t window;
+  uint32_t initial_window;
+  uint32_t max_frame;
+  hpack_table_t decoder;
+  // GOAWAY sent, or received
+  uint8_t goaway;
+  uint8_t peer_goaway;
+} h2_conn_t;
+
+int8_t h2_preface(const char *buffer, size_t len);
+int8_t h2_start(client_t *client, const char *data, size_t len, request_t *upgrade,
+  const char *settings);
+int8_t h2_read(client_t *client);
+ssize_t h2_send(client_t *client, size_t budget);
+short h2_events(client_t *client);
+uint8_t h2_idle(client_t *client);
+int8_t h2_respond(client_t *client, const char *head, size_t head_len, int32_t filefd,
+  off_t offset, size_t size, uint8_t policy);
+void h2_open_complete(client_t *client, uint32_t id, int filefd, int err,
+  client_t **clients);
+void h2_free(client_t *client);
+
+#endif // __H2_H__
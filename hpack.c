@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "defines.h"
+#include "hpack.h"
+
+/**
+ * The Huffman code of HPACK is canonical: the codes of a length follow each
+ * other in the order of their symbols, so that it is described by the number
+ * of codes of each length and the symbols sorted by code, and decoded a bit
+ * at a time without a tree.
+ */
+
+typedef struct {
+  const char *name;
+  const char *value;
+} hpack_static_t;
+
+// Index 1 is the first entry
+static const hpack_static_t g_static[HPACK_STATIC_ENTRIES] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+static const uint8_t g_huffman_counts[HPACK_HUFFMAN_MAX_BITS + 1] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t g_huffman_symbols[HPACK_HUFFMAN_SYMBOLS] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+  45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+  95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+  58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+  106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+  88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+  0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+  167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+  132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+  173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+  151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+  183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+  171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+  255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+  246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+  6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+  249, 10, 13, 22, 256,
+};
+
+void hpack_init(hpack_table_t *table) {
+  memset(table, 0, sizeof (hpack_table_t));
+  table->max_size = HPACK_TABLE_SIZE;
+}
+
+static hpack_entry_t *entry(hpack_table_t *table, uint32_t i) {
+  return &table->entries[(table->first + i) % HPACK_MAX_ENTRIES];
+}
+
+static void evict(hpack_table_t *table, uint32_t max_size) {
+  while (table->size > max_size) {
+    hpack_entry_t *oldest = entry(table, table->count - 1);
+    table->size -= oldest->name_len + oldest->value_len + HPACK_ENTRY_OVERHEAD;
+    free(oldest->name);
+    oldest->name = NULL;
+    --table->count;
+  }
+}
+
+void hpack_free(hpack_table_t *table) {
+  evict(table, 0);
+}
+
+static int8_t insert(hpack_table_t *table, const char *name, size_t name_len,
+  const char *value, size_t value_len) {
+  size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+  // Too large, the table is emptied
+  if (size > table->max_size) {
+    evict(table, 0);
+    return 0;
+  }
+  // Copied first, the name may come from an entry about to be evicted
+  char *copy = malloc(name_len + value_len + 1);
+  if (copy == NULL) {
+    perror("malloc");
+    return ERROR;
+  }
+  memcpy(copy, name, name_len);
+  memcpy(copy + name_len, value, value_len);
+  evict(table, table->max_size - size);
+  table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+  hpack_entry_t *e = entry(table, 0);
+  e->name = copy;
+  e->name_len = name_len;
+  e->value_len = value_len;
+  ++table->count;
+  table->size += size;
+  return 0;
+}
+
+/**
+ * Name and value of an index of the static and dynamic tables.
+ */
+static int8_t lookup(hpack_table_t *table, uint32_t index, const char **name,
+  size_t *name_len, const char **value, size_t *value_len) {
+  if (index == 0) return ERROR;
+  if (index <= HPACK_STATIC_ENTRIES) {
+    *name = g_static[index - 1].name;
+    *name_len = strlen(*name);
+    *value = g_static[index - 1].value;
+    *value_len = strlen(*value);
+    return 0;
+  }
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if (index >= table->count) return ERROR;
+  hpack_entry_t *e = entry(table, index);
+  *name = e->name;
+  *name_len = e->name_len;
+  *value = e->name + e->name_len;
+  *value_len = e->value_len;
+  return 0;
+}
+
+// Integer on a prefix of the first byte, continued 7 bits at a time
+static int8_t decode_int(const uint8_t **p, const uint8_t *end, uint8_t prefix,
+  uint32_t *value) {
+  if (*p >= end) return ERROR;
+  uint32_t max = (1 << prefix) - 1;
+  uint32_t v = *(*p)++ & max;
+  if (v < max) {
+    *value = v;
+    return 0;
+  }
+  // Nothing needs more than 28 bits
+  for (uint8_t shift = 0; shift < 28; shift += 7) {
+    if (*p >= end) return ERROR;
+    uint8_t byte = *(*p)++;
+    v += (uint32_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *value = v;
+      return 0;
+    }
+  }
+  return ERROR;
+}
+
+/**
+ * Decode a string, Huffman coded ones to the scratch buffer.
+ */
+static int8_t decode_string(const uint8_t **p, const uint8_t *end, char **scratch,
+  const char **s, size_t *len) {
+  if (*p >= end) return ERROR;
+  uint8_t huffman = **p & 0x80;
+  uint32_t length;
+  if (decode_int(p, end, 7, &length) < 0 || length > (size_t) (end - *p)) return ERROR;
+  if (!huffman) {
+    *s = (const char *) *p;
+    *len = length;
+  } else {
+    ssize_t decoded = hpack_huffman_decode(*p, length, *scratch);
+    if (decoded < 0) return ERROR;
+    *s = *scratch;
+    *len = decoded;
+    *scratch += decoded;
+  }
+  *p += length;
+  return 0;
+}
+
+/**
+ * Decode a Huffman coded string to out, which holds 8 / 5 of its length.
+ * Returns the decoded length, ERROR if the code or its padding is invalid.
+ */
+ssize_t hpack_huffman_decode(const uint8_t *in, size_t len, char *out) {
+  size_t n = 0;
+  // Code being read and its length, first code of that length and the rank
+  // of that code among the symbols
+  uint32_t code = 0;
+  uint32_t first = 0;
+  uint32_t index = 0;
+  uint8_t bits = 0;
+  // The padding is the start of the EOS code, all ones
+  uint8_t ones = 1;
+  for (size_t i = 0; i < len; ++i) {
+    for (int8_t b = 7; b >= 0; --b) {
+      uint8_t bit = (in[i] >> b) & 1;
+      code |= bit;
+      ones &= bit;
+      uint32_t count = g_huffman_counts[++bits];
+      if (code - first < count) {
+        uint16_t symbol = g_huffman_symbols[index + code - first];
+        if (symbol == HPACK_HUFFMAN_SYMBOLS - 1) return ERROR;
+        out[n++] = symbol;
+        code = first = index = bits = 0;
+        ones = 1;
+        continue;
+      }
+      if (bits == HPACK_HUFFMAN_MAX_BITS) return ERROR;
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+  }
+  if (bits > 7 || !ones) return ERROR;
+  return n;
+}
+
+/**
+ * Decode a header block, calling header for every field. The dynamic table
+ * is updated as the block says. Returns ERROR if the block is malformed
+ * (a compression error, fatal to the connection) or header failed.
+ */
+int8_t hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len,
+  hpack_header_f header, void *context) {
+  // Every Huffman coded string holds in 8 / 5 of its length
+  char *buffer = malloc(len * 2 + 1);
+  if (buffer == NULL) {
+    perror("malloc");
+    return ERROR;
+  }
+  const uint8_t *p = block;
+  const uint8_t *end = block + len;
+  uint8_t fields = 0;
+  int8_t ret = 0;
+  while (p < end && ret == 0) {
+    char *scratch = buffer;
+    const char *name;
+    const char *value;
+    size_t name_len;
+    size_t value_len;
+    uint32_t index;
+    uint8_t byte = *p;
+    if (byte & 0x80) {
+      // Indexed field
+      ret = decode_int(&p, end, 7, &index) < 0 ||
+        lookup(table, index, &name, &name_len, &value, &value_len) < 0 ? ERROR : 0;
+    } else if ((byte & 0xE0) == 0x20) {
+      // Table size update, only before the fields
+      ret = fields || decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE ?
+        ERROR : 0;
+      if (ret == 0) {
+        evict(table, index);
+        table->max_size = index;
+      }
+      continue;
+    } else {
+      // Literal, added to the table (01), or not (0000 and never 0001)
+      uint8_t indexing = (byte & 0xC0) == 0x40;
+      ret = decode_int(&p, end, indexing ? 6 : 4, &index);
+      if (ret == 0 && index > 0)
+        ret = lookup(table, index, &name, &name_len, &value, &value_len);
+      else if (ret == 0) ret = decode_string(&p, end, &scratch, &name, &name_len);
+      if (ret == 0) ret = decode_string(&p, end, &scratch, &value, &value_len);
+      // Before the insertion, which may evict the entry the name came from
+      if (ret == 0) ret = header(context, name, name_len, value, value_len);
+      if (ret == 0 && indexing) ret = insert(table, name, name_len, value, value_len);
+      fields = 1;
+      continue;
+    }
+    fields = 1;
+    if (ret == 0) ret = header(context, name, name_len, value, value_len);
+  }
+  free(buffer);
+  return ret;
+}
+
+static size_t encode_int(uint8_t *out, uint32_t value, uint8_t prefix, uint8_t flags) {
+  uint32_t max = (1 << prefix) - 1;
+  if (value < max) {
+    out[0] = flags | value;
+    return 1;
+  }
+  size_t n = 0;
+  out[n++] = flags | max;
+  value -= max;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+/**
+ * Encode a :status field to out, which holds 5 bytes.
+ */
+size_t hpack_encode_status(uint8_t *out, uint16_t status) {
+  for (uint8_t i = 7; i < 14; ++i)
+    if (atoi(g_static[i].value) == status) return encode_int(out, i + 1, 7, 0x80);
+  // A literal with the name of :status
+  out[0] = 0x08;
+  out[1] = 3;
+  out[2] = '0' + status / 100 % 10;
+  out[3] = '0' + status / 10 % 10;
+  out[4] = '0' + status % 10;
+  return 5;
+}
+
+/**
+ * Encode a field, its name in lower case, as a literal never added to the
+ * table. Returns its size, 0 if out is too small.
+ */
+size_t hpack_encode_header(uint8_t *out, size_t size, const char *name, size_t name_len,
+  const char *value, size_t value_len) {
+  if (size < name_len + value_len + 3 * 5) return 0;
+  size_t n = 0;
+  uint8_t i;
+  for (i = 0; i < HPACK_STATIC_ENTRIES; ++i)
+    if (strlen(g_static[i].name) == name_len && !memcmp(g_static[i].name, name, name_len))
+      break;
+  if (i < HPACK_STATIC_ENTRIES) n += encode_int(out, i + 1, 4, 0);
+  else {
+    out[n++] = 0;
+    n += encode_int(out + n, name_len, 7, 0);
+    memcpy(out + n, name, name_len);
+    n += name_len;
+  }
+  n += encode_int(out + n, value_len, 7, 0);
+  memcpy(out + n, value, value_len);
+  return n + value_len;
+}
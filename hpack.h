@@ -0,0 +1,54 @@
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "defines.h"
+
+/**
+ * HPACK (RFC 7541), the header compression of HTTP/2. Requests are decoded
+ * with the static table, a dynamic table and the Huffman code. Responses are
+ * encoded as literals that are never added to the dynamic table, so that the
+ * encoder needs no state.
+ */
+// Size of the dynamic table of the decoder, the default of the protocol
+#define HPACK_TABLE_SIZE 4096
+// An entry counts for its name, its value and this overhead
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_HUFFMAN_SYMBOLS 257
+#define HPACK_HUFFMAN_MAX_BITS 30
+
+typedef struct {
+  // Name followed by the value, in a single allocation
+  char *name;
+  uint32_t name_len;
+  uint32_t value_len;
+} hpack_entry_t;
+
+typedef struct {
+  // Ring of entries, the newest at first
+  hpack_entry_t entries[HPACK_MAX_ENTRIES];
+  uint32_t first;
+  uint32_t count;
+  uint32_t size;
+  uint32_t max_size;
+} hpack_table_t;
+
+// Called for every header of a block, the strings are not terminated
+typedef int8_t (*hpack_header_f)(void *context, const char *name, size_t name_len,
+  const char *value, size_t value_len);
+
+void hpack_init(hpack_table_t *table);
+void hpack_free(hpack_table_t *table);
+int8_t hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len,
+  hpack_header_f header, void *context);
+ssize_t hpack_huffman_decode(const uint8_t *in, size_t len, char *out);
+size_t hpack_encode_status(uint8_t *out, uint16_t status);
+size_t hpack_encode_header(uint8_t *out, size_t size, const char *name, size_t name_len,
+  const char *value, size_t value_len);
+
+#endif // __HPACK_H__
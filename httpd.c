@@ -1,3 +1,6 @@
+// accept4
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -11,10 +14,41 @@
 #include <fcntl.h>
 #include <time.h>
 #include <poll.h>
+#include <sys/resource.h>
 
 #include "httpd.h"
 #include "defines.h"
 #include "mime.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "trace.h"
+#include "perf.h"
+#include "sched.h"
+#include "negcache.h"
+#include "resolve.h"
+#include "fileio.h"
+#include "pagecache.h"
+#include "pack.h"
+#include "guard.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "tls.h"
+#include "h2.h"
+#include "upstream.h"
+#include "gateway.h"
+#include "chunked.h"
+
+// Tells apart the connections reusing a file descriptor
+static uint64_t g_client_ids = 0;
+// Connections accepted at most, from the file descriptor limit
+size_t g_max_clients = 0;
+// Clients in the list, the listening socket included
+size_t g_nb_clients = 0;
+// Clients by file descriptor
+static client_t **g_client_table = NULL;
+static size_t g_client_table_size = 0;
+// Closed to accept, and close, a connection when out of descriptors
+static int g_reserve_fd = -1;
 
 #define POSIX_SPACES " \f\n\r\t\v";
 
@@ -99,13 +133,58 @@ int8_t create_addr(option_t options, struct sockaddr_in *addr) {
   return 0;
 }
 
+/**
+ * Size the connection table from RLIMIT_NOFILE, the soft limit raised to the
+ * hard one, and keep a descriptor in reserve to turn connections away when
+ * they are exhausted anyway (EMFILE) instead of spinning on the listening
+ * socket.
+ */
+int8_t clients_init() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    perror("getrlimit");
+    return ERROR;
+  }
+  if (limit.rlim_cur < limit.rlim_max) {
+    rlim_t soft = limit.rlim_cur;
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? MAX_FDS : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) limit.rlim_cur = soft;
+  }
+  if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAX_FDS) limit.rlim_cur = MAX_FDS;
+  if (limit.rlim_cur <= 2 * FD_RESERVED) {
+    LOG_ERROR("%lu file descriptors are not enough\n", (size_t) limit.rlim_cur);
+    return ERROR;
+  }
+  g_client_table_size = limit.rlim_cur;
+  if ((g_client_table = calloc(g_client_table_size, sizeof (client_t *))) == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  g_max_clients = limit.rlim_cur - FD_RESERVED;
+  if ((g_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+    perror("open");
+    return ERROR;
+  }
+  LOG_MSG("up to %lu connections\n", g_max_clients);
+  return 0;
+}
+
+/**
+ * Fill fds with the descriptors of the clients, the listening socket first.
+ * fds holds g_max_clients + 1 entries.
+ */
 size_t rebuild_fds(struct pollfd *fds, client_t *clients) {
   client_t *head = clients;
   size_t counter = 0;
-  memset(fds, 0, MAX_CLIENT);
-  while (head && counter < MAX_CLIENT) {
+  uint64_t now = now_ns();
+  while (head && counter <= g_max_clients) {
     fds[counter].fd = head->clientfd;
-    fds[counter].events = POLLIN;
+    // The listening socket has no address, it is left alone when the table
+    // is full or the server overloaded, as is a connection waiting for the
+    // pool
+    if (head->client_addr == NULL)
+      fds[counter].events = g_nb_clients <= g_max_clients && !admission_paused() ? POLLIN : 0;
+    else fds[counter].events = head->io_pending ? 0 : sched_events(head, now);
     fds[counter].revents = 0;
     head = head->next;
     ++counter;
@@ -113,82 +192,113 @@ size_t rebuild_fds(struct pollfd *fds, client_t *clients) {
   return counter;
 }
 
-size_t add_client(struct pollfd *fds, int16_t clientfd,
-  struct sockaddr *client_addr, client_t **clients) {
-  client_t *new = malloc(sizeof (client_t));
+/**
+ * Add a client after the listening socket, which stays first.
+ */
+client_t *add_client(int32_t clientfd, struct sockaddr *client_addr,
+  client_t **clients) {
+  if (clientfd < 0 || (size_t) clientfd >= g_client_table_size) return NULL;
+  client_t *new = calloc(1, sizeof (client_t));
   if (new == NULL) {
-    perror("malloc");
-    return ERROR;
+    perror("calloc");
+    return NULL;
   }
   new->client_addr = client_addr;
   new->clientfd = clientfd;
-  new->next = NULL;
+  new->accept_ns = new->idle_ns = now_ns();
+  new->nb_requests = 0;
+  new->transfer.filefd = -1;
+  new->id = ++g_client_ids;
   if (*clients == NULL) {
     *clients = new;
   } else {
-    client_t *last = *clients;
-    while (last->next != NULL) {
-      last = last->next;
-    }
-    last->next = new;
+    new->prev = *clients;
+    new->next = (*clients)->next;
+    if (new->next != NULL) new->next->prev = new;
+    (*clients)->next = new;
   }
-  return rebuild_fds(fds, *clients);
+  g_client_table[clientfd] = new;
+  ++g_nb_clients;
+  return new;
 }
 
-size_t delete_client(int16_t clientfd, struct pollfd *fds, client_t **clients) {
-  client_t *node = *clients;
-  client_t *prev = node;
-  while (node && node->clientfd != clientfd) {
-    prev = node;
-    node = node->next;
-  }
+int8_t delete_client(int32_t clientfd, client_t **clients) {
+  client_t *node = find_client(clientfd);
   if (node == NULL) return ERROR;
-  if (*clients == node) {
-    *clients = (*clients)->next;
+  // Its streams are accounted for while the connection is still there
+  h2_free(node);
+  if (node->prev != NULL) node->prev->next = node->next;
+  else *clients = node->next;
+  if (node->next != NULL) node->next->prev = node->prev;
+  g_client_table[clientfd] = NULL;
+  --g_nb_clients;
+  // An interrupted response is still accounted for
+  if (node->transfer.active || node->io_pending || node->upstream != NULL ||
+    node->chunked != NULL) {
+    sched_cancel(node);
+    finish_request(node);
   }
-  else prev->next = prev->next->next;
+  release_header(node);
+  tls_free(node);
   // close the file descriptor and destroy the client
   close(node->clientfd);
   if (node->client_addr != NULL) {
+    guard_release(node->client_addr);
+    METRIC_DEC(active_connections);
     LOG_DEBUG("disconnecting client %s\n",
       inet_ntoa(((struct sockaddr_in *) node->client_addr)->sin_addr));
     free(node->client_addr);
   }
   free(node);
-  return rebuild_fds(fds, *clients);
+  return 0;
 }
 
 void delete_all_clients(client_t **clients) {
   while (*clients != NULL) {
     client_t *tmp = (*clients)->next;
-    close((*clients)->clientfd);
+    h2_free(*clients);
+    tls_free(*clients);
+    // The listening socket may be closed already
+    if ((*clients)->clientfd >= 0) {
+      g_client_table[(*clients)->clientfd] = NULL;
+      close((*clients)->clientfd);
+    }
     if ((*clients)->client_addr != NULL) free((*clients)->client_addr);
     free((*clients));
     *clients = tmp;
   }
+  g_nb_clients = 0;
 }
 
+/**
+ * Close the listening socket, first of the clients. It stays there without a
+ * descriptor, which poll ignores.
+ */
+void stop_accepting(client_t *clients) {
+  if (clients->clientfd < 0) return;
+  g_client_table[clients->clientfd] = NULL;
+  close(clients->clientfd);
+  clients->clientfd = -1;
+}
 
-size_t count_clients(client_t *clients) {
-  size_t counter = 0;
-  while (clients) {
-    clients = clients->next;
-    ++counter;
-  }
-  return counter;
+client_t *find_client(int32_t clientfd) {
+  if (clientfd < 0 || (size_t) clientfd >= g_client_table_size) return NULL;
+  return g_client_table[clientfd];
 }
 
-int8_t prepare_socket(int16_t socketfd, struct sockaddr_in addr) {
+int8_t prepare_socket(int32_t socketfd, struct sockaddr_in addr) {
   // Set the address/port associated to that socket reusable
-  uint8_t t = 1;
-  setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof (uint8_t));
+  int t = 1;
+  setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof (int));
+  // Connections are accepted until EAGAIN
+  fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
   // Bind the address to the socket
   if (bind(socketfd, (struct sockaddr *) &addr, sizeof (struct sockaddr_in)) != 0) {
     perror("bind");
     return ERROR;
   }
-  // Listen only to one client
-  if (listen(socketfd, 1)) {
+  // The backlog holds the connections while the table is full
+  if (listen(socketfd, SOMAXCONN)) {
     perror("listen");
     return ERROR;
   }
@@ -201,6 +311,7 @@ int8_t request_complete(request_t *request) {
 
 void free_request(request_t request) {
   if (request.path != NULL) free(request.path);
+  if (request.query != NULL) free(request.query);
   if (request.body != NULL) free(request.body);
   for (uint8_t i = 0; i < NB_HEADERS; ++i) {
     if (request.headers[i] != NULL) free(request.headers[i]);
@@ -208,7 +319,7 @@ void free_request(request_t request) {
   // TODO: clear extra headers
 }
 
-int8_t parse_request_line(char *request_line, request_t *request) {
+ssize_t parse_request_line(char *request_line, request_t *request) {
   uint8_t i;
   char *token;
   int16_t tokensize;
@@ -230,9 +341,10 @@ int8_t parse_request_line(char *request_line, request_t *request) {
     LOG_ERROR("Wrongly formed request line: %s\n", request_line);
     return ERROR;
   }
-  if (preprocess_path(token, tokensize, request) != 0) {
+  int8_t ret = preprocess_path(token, tokensize, request);
+  if (ret != 0) {
     LOG_ERROR("error processing path%s\n", "");
-    return ERROR;
+    return ret;
   }
   // Parse the HTTP version
   tokensize = next_token(&token[tokensize], &token);
@@ -254,7 +366,7 @@ int8_t parse_request_line(char *request_line, request_t *request) {
   return token - request_line;
 }
 
-int8_t parse_headers(char *header_lines, request_t *request) {
+ssize_t parse_headers(char *header_lines, request_t *request) {
   ssize_t eoh = end_of_header(header_lines, strnlen(header_lines, BUFFER_SIZE));
   if (eoh < 0) return ERROR;
   char *token = header_lines;
@@ -266,9 +378,14 @@ int8_t parse_headers(char *header_lines, request_t *request) {
     typesize = next_token(&token[0], &token);
     if (typesize < 0) return ERROR;
     type = token;
-    valuesize = next_token(&token[typesize], &token);
-    if (valuesize < 0) return ERROR;
+    // Values run to the end of the line (Accept-Encoding: gzip, br)
+    token = &token[typesize];
+    while (*token && isspace(*token) && !iseol(token)) ++token;
+    if (*token == 0) return ERROR;
+    valuesize = 0;
+    while (token[valuesize] && !iseol(&token[valuesize])) ++valuesize;
     value = strndup(token, valuesize);
+    while (valuesize > 0 && isspace(value[valuesize - 1])) value[--valuesize] = 0;
     uint8_t i;
     for (i = 0; i < NB_HEADERS; ++i)
       if (!strncasecmp(g_headers[i], type, typesize - 1)) break;
@@ -285,149 +402,493 @@ int8_t parse_headers(char *header_lines, request_t *request) {
   return token - header_lines;
 }
 
-int32_t parse_request(int8_t clientfd, request_t *request) {
-  if (request == NULL) return ERROR;
-  char buffer[BUFFER_SIZE];
-  memset(buffer, 0, BUFFER_SIZE * sizeof (char));
-  ssize_t totallen = 0;
-  while (end_of_header(buffer, totallen) < 0) {
-    ssize_t len = read(clientfd, &buffer[totallen], BUFFER_SIZE - totallen);
-    if (len < 0) {
-      perror("read");
+/**
+ * Read what arrived of the headers of the next request, without blocking.
+ * Returns 1 once they are complete, 0 if more is expected, FD_CLOSED, or an
+ * error.
+ */
+int32_t read_header(client_t *client) {
+  if (client->header == NULL) {
+    if ((client->header = malloc(BUFFER_SIZE)) == NULL) {
+      perror("malloc");
       return ERROR;
     }
+    client->header_len = 0;
+    client->header_ns = now_ns();
+  }
+  while (1) {
+    ssize_t len = tls_read(client->clientfd, &client->header[client->header_len],
+      BUFFER_SIZE - 1 - client->header_len);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      LOG_DEBUG("read on %i: %s\n", client->clientfd, strerror(errno));
+      return FD_CLOSED;
+    }
     if (len == 0) return FD_CLOSED;
-    totallen += len;
+    client->header_len += len;
+    client->header[client->header_len] = 0;
+    if (end_of_header(client->header, client->header_len) >= 0) return 1;
+    if (client->header_len >= BUFFER_SIZE - 1) return ERR_BAD_REQUEST;
   }
+  // Nothing held for a connection that only woke up
+  if (client->header_len == 0) release_header(client);
+  return 0;
+}
+
+void release_header(client_t *client) {
+  free(client->header);
+  client->header = NULL;
+  client->header_len = 0;
+}
+
+int32_t parse_request(char *buffer, ssize_t totallen, request_t *request) {
+  if (request == NULL) return ERROR;
+  TRACE_MARK(request, TRACE_READ);
+  PERF_BEGIN(request, PERF_PHASE_PARSE);
   ssize_t bytes_parsed = 0;
   ssize_t total_bytes_parsed = 0;
-  if ((bytes_parsed = parse_request_line(buffer, request)) <= 0) return bytes_parsed;
-  total_bytes_parsed += bytes_parsed;
-  if (total_bytes_parsed < totallen) {
-    if ((bytes_parsed = parse_headers(&buffer[bytes_parsed], request)) < 0) return ERROR;
+  if ((bytes_parsed = parse_request_line(buffer, request)) > 0) {
     total_bytes_parsed += bytes_parsed;
+    if (total_bytes_parsed < totallen) {
+      if ((bytes_parsed = parse_headers(&buffer[bytes_parsed], request)) >= 0)
+        total_bytes_parsed += bytes_parsed;
+      else bytes_parsed = ERROR;
+    }
   }
+  PERF_END(request, PERF_PHASE_PARSE);
+  if (bytes_parsed < 0 || total_bytes_parsed == 0) return bytes_parsed;
+  TRACE_MARK(request, TRACE_PARSED);
   return total_bytes_parsed;
 }
 
-int8_t answer(int8_t clientfd, request_t *request, status_code_e status_code) {
+ssize_t write_all(int32_t fd, const char *buffer, size_t len) {
+  size_t tlen = 0;
+  while (tlen < len) {
+    ssize_t written = tls_write(fd, buffer + tlen, len - tlen);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      return ERROR;
+    }
+    tlen += written;
+  }
+  return tlen;
+}
+
+int8_t answer(int32_t clientfd, request_t *request, status_code_e status_code) {
   LOG_DEBUG("sending back code %i %s\n", g_status_code[status_code].code,
     g_status_code[status_code].message);
+  request->status = status_code;
   char buffer[BUFFER_SIZE];
   memset(buffer, 0, BUFFER_SIZE * sizeof (char));
-  ssize_t len = snprintf(buffer, BUFFER_SIZE, "%s %i %s\n",
+  // Without a body, so that the connection can be kept alive
+  ssize_t len = snprintf(buffer, BUFFER_SIZE,
+    "%s %i %s\n"
+    "Server: shttpd/%i.%i.%i\n"
+    "Content-length: 0\n"
+    "\n",
     g_version[request->http_version], g_status_code[status_code].code,
-    g_status_code[status_code].message);
-  if (write(clientfd, buffer, len) < 0) {
-    perror("write");
+    g_status_code[status_code].message,
+    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+  return send_response(clientfd, buffer, len);
+}
+
+/**
+ * Send a response held in memory, its head and body. Whatever the socket
+ * does not take is queued.
+ */
+int8_t send_response(int32_t clientfd, const char *response, size_t len) {
+  client_t *client = find_client(clientfd);
+  if (client == NULL) return ERROR;
+  return sched_start(client, response, len, -1, 0, 0, PAGECACHE_NORMAL);
+}
+
+/**
+ * Answer with a body generated in memory, used by the internal endpoints.
+ */
+int8_t send_buffer(int32_t clientfd, request_t *request, const char *type,
+  const char *body, size_t bodylen) {
+  char header[BUFFER_SIZE];
+  ssize_t headerlen = snprintf(header, BUFFER_SIZE,
+    "HTTP/1.1 200 OK\n"
+    "Server: shttpd/%i.%i.%i\n"
+    "Content-type: %s\n"
+    "Content-length: %lu\n"
+    "Cache-Control: no-store\n"
+    "\n",
+    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, type, bodylen);
+  request->status = _200;
+  if (request->method != GET) bodylen = 0;
+  char *response = malloc(headerlen + bodylen);
+  if (response == NULL) {
+    perror("malloc");
     return ERROR;
   }
-  return 0;
+  memcpy(response, header, headerlen);
+  memcpy(response + headerlen, body, bodylen);
+  int8_t ret = send_response(clientfd, response, headerlen + bodylen);
+  free(response);
+  return ret;
 }
 
-int16_t poll_(struct pollfd *fds, size_t nfds) {
-  int16_t nevents = 0;
-  while (nevents <= 0) {
-    if ((nevents = poll(fds, nfds,-1)) < 0) {
-      perror("poll");
-      return ERROR;
-    }
+int8_t send_metrics(int32_t clientfd, request_t *request) {
+  char body[METRICS_BUFFER_SIZE];
+  size_t bodylen = metrics_render(body, METRICS_BUFFER_SIZE);
+  return send_buffer(clientfd, request, "text/plain; version=0.0.4", body, bodylen);
+}
+
+/**
+ * Stream the trace export, its first bytes sent before the last requests are
+ * rendered. HTTP/2 streams get the whole document at once.
+ */
+int8_t send_trace(client_t *client, request_t *request) {
+  if (client->h2 != NULL) {
+    size_t bodylen;
+    char *body = trace_render(&bodylen);
+    if (body == NULL) return answer(client->clientfd, request, _500);
+    int8_t ret = send_buffer(client->clientfd, request, "application/json", body, bodylen);
+    free(body);
+    return ret;
+  }
+  if (trace_open(client) == NULL) return answer(client->clientfd, request, _500);
+  chunked_mode_e mode = chunked_mode(request->http_version, 200);
+  char header[BUFFER_SIZE];
+  ssize_t headerlen = snprintf(header, BUFFER_SIZE,
+    "HTTP/1.1 200 OK\n"
+    "Server: shttpd/%i.%i.%i\n"
+    "Content-type: application/json\n"
+    "Cache-Control: no-store\n"
+    "%s\n"
+    "\n",
+    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, chunked_header(mode));
+  request->status = _200;
+  return chunked_start(client, header, headerlen, mode);
+}
+
+/**
+ * Wait for events at most timeout milliseconds (-1 for ever). Returns the
+ * number of file descriptors with events, 0 on timeout or signal.
+ */
+int32_t poll_(struct pollfd *fds, size_t nfds, int timeout) {
+  int32_t nevents = 0;
+  if ((nevents = poll(fds, nfds, timeout)) < 0) {
+    if (errno == EINTR) return 0;
+    perror("poll");
+    return ERROR;
   }
   return nevents;
 }
 
-int16_t serve(struct pollfd *fds, client_t *clients) {
-  int16_t clientfd = 0;
-  // We poll already polled clients, no newly created. So the counter has to
-  // initialized here
-  size_t nclients = count_clients(clients);
-  if (fds[SOCKET_INDEX].revents & POLLIN) {
+/**
+ * Accept and close a connection with the descriptor kept in reserve, rather
+ * than leaving it in the backlog where it would wake the loop up again.
+ */
+static void shed_client(int32_t socketfd) {
+  if (g_reserve_fd < 0) return;
+  close(g_reserve_fd);
+  int32_t clientfd = accept(socketfd, NULL, NULL);
+  if (clientfd >= 0) {
+    close(clientfd);
+    METRIC_INC(shed_connections);
+  }
+  g_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static void accept_clients(int32_t socketfd, client_t **clients) {
+  for (uint8_t i = 0; i < ACCEPT_BATCH && g_nb_clients <= g_max_clients; ++i) {
     struct sockaddr *client_addr = malloc(sizeof (struct sockaddr));
     if (client_addr == NULL) {
       perror("malloc");
-      return ERROR;
+      return;
     }
     socklen_t socklen = sizeof (struct sockaddr);
-    // Wait for a client to connect
-    clientfd = accept(fds[SOCKET_INDEX].fd, client_addr, &socklen);
+    // Client sockets are non-blocking so that responses can be sent a piece
+    // at a time, and not inherited by a new binary
+    int32_t clientfd = accept4(socketfd, client_addr, &socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (clientfd < 0) {
-      perror("accept");
-      return ERROR;
+      free(client_addr);
+      if (errno == EMFILE || errno == ENFILE) {
+        LOG_WARNING("out of file descriptors with %lu connections\n", g_nb_clients - 1);
+        shed_client(socketfd);
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+        errno != ECONNABORTED) perror("accept");
+      return;
+    }
+    METRIC_INC(accepts);
+    if (guard_admit(client_addr)) {
+      METRIC_INC(capped_connections);
+      close(clientfd);
+      free(client_addr);
+      continue;
     }
-    add_client(fds, clientfd, client_addr, &clients);
+    METRIC_INC(active_connections);
+    client_t *client = add_client(clientfd, client_addr, clients);
+    if (client == NULL) {
+      guard_release(client_addr);
+      METRIC_DEC(active_connections);
+      close(clientfd);
+      free(client_addr);
+    } else if (tls_accept(client) < 0) delete_client(clientfd, clients);
   }
-  for (size_t i = 0; i < nclients; ++i) {
-    // printf("fd: %i revents: %i %s %s %s\n", fds[i].fd, fds[i].revents,
-    //   fds[i].revents & POLLIN ? "POLLIN" : "",
-    //   fds[i].revents & POLLHUP ? "POLLHUP" : "",
-    //   fds[i].revents & POLLHUP ? "POLLHUP" : "");
+}
+
+/**
+ * Handle the events of the nfds first entries of fds, the clients.
+ */
+int16_t serve(struct pollfd *fds, size_t nfds, client_t *clients) {
+  if (fds[SOCKET_INDEX].revents & POLLIN) accept_clients(fds[SOCKET_INDEX].fd, &clients);
+  for (size_t i = SOCKET_INDEX + 1; i < nfds; ++i) {
     // TODO: Manage timeout on keep-alive connections
-    if (fds[i].revents & POLLHUP || fds[i].revents & POLLNVAL) {
-      delete_client(fds[i].fd, fds, &clients);
+    if (fds[i].revents & (POLLHUP | POLLNVAL | POLLERR)) {
+      delete_client(fds[i].fd, &clients);
     } else {
       if (fds[i].revents & POLLIN) {
-        if (handle(fds[i].fd) != 0) {
-          delete_client(fds[i].fd, fds, &clients);
+        client_t *client = find_client(fds[i].fd);
+        if (client != NULL && handle(client) != 0) {
+          delete_client(fds[i].fd, &clients);
         }
       }
     }
   }
+  // Then send a piece of every pending response
+  sched_run(fds, nfds, &clients);
   return 0;
 }
 
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
+// Non zero if one of the 8 bytes of word is c
+static inline uint64_t has_byte(uint64_t word, uint8_t c) {
+  uint64_t x = word ^ (SWAR_ONES * c);
+  return (x - SWAR_ONES) & ~x & SWAR_HIGHS;
+}
+
+static inline int8_t hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return ERROR;
+}
+
+/**
+ * Normalize a request target in place, in a single pass: the query is cut
+ * off, %XX sequences are decoded, repeated slashes collapsed and the "." and
+ * ".." segments removed (".." never goes above the root). Runs of plain
+ * characters are copied 8 bytes at a time. The result starts with a '/' and
+ * is the key the caches use. Returns its length, or ERROR if the target is
+ * malformed or decodes to a control character.
+ */
+ssize_t normalize_path(char *path, size_t len, char **query) {
+  *query = NULL;
+  if (len == 0 || path[0] != '/') return ERROR;
+  char *end = path + len;
+  char *r = path + 1;
+  char *w = path + 1;
+  // Start of the segment being written
+  char *segment = w;
+  while (1) {
+    while (r + 8 <= end) {
+      uint64_t word;
+      memcpy(&word, r, 8);
+      if (has_byte(word, '/') | has_byte(word, '%') | has_byte(word, '?') |
+        has_byte(word, '#') | has_byte(word, 0)) break;
+      memmove(w, r, 8);
+      w += 8;
+      r += 8;
+    }
+    char c = '\0';
+    uint8_t at_end = r >= end;
+    if (!at_end && (*r == '?' || *r == '#' || *r == '\0')) {
+      if (*r == '\0') return ERROR;
+      if (*r == '?') *query = r + 1;
+      end = r;
+      at_end = 1;
+    } else if (!at_end && *r == '%') {
+      if (end - r < 3 || hex_value(r[1]) < 0 || hex_value(r[2]) < 0) return ERROR;
+      c = hex_value(r[1]) << 4 | hex_value(r[2]);
+      if ((unsigned char) c < 0x20 || c == 0x7F) return ERROR;
+      r += 3;
+    } else if (!at_end) c = *r++;
+    if (!at_end && c != '/') {
+      *w++ = c;
+      continue;
+    }
+    // End of a segment
+    size_t segment_len = w - segment;
+    if (segment_len == 1 && segment[0] == '.') {
+      w = segment;
+    } else if (segment_len == 2 && segment[0] == '.' && segment[1] == '.') {
+      w = segment;
+      if (segment > path + 1) {
+        // Back to the start of the previous segment
+        --w;
+        while (w > path + 1 && w[-1] != '/') --w;
+      }
+    } else if (!at_end && segment_len > 0) {
+      *w++ = '/';
+    }
+    segment = w;
+    if (at_end) break;
+  }
+  *w = '\0';
+  if (*query != NULL) {
+    char *fragment = memchr(*query, '#', path + len - *query);
+    if (fragment != NULL) *fragment = '\0';
+  }
+  return w - path;
+}
+
 int8_t preprocess_path(char *path, ssize_t pathsize, request_t *request) {
-  if (!strncmp(path, "/", pathsize)) {
-    request->path = strndup("index.html", 10);
-  } else if (path[0] == '/') {
-    request->path = strndup(&path[1], pathsize - 1);
+  // Room for the index of a directory
+  char *buffer = malloc(pathsize + sizeof (DEFAULT_INDEX) + 1);
+  if (buffer == NULL) {
+    perror("malloc");
+    return ERROR;
+  }
+  memcpy(buffer, path, pathsize);
+  buffer[pathsize] = '\0';
+  char *query;
+  ssize_t len = normalize_path(buffer, pathsize, &query);
+  if (len < 0) {
+    free(buffer);
+    return ERR_BAD_REQUEST;
   }
-  if (request->path == NULL) {
-    perror("strndup");
+  if (query != NULL && (request->query = strdup(query)) == NULL) {
+    perror("strdup");
+    free(buffer);
     return ERROR;
   }
+  // Paths are relative to the docroot
+  memmove(buffer, &buffer[1], len);
+  if (len == 1 || buffer[len - 2] == '/') {
+    strcpy(&buffer[len - 1], DEFAULT_INDEX);
+    request->directory = 1;
+  }
+  request->path = buffer;
   return 0;
 }
 
-// TODO: refactor that beast of a function!
-int8_t sendfile_(int16_t clientfd, request_t *request) {
+/**
+ * Status line, Server and Date headers of a 200 response.
+ */
+static ssize_t response_head(char *buffer, size_t size) {
+  time_t t = time(NULL);
+  struct tm tm = *localtime(&t);
+  ssize_t position = snprintf(buffer, size, "HTTP/1.1 200 OK\n");
+  position += snprintf(buffer + position, size - position,
+    "Server: shttpd/%i.%i.%i\n",
+    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+  position += snprintf(buffer + position, size - position,
+    "Date: %s, %i %s %i %i:%i:%i GMT\n",
+    dow[tm.tm_wday], tm.tm_mday, moy[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  return position;
+}
+
+/**
+ * Answer with the requested file. Error statuses are answered here too.
+ * Returns ERROR only when the connection is broken; client->io_pending is
+ * set if the answer waits for the file operations pool.
+ */
+int8_t sendfile_(client_t *client, request_t *request) {
+  const pack_entry_t *entry = pack_lookup(request->path);
+  if (entry != NULL) return send_pack(client, request, entry);
+  // Paths already missed are answered without a syscall
+  if (negcache_lookup(request->path)) {
+    request->cache_hit = 1;
+    METRIC_INC(cache_hits);
+    METRIC_INC(negative_hits);
+    return answer(client->clientfd, request, _404);
+  }
+  // Cold files are opened and read in by the pool, the connection waits, or
+  // the stream of an HTTP/2 one
+  int filefd = resolve_open(request->path, O_RDONLY, g_fileio_enabled);
+  uint8_t cached = filefd >= 0;
+  if (filefd >= 0 && g_fileio_enabled) {
+    // The hit rate of the hot set, which the large files should not pollute
+    METRIC_INC(page_cache_lookups);
+    if (!(cached = fileio_cached(filefd))) METRIC_INC(page_cache_misses);
+  }
+  if (!cached && (filefd >= 0 || errno == EAGAIN)) {
+    h2_stream_t *stream = client->h2 != NULL ? client->h2->current : NULL;
+    if (fileio_submit(client, stream != NULL ? stream->id : 0, request->path, filefd) == 0) {
+      if (stream != NULL) stream->io_pending = 1;
+      METRIC_INC(file_ops_offloaded);
+      return 0;
+    }
+    // The pool is full, block
+    if (filefd < 0) filefd = resolve_open(request->path, O_RDONLY, 0);
+  }
+  return send_file(client, request, filefd, errno);
+}
+
+/**
+ * Resume a request once the pool opened its file.
+ */
+void open_complete(client_t *client, int filefd, int err, client_t **clients) {
+  request_t *request = &client->request;
+  client->io_pending = 0;
+  PERF_BEGIN(request, PERF_PHASE_RESPONSE);
+  int8_t ret = send_file(client, request, filefd, err);
+  PERF_END(request, PERF_PHASE_RESPONSE);
+  answered_later(client, ret, clients);
+}
+
+/**
+ * Account for the answer to a request that was waiting for its file, its
+ * upstream or its worker: the client is dropped if it could not be sent.
+ */
+void answered_later(client_t *client, int8_t ret, client_t **clients) {
+  if (ret < 0) {
+    finish_request(client);
+    delete_client(client->clientfd, clients);
+  } else if (!client->transfer.active) finish_request(client);
+}
+
+void answer_later(client_t *client, status_code_e status, client_t **clients) {
+  answered_later(client, answer(client->clientfd, &client->request, status), clients);
+}
+
+/**
+ * Send an opened file, or the error that prevented opening it (err).
+ */
+int8_t send_file(client_t *client, request_t *request, int filefd, int err) {
+  int32_t clientfd = client->clientfd;
   char buffer[BUFFER_SIZE];
   memset(buffer, 0, BUFFER_SIZE * sizeof (char));
-  int16_t filefd = open(request->path, O_RDONLY);
+  errno = err;
   if (filefd < 0) {
-    if (errno == EACCES) {
-      answer(clientfd, request, _403);
-      return ERROR;
+    // Out of the docroot, or through a /proc magic link
+    if (errno == EACCES || errno == EXDEV || errno == ELOOP) {
+      return answer(clientfd, request, _403);
     } else if (errno == ENOENT) {
       LOG_DEBUG("file %s does not exists\n", request->path);
-      answer(clientfd, request, _404);
-      return ERROR;
+      negcache_insert(request->path);
+      return answer(clientfd, request, _404);
     }
-    answer(clientfd, request, _500);
-    return ERROR;
+    return answer(clientfd, request, _500);
   }
+  TRACE_MARK(request, TRACE_OPEN);
   ssize_t filesize = lseek(filefd, 0, SEEK_END);
   if (filesize < 0) {
     perror("lseek");
-    return ERROR;
+    close(filefd);
+    return answer(clientfd, request, _500);
   }
   // Be kind, rewind
   lseek(filefd, 0, SEEK_SET);
   // Some headers
   time_t t = time(NULL);
   struct tm tm = *localtime(&t);
-  ssize_t position = 0;
-  position = snprintf(buffer, BUFFER_SIZE, "HTTP/1.1 200 OK\n");
-  position += snprintf(buffer + position,
-    BUFFER_SIZE - position,
-    "Server: shttpd/%i.%i.%i\n",
-    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
-  position += snprintf(buffer + position,
-    BUFFER_SIZE - position,
-    "Date: %s, %i %s %i %i:%i:%i GMT\n",
-    dow[tm.tm_wday], tm.tm_mday, moy[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  ssize_t position = response_head(buffer, BUFFER_SIZE);
+  PERF_BEGIN(request, PERF_PHASE_MIME);
+  const char *mime_type =
+    get_mime_type(get_extension(request->path, strlen(request->path)));
+  PERF_END(request, PERF_PHASE_MIME);
   position += snprintf(buffer + position,
     BUFFER_SIZE - position,
-    "Content-type: %s\n", get_mime_type(get_extension(request->path, strlen(request->path))));
+    "Content-type: %s\n", mime_type);
   position += snprintf(buffer + position,
     BUFFER_SIZE - position,
     "Content-length: %lu\n", filesize);
@@ -438,49 +899,211 @@ int8_t sendfile_(int16_t clientfd, request_t *request) {
   position += snprintf(buffer + position,
     BUFFER_SIZE - position,
     "\n");
-  size_t tlen = 0;
-  while (tlen < strnlen(buffer, BUFFER_SIZE)) {
-    ssize_t len = write(clientfd, buffer, position);
-    if (len < 0) {
-      perror("write");
-      return ERROR;
-    }
-    tlen += len;
-  }
-  if (request->method == GET) {
-    // Sending file
-    LOG_DEBUG("Sending %s\n", request->path);
-    ssize_t bytesent = sendfile(clientfd, filefd, 0, filesize);
-    if (bytesent < 0) {
-      perror("sendfile");
-      return ERROR;
-    }
-    LOG_DEBUG("%li bytes sent\n", bytesent);
+  request->status = _200;
+  pagecache_policy_e policy = PAGECACHE_NORMAL;
+  if (request->method != GET) {
+    close(filefd);
+    filefd = -1;
+  } else policy = pagecache_advise(request->path, filefd, filesize);
+  // Sending file
+  LOG_DEBUG("Sending %s\n", request->path);
+  return sched_start(client, buffer, position, filefd, 0, filesize, policy);
+}
+
+/**
+ * Send an entry of the archive, its gzip variant if the client accepts it.
+ */
+int8_t send_pack(client_t *client, request_t *request, const pack_entry_t *entry) {
+  const char *accept = request->headers[ACCEPT_ENCODING];
+  const pack_variant_t *variant = &entry->variants[PACK_IDENTITY];
+  if (accept != NULL && strstr(accept, "gzip") != NULL &&
+    entry->variants[PACK_GZIP].head_len > 0) variant = &entry->variants[PACK_GZIP];
+  char buffer[BUFFER_SIZE];
+  ssize_t position = response_head(buffer, BUFFER_SIZE);
+  memcpy(buffer + position, pack_data(variant->head_offset), variant->head_len);
+  position += variant->head_len;
+  buffer[position++] = '\n';
+  request->status = _200;
+  request->cache_hit = 1;
+  METRIC_INC(cache_hits);
+  METRIC_INC(archive_hits);
+  // Keeps the archive open until the transfer ends, even if it is reloaded
+  int filefd = -1;
+  if (request->method == GET && variant->body_len > 0 &&
+    (filefd = fcntl(pack_fd(), F_DUPFD_CLOEXEC, 0)) < 0) {
+    perror("fcntl");
+    return answer(client->clientfd, request, _500);
   }
-  return 0;
+  return sched_start(client, buffer, position, filefd, variant->body_offset,
+    variant->body_len, PAGECACHE_NORMAL);
 }
 
-int8_t handle(int16_t clientfd) {
-  request_t request;
-  memset(&request, 0, sizeof (request));
-  int32_t ret = 0;
-  if ((ret = parse_request(clientfd, &request)) > 0) {
-    LOG_DEBUG("%s %s\n", g_methods[request.method], request.path);
+/**
+ * Status of a response relayed from a backend or a worker, by its code.
+ */
+status_code_e status_of(uint16_t code) {
+  for (uint8_t i = 0; i < NB_STATUS_CODE; ++i)
+    if (g_status_code[i].code == code) return i;
+  // The nearest one of its class, for the metrics and the logs
+  return code < 300 ? _200 : code < 400 ? _302 : code < 500 ? _400 : _500;
+}
+
+/**
+ * Copy the prefix of a route or pool option, /prefix=..., without the slashes
+ * around like the request paths. Returns NULL if out of memory.
+ */
+char *route_prefix(const char *spec, const char *equal, size_t *len) {
+  const char *prefix = spec + 1;
+  *len = equal - prefix;
+  while (*len > 0 && prefix[*len - 1] == '/') --*len;
+  return strndup(prefix, *len);
+}
+
+/**
+ * Whether the first len bytes of the path are the prefix or below it. The
+ * empty prefix takes every path.
+ */
+uint8_t route_match(request_t *request, size_t len, const char *prefix, size_t prefix_len) {
+  return len >= prefix_len && !memcmp(request->path, prefix, prefix_len) &&
+    (prefix_len == 0 || len == prefix_len || request->path[prefix_len] == '/');
+}
+
+// Length of the path, without the index appended to a directory
+size_t request_path_len(request_t *request) {
+  size_t len = strlen(request->path);
+  return request->directory ? len - strlen(DEFAULT_INDEX) : len;
+}
+
+/**
+ * Account for a request once its response was sent, or given up on.
+ */
+void finish_request(client_t *client) {
+  end_request(client, &client->request);
+}
+
+/**
+ * Account for a request of the connection, the one of an HTTP/1.x
+ * connection or the one of an HTTP/2 stream, and free it.
+ */
+void end_request(client_t *client, request_t *request) {
+  trace_end_request(request);
+  perf_end_request(request);
+  metrics_record_request(request);
+  accesslog_record(client, request);
+  ++client->nb_requests;
+  client->idle_ns = now_ns();
+  admission_done(request);
+  free_request(*request);
+  memset(request, 0, sizeof (request_t));
+}
+
+/**
+ * Answer a parsed request, the one of an HTTP/1.x connection or the one of an
+ * HTTP/2 stream. Returns ERROR when the connection is broken.
+ */
+int8_t respond(client_t *client, request_t *request) {
+  int32_t clientfd = client->clientfd;
+  int8_t ret;
+  LOG_DEBUG("%s %s\n", g_methods[request->method], request->path);
+  if (LOG_ENABLED(LOG_LEVEL_DEBUG))
     for (uint8_t i = 0; i < NB_HEADERS; ++i)
-      if (request.headers[i])
-        LOG_DEBUG("%s: %s\n", g_headers[i], request.headers[i]);
-    sendfile_(clientfd, &request);
+      if (request->headers[i])
+        LOG_DEBUG("%s: %s\n", g_headers[i], request->headers[i]);
+  METRIC_INC(requests[request->method]);
+  if (ratelimit_check(client, request)) ret = ratelimit_reject(clientfd, request);
+  else if (is_metrics_request(request)) ret = send_metrics(clientfd, request);
+  else if (is_trace_request(request)) ret = send_trace(client, request);
+  else if (admission_check(request)) ret = admission_reject(clientfd, request);
+  else if (upstream_match(request)) ret = upstream_forward(client, request);
+  else if (gateway_match(request)) ret = gateway_forward(client, request);
+  else {
+    PERF_BEGIN(request, PERF_PHASE_RESPONSE);
+    ret = sendfile_(client, request);
+    PERF_END(request, PERF_PHASE_RESPONSE);
+  }
+  return ret < 0 ? ERROR : 0;
+}
+
+/**
+ * Switch to HTTP/2 after an Upgrade: h2c request, answered as stream 1.
+ */
+static int8_t upgrade_h2c(client_t *client, request_t *request) {
+  static const char switching[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+  if (write_all(client->clientfd, switching, sizeof (switching) - 1) < 0) return ERROR;
+  request->bytes_sent += sizeof (switching) - 1;
+  char *settings = request->headers[HTTP2_SETTINGS];
+  request->headers[HTTP2_SETTINGS] = NULL;
+  int8_t ret = h2_start(client, NULL, 0, request, settings);
+  free(settings);
+  // Unless it was moved to the stream
+  free_request(*request);
+  memset(request, 0, sizeof (request_t));
+  return ret;
+}
+
+// Not with routes to backends or workers, which HTTP/2 streams cannot take
+static uint8_t is_h2c_upgrade(client_t *client, request_t *request) {
+  return client->tls == NULL && !upstream_enabled() && !gateway_enabled() &&
+    request->headers[UPGRADE] != NULL &&
+    !strcasecmp(request->headers[UPGRADE], "h2c") && request->headers[HTTP2_SETTINGS] != NULL;
+}
+
+int8_t handle(client_t *client) {
+  int32_t clientfd = client->clientfd;
+  // The handshake goes first, then the request of the same event
+  int32_t ret = tls_handshake(client);
+  if (ret <= 0) return ret < 0;
+  // h2 was picked during the handshake (ALPN)
+  if (client->h2 == NULL && tls_alpn_h2(client) && h2_start(client, NULL, 0, NULL, NULL) < 0)
+    return 1;
+  if (client->h2 != NULL) return h2_read(client) < 0;
+  ret = read_header(client);
+  if (ret == 0) return 0;
+  // HTTP/2 with prior knowledge, the preface reads as headers
+  int8_t preface = ret > 0 ? h2_preface(client->header, client->header_len) : ERROR;
+  if (preface == 0) return 0;
+  if (preface > 0) {
+    ret = h2_start(client, client->header, client->header_len, NULL, NULL);
+    release_header(client);
+    return ret < 0;
+  }
+  request_t *request = &client->request;
+  memset(request, 0, sizeof (request_t));
+  // The request started with its first byte
+  request->start_ns = client->header_ns ? client->header_ns : now_ns();
+  trace_start_request(client, request);
+  if (ret > 0 && (ret = parse_request(client->header, client->header_len, request)) > 0) {
+    if (is_h2c_upgrade(client, request)) {
+      release_header(client);
+      return upgrade_h2c(client, request) < 0;
+    }
+    if (respond(client, request) < 0) ret = ERROR;
   } else {
     switch (ret) {
     case FD_CLOSED:
       break;
     case ERR_UNKNOWN_METHOD:
-      answer(clientfd, &request, _501);
+      answer(clientfd, request, _501);
+      break;
+    case ERR_BAD_REQUEST:
+      answer(clientfd, request, _400);
       break;
     default:
-      answer(clientfd, &request, _500);
+      answer(clientfd, request, _500);
     }
   }
-  free_request(request);
+  release_header(client);
+  if (ret == FD_CLOSED) {
+    free_request(*request);
+    memset(request, 0, sizeof (request_t));
+  // The scheduler finishes the requests it queued, the upstream module those
+  // it forwarded and the writers those they stream
+  } else if (!client->transfer.active && !client->io_pending && client->upstream == NULL &&
+    client->chunked == NULL)
+    finish_request(client);
   return ret < 0;
 }
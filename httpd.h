@@ -3,34 +3,62 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 
 #include "defines.h"
+#include "pack.h"
 
 uint8_t iseol(char *s);
 ssize_t end_of_header(char *s, ssize_t size);
 char *get_extension(char *path, ssize_t len);
 int16_t next_token(char *s, char **next);
-int8_t prepare_socket(int16_t socketfd, struct sockaddr_in addr);
+int8_t prepare_socket(int32_t socketfd, struct sockaddr_in addr);
 int8_t create_addr(option_t options, struct sockaddr_in *addr);
+extern size_t g_max_clients;
+extern size_t g_nb_clients;
+
+int8_t clients_init();
 size_t rebuild_fds(struct pollfd *fds, client_t *clients);
-size_t add_client(struct pollfd *fds, int16_t clientfd,
-  struct sockaddr *client_addr, client_t **clients);
-size_t delete_client(int16_t clientfd, struct pollfd *fds, client_t **clients);
+client_t *add_client(int32_t clientfd, struct sockaddr *client_addr,
+  client_t **clients);
+int8_t delete_client(int32_t clientfd, client_t **clients);
 void delete_all_clients(client_t **clients);
-size_t count_clients(client_t *clients);
-int8_t parse_request_line(char *request_line, request_t *request);
+void stop_accepting(client_t *clients);
+client_t *find_client(int32_t clientfd);
+ssize_t parse_request_line(char *request_line, request_t *request);
 int8_t request_complete(request_t *request);
-int8_t parse_request_line(char *request_line, request_t *request);
+ssize_t parse_request_line(char *request_line, request_t *request);
 void free_request(request_t request);
-int8_t parse_request_line(char *request_line, request_t *request);
-int8_t parse_headers(char *header_lines, request_t *request);
-int32_t parse_request(int8_t clientfd, request_t *request);
-int8_t answer(int8_t clientfd, request_t *request, status_code_e status_code);
-int16_t poll_(struct pollfd *fds, size_t nfds);
-int16_t serve(struct pollfd *fds, client_t *clients);
+ssize_t parse_request_line(char *request_line, request_t *request);
+ssize_t parse_headers(char *header_lines, request_t *request);
+int32_t read_header(client_t *client);
+void release_header(client_t *client);
+int32_t parse_request(char *buffer, ssize_t totallen, request_t *request);
+ssize_t write_all(int32_t fd, const char *buffer, size_t len);
+int8_t answer(int32_t clientfd, request_t *request, status_code_e status_code);
+status_code_e status_of(uint16_t code);
+char *route_prefix(const char *spec, const char *equal, size_t *len);
+uint8_t route_match(request_t *request, size_t len, const char *prefix, size_t prefix_len);
+size_t request_path_len(request_t *request);
+int32_t poll_(struct pollfd *fds, size_t nfds, int timeout);
+int16_t serve(struct pollfd *fds, size_t nfds, client_t *clients);
+ssize_t normalize_path(char *path, size_t len, char **query);
 int8_t preprocess_path(char *path, ssize_t pathsize, request_t *request);
-int8_t handle(int16_t clientfd);
-int8_t sendfile_(int16_t clientfd, request_t *request);
+int8_t handle(client_t *client);
+int8_t sendfile_(client_t *client, request_t *request);
+int8_t send_file(client_t *client, request_t *request, int filefd, int err);
+int8_t send_pack(client_t *client, request_t *request, const pack_entry_t *entry);
+void open_complete(client_t *client, int filefd, int err, client_t **clients);
+void answered_later(client_t *client, int8_t ret, client_t **clients);
+void answer_later(client_t *client, status_code_e status, client_t **clients);
+void finish_request(client_t *client);
+void end_request(client_t *client, request_t *request);
+int8_t respond(client_t *client, request_t *request);
+int8_t send_response(int32_t clientfd, const char *response, size_t len);
+int8_t send_buffer(int32_t clientfd, request_t *request, const char *type,
+  const char *body, size_t bodylen);
+int8_t send_metrics(int32_t clientfd, request_t *request);
+int8_t send_trace(client_t *client, request_t *request);
 
 #endif // __HTTPD_H__
\ No newline at end of file
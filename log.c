@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "defines.h"
+#include "log.h"
+
+/**
+ * Log records are not formatted by the thread logging them. The format
+ * string pointer and the raw arguments are copied in a ring buffer owned by
+ * the calling thread, and a background thread formats them and writes them
+ * in batches. A full ring drops the record rather than blocking the caller.
+ */
+
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+// Record that only pads the end of a ring, the next one starts at offset 0
+#define LOG_PADDING 0xFF
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+typedef struct {
+  uint16_t size;
+  uint8_t level;
+  uint8_t unused;
+  uint32_t line;
+  const char *file;
+  const char *func;
+  const char *format;
+} log_header_t;
+
+/**
+ * Single producer, single consumer ring. head is only written by the thread
+ * owning the ring, tail only by the background thread.
+ */
+typedef struct {
+  uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint64_t dropped;
+  uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  char data[LOG_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} log_ring_t;
+
+// A conversion specification of a printf format
+typedef struct {
+  char flags[8];
+  int32_t width;
+  int32_t precision;
+  uint8_t width_star;
+  uint8_t precision_star;
+  char length[3];
+  char conversion;
+} spec_t;
+
+typedef struct {
+  int fd;
+  char buffer[LOG_BATCH_SIZE];
+  size_t position;
+} log_batch_t;
+
+uint8_t g_log_level = LOG_LEVEL_INFO;
+
+static log_ring_t *g_rings[LOG_MAX_RINGS];
+static uint32_t g_nb_rings = 0;
+static pthread_mutex_t g_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread log_ring_t *t_ring = NULL;
+// Records that could not even get a ring
+static uint64_t g_unringed_drops = 0;
+
+static pthread_t g_log_thread;
+static uint8_t g_log_running = 0;
+
+static const char g_level_names[][8] = { "error", "warning", "info", "debug" };
+
+int8_t log_parse_level(const char *name) {
+  for (uint8_t i = 0; i < sizeof (g_level_names) / sizeof (g_level_names[0]); ++i)
+    if (!strcasecmp(name, g_level_names[i])) return i;
+  return ERROR;
+}
+
+/**
+ * Parse the conversion specification following a '%'. Returns a pointer to
+ * the character following it, or NULL if the conversion is not supported.
+ */
+static const char *parse_spec(const char *s, spec_t *spec) {
+  memset(spec, 0, sizeof (spec_t));
+  spec->width = -1;
+  spec->precision = -1;
+  uint8_t nflags = 0;
+  while (*s && strchr("-+ #0'", *s) && nflags < sizeof (spec->flags) - 1)
+    spec->flags[nflags++] = *s++;
+  if (*s == '*') {
+    spec->width_star = 1;
+    ++s;
+  } else if (*s >= '0' && *s <= '9') {
+    spec->width = strtol(s, (char **) &s, 10);
+  }
+  if (*s == '.') {
+    ++s;
+    if (*s == '*') {
+      spec->precision_star = 1;
+      ++s;
+    } else spec->precision = strtol(s, (char **) &s, 10);
+  }
+  uint8_t nlength = 0;
+  while (*s && strchr("hlzjtL", *s) && nlength < sizeof (spec->length) - 1)
+    spec->length[nlength++] = *s++;
+  if (*s == 0 || !strchr("diuoxXcspfFeEgGaAn", *s)) return NULL;
+  spec->conversion = *s;
+  return s + 1;
+}
+
+static inline uint8_t put(char *record, size_t *position, const void *value,
+  size_t len) {
+  if (*position + len > LOG_MAX_RECORD) return 0;
+  memcpy(record + *position, value, len);
+  *position += len;
+  return 1;
+}
+
+static uint64_t pull_signed(const char *length, va_list *args) {
+  if (!strcmp(length, "hh")) return (int64_t) (signed char) va_arg(*args, int);
+  if (!strcmp(length, "h")) return (int64_t) (short) va_arg(*args, int);
+  if (!strcmp(length, "l")) return (int64_t) va_arg(*args, long);
+  if (!strcmp(length, "ll")) return (int64_t) va_arg(*args, long long);
+  if (!strcmp(length, "z")) return (int64_t) va_arg(*args, ssize_t);
+  if (!strcmp(length, "j")) return (int64_t) va_arg(*args, intmax_t);
+  if (!strcmp(length, "t")) return (int64_t) va_arg(*args, ptrdiff_t);
+  return (int64_t) va_arg(*args, int);
+}
+
+static uint64_t pull_unsigned(const char *length, va_list *args) {
+  if (!strcmp(length, "hh")) return (unsigned char) va_arg(*args, unsigned);
+  if (!strcmp(length, "h")) return (unsigned short) va_arg(*args, unsigned);
+  if (!strcmp(length, "l")) return va_arg(*args, unsigned long);
+  if (!strcmp(length, "ll")) return va_arg(*args, unsigned long long);
+  if (!strcmp(length, "z")) return va_arg(*args, size_t);
+  if (!strcmp(length, "j")) return va_arg(*args, uintmax_t);
+  if (!strcmp(length, "t")) return (uint64_t) va_arg(*args, ptrdiff_t);
+  return va_arg(*args, unsigned);
+}
+
+/**
+ * Copy the arguments referenced by format in record, as 64 bits values or
+ * as length prefixed strings. Returns the number of bytes used.
+ */
+static size_t capture(char *record, const char *format, va_list *args) {
+  size_t position = 0;
+  const char *s = format;
+  spec_t spec;
+  while ((s = strchr(s, '%')) != NULL) {
+    if (s[1] == '%') {
+      s += 2;
+      continue;
+    }
+    if ((s = parse_spec(s + 1, &spec)) == NULL) break;
+    int64_t star;
+    if (spec.width_star) {
+      star = va_arg(*args, int);
+      if (!put(record, &position, &star, sizeof (star))) break;
+    }
+    if (spec.precision_star) {
+      star = va_arg(*args, int);
+      spec.precision = star;
+      if (!put(record, &position, &star, sizeof (star))) break;
+    }
+    uint64_t value = 0;
+    double real;
+    switch (spec.conversion) {
+    case 'd': case 'i':
+      value = pull_signed(spec.length, args);
+      break;
+    case 'u': case 'o': case 'x': case 'X':
+      value = pull_unsigned(spec.length, args);
+      break;
+    case 'c':
+      value = va_arg(*args, int);
+      break;
+    case 'p':
+      value = (uintptr_t) va_arg(*args, void *);
+      break;
+    case 'n':
+      va_arg(*args, void *);
+      continue;
+    case 's': {
+      const char *string = va_arg(*args, const char *);
+      if (string == NULL) string = "(null)";
+      size_t max = LOG_MAX_RECORD;
+      if (spec.precision >= 0 && (size_t) spec.precision < max) max = spec.precision;
+      uint16_t len = strnlen(string, max);
+      if (position + sizeof (len) + len + 1 > LOG_MAX_RECORD) {
+        len = position + sizeof (len) + 1 < LOG_MAX_RECORD ?
+          LOG_MAX_RECORD - position - sizeof (len) - 1 : 0;
+      }
+      if (!put(record, &position, &len, sizeof (len))) return position;
+      memcpy(record + position, string, len);
+      record[position + len] = 0;
+      position += len + 1;
+      continue;
+    }
+    default:
+      if (!strcmp(spec.length, "L")) real = (double) va_arg(*args, long double);
+      else real = va_arg(*args, double);
+      memcpy(&value, &real, sizeof (value));
+    }
+    if (!put(record, &position, &value, sizeof (value))) break;
+  }
+  return position;
+}
+
+static inline uint8_t take(const char *payload, size_t size, size_t *position,
+  void *value, size_t len) {
+  if (*position + len > size) return 0;
+  memcpy(value, payload + *position, len);
+  *position += len;
+  return 1;
+}
+
+/**
+ * Rebuild the message of a record. This is the reverse of capture, each
+ * conversion is formatted separately with the value copied in the payload.
+ */
+static size_t format_record(char *line, size_t size, const char *format,
+  const char *payload, size_t payload_size) {
+  size_t out = 0;
+  size_t position = 0;
+  const char *s = format;
+  spec_t spec;
+  while (*s && out < size - 1) {
+    if (*s != '%') {
+      line[out++] = *s++;
+      continue;
+    }
+    if (s[1] == '%') {
+      line[out++] = '%';
+      s += 2;
+      continue;
+    }
+    const char *next = parse_spec(s + 1, &spec);
+    if (next == NULL) {
+      // Unsupported conversion, output the rest verbatim
+      out += snprintf(line + out, size - out, "%s", s);
+      break;
+    }
+    s = next;
+    int64_t star;
+    if (spec.width_star) {
+      if (!take(payload, payload_size, &position, &star, sizeof (star))) break;
+      spec.width = star;
+    }
+    if (spec.precision_star) {
+      if (!take(payload, payload_size, &position, &star, sizeof (star))) break;
+      spec.precision = star;
+    }
+    if (spec.conversion == 'n') continue;
+    char conversion[32];
+    size_t len = snprintf(conversion, sizeof (conversion), "%%%s", spec.flags);
+    if (spec.width >= 0)
+      len += snprintf(conversion + len, sizeof (conversion) - len, "%d", spec.width);
+    if (spec.precision >= 0)
+      len += snprintf(conversion + len, sizeof (conversion) - len, ".%d", spec.precision);
+    int written;
+    uint64_t value;
+    if (spec.conversion == 's') {
+      uint16_t slen;
+      if (!take(payload, payload_size, &position, &slen, sizeof (slen))) break;
+      if (position + slen + 1 > payload_size) break;
+      snprintf(conversion + len, sizeof (conversion) - len, "s");
+      written = snprintf(line + out, size - out, conversion, payload + position);
+      position += slen + 1;
+    } else {
+      if (!take(payload, payload_size, &position, &value, sizeof (value))) break;
+      switch (spec.conversion) {
+      case 'd': case 'i':
+        snprintf(conversion + len, sizeof (conversion) - len, "ll%c", spec.conversion);
+        written = snprintf(line + out, size - out, conversion, (long long) value);
+        break;
+      case 'u': case 'o': case 'x': case 'X':
+        snprintf(conversion + len, sizeof (conversion) - len, "ll%c", spec.conversion);
+        written = snprintf(line + out, size - out, conversion,
+          (unsigned long long) value);
+        break;
+      case 'c':
+        snprintf(conversion + len, sizeof (conversion) - len, "c");
+        written = snprintf(line + out, size - out, conversion, (int) value);
+        break;
+      case 'p':
+        snprintf(conversion + len, sizeof (conversion) - len, "p");
+        written = snprintf(line + out, size - out, conversion, (void *) (uintptr_t) value);
+        break;
+      default: {
+        double real;
+        memcpy(&real, &value, sizeof (real));
+        snprintf(conversion + len, sizeof (conversion) - len, "%c", spec.conversion);
+        written = snprintf(line + out, size - out, conversion, real);
+      }
+      }
+    }
+    if (written > 0) out += written;
+  }
+  if (out >= size) out = size - 1;
+  line[out] = 0;
+  return out;
+}
+
+static size_t format_prefix(char *line, size_t size, log_header_t *header) {
+  switch (header->level) {
+  case LOG_LEVEL_ERROR:
+    return snprintf(line, size, "Error:");
+  case LOG_LEVEL_WARNING:
+    return snprintf(line, size, "Warning:");
+  case LOG_LEVEL_DEBUG:
+    return snprintf(line, size, "%s(%u) - %s: ", header->file, header->line,
+      header->func);
+  }
+  return 0;
+}
+
+static log_ring_t *register_ring() {
+  log_ring_t *ring = NULL;
+  pthread_mutex_lock(&g_rings_mutex);
+  if (g_nb_rings < LOG_MAX_RINGS && (ring = calloc(1, sizeof (log_ring_t))) != NULL) {
+    __atomic_store_n(&g_rings[g_nb_rings], ring, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_nb_rings, g_nb_rings + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&g_rings_mutex);
+  return ring;
+}
+
+static uint8_t ring_push(log_ring_t *ring, log_header_t *header,
+  const char *payload, size_t payload_size) {
+  size_t size = ALIGN8(sizeof (log_header_t) + payload_size);
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t offset = head & LOG_RING_MASK;
+  size_t contiguous = LOG_RING_SIZE - offset;
+  size_t needed = contiguous < size ? size + contiguous : size;
+  if (LOG_RING_SIZE - (head - tail) < needed) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  if (contiguous < size) {
+    log_header_t padding = { contiguous, LOG_PADDING, 0, 0, NULL, NULL, NULL };
+    // Records are 8 bytes aligned, the size and level always fit
+    memcpy(ring->data + offset, &padding, sizeof (uint32_t));
+    head += contiguous;
+    offset = 0;
+  }
+  header->size = size;
+  memcpy(ring->data + offset, header, sizeof (log_header_t));
+  memcpy(ring->data + offset + sizeof (log_header_t), payload, payload_size);
+  __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void log_record(uint8_t level, const char *file, uint16_t line,
+  const char *func, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (!__atomic_load_n(&g_log_running, __ATOMIC_ACQUIRE)) {
+    // No background thread (startup, shutdown or tests), write synchronously
+    char message[LOG_MAX_LINE];
+    log_header_t header = { 0, level, 0, line, file, func, format };
+    size_t len = format_prefix(message, LOG_MAX_LINE, &header);
+    vsnprintf(message + len, LOG_MAX_LINE - len, format, args);
+    fputs(message, level == LOG_LEVEL_INFO ? stdout : stderr);
+    va_end(args);
+    return;
+  }
+  if (t_ring == NULL && (t_ring = register_ring()) == NULL) {
+    __atomic_fetch_add(&g_unringed_drops, 1, __ATOMIC_RELAXED);
+    va_end(args);
+    return;
+  }
+  char payload[LOG_MAX_RECORD];
+  size_t payload_size = capture(payload, format, &args);
+  va_end(args);
+  log_header_t header = { 0, level, 0, line, file, func, format };
+  ring_push(t_ring, &header, payload, payload_size);
+}
+
+uint64_t log_dropped() {
+  uint64_t dropped = __atomic_load_n(&g_unringed_drops, __ATOMIC_RELAXED);
+  uint32_t nb_rings = __atomic_load_n(&g_nb_rings, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < nb_rings; ++i)
+    dropped += __atomic_load_n(&g_rings[i]->dropped, __ATOMIC_RELAXED);
+  return dropped;
+}
+
+static void batch_flush(log_batch_t *batch) {
+  size_t written = 0;
+  while (written < batch->position) {
+    ssize_t len = write(batch->fd, batch->buffer + written, batch->position - written);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      // Nowhere left to report it
+      break;
+    }
+    written += len;
+  }
+  batch->position = 0;
+}
+
+static void batch_append(log_batch_t *batch, const char *line, size_t len) {
+  if (batch->position + len > LOG_BATCH_SIZE) batch_flush(batch);
+  memcpy(batch->buffer + batch->position, line, len);
+  batch->position += len;
+}
+
+/**
+ * Format every record available in the ring. Returns the number of records
+ * consumed.
+ */
+static size_t ring_drain(log_ring_t *ring, log_batch_t *out, log_batch_t *err) {
+  size_t count = 0;
+  uint64_t tail = ring->tail;
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  char line[LOG_MAX_LINE];
+  while (tail < head) {
+    size_t offset = tail & LOG_RING_MASK;
+    log_header_t header;
+    memcpy(&header, ring->data + offset, sizeof (uint32_t));
+    if (header.level != LOG_PADDING) {
+      memcpy(&header, ring->data + offset, sizeof (log_header_t));
+      size_t len = format_prefix(line, LOG_MAX_LINE, &header);
+      len += format_record(line + len, LOG_MAX_LINE - len, header.format,
+        ring->data + offset + sizeof (log_header_t),
+        header.size - sizeof (log_header_t));
+      batch_append(header.level == LOG_LEVEL_INFO ? out : err, line, len);
+      ++count;
+    }
+    tail += header.size;
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  return count;
+}
+
+static void *log_loop(void *arg) {
+  (void) arg;
+  static log_batch_t out = { STDOUT_FILENO, { 0 }, 0 };
+  static log_batch_t err = { STDERR_FILENO, { 0 }, 0 };
+  uint64_t reported_drops = 0;
+  uint8_t running = 1;
+  while (1) {
+    size_t count = 0;
+    uint32_t nb_rings = __atomic_load_n(&g_nb_rings, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < nb_rings; ++i)
+      count += ring_drain(g_rings[i], &out, &err);
+    uint64_t drops = log_dropped();
+    if (drops != reported_drops) {
+      char line[128];
+      size_t len = snprintf(line, sizeof (line),
+        "Warning:%lu log messages dropped\n", drops - reported_drops);
+      batch_append(&err, line, len);
+      reported_drops = drops;
+    }
+    batch_flush(&out);
+    batch_flush(&err);
+    // Exit only once a pass following the stop request found nothing left
+    if (!running && count == 0) break;
+    running = __atomic_load_n(&g_log_running, __ATOMIC_ACQUIRE);
+    if (count == 0 && running) {
+      struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
+      nanosleep(&idle, NULL);
+    }
+  }
+  return NULL;
+}
+
+int8_t log_start() {
+  fflush(stdout);
+  fflush(stderr);
+  __atomic_store_n(&g_log_running, 1, __ATOMIC_RELEASE);
+  int ret;
+  if ((ret = pthread_create(&g_log_thread, NULL, log_loop, NULL)) != 0) {
+    __atomic_store_n(&g_log_running, 0, __ATOMIC_RELEASE);
+    errno = ret;
+    perror("pthread_create");
+    return ERROR;
+  }
+  return 0;
+}
+
+/**
+ * Stop the background thread once it has written every pending record. The
+ * following records are written synchronously.
+ */
+void log_stop() {
+  if (!__atomic_exchange_n(&g_log_running, 0, __ATOMIC_ACQ_REL)) return;
+  pthread_join(g_log_thread, NULL);
+}
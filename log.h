@@ -0,0 +1,49 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Levels above this one are compiled out, e.g. -DLOG_COMPILE_LEVEL=1 keeps
+// only the errors and warnings
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Per thread ring buffer size, must be a power of two
+#define LOG_RING_SIZE (1 << 18)
+#define LOG_MAX_RINGS 64
+// Largest record stored in a ring, strings are truncated to fit
+#define LOG_MAX_RECORD 1024
+#define LOG_MAX_LINE 2048
+#define LOG_BATCH_SIZE 65536
+// Time the background thread sleeps when all the rings are empty
+#define LOG_IDLE_SLEEP_NS 2000000
+
+extern uint8_t g_log_level;
+
+#define LOG_ENABLED(level) \
+  ((level) <= LOG_COMPILE_LEVEL && (level) < g_log_level + 1)
+
+#define LOG_AT(level, format, ...) \
+  { if (LOG_ENABLED(level)) \
+      log_record(level, __FILE__, __LINE__, __func__, format, __VA_ARGS__); }
+
+#define LOG_MSG(format, ...) LOG_AT(LOG_LEVEL_INFO, format, __VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, __VA_ARGS__)
+#define LOG_WARNING(format, ...) LOG_AT(LOG_LEVEL_WARNING, format, __VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, __VA_ARGS__)
+
+void log_record(uint8_t level, const char *file, uint16_t line,
+  const char *func, const char *format, ...)
+  __attribute__((format(printf, 5, 6)));
+int8_t log_parse_level(const char *name);
+int8_t log_start();
+void log_stop();
+uint64_t log_dropped();
+
+#endif // __LOG_H__
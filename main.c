@@ -13,59 +13,469 @@
 
 #include "defines.h"
 #include "httpd.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "trace.h"
+#include "perf.h"
+#include "sched.h"
+#include "negcache.h"
+#include "resolve.h"
+#include "fileio.h"
+#include "pagecache.h"
+#include "pack.h"
+#include "warmup.h"
+#include "guard.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "upgrade.h"
+#include "tls.h"
+#include "upstream.h"
+#include "proxycache.h"
+#include "gateway.h"
 
 client_t *g_clients = NULL;
-uint8_t g_running = 1;
 
 void usage(char **argv) {
-  fprintf(stderr, "usage: %s ip port\n", argv[0]);
+  fprintf(stderr, "usage: %s [-l level] [-m metrics_path] [-a access_log] "
+    "[-F common|combined] [-S sampling] [-t trace_path] [-T threshold_us] "
+    "[-P] [-b bytes_per_sec] [-B bytes_per_sec] [-N] [-j threads]\n"
+    "  [-s bytes] [-d bytes] [-x prefix] [-A archive]\n"
+    "  [-W threads [-H manifest] [-w]]\n"
+    "  [-r ms] [-k ms] [-u ms] [-f bytes_per_sec] [-c connections]\n"
+    "  [-q requests_per_sec [-Q burst] [-L buckets] [-X]] [-D ms] [-I requests]\n"
+    "  [-g ms] [-C cert [-K key]] [-p prefix=address:port[,address:port]] [-o ms]\n"
+    "  [-M bytes] [-Z file [-z bytes]] [-e prefix=command [-E n] [-J n] [-R ms]]\n"
+    "  ip port\n", argv[0]);
+  fprintf(stderr, "  -l level  log level: error, warning, info (default) or debug\n");
+  fprintf(stderr, "  -m path  expose metrics in the Prometheus format on path "
+    "(e.g. /_shttpd/metrics)\n");
+  fprintf(stderr, "  -a file  write an access log to file, reopened on SIGHUP\n");
+  fprintf(stderr, "  -F format  access log format, common or combined (default)\n");
+  fprintf(stderr, "  -S n  log only one successful request out of n\n");
+  fprintf(stderr, "  -t path  export slow requests as a Chrome trace on path "
+    "(e.g. /_shttpd/trace)\n");
+  fprintf(stderr, "  -T us  trace requests slower than us microseconds "
+    "(default 10000)\n");
+  fprintf(stderr, "  -P  profile requests with the hardware counters, dumped on "
+    "SIGUSR1 and with the metrics\n");
+  fprintf(stderr, "  -b rate  cap each connection to rate bytes per second\n");
+  fprintf(stderr, "  -B rate  cap the whole server to rate bytes per second\n");
+  fprintf(stderr, "  -N       do not cache the lookups of missing files\n");
+  fprintf(stderr, "  -j n     threads opening cold files (default %i, at most %i), 0 to "
+    "open them from the event loop\n", FILEIO_DEFAULT_THREADS, FILEIO_MAX_THREADS);
+  fprintf(stderr, "  -s size  drop files from the page cache as they are sent from that "
+    "size on (default %i)\n", PAGECACHE_DEFAULT_STREAM_SIZE);
+  fprintf(stderr, "  -d size  read files with O_DIRECT from that size on\n");
+  fprintf(stderr, "  -x path  drop the files under path from the page cache as they "
+    "are sent, can be repeated\n");
+  fprintf(stderr, "  -A file  serve the files of an archive built by shttpd-pack, "
+    "reloaded on SIGHUP\n");
+  fprintf(stderr, "  -r ms    close the connections not sending their headers within ms "
+    "(default %i)\n", HEADER_WAIT_MS);
+  fprintf(stderr, "  -k ms    close the connections idle for ms (default %i)\n",
+    GUARD_IDLE_TIMEOUT_MS);
+  fprintf(stderr, "  -u ms    close the connections not taking any of their response "
+    "for ms (default %i)\n", GUARD_STALL_TIMEOUT_MS);
+  fprintf(stderr, "  -f rate  close the connections taking their response slower than "
+    "rate bytes per second\n");
+  fprintf(stderr, "  -c n     accept at most n connections per address\n");
+  fprintf(stderr, "  -q rate  cap every client to rate requests per second, answering "
+    "429 above\n");
+  fprintf(stderr, "  -Q n     let clients burst to n requests (default the rate)\n");
+  fprintf(stderr, "  -L n     rate limit buckets (default %i)\n", RATELIMIT_DEFAULT_SLOTS);
+  fprintf(stderr, "  -X       rate limit by the address the load balancer puts last in "
+    "X-Forwarded-For\n");
+  fprintf(stderr, "  -D ms    answer 503 when requests wait longer than ms in the event "
+    "loop\n");
+  fprintf(stderr, "  -I n     answer 503 when n requests are already in flight\n");
+  fprintf(stderr, "  -g ms    let responses finish for ms on SIGTERM or after an upgrade "
+    "(SIGUSR2, default %i)\n", UPGRADE_DRAIN_TIMEOUT_MS);
+  fprintf(stderr, "  -C file  serve HTTPS with the certificate chain of file (PEM), "
+    "needs make TLS=1\n");
+  fprintf(stderr, "  -K file  private key of the certificate (default the -C file)\n");
+  fprintf(stderr, "  -p spec  forward the requests under prefix to the backends at "
+    "address:port, can be repeated\n");
+  fprintf(stderr, "  -o ms    answer 504 when a backend does not start its response "
+    "within ms (default %i)\n", UPSTREAM_TIMEOUT_MS);
+  fprintf(stderr, "  -M size  cache the proxied responses in size bytes of memory "
+    "(default %i), 0 not to\n", PROXYCACHE_DEFAULT_MEMORY);
+  fprintf(stderr, "  -Z file  move the least recently used responses of the cache "
+    "to file\n");
+  fprintf(stderr, "  -z size  size of that file (default %llu)\n",
+    PROXYCACHE_DEFAULT_STORE_SIZE);
+  fprintf(stderr, "  -e spec  hand the requests under prefix to workers started with "
+    "command, can be repeated\n");
+  fprintf(stderr, "  -E n     workers per prefix (default %i)\n", GATEWAY_DEFAULT_PROCESSES);
+  fprintf(stderr, "  -J n     requests a worker takes at once (default %i)\n",
+    GATEWAY_DEFAULT_CONCURRENCY);
+  fprintf(stderr, "  -R ms    answer 504 when no worker takes a request or starts its "
+    "response within ms (default %i)\n", GATEWAY_TIMEOUT_MS);
+  fprintf(stderr, "  -W n     warm the caches up with n threads at startup (at most %i)\n",
+    WARMUP_MAX_THREADS);
+  fprintf(stderr, "  -H file  read in the files listed in file first, hottest first\n");
+  fprintf(stderr, "  -w       wait for the end of the warm-up to accept connections\n");
 }
 
-void exit_handler() {
-  LOG_DEBUG("cleaning up...%s\n", "");
-  g_running = 0;
-  delete_all_clients(&g_clients);
+/**
+ * Parse a number of threads, up to max. Returns ERROR if it is not one.
+ */
+static int8_t parse_threads(const char *value, uint8_t max, uint8_t *threads) {
+  char *endptr;
+  unsigned long n = strtoul(value, &endptr, 10);
+  if (value == endptr || *endptr != '\0' || n > max) {
+    LOG_ERROR("Invalid number of threads: %s\n", value);
+    return ERROR;
+  }
+  *threads = n;
+  return 0;
+}
+
+void reopen_handler() {
+  g_accesslog_reopen = 1;
+  g_pack_reload = 1;
+}
+
+/**
+ * Poll timeout in milliseconds: the earliest of the access log flush, of the
+ * resumption of a throttled transfer, of the deadline sweep, of the end of
+ * an overload, of the drain checks, of the backend timeouts and health
+ * probes, of the worker timeouts and restarts and of the warm-up progress
+ * report.
+ */
+int poll_timeout() {
+  int timeout = sched_timeout();
+  if (accesslog_enabled() && (timeout < 0 || timeout > ACCESSLOG_FLUSH_INTERVAL_MS))
+    timeout = ACCESSLOG_FLUSH_INTERVAL_MS;
+  // Closes the connections past their deadlines
+  if (g_clients != NULL && g_clients->next != NULL &&
+    (timeout < 0 || timeout > GUARD_SWEEP_MS)) timeout = GUARD_SWEEP_MS;
+  // Resumes the accepts paused by the admission control
+  int admission = admission_timeout();
+  if (admission >= 0 && (timeout < 0 || timeout > admission)) timeout = admission;
+  // Closes the connections while draining
+  int upgrade = upgrade_timeout();
+  if (upgrade >= 0 && (timeout < 0 || timeout > upgrade)) timeout = upgrade;
+  // Times the backends out and probes the ones down
+  int upstream = upstream_timeout();
+  if (upstream >= 0 && (timeout < 0 || timeout > upstream)) timeout = upstream;
+  // Times the workers out and restarts the ones that exited
+  int gateway = gateway_timeout();
+  if (gateway >= 0 && (timeout < 0 || timeout > gateway)) timeout = gateway;
+  // Reports the progress of the warm-up
+  if (warmup_running() && (timeout < 0 || timeout > WARMUP_REPORT_MS))
+    timeout = WARMUP_REPORT_MS;
+  return timeout;
+}
+
+void perf_dump_handler() {
+  g_perf_dump = 1;
+}
+
+void stop_handler() {
+  ++g_stop_requested;
+}
+
+void upgrade_handler() {
+  g_upgrade_requested = 1;
 }
 
 // TODO: Manage zip compression
-// TODO: Manage calling shell command as backend methods
 // TODO: Manage CORS headers
 int main(int argc, char **argv) {
-  if (argc != 3) {
+  option_t options;
+  memset(&options, 0, sizeof (options));
+  options.trace_threshold_us = DEFAULT_TRACE_THRESHOLD_US;
+  options.fileio_threads = FILEIO_DEFAULT_THREADS;
+  options.header_timeout_ms = HEADER_WAIT_MS;
+  options.idle_timeout_ms = GUARD_IDLE_TIMEOUT_MS;
+  options.stall_timeout_ms = GUARD_STALL_TIMEOUT_MS;
+  options.rate_limit_slots = RATELIMIT_DEFAULT_SLOTS;
+  options.drain_timeout_ms = UPGRADE_DRAIN_TIMEOUT_MS;
+  options.upstream_timeout_ms = UPSTREAM_TIMEOUT_MS;
+  options.proxy_cache_memory = PROXYCACHE_DEFAULT_MEMORY;
+  options.proxy_cache_store_size = PROXYCACHE_DEFAULT_STORE_SIZE;
+  options.gateway_processes = GATEWAY_DEFAULT_PROCESSES;
+  options.gateway_concurrency = GATEWAY_DEFAULT_CONCURRENCY;
+  options.gateway_timeout_ms = GATEWAY_TIMEOUT_MS;
+  int opt;
+  int8_t level;
+  while ((opt = getopt(argc, argv, "l:m:a:F:S:t:T:Pb:B:Nj:s:d:x:A:W:H:wr:k:u:f:c:q:Q:L:XD:I:g:C:K:p:o:M:Z:z:e:E:J:R:")) != -1) {
+    switch (opt) {
+    case 'l':
+      if ((level = log_parse_level(optarg)) < 0) {
+        usage(argv);
+        return ERROR;
+      }
+      g_log_level = level;
+      break;
+    case 'm':
+      options.metrics_path = optarg;
+      break;
+    case 'a':
+      options.accesslog = optarg;
+      break;
+    case 'F':
+      if (!strcmp(optarg, "common")) options.accesslog_format = E_ACCESSLOG_COMMON;
+      else if (!strcmp(optarg, "combined")) options.accesslog_format = E_ACCESSLOG_COMBINED;
+      else {
+        usage(argv);
+        return ERROR;
+      }
+      break;
+    case 'S':
+      options.accesslog_sampling = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      options.trace_path = optarg;
+      break;
+    case 'T':
+      options.trace_threshold_us = strtoull(optarg, NULL, 10);
+      break;
+    case 'P':
+      options.perf = 1;
+      break;
+    case 'b':
+      options.connection_rate = strtoull(optarg, NULL, 10);
+      break;
+    case 'B':
+      options.global_rate = strtoull(optarg, NULL, 10);
+      break;
+    case 'N':
+      options.no_negcache = 1;
+      break;
+    case 'j':
+      if (parse_threads(optarg, FILEIO_MAX_THREADS, &options.fileio_threads)) return ERROR;
+      break;
+    case 's':
+      g_pagecache_stream_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'd':
+      g_pagecache_direct_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      options.header_timeout_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'k':
+      options.idle_timeout_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'u':
+      options.stall_timeout_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'f':
+      options.rate_floor = strtoull(optarg, NULL, 10);
+      break;
+    case 'c':
+      options.max_per_ip = strtoul(optarg, NULL, 10);
+      break;
+    case 'q':
+      options.request_rate = strtoull(optarg, NULL, 10);
+      break;
+    case 'Q':
+      options.request_burst = strtoull(optarg, NULL, 10);
+      break;
+    case 'L':
+      options.rate_limit_slots = strtoull(optarg, NULL, 10);
+      break;
+    case 'X':
+      g_ratelimit_trust_forwarded = 1;
+      break;
+    case 'D':
+      options.target_delay_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'I':
+      options.max_in_flight = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      options.drain_timeout_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'W':
+      if (parse_threads(optarg, WARMUP_MAX_THREADS, &options.warmup_threads)) return ERROR;
+      break;
+    case 'H':
+      options.manifest = optarg;
+      break;
+    case 'w':
+      options.warmup_wait = 1;
+      break;
+    case 'A':
+      options.archive = optarg;
+      break;
+    case 'C':
+      options.cert = optarg;
+      break;
+    case 'K':
+      options.key = optarg;
+      break;
+    case 'p':
+      if (upstream_add_route(optarg)) return ERROR;
+      break;
+    case 'o':
+      options.upstream_timeout_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'M':
+      options.proxy_cache_memory = strtoull(optarg, NULL, 10);
+      break;
+    case 'Z':
+      options.proxy_cache_store = optarg;
+      break;
+    case 'z':
+      options.proxy_cache_store_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'e':
+      if (gateway_add_pool(optarg)) return ERROR;
+      break;
+    case 'E':
+      options.gateway_processes = strtoul(optarg, NULL, 10);
+      break;
+    case 'J':
+      options.gateway_concurrency = strtoul(optarg, NULL, 10);
+      break;
+    case 'R':
+      options.gateway_timeout_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'x':
+      if (pagecache_stream_prefix(optarg)) {
+        LOG_ERROR("too many stream prefixes%s\n", "");
+        return ERROR;
+      }
+      break;
+    default:
+      usage(argv);
+      return ERROR;
+    }
+  }
+  if (argc - optind != 2) {
     usage(argv);
     return ERROR;
   }
-  option_t options;
-  options.address = argv[1];
+  options.address = argv[optind];
   // Retrieve port number
   char *endptr;
-  options.portno = strtol(argv[2], &endptr, 10);
-  if (argv[2] == endptr || options.portno > MAX_PORT_NO) {
-    LOG_ERROR("Invalid port: %s\n", argv[2]);
+  options.portno = strtol(argv[optind + 1], &endptr, 10);
+  if (argv[optind + 1] == endptr || options.portno > MAX_PORT_NO) {
+    LOG_ERROR("Invalid port: %s\n", argv[optind + 1]);
     return ERROR;
   }
-  atexit(exit_handler);
-  signal(SIGTERM, exit_handler);
-  signal(SIGINT, exit_handler);
-  int16_t socketfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (options.metrics_path != NULL) {
+    // Request paths are matched once stripped of their leading '/'
+    g_metrics_path = options.metrics_path[0] == '/' ?
+      &options.metrics_path[1] : options.metrics_path;
+  }
+  g_sched_connection_rate = options.connection_rate;
+  g_sched_global_rate = options.global_rate;
+  if (options.trace_path != NULL) {
+    g_trace_path = options.trace_path[0] == '/' ?
+      &options.trace_path[1] : options.trace_path;
+    trace_enable(options.trace_threshold_us);
+  }
+  if (options.accesslog != NULL && accesslog_open(options.accesslog,
+      options.accesslog_format, options.accesslog_sampling)) return ERROR;
+  if (log_start()) return ERROR;
+  // Flushes the errors of the start up too
+  atexit(log_stop);
+  if (options.perf) perf_enable();
+  // Requests are served from the working directory
+  if (clients_init()) return ERROR;
+  g_guard_header_timeout_ms = options.header_timeout_ms;
+  g_guard_idle_timeout_ms = options.idle_timeout_ms;
+  g_guard_stall_timeout_ms = options.stall_timeout_ms;
+  g_guard_rate_floor = options.rate_floor;
+  g_guard_max_per_ip = options.max_per_ip;
+  if (guard_init(g_max_clients)) return ERROR;
+  if (ratelimit_init(options.request_rate, options.request_burst,
+    options.rate_limit_slots)) return ERROR;
+  g_upgrade_drain_timeout_ms = options.drain_timeout_ms;
+  g_admission_target_ms = options.target_delay_ms;
+  g_admission_max_in_flight = options.max_in_flight;
+  if (admission_init()) return ERROR;
+  // The key may be in the same file as the certificate
+  if (options.cert != NULL && tls_init(options.cert,
+    options.key != NULL ? options.key : options.cert)) return ERROR;
+  if (resolve_init(".")) return ERROR;
+  g_upstream_timeout_ms = options.upstream_timeout_ms;
+  if (upstream_init()) return ERROR;
+  // Only for the routes to proxy
+  if (upstream_max_fds() > 0 && proxycache_init(options.proxy_cache_memory,
+    options.proxy_cache_store, options.proxy_cache_store_size)) return ERROR;
+  g_gateway_processes = options.gateway_processes;
+  g_gateway_concurrency = options.gateway_concurrency;
+  g_gateway_timeout_ms = options.gateway_timeout_ms;
+  if (gateway_init()) return ERROR;
+  if (!options.no_negcache) negcache_enable();
+  if (fileio_start(options.fileio_threads)) return ERROR;
+  if (options.archive != NULL && pack_open(options.archive)) return ERROR;
+  if (warmup_start(options.warmup_threads, options.manifest)) return ERROR;
+  if (options.warmup_wait) warmup_wait();
+  signal(SIGTERM, stop_handler);
+  signal(SIGINT, stop_handler);
+  signal(SIGHUP, reopen_handler);
+  signal(SIGUSR1, perf_dump_handler);
+  signal(SIGUSR2, upgrade_handler);
+  // Clients going away are seen as write errors
+  signal(SIGPIPE, SIG_IGN);
+  // A new binary takes the socket of the old one over
+  int32_t socketfd = upgrade_inherited_socket();
   if (socketfd < 0) {
-    perror("socket");
-    return ERROR;
+    if ((socketfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+      perror("socket");
+      return ERROR;
+    }
+    struct sockaddr_in addr;
+    if (create_addr(options, &addr)) {
+      return ERROR;
+    }
+    if (prepare_socket(socketfd, addr) < 0) return ERROR;
   }
-  struct sockaddr_in addr;
-  if (create_addr(options, &addr)) {
+  // The clients, the backends, the workers, then the completions of the file
+  // operations pool
+  struct pollfd *fds = calloc(g_max_clients + 2 + upstream_max_fds() + gateway_max_fds(),
+    sizeof (struct pollfd));
+  if (fds == NULL) {
+    perror("calloc");
     return ERROR;
   }
-  if (prepare_socket(socketfd, addr) < 0) return ERROR;
-  struct pollfd fds[MAX_CLIENT];
   // The socket file descriptor will always be the first one in the list
-  add_client(fds, socketfd, NULL, &g_clients);
+  add_client(socketfd, NULL, &g_clients);
   LOG_MSG("listening to %s %u\n", options.address, options.portno);
-  while (g_running) {
-    // TODO: improve performance by keeping count at this level
-    poll_(fds, count_clients(g_clients));
-    serve(fds, g_clients);
+  upgrade_notify_ready();
+  while (1) {
+    // The events of a connection depend on the state of its response
+    size_t nclients = rebuild_fds(fds, g_clients);
+    size_t nfds = nclients;
+    size_t nupstream = upstream_fds(&fds[nfds]);
+    nfds += nupstream;
+    size_t ngateway = gateway_fds(&fds[nfds]);
+    nfds += ngateway;
+    if (g_fileio_enabled) {
+      fds[nfds].fd = fileio_fd();
+      fds[nfds].events = POLLIN;
+      fds[nfds++].revents = 0;
+    }
+    uint64_t poll_ns = now_ns();
+    poll_(fds, nfds, poll_timeout());
+    TRACE_WAKEUP();
+    admission_turn(poll_ns);
+    // Files created since the last turn are no longer missing
+    negcache_tick();
+    serve(fds, nclients, g_clients);
+    upstream_run(&fds[nclients], nupstream, &g_clients);
+    gateway_run(&fds[nclients + nupstream], ngateway, &g_clients);
+    if (g_fileio_enabled && (fds[nfds - 1].revents & POLLIN)) fileio_complete(&g_clients);
+    accesslog_tick();
+    perf_tick();
+    pack_tick();
+    warmup_tick();
+    guard_sweep(&g_clients);
+    upstream_tick(&g_clients);
+    gateway_tick(&g_clients);
+    if (upgrade_tick(argv, &g_clients)) break;
   }
-  close(socketfd);
+  delete_all_clients(&g_clients);
+  upstream_stop();
+  proxycache_stop();
+  gateway_stop();
+  free(fds);
+  accesslog_close();
+  log_stop();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "defines.h"
+#include "metrics.h"
+#include "log.h"
+#include "perf.h"
+
+metrics_t g_metrics[MAX_WORKERS];
+// The main event loop uses the first slot without having to register
+__thread metrics_t *t_metrics = &g_metrics[0];
+static uint32_t g_nb_workers = 1;
+// Path of the metrics endpoint, without the leading '/'. NULL if disabled
+char *g_metrics_path = NULL;
+
+// Quantiles exported next to the histogram, computed at scrape time
+static const double g_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t position;
+} render_t;
+
+uint64_t latency_bucket_upper_bound(uint16_t bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+  uint8_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t mantissa = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1;
+  return (mantissa << shift) - 1;
+}
+
+/**
+ * Give the calling thread its own slot. Returns NULL when all the slots are
+ * taken, in which case the thread keeps sharing the slot of the main loop.
+ */
+metrics_t *metrics_register_worker() {
+  uint32_t slot = __atomic_fetch_add(&g_nb_workers, 1, __ATOMIC_RELAXED);
+  if (slot >= MAX_WORKERS) {
+    LOG_WARNING("no metrics slot left for worker %u\n", slot);
+    return NULL;
+  }
+  t_metrics = &g_metrics[slot];
+  return t_metrics;
+}
+
+void metrics_record_request(request_t *request) {
+  uint64_t elapsed = now_ns() - request->start_ns;
+  METRIC_INC(responses[request->status]);
+  METRIC_ADD(bytes_sent, request->bytes_sent);
+  METRIC_ADD(latency_sum_ns, elapsed);
+  METRIC_INC(latency[latency_bucket(elapsed)]);
+}
+
+void metrics_aggregate(metrics_t *total) {
+  memset(total, 0, sizeof (metrics_t));
+  uint32_t nb_workers = __atomic_load_n(&g_nb_workers, __ATOMIC_RELAXED);
+  if (nb_workers > MAX_WORKERS) nb_workers = MAX_WORKERS;
+  // Every field is a uint64_t, sum the structures as flat arrays
+  size_t nb_fields = offsetof(metrics_t, latency) / sizeof (uint64_t) +
+    NB_LATENCY_BUCKETS;
+  uint64_t *dst = (uint64_t *) total;
+  for (uint32_t w = 0; w < nb_workers; ++w) {
+    uint64_t *src = (uint64_t *) &g_metrics[w];
+    for (size_t i = 0; i < nb_fields; ++i)
+      dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+static void render(render_t *r, const char *format, ...) {
+  if (r->position >= r->size) return;
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(r->buffer + r->position, r->size - r->position, format, args);
+  va_end(args);
+  if (len > 0) r->position += len;
+}
+
+static void render_header(render_t *r, const char *name, const char *type,
+  const char *help) {
+  render(r, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static double quantile(metrics_t *total, uint64_t count, double q) {
+  uint64_t rank = (uint64_t) (q * count);
+  uint64_t seen = 0;
+  for (uint16_t i = 0; i < NB_LATENCY_BUCKETS; ++i) {
+    seen += total->latency[i];
+    if (seen > rank) return latency_bucket_upper_bound(i) / 1e9;
+  }
+  return 0;
+}
+
+/**
+ * Aggregate the workers and render them in the Prometheus text format.
+ * Returns the number of bytes written to the buffer.
+ */
+size_t metrics_render(char *buffer, size_t size) {
+  metrics_t total;
+  metrics_aggregate(&total);
+  render_t r = { buffer, size, 0 };
+
+  render_header(&r, "shttpd_requests_total", "counter", "Requests received, by method.");
+  for (uint8_t i = 0; i < NB_METHODS; ++i)
+    render(&r, "shttpd_requests_total{method=\"%s\"} %lu\n", g_methods[i],
+      total.requests[i]);
+  render_header(&r, "shttpd_responses_total", "counter", "Responses sent, by status code.");
+  for (uint8_t i = 0; i < NB_STATUS_CODE; ++i)
+    render(&r, "shttpd_responses_total{code=\"%u\"} %lu\n", g_status_code[i].code,
+      total.responses[i]);
+  render_header(&r, "shttpd_sent_bytes_total", "counter", "Bytes sent, headers included.");
+  render(&r, "shttpd_sent_bytes_total %lu\n", total.bytes_sent);
+  render_header(&r, "shttpd_accepts_total", "counter", "Accepted connections.");
+  render(&r, "shttpd_accepts_total %lu\n", total.accepts);
+  render_header(&r, "shttpd_shed_connections_total", "counter",
+    "Connections closed on accept for lack of file descriptors.");
+  render(&r, "shttpd_shed_connections_total %lu\n", total.shed_connections);
+  render_header(&r, "shttpd_capped_connections_total", "counter",
+    "Connections closed on accept, their address having too many.");
+  render(&r, "shttpd_capped_connections_total %lu\n", total.capped_connections);
+  render_header(&r, "shttpd_timed_out_connections_total", "counter",
+    "Connections closed past a header, idle, write stall or rate deadline.");
+  render(&r, "shttpd_timed_out_connections_total %lu\n", total.timed_out_connections);
+  render_header(&r, "shttpd_rate_limit_evictions_total", "counter",
+    "Rate limit buckets reused before they were full again.");
+  render(&r, "shttpd_rate_limit_evictions_total %lu\n", total.rate_limit_evictions);
+  render_header(&r, "shttpd_overloads_total", "counter",
+    "Intervals the requests started waiting longer than the target delay.");
+  render(&r, "shttpd_overloads_total %lu\n", total.overloads);
+  render_header(&r, "shttpd_shed_requests_total", "counter",
+    "Requests answered 503 by the admission control.");
+  render(&r, "shttpd_shed_requests_total{reason=\"queue_delay\"} %lu\n",
+    total.shed_queue_delay);
+  render(&r, "shttpd_shed_requests_total{reason=\"in_flight\"} %lu\n",
+    total.shed_in_flight);
+  render_header(&r, "shttpd_tls_handshakes_total", "counter",
+    "TLS handshakes completed.");
+  render(&r, "shttpd_tls_handshakes_total %lu\n", total.tls_handshakes);
+  render_header(&r, "shttpd_tls_resumptions_total", "counter",
+    "TLS handshakes that resumed a session.");
+  render(&r, "shttpd_tls_resumptions_total %lu\n", total.tls_resumptions);
+  render_header(&r, "shttpd_ktls_connections_total", "counter",
+    "TLS connections encrypted by the kernel.");
+  render(&r, "shttpd_ktls_connections_total %lu\n", total.ktls_connections);
+  render_header(&r, "shttpd_h2_connections_total", "counter",
+    "Connections switched to HTTP/2.");
+  render(&r, "shttpd_h2_connections_total %lu\n", total.h2_connections);
+  render_header(&r, "shttpd_h2_streams_total", "counter", "HTTP/2 streams opened.");
+  render(&r, "shttpd_h2_streams_total %lu\n", total.h2_streams);
+  render_header(&r, "shttpd_upstream_requests_total", "counter",
+    "Requests forwarded to a backend.");
+  render(&r, "shttpd_upstream_requests_total %lu\n", total.upstream_requests);
+  render_header(&r, "shttpd_upstream_connections_total", "counter",
+    "Connections opened to the backends.");
+  render(&r, "shttpd_upstream_connections_total %lu\n", total.upstream_connections);
+  render_header(&r, "shttpd_upstream_reuses_total", "counter",
+    "Requests sent on a pooled connection to a backend.");
+  render(&r, "shttpd_upstream_reuses_total %lu\n", total.upstream_reuses);
+  render_header(&r, "shttpd_upstream_errors_total", "counter",
+    "Connections to the backends that failed or timed out.");
+  render(&r, "shttpd_upstream_errors_total %lu\n", total.upstream_errors);
+  render_header(&r, "shttpd_upstream_bytes_total", "counter",
+    "Bytes of response bodies received from the backends.");
+  render(&r, "shttpd_upstream_bytes_total %lu\n", total.upstream_bytes);
+  render_header(&r, "shttpd_proxy_cache_hits_total", "counter",
+    "Proxied requests answered from the cache, fresh.");
+  render(&r, "shttpd_proxy_cache_hits_total %lu\n", total.proxy_cache_hits);
+  render_header(&r, "shttpd_proxy_cache_stale_hits_total", "counter",
+    "Proxied requests answered from the cache, stale while it is refreshed.");
+  render(&r, "shttpd_proxy_cache_stale_hits_total %lu\n", total.proxy_cache_stale_hits);
+  render_header(&r, "shttpd_proxy_cache_misses_total", "counter",
+    "Proxied requests missing the cache.");
+  render(&r, "shttpd_proxy_cache_misses_total %lu\n", total.proxy_cache_misses);
+  render_header(&r, "shttpd_proxy_cache_coalesced_total", "counter",
+    "Misses waiting for the fetch of another request.");
+  render(&r, "shttpd_proxy_cache_coalesced_total %lu\n", total.proxy_cache_coalesced);
+  render_header(&r, "shttpd_proxy_cache_disk_hits_total", "counter",
+    "Entries of the cache brought back from the on-disk store.");
+  render(&r, "shttpd_proxy_cache_disk_hits_total %lu\n", total.proxy_cache_disk_hits);
+  render_header(&r, "shttpd_proxy_cache_stores_total", "counter",
+    "Responses stored in the cache.");
+  render(&r, "shttpd_proxy_cache_stores_total %lu\n", total.proxy_cache_stores);
+  render_header(&r, "shttpd_gateway_requests_total", "counter",
+    "Requests handed to a worker pool.");
+  render(&r, "shttpd_gateway_requests_total %lu\n", total.gateway_requests);
+  render_header(&r, "shttpd_gateway_queued_total", "counter",
+    "Requests that waited for a free worker.");
+  render(&r, "shttpd_gateway_queued_total %lu\n", total.gateway_queued);
+  render_header(&r, "shttpd_gateway_timeouts_total", "counter",
+    "Requests that timed out waiting for a worker or its response.");
+  render(&r, "shttpd_gateway_timeouts_total %lu\n", total.gateway_timeouts);
+  render_header(&r, "shttpd_gateway_crashes_total", "counter",
+    "Workers that exited, broke the protocol or hung, and were started again.");
+  render(&r, "shttpd_gateway_crashes_total %lu\n", total.gateway_crashes);
+  render_header(&r, "shttpd_active_connections", "gauge", "Currently open client connections.");
+  render(&r, "shttpd_active_connections %ld\n", (int64_t) total.active_connections);
+  render_header(&r, "shttpd_cache_hits_total", "counter", "Requests answered from a cache.");
+  render(&r, "shttpd_cache_hits_total %lu\n", total.cache_hits);
+  render_header(&r, "shttpd_negative_cache_hits_total", "counter",
+    "Requests for missing files answered from the negative lookup cache.");
+  render(&r, "shttpd_negative_cache_hits_total %lu\n", total.negative_hits);
+  render_header(&r, "shttpd_archive_hits_total", "counter",
+    "Requests answered from the archive.");
+  render(&r, "shttpd_archive_hits_total %lu\n", total.archive_hits);
+  render_header(&r, "shttpd_file_ops_offloaded_total", "counter",
+    "Files opened or read in by the file operations pool.");
+  render(&r, "shttpd_file_ops_offloaded_total %lu\n", total.file_ops_offloaded);
+  render_header(&r, "shttpd_page_cache_lookups_total", "counter",
+    "Files whose first page was looked up in the page cache.");
+  render(&r, "shttpd_page_cache_lookups_total %lu\n", total.page_cache_lookups);
+  render_header(&r, "shttpd_page_cache_misses_total", "counter",
+    "Files whose first page was not in the page cache.");
+  render(&r, "shttpd_page_cache_misses_total %lu\n", total.page_cache_misses);
+  render_header(&r, "shttpd_page_cache_streamed_bytes_total", "counter",
+    "Bytes of streamed files sent through the page cache.");
+  render(&r, "shttpd_page_cache_streamed_bytes_total %lu\n",
+    total.page_cache_streamed_bytes);
+  render_header(&r, "shttpd_page_cache_dropped_bytes_total", "counter",
+    "Bytes of streamed files dropped from the page cache once sent.");
+  render(&r, "shttpd_page_cache_dropped_bytes_total %lu\n",
+    total.page_cache_dropped_bytes);
+  render_header(&r, "shttpd_direct_io_bytes_total", "counter",
+    "Bytes read with O_DIRECT, bypassing the page cache.");
+  render(&r, "shttpd_direct_io_bytes_total %lu\n", total.direct_io_bytes);
+  render_header(&r, "shttpd_active_transfers", "gauge",
+    "Responses not fully sent yet.");
+  render(&r, "shttpd_active_transfers %ld\n", (int64_t) total.active_transfers);
+  render_header(&r, "shttpd_queued_bytes", "gauge",
+    "Bytes of responses waiting to be sent.");
+  render(&r, "shttpd_queued_bytes %ld\n", (int64_t) total.queued_bytes);
+  render_header(&r, "shttpd_log_dropped_total", "counter",
+    "Log records dropped because a log ring was full.");
+  render(&r, "shttpd_log_dropped_total %lu\n", log_dropped());
+
+  // Export one cumulative bucket per power of two between 1us and 17s, the
+  // full resolution is used for the quantiles below
+  uint64_t count = 0;
+  for (uint16_t i = 0; i < NB_LATENCY_BUCKETS; ++i) count += total.latency[i];
+  render_header(&r, "shttpd_request_duration_seconds", "histogram",
+    "Time spent handling a request.");
+  uint64_t cumulative = 0;
+  uint16_t bucket = 0;
+  for (uint8_t power = 10; power <= 34; ++power) {
+    uint64_t bound = (1ULL << power) - 1;
+    while (bucket < NB_LATENCY_BUCKETS && latency_bucket_upper_bound(bucket) <= bound)
+      cumulative += total.latency[bucket++];
+    render(&r, "shttpd_request_duration_seconds_bucket{le=\"%.9f\"} %lu\n",
+      (bound + 1) / 1e9, cumulative);
+  }
+  render(&r, "shttpd_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+  render(&r, "shttpd_request_duration_seconds_sum %.9f\n", total.latency_sum_ns / 1e9);
+  render(&r, "shttpd_request_duration_seconds_count %lu\n", count);
+  render_header(&r, "shttpd_request_duration_quantile_seconds", "gauge",
+    "Request duration quantiles since startup.");
+  for (uint8_t i = 0; i < sizeof (g_quantiles) / sizeof (g_quantiles[0]); ++i)
+    render(&r, "shttpd_request_duration_quantile_seconds{quantile=\"%g\"} %.9f\n",
+      g_quantiles[i], quantile(&total, count, g_quantiles[i]));
+  if (r.position < r.size)
+    r.position += perf_render(r.buffer + r.position, r.size - r.position);
+
+  return r.position < r.size ? r.position : r.size - 1;
+}
+
+int8_t is_metrics_request(request_t *request) {
+  return g_metrics_path != NULL && request->path != NULL &&
+    !strcmp(request->path, g_metrics_path);
+}
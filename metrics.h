@@ -0,0 +1,101 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "defines.h"
+
+#define MAX_WORKERS 64
+#define METRICS_BUFFER_SIZE 32768
+
+/**
+ * Latency histogram buckets are log-linear: every power of two is split in
+ * 2^LATENCY_SUB_BUCKET_BITS linear sub-buckets, which bounds the relative
+ * error to 25% over the whole 1ns..2^63ns range.
+ */
+#define LATENCY_SUB_BUCKET_BITS 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define NB_LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/**
+ * Counters of one worker. Only the owning worker writes them, so updates are
+ * plain relaxed load/store pairs without lock prefix. The structure is padded
+ * to a cache line so that workers never share one.
+ */
+typedef struct {
+  uint64_t requests[NB_METHODS];
+  uint64_t responses[NB_STATUS_CODE];
+  uint64_t bytes_sent;
+  uint64_t accepts;
+  uint64_t shed_connections;
+  uint64_t capped_connections;
+  uint64_t timed_out_connections;
+  uint64_t rate_limit_evictions;
+  uint64_t overloads;
+  uint64_t shed_queue_delay;
+  uint64_t shed_in_flight;
+  uint64_t tls_handshakes;
+  uint64_t tls_resumptions;
+  uint64_t ktls_connections;
+  uint64_t h2_connections;
+  uint64_t h2_streams;
+  uint64_t upstream_requests;
+  uint64_t upstream_connections;
+  uint64_t upstream_reuses;
+  uint64_t upstream_errors;
+  uint64_t upstream_bytes;
+  uint64_t proxy_cache_hits;
+  uint64_t proxy_cache_stale_hits;
+  uint64_t proxy_cache_misses;
+  uint64_t proxy_cache_coalesced;
+  uint64_t proxy_cache_disk_hits;
+  uint64_t proxy_cache_stores;
+  uint64_t gateway_requests;
+  uint64_t gateway_queued;
+  uint64_t gateway_timeouts;
+  uint64_t gateway_crashes;
+  uint64_t active_connections;
+  uint64_t cache_hits;
+  uint64_t negative_hits;
+  uint64_t archive_hits;
+  uint64_t file_ops_offloaded;
+  uint64_t page_cache_lookups;
+  uint64_t page_cache_misses;
+  uint64_t page_cache_streamed_bytes;
+  uint64_t page_cache_dropped_bytes;
+  uint64_t direct_io_bytes;
+  uint64_t active_transfers;
+  uint64_t queued_bytes;
+  uint64_t latency_sum_ns;
+  uint64_t latency[NB_LATENCY_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) metrics_t;
+
+extern metrics_t g_metrics[MAX_WORKERS];
+extern __thread metrics_t *t_metrics;
+extern char *g_metrics_path;
+
+// Single writer update, readers may see a stale but never a torn value
+#define METRIC_ADD(field, value) \
+  __atomic_store_n(&t_metrics->field, \
+    __atomic_load_n(&t_metrics->field, __ATOMIC_RELAXED) + (value), \
+    __ATOMIC_RELAXED)
+#define METRIC_INC(field) METRIC_ADD(field, 1)
+#define METRIC_DEC(field) METRIC_ADD(field, -1)
+
+static inline uint16_t latency_bucket(uint64_t ns) {
+  if (ns < LATENCY_SUB_BUCKETS) return ns;
+  uint8_t msb = 63 - __builtin_clzll(ns);
+  uint8_t shift = msb - LATENCY_SUB_BUCKET_BITS;
+  return (shift + 1) * LATENCY_SUB_BUCKETS +
+    ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+uint64_t latency_bucket_upper_bound(uint16_t bucket);
+metrics_t *metrics_register_worker();
+void metrics_record_request(request_t *request);
+void metrics_aggregate(metrics_t *total);
+size_t metrics_render(char *buffer, size_t size);
+int8_t is_metrics_request(request_t *request);
+
+#endif // __METRICS_H__
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include "defines.h"
+#include "negcache.h"
+#include "resolve.h"
+
+/**
+ * Entries are only valid as long as nothing is created in the docroot, so
+ * every directory of it is watched with inotify. A file or directory created
+ * or moved in invalidates its path and every path below it. The directories
+ * reached through symbolic links are not watched. The directories moved out
+ * or removed are dropped from the cache of resolve.c.
+ */
+
+uint8_t g_negcache_enabled = 0;
+
+static negcache_entry_t g_table[NEGCACHE_SETS][NEGCACHE_WAYS];
+static uint8_t g_next_way[NEGCACHE_SETS];
+static uint8_t g_bloom[NEGCACHE_BLOOM_BITS / 8];
+// Inserted since the Bloom filter was last rebuilt
+static uint32_t g_bloom_inserts = 0;
+
+static int g_inotify_fd = -1;
+// Path of the directory of each watch descriptor, relative to the docroot
+static char **g_watches = NULL;
+static int g_nb_watches = 0;
+
+static uint64_t hash(const char *path) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (*path) {
+    h ^= (uint8_t) *path++;
+    h *= 0x100000001b3ULL;
+  }
+  // 0 marks the empty entries
+  return h ? h : 1;
+}
+
+// Bit i of the filter for a hash, by double hashing
+static uint32_t bloom_bit(uint64_t h, uint8_t i) {
+  return (uint32_t) ((h + i * ((h >> 32) | 1)) % NEGCACHE_BLOOM_BITS);
+}
+
+static void bloom_add(uint64_t h) {
+  for (uint8_t i = 0; i < NEGCACHE_BLOOM_HASHES; ++i) {
+    uint32_t bit = bloom_bit(h, i);
+    g_bloom[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+static uint8_t bloom_test(uint64_t h) {
+  for (uint8_t i = 0; i < NEGCACHE_BLOOM_HASHES; ++i) {
+    uint32_t bit = bloom_bit(h, i);
+    if (!(g_bloom[bit / 8] & (1 << (bit % 8)))) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Bits cannot be removed from the filter, so the evicted and invalidated
+ * entries are dropped from it once in a while.
+ */
+static void bloom_rebuild() {
+  memset(g_bloom, 0, sizeof (g_bloom));
+  for (uint32_t s = 0; s < NEGCACHE_SETS; ++s)
+    for (uint8_t w = 0; w < NEGCACHE_WAYS; ++w)
+      if (g_table[s][w].hash) bloom_add(g_table[s][w].hash);
+  g_bloom_inserts = 0;
+}
+
+static void flush() {
+  memset(g_table, 0, sizeof (g_table));
+  memset(g_bloom, 0, sizeof (g_bloom));
+  g_bloom_inserts = 0;
+}
+
+static negcache_entry_t *find(const char *path, uint64_t h) {
+  negcache_entry_t *set = g_table[h % NEGCACHE_SETS];
+  for (uint8_t w = 0; w < NEGCACHE_WAYS; ++w)
+    if (set[w].hash == h && !strcmp(set[w].path, path)) return &set[w];
+  return NULL;
+}
+
+/**
+ * Returns 1 if the path is known not to exist.
+ */
+int8_t negcache_lookup(const char *path) {
+  if (!g_negcache_enabled) return 0;
+  uint64_t h = hash(path);
+  if (!bloom_test(h)) return 0;
+  return find(path, h) != NULL;
+}
+
+void negcache_insert(const char *path) {
+  if (!g_negcache_enabled || strlen(path) >= NEGCACHE_MAX_PATH) return;
+  uint64_t h = hash(path);
+  if (find(path, h) != NULL) return;
+  uint32_t s = h % NEGCACHE_SETS;
+  negcache_entry_t *entry = &g_table[s][g_next_way[s]];
+  g_next_way[s] = (g_next_way[s] + 1) % NEGCACHE_WAYS;
+  entry->hash = h;
+  strcpy(entry->path, path);
+  bloom_add(h);
+  if (++g_bloom_inserts > 2 * NEGCACHE_SETS * NEGCACHE_WAYS) bloom_rebuild();
+}
+
+/**
+ * Forget the path and everything below it.
+ */
+void negcache_invalidate(const char *path) {
+  size_t len = strlen(path);
+  for (uint32_t s = 0; s < NEGCACHE_SETS; ++s) {
+    for (uint8_t w = 0; w < NEGCACHE_WAYS; ++w) {
+      negcache_entry_t *entry = &g_table[s][w];
+      if (entry->hash && !strncmp(entry->path, path, len) &&
+        (entry->path[len] == '\0' || entry->path[len] == '/' || len == 0))
+        entry->hash = 0;
+    }
+  }
+}
+
+/**
+ * Watch a directory and the ones below it. A directory watched again, after
+ * a move, gets its path updated.
+ */
+static int8_t watch_tree(const char *dir) {
+  int wd = inotify_add_watch(g_inotify_fd, dir[0] ? dir : ".",
+    IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR |
+    IN_DONT_FOLLOW);
+  if (wd < 0) {
+    // Removed in the meantime
+    if (errno == ENOENT || errno == ENOTDIR) return 0;
+    LOG_WARNING("cannot watch %s: %s\n", dir[0] ? dir : ".", strerror(errno));
+    return ERROR;
+  }
+  if (wd >= g_nb_watches) {
+    char **watches = realloc(g_watches, (wd + 1) * sizeof (char *));
+    if (watches == NULL) {
+      perror("realloc");
+      return ERROR;
+    }
+    memset(&watches[g_nb_watches], 0, (wd + 1 - g_nb_watches) * sizeof (char *));
+    g_watches = watches;
+    g_nb_watches = wd + 1;
+  }
+  free(g_watches[wd]);
+  if ((g_watches[wd] = strdup(dir)) == NULL) {
+    perror("strdup");
+    return ERROR;
+  }
+  DIR *d = opendir(dir[0] ? dir : ".");
+  if (d == NULL) return 0;
+  struct dirent *entry;
+  int8_t ret = 0;
+  while (ret == 0 && (entry = readdir(d)) != NULL) {
+    if (entry->d_type != DT_DIR || !strcmp(entry->d_name, ".") ||
+      !strcmp(entry->d_name, "..")) continue;
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s%s%s", dir, dir[0] ? "/" : "", entry->d_name);
+    ret = watch_tree(path);
+  }
+  closedir(d);
+  return ret;
+}
+
+static void disable() {
+  g_negcache_enabled = 0;
+  flush();
+  resolve_forget("");
+  if (g_inotify_fd >= 0) close(g_inotify_fd);
+  g_inotify_fd = -1;
+  LOG_WARNING("negative lookup cache disabled%s\n", "");
+}
+
+/**
+ * The docroot is the working directory, the paths of the requests are
+ * relative to it.
+ */
+int8_t negcache_enable() {
+  if ((g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    perror("inotify_init1");
+    return ERROR;
+  }
+  if (watch_tree("") < 0) {
+    disable();
+    return ERROR;
+  }
+  g_negcache_enabled = 1;
+  return 0;
+}
+
+/**
+ * Called by the event loop before serving, applies the changes made to the
+ * docroot since the previous call.
+ */
+void negcache_tick() {
+  if (!g_negcache_enabled) return;
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(g_inotify_fd, buffer, sizeof (buffer))) > 0) {
+    for (char *p = buffer; p < buffer + len;) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      p += sizeof (struct inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        // Changes were lost, start over
+        flush();
+        resolve_forget("");
+        if (watch_tree("") < 0) {
+          disable();
+          return;
+        }
+        continue;
+      }
+      if (event->wd < 0 || event->wd >= g_nb_watches || g_watches[event->wd] == NULL)
+        continue;
+      if (event->mask & IN_IGNORED) {
+        free(g_watches[event->wd]);
+        g_watches[event->wd] = NULL;
+        continue;
+      }
+      char path[PATH_MAX];
+      const char *dir = g_watches[event->wd];
+      snprintf(path, PATH_MAX, "%s%s%s", dir, dir[0] ? "/" : "", event->name);
+      if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+        if (event->mask & IN_ISDIR) resolve_forget(path);
+        continue;
+      }
+      negcache_invalidate(path);
+      if ((event->mask & IN_ISDIR) && watch_tree(path) < 0) {
+        disable();
+        return;
+      }
+    }
+  }
+}
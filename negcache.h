@@ -0,0 +1,30 @@
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+#include <stdint.h>
+
+/**
+ * Paths known not to exist. The table is 4-way set associative, the oldest
+ * entry of a set is replaced. A Bloom filter in front of it answers for the
+ * paths that were never missed without touching the table.
+ */
+#define NEGCACHE_SETS 1024
+#define NEGCACHE_WAYS 4
+#define NEGCACHE_MAX_PATH 128
+#define NEGCACHE_BLOOM_BITS (1 << 19)
+#define NEGCACHE_BLOOM_HASHES 4
+
+typedef struct {
+  uint64_t hash;
+  char path[NEGCACHE_MAX_PATH];
+} negcache_entry_t;
+
+extern uint8_t g_negcache_enabled;
+
+int8_t negcache_enable();
+int8_t negcache_lookup(const char *path);
+void negcache_insert(const char *path);
+void negcache_invalidate(const char *path);
+void negcache_tick();
+
+#endif // __NEGCACHE_H__
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defines.h"
+#include "pack.h"
+
+/**
+ * The archive is mapped once; looking an entry up costs a hash and a probe,
+ * without any syscall. Responses are sent with sendfile from a duplicate of
+ * the descriptor of the archive, so that a reload (SIGHUP, after the archive
+ * was replaced with rename) never pulls the file from under a transfer.
+ */
+
+// Set from the SIGHUP handler, the archive is reloaded by the next tick
+volatile sig_atomic_t g_pack_reload = 0;
+
+static char *g_pack_path = NULL;
+static int g_pack_fd = -1;
+static const char *g_pack = NULL;
+static size_t g_pack_size = 0;
+static const uint32_t *g_buckets = NULL;
+static const pack_entry_t *g_entries = NULL;
+static uint32_t g_nb_buckets = 0;
+static uint32_t g_nb_entries = 0;
+
+static uint8_t in_bounds(uint64_t offset, uint64_t len, size_t size) {
+  return offset <= size && len <= size - offset;
+}
+
+/**
+ * Check that everything the entries point to is within the archive.
+ */
+static int8_t validate(const char *pack, size_t size) {
+  if (size < sizeof (pack_header_t)) return ERROR;
+  const pack_header_t *header = (const pack_header_t *) pack;
+  if (memcmp(header->magic, PACK_MAGIC, sizeof (PACK_MAGIC)) ||
+    header->version != PACK_VERSION || header->size != size) return ERROR;
+  if (header->nb_buckets == 0 || (header->nb_buckets & (header->nb_buckets - 1)) ||
+    header->nb_buckets < header->nb_entries) return ERROR;
+  if (!in_bounds(header->buckets_offset, header->nb_buckets * sizeof (uint32_t), size) ||
+    !in_bounds(header->entries_offset, header->nb_entries * sizeof (pack_entry_t), size) ||
+    header->buckets_offset % sizeof (uint32_t) || header->entries_offset % sizeof (uint64_t))
+    return ERROR;
+  const pack_entry_t *entries = (const pack_entry_t *) (pack + header->entries_offset);
+  for (uint32_t i = 0; i < header->nb_entries; ++i) {
+    if (!in_bounds(entries[i].path_offset, entries[i].path_len, size)) return ERROR;
+    for (uint8_t v = 0; v < NB_PACK_VARIANTS; ++v) {
+      const pack_variant_t *variant = &entries[i].variants[v];
+      if (!in_bounds(variant->body_offset, variant->body_len, size) ||
+        !in_bounds(variant->head_offset, variant->head_len, size) ||
+        variant->head_len > PACK_MAX_HEAD) return ERROR;
+    }
+  }
+  const uint32_t *buckets = (const uint32_t *) (pack + header->buckets_offset);
+  for (uint32_t i = 0; i < header->nb_buckets; ++i)
+    if (buckets[i] > header->nb_entries) return ERROR;
+  return 0;
+}
+
+/**
+ * Map the archive at path, replacing the one already mapped if any.
+ */
+int8_t pack_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("cannot open archive %s: %s\n", path, strerror(errno));
+    return ERROR;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    LOG_ERROR("cannot read archive %s\n", path);
+    close(fd);
+    return ERROR;
+  }
+  char *pack = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (pack == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return ERROR;
+  }
+  if (validate(pack, st.st_size) < 0) {
+    LOG_ERROR("%s is not a valid archive\n", path);
+    munmap(pack, st.st_size);
+    close(fd);
+    return ERROR;
+  }
+  if (g_pack != NULL) {
+    munmap((void *) g_pack, g_pack_size);
+    close(g_pack_fd);
+  }
+  const pack_header_t *header = (const pack_header_t *) pack;
+  g_pack_fd = fd;
+  g_pack = pack;
+  g_pack_size = st.st_size;
+  g_buckets = (const uint32_t *) (pack + header->buckets_offset);
+  g_entries = (const pack_entry_t *) (pack + header->entries_offset);
+  g_nb_buckets = header->nb_buckets;
+  g_nb_entries = header->nb_entries;
+  if (g_pack_path != path) {
+    free(g_pack_path);
+    g_pack_path = strdup(path);
+  }
+  LOG_MSG("serving %u files from %s\n", g_nb_entries, path);
+  return 0;
+}
+
+/**
+ * Entry of a normalized path, NULL if it is not in the archive.
+ */
+const pack_entry_t *pack_lookup(const char *path) {
+  if (g_pack == NULL) return NULL;
+  size_t len = strlen(path);
+  uint64_t h = pack_hash(path, len);
+  for (uint32_t i = 0; i < g_nb_buckets; ++i) {
+    uint32_t bucket = g_buckets[(h + i) & (g_nb_buckets - 1)];
+    if (bucket == 0) return NULL;
+    const pack_entry_t *entry = &g_entries[bucket - 1];
+    if (entry->hash == h && entry->path_len == len &&
+      !memcmp(g_pack + entry->path_offset, path, len)) return entry;
+  }
+  return NULL;
+}
+
+const char *pack_data(uint64_t offset) {
+  return g_pack + offset;
+}
+
+int pack_fd() {
+  return g_pack_fd;
+}
+
+/**
+ * Called by the event loop, reloads the archive after a SIGHUP. The archive
+ * in use is kept if the new one is not valid.
+ */
+void pack_tick() {
+  if (!g_pack_reload) return;
+  g_pack_reload = 0;
+  if (g_pack_path != NULL) pack_open(g_pack_path);
+}
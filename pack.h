@@ -0,0 +1,80 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+
+#include "defines.h"
+
+/**
+ * Archive of a docroot built by shttpd-pack and served from memory. All the
+ * offsets are from the start of the file:
+ *
+ *   pack_header_t
+ *   uint32_t buckets[nb_buckets]   open addressing, entry index + 1, 0 empty
+ *   pack_entry_t entries[nb_entries]
+ *   paths and precomputed headers
+ *   bodies
+ *
+ * The precomputed headers of an entry (Content-type, Content-length, ETag,
+ * Last-Modified, Content-Encoding) follow the status line, Server and Date
+ * headers written by the server.
+ */
+#define PACK_MAGIC "SHTPACK"
+#define PACK_VERSION 1
+#define PACK_MAX_HEAD 512
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nb_entries;
+  uint32_t nb_buckets;
+  uint32_t unused;
+  uint64_t buckets_offset;
+  uint64_t entries_offset;
+  uint64_t size;
+} pack_header_t;
+
+typedef struct {
+  uint64_t body_offset;
+  uint64_t body_len;
+  uint64_t head_offset;
+  uint32_t head_len;
+  uint32_t unused;
+} pack_variant_t;
+
+typedef enum {
+  PACK_IDENTITY = 0,
+  PACK_GZIP,
+  NB_PACK_VARIANTS
+} pack_encoding_e;
+
+typedef struct {
+  // FNV-1a of the path
+  uint64_t hash;
+  uint64_t path_offset;
+  uint32_t path_len;
+  uint32_t unused;
+  // A variant with a head_len of 0 is not in the archive
+  pack_variant_t variants[NB_PACK_VARIANTS];
+} pack_entry_t;
+
+extern volatile sig_atomic_t g_pack_reload;
+
+static inline uint64_t pack_hash(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (uint8_t) data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+int8_t pack_open(const char *path);
+const pack_entry_t *pack_lookup(const char *path);
+const char *pack_data(uint64_t offset);
+int pack_fd();
+void pack_tick();
+
+#endif // __PACK_H__
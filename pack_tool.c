@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "mime.h"
+#include "pack.h"
+#include "resolve.h"
+
+/**
+ * shttpd-pack: pack a docroot in an archive served with -A. The archive is
+ * written next to its destination and renamed over it, so that a server
+ * reloading it (SIGHUP) never sees a partial file.
+ */
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t) 7)
+// A gzip variant is only kept if it saves that much
+#define PACK_MIN_GZIP_RATIO 0.9
+
+typedef struct {
+  char *path;
+  char *body[NB_PACK_VARIANTS];
+  size_t body_len[NB_PACK_VARIANTS];
+  char head[NB_PACK_VARIANTS][PACK_MAX_HEAD];
+  size_t head_len[NB_PACK_VARIANTS];
+} file_t;
+
+static file_t *g_files = NULL;
+static uint32_t g_nb_files = 0;
+static uint8_t g_gzip = 0;
+
+static const char *g_compressible[] = {
+  "text/", "application/javascript", "application/json", "application/xml",
+  "image/svg+xml",
+};
+
+static uint8_t compressible(const char *type) {
+  for (uint8_t i = 0; i < sizeof (g_compressible) / sizeof (g_compressible[0]); ++i)
+    if (!strncmp(type, g_compressible[i], strlen(g_compressible[i]))) return 1;
+  return 0;
+}
+
+static char *read_file(int fd, const char *path, size_t *len) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    return NULL;
+  }
+  char *data = malloc(st.st_size ? st.st_size : 1);
+  size_t total = 0;
+  while (data != NULL && total < (size_t) st.st_size) {
+    ssize_t n = read(fd, data + total, st.st_size - total);
+    if (n <= 0) {
+      perror(path);
+      free(data);
+      data = NULL;
+      break;
+    }
+    total += n;
+  }
+  *len = total;
+  return data;
+}
+
+static char *gzip(const char *data, size_t len, size_t *gzlen) {
+  z_stream z;
+  memset(&z, 0, sizeof (z));
+  // 16 + 15 window bits: gzip wrapper
+  if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+  size_t bound = deflateBound(&z, len);
+  char *out = malloc(bound);
+  if (out == NULL) {
+    deflateEnd(&z);
+    return NULL;
+  }
+  z.next_in = (Bytef *) data;
+  z.avail_in = len;
+  z.next_out = (Bytef *) out;
+  z.avail_out = bound;
+  if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&z);
+    free(out);
+    return NULL;
+  }
+  *gzlen = z.total_out;
+  deflateEnd(&z);
+  return out;
+}
+
+/**
+ * Pack the file at path, opened beneath the docroot as the server does: the
+ * symbolic links leading out of it are skipped, like the files which are not
+ * regular.
+ */
+static int8_t add_file(const char *path) {
+  int fd = resolve_open_beneath(path, O_RDONLY | O_NONBLOCK);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    if (fd < 0) {
+      LOG_WARNING("skipping %s: %s\n", path, strerror(errno));
+    } else close(fd);
+    return 0;
+  }
+  time_t mtime = st.st_mtime;
+  file_t *files = realloc(g_files, (g_nb_files + 1) * sizeof (file_t));
+  if (files == NULL) {
+    perror("realloc");
+    close(fd);
+    return ERROR;
+  }
+  g_files = files;
+  file_t *file = &g_files[g_nb_files];
+  memset(file, 0, sizeof (file_t));
+  if ((file->path = strdup(path)) != NULL)
+    file->body[PACK_IDENTITY] = read_file(fd, path, &file->body_len[PACK_IDENTITY]);
+  close(fd);
+  if (file->body[PACK_IDENTITY] == NULL) return ERROR;
+  ++g_nb_files;
+  const char *type = get_mime_type(get_extension(file->path, strlen(file->path)));
+  if (g_gzip && compressible(type) && file->body_len[PACK_IDENTITY] > 0) {
+    size_t gzlen;
+    char *gz = gzip(file->body[PACK_IDENTITY], file->body_len[PACK_IDENTITY], &gzlen);
+    if (gz != NULL && gzlen < file->body_len[PACK_IDENTITY] * PACK_MIN_GZIP_RATIO) {
+      file->body[PACK_GZIP] = gz;
+      file->body_len[PACK_GZIP] = gzlen;
+    } else free(gz);
+  }
+  char modified[64];
+  struct tm tm;
+  strftime(modified, sizeof (modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&mtime, &tm));
+  uint64_t etag = pack_hash(file->body[PACK_IDENTITY], file->body_len[PACK_IDENTITY]);
+  uint8_t has_gzip = file->body[PACK_GZIP] != NULL;
+  for (uint8_t v = 0; v < NB_PACK_VARIANTS; ++v) {
+    if (file->body[v] == NULL) continue;
+    file->head_len[v] = snprintf(file->head[v], PACK_MAX_HEAD,
+      "Content-type: %s\n"
+      "Content-length: %lu\n"
+      "ETag: \"%016lx%s\"\n"
+      "Last-Modified: %s\n"
+      "%s%s",
+      type, file->body_len[v], etag, v == PACK_GZIP ? "-gz" : "", modified,
+      v == PACK_GZIP ? "Content-Encoding: gzip\n" : "",
+      has_gzip ? "Vary: Accept-Encoding\n" : "");
+  }
+  return 0;
+}
+
+static int8_t add_tree(const char *root, const char *dir) {
+  char dirpath[PATH_MAX];
+  snprintf(dirpath, PATH_MAX, "%s%s%s", root, dir[0] ? "/" : "", dir);
+  DIR *d = opendir(dirpath);
+  if (d == NULL) {
+    perror(dirpath);
+    return ERROR;
+  }
+  struct dirent *entry;
+  int8_t ret = 0;
+  while (ret == 0 && (entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' ||
+      (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) continue;
+    char path[PATH_MAX];
+    char fullpath[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s%s%s", dir, dir[0] ? "/" : "", entry->d_name) >= PATH_MAX ||
+      snprintf(fullpath, PATH_MAX, "%s/%s", root, path) >= PATH_MAX) {
+      LOG_ERROR("path too long in %s\n", dirpath);
+      continue;
+    }
+    struct stat st;
+    // Symbolic links to directories are not followed, against loops
+    if (lstat(fullpath, &st) == 0 && S_ISDIR(st.st_mode)) ret = add_tree(root, path);
+    else ret = add_file(path);
+  }
+  closedir(d);
+  return ret;
+}
+
+static int8_t write_all_(FILE *out, const void *data, size_t len) {
+  return fwrite(data, 1, len, out) == len ? 0 : ERROR;
+}
+
+static int8_t pad(FILE *out, uint64_t *position) {
+  static const char zeros[8] = { 0 };
+  uint64_t aligned = ALIGN8(*position);
+  if (write_all_(out, zeros, aligned - *position)) return ERROR;
+  *position = aligned;
+  return 0;
+}
+
+static int8_t write_archive(const char *archive) {
+  pack_header_t header;
+  memset(&header, 0, sizeof (header));
+  memcpy(header.magic, PACK_MAGIC, sizeof (PACK_MAGIC));
+  header.version = PACK_VERSION;
+  header.nb_entries = g_nb_files;
+  header.nb_buckets = 1;
+  while (header.nb_buckets < 2 * g_nb_files) header.nb_buckets <<= 1;
+  header.buckets_offset = ALIGN8(sizeof (header));
+  header.entries_offset = ALIGN8(header.buckets_offset +
+    header.nb_buckets * sizeof (uint32_t));
+  uint32_t *buckets = calloc(header.nb_buckets, sizeof (uint32_t));
+  pack_entry_t *entries = calloc(g_nb_files ? g_nb_files : 1, sizeof (pack_entry_t));
+  if (buckets == NULL || entries == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  // Paths and headers, then bodies
+  uint64_t position = header.entries_offset + g_nb_files * sizeof (pack_entry_t);
+  for (uint32_t i = 0; i < g_nb_files; ++i) {
+    entries[i].path_len = strlen(g_files[i].path);
+    entries[i].hash = pack_hash(g_files[i].path, entries[i].path_len);
+    entries[i].path_offset = position;
+    position += entries[i].path_len;
+    for (uint8_t v = 0; v < NB_PACK_VARIANTS; ++v) {
+      entries[i].variants[v].head_offset = position;
+      entries[i].variants[v].head_len = g_files[i].head_len[v];
+      position += g_files[i].head_len[v];
+    }
+    uint32_t b = entries[i].hash & (header.nb_buckets - 1);
+    while (buckets[b] != 0) b = (b + 1) & (header.nb_buckets - 1);
+    buckets[b] = i + 1;
+  }
+  position = ALIGN8(position);
+  for (uint32_t i = 0; i < g_nb_files; ++i) {
+    for (uint8_t v = 0; v < NB_PACK_VARIANTS; ++v) {
+      if (g_files[i].body[v] == NULL) continue;
+      entries[i].variants[v].body_offset = position;
+      entries[i].variants[v].body_len = g_files[i].body_len[v];
+      position = ALIGN8(position + g_files[i].body_len[v]);
+    }
+  }
+  header.size = position;
+
+  char tmp[PATH_MAX];
+  snprintf(tmp, PATH_MAX, "%s.tmp", archive);
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    perror(tmp);
+    return ERROR;
+  }
+  int8_t ret = 0;
+  position = sizeof (header);
+  ret |= write_all_(out, &header, sizeof (header));
+  ret |= pad(out, &position);
+  ret |= write_all_(out, buckets, header.nb_buckets * sizeof (uint32_t));
+  position += header.nb_buckets * sizeof (uint32_t);
+  ret |= pad(out, &position);
+  ret |= write_all_(out, entries, g_nb_files * sizeof (pack_entry_t));
+  position += g_nb_files * sizeof (pack_entry_t);
+  for (uint32_t i = 0; i < g_nb_files; ++i) {
+    ret |= write_all_(out, g_files[i].path, entries[i].path_len);
+    position += entries[i].path_len;
+    for (uint8_t v = 0; v < NB_PACK_VARIANTS; ++v) {
+      ret |= write_all_(out, g_files[i].head[v], g_files[i].head_len[v]);
+      position += g_files[i].head_len[v];
+    }
+  }
+  ret |= pad(out, &position);
+  for (uint32_t i = 0; i < g_nb_files; ++i) {
+    for (uint8_t v = 0; v < NB_PACK_VARIANTS; ++v) {
+      if (g_files[i].body[v] == NULL) continue;
+      ret |= write_all_(out, g_files[i].body[v], g_files[i].body_len[v]);
+      position += g_files[i].body_len[v];
+      ret |= pad(out, &position);
+    }
+  }
+  if (fflush(out) || fsync(fileno(out))) ret = ERROR;
+  if (fclose(out)) ret = ERROR;
+  free(buckets);
+  free(entries);
+  if (ret == 0 && rename(tmp, archive) < 0) {
+    perror("rename");
+    ret = ERROR;
+  }
+  if (ret != 0) {
+    unlink(tmp);
+    LOG_ERROR("cannot write %s\n", archive);
+  }
+  return ret;
+}
+
+void usage(char **argv) {
+  fprintf(stderr, "usage: %s [-z] docroot archive\n", argv[0]);
+  fprintf(stderr, "  -z  add gzip variants of the compressible files\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "z")) != -1) {
+    switch (opt) {
+    case 'z':
+      g_gzip = 1;
+      break;
+    default:
+      usage(argv);
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv);
+    return 1;
+  }
+  if (resolve_init(argv[optind]) < 0 || add_tree(argv[optind], "") < 0) return 1;
+  if (write_archive(argv[optind + 1]) < 0) return 1;
+  uint32_t nb_gzip = 0;
+  for (uint32_t i = 0; i < g_nb_files; ++i) nb_gzip += g_files[i].body[PACK_GZIP] != NULL;
+  printf("%u files packed in %s, %u with a gzip variant\n", g_nb_files,
+    argv[optind + 1], nb_gzip);
+  return 0;
+}
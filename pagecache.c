@@ -0,0 +1,87 @@
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "defines.h"
+#include "metrics.h"
+#include "pagecache.h"
+
+/**
+ * A few huge files sent once would evict the small ones that make most of
+ * the requests. Files are given a policy when opened: the normal ones are
+ * read in ahead, the ones above the stream size (or under a stream prefix)
+ * are dropped from the page cache as they are sent, and the ones above the
+ * direct size, if set, are read with O_DIRECT in an aligned buffer (see
+ * sched.c) and never enter it.
+ */
+
+uint64_t g_pagecache_stream_size = PAGECACHE_DEFAULT_STREAM_SIZE;
+// 0 for no O_DIRECT
+uint64_t g_pagecache_direct_size = 0;
+
+static const char *g_prefixes[PAGECACHE_MAX_PREFIXES];
+static uint8_t g_nb_prefixes = 0;
+
+/**
+ * Stream the files under prefix whatever their size.
+ */
+int8_t pagecache_stream_prefix(const char *prefix) {
+  if (g_nb_prefixes >= PAGECACHE_MAX_PREFIXES) return ERROR;
+  // Paths are relative to the docroot
+  g_prefixes[g_nb_prefixes++] = prefix[0] == '/' ? &prefix[1] : prefix;
+  return 0;
+}
+
+static pagecache_policy_e policy(const char *path, size_t size) {
+  if (g_pagecache_direct_size && size >= g_pagecache_direct_size) return PAGECACHE_DIRECT;
+  if (size >= g_pagecache_stream_size) return PAGECACHE_STREAM;
+  for (uint8_t i = 0; i < g_nb_prefixes; ++i)
+    if (!strncmp(path, g_prefixes[i], strlen(g_prefixes[i]))) return PAGECACHE_STREAM;
+  return PAGECACHE_NORMAL;
+}
+
+/**
+ * Give the kernel the hints of the policy of a file about to be sent, and
+ * return it.
+ */
+pagecache_policy_e pagecache_advise(const char *path, int fd, size_t size) {
+  pagecache_policy_e p = policy(path, size);
+  if (p == PAGECACHE_DIRECT) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0) return p;
+    // Not supported by every file system (tmpfs)
+    LOG_DEBUG("no O_DIRECT for %s, streaming it\n", path);
+    p = PAGECACHE_STREAM;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (p == PAGECACHE_NORMAL && size <= PAGECACHE_WILLNEED_SIZE)
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+  if (p == PAGECACHE_STREAM) posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+  return p;
+}
+
+/**
+ * Called after len bytes of the file were sent through the page cache.
+ */
+void pagecache_sent(transfer_t *transfer, size_t len) {
+  if (transfer->policy != PAGECACHE_STREAM) return;
+  METRIC_ADD(page_cache_streamed_bytes, len);
+  pagecache_drop(transfer, 0);
+}
+
+/**
+ * Drop what was sent of a streamed file from the page cache, by windows
+ * unless all is set.
+ */
+void pagecache_drop(transfer_t *transfer, uint8_t all) {
+  if (transfer->policy != PAGECACHE_STREAM || transfer->filefd < 0) return;
+  off_t len = transfer->offset - transfer->dropped;
+  if (len <= 0 || (!all && len < PAGECACHE_DROP_WINDOW)) return;
+  posix_fadvise(transfer->filefd, transfer->dropped, len, POSIX_FADV_DONTNEED);
+  METRIC_ADD(page_cache_dropped_bytes, len);
+  transfer->dropped = transfer->offset;
+}
@@ -0,0 +1,36 @@
+#ifndef __PAGECACHE_H__
+#define __PAGECACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "defines.h"
+
+/**
+ * How a file uses the page cache. Streamed files are dropped from it behind
+ * the transfer, direct ones do not go through it (O_DIRECT).
+ */
+typedef enum {
+  PAGECACHE_NORMAL = 0,
+  PAGECACHE_STREAM,
+  PAGECACHE_DIRECT,
+} pagecache_policy_e;
+
+#define PAGECACHE_DEFAULT_STREAM_SIZE (64 * 1024 * 1024)
+// Files up to that size are read in ahead of the transfer
+#define PAGECACHE_WILLNEED_SIZE (2 * 1024 * 1024)
+// Streamed files are dropped from the cache by windows of that size
+#define PAGECACHE_DROP_WINDOW (4 * 1024 * 1024)
+#define PAGECACHE_DIRECT_CHUNK (256 * 1024)
+#define PAGECACHE_ALIGN 4096
+#define PAGECACHE_MAX_PREFIXES 16
+
+extern uint64_t g_pagecache_stream_size;
+extern uint64_t g_pagecache_direct_size;
+
+int8_t pagecache_stream_prefix(const char *prefix);
+pagecache_policy_e pagecache_advise(const char *path, int fd, size_t size);
+void pagecache_sent(transfer_t *transfer, size_t len);
+void pagecache_drop(transfer_t *transfer, uint8_t all);
+
+#endif // __PAGECACHE_H__
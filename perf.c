@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "defines.h"
+#include "perf.h"
+
+/**
+ * Hardware counters of every thread serving requests are opened as one
+ * perf event group, so that a single read() returns all of them. The
+ * counters are read at the boundaries of the phases of a request and the
+ * differences summed per class of request.
+ */
+
+uint8_t g_perf_enabled = 0;
+// Set from the SIGUSR1 handler, the totals are logged by the next tick
+volatile sig_atomic_t g_perf_dump = 0;
+
+static perf_thread_t *g_perf_threads[PERF_MAX_THREADS];
+static uint32_t g_nb_perf_threads = 0;
+static pthread_mutex_t g_perf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread perf_thread_t *t_perf = NULL;
+
+static const uint64_t g_perf_configs[NB_PERF_COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES,
+};
+static const char g_perf_counter_names[NB_PERF_COUNTERS][16] = {
+  "cycles", "instructions", "cache_misses", "branch_misses",
+};
+static const char g_perf_phase_names[NB_PERF_PHASES][16] = {
+  "parse", "mime", "response",
+};
+static const char g_perf_class_names[NB_PERF_CLASSES][16] = {
+  "cache_hit", "not_found", "error", "small", "medium", "large",
+};
+
+static int open_counter(uint64_t config, int group_fd, uint8_t exclude_kernel) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  attr.disabled = group_fd < 0;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Open the counters of the calling thread. The time spent in the kernel by
+ * sendfile is part of the response path, so it is counted when allowed.
+ */
+static int open_group() {
+  uint8_t exclude_kernel = 0;
+  int leader = open_counter(g_perf_configs[0], -1, exclude_kernel);
+  if (leader < 0 && (errno == EACCES || errno == EPERM)) {
+    exclude_kernel = 1;
+    leader = open_counter(g_perf_configs[0], -1, exclude_kernel);
+  }
+  if (leader < 0) return ERROR;
+  // The other counters of the group, kept open as long as the leader
+  int fds[NB_PERF_COUNTERS];
+  for (uint8_t i = 1; i < NB_PERF_COUNTERS; ++i) {
+    if ((fds[i] = open_counter(g_perf_configs[i], leader, exclude_kernel)) < 0) {
+      int error = errno;
+      while (--i > 0) close(fds[i]);
+      close(leader);
+      errno = error;
+      return ERROR;
+    }
+  }
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return leader;
+}
+
+static perf_thread_t *register_thread() {
+  perf_thread_t *thread = calloc(1, sizeof (perf_thread_t));
+  if (thread == NULL) return NULL;
+  if ((thread->fd = open_group()) < 0) {
+    LOG_WARNING("cannot open hardware counters: %s\n", strerror(errno));
+  }
+  pthread_mutex_lock(&g_perf_mutex);
+  if (g_nb_perf_threads < PERF_MAX_THREADS)
+    g_perf_threads[g_nb_perf_threads++] = thread;
+  pthread_mutex_unlock(&g_perf_mutex);
+  return thread;
+}
+
+int8_t perf_enable() {
+  if ((t_perf = register_thread()) == NULL || t_perf->fd < 0) {
+    LOG_WARNING("%s\n", "hardware counters profiling disabled");
+    return ERROR;
+  }
+  g_perf_enabled = 1;
+  return 0;
+}
+
+void perf_phase(request_t *request, perf_phase_e phase, uint8_t end) {
+  if (t_perf == NULL && (t_perf = register_thread()) == NULL) return;
+  if (t_perf->fd < 0) return;
+  // { nr, values[nr] } with PERF_FORMAT_GROUP
+  uint64_t values[NB_PERF_COUNTERS + 1];
+  // The phase is left out when either end could not be read
+  uint8_t read_ok = read(t_perf->fd, values, sizeof (values)) == sizeof (values);
+  if (!end) {
+    t_perf->started[phase] = read_ok;
+    for (uint8_t i = 0; read_ok && i < NB_PERF_COUNTERS; ++i)
+      t_perf->start[phase][i] = values[i + 1];
+    return;
+  }
+  uint8_t started = t_perf->started[phase];
+  t_perf->started[phase] = 0;
+  if (!started || !read_ok) return;
+  for (uint8_t i = 0; i < NB_PERF_COUNTERS; ++i)
+    request->perf[phase][i] += values[i + 1] - t_perf->start[phase][i];
+}
+
+static perf_class_e classify(request_t *request) {
+  if (request->cache_hit) return E_CLASS_CACHE_HIT;
+  if (request->status == _404) return E_CLASS_NOT_FOUND;
+  if (g_status_code[request->status].code >= 400) return E_CLASS_ERROR;
+  if (request->bytes_sent < PERF_SMALL_RESPONSE) return E_CLASS_SMALL;
+  if (request->bytes_sent < PERF_LARGE_RESPONSE) return E_CLASS_MEDIUM;
+  return E_CLASS_LARGE;
+}
+
+void perf_end_request(request_t *request) {
+  if (!g_perf_enabled || t_perf == NULL) return;
+  perf_class_t *class = &t_perf->classes[classify(request)];
+  __atomic_store_n(&class->requests, class->requests + 1, __ATOMIC_RELAXED);
+  for (uint8_t p = 0; p < NB_PERF_PHASES; ++p)
+    for (uint8_t i = 0; i < NB_PERF_COUNTERS; ++i)
+      __atomic_store_n(&class->counters[p][i],
+        class->counters[p][i] + request->perf[p][i], __ATOMIC_RELAXED);
+}
+
+static void aggregate(perf_class_t *classes) {
+  memset(classes, 0, sizeof (perf_class_t) * NB_PERF_CLASSES);
+  pthread_mutex_lock(&g_perf_mutex);
+  for (uint32_t t = 0; t < g_nb_perf_threads; ++t) {
+    for (uint8_t c = 0; c < NB_PERF_CLASSES; ++c) {
+      perf_class_t *class = &g_perf_threads[t]->classes[c];
+      classes[c].requests += __atomic_load_n(&class->requests, __ATOMIC_RELAXED);
+      for (uint8_t p = 0; p < NB_PERF_PHASES; ++p)
+        for (uint8_t i = 0; i < NB_PERF_COUNTERS; ++i)
+          classes[c].counters[p][i] +=
+            __atomic_load_n(&class->counters[p][i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&g_perf_mutex);
+}
+
+/**
+ * Render the totals in the Prometheus text format, appended to the metrics.
+ */
+size_t perf_render(char *buffer, size_t size) {
+  if (!g_perf_enabled) return 0;
+  perf_class_t classes[NB_PERF_CLASSES];
+  aggregate(classes);
+  size_t position = snprintf(buffer, size,
+    "# HELP shttpd_perf_requests_total Requests profiled, by class.\n"
+    "# TYPE shttpd_perf_requests_total counter\n");
+  for (uint8_t c = 0; c < NB_PERF_CLASSES && position < size; ++c)
+    position += snprintf(buffer + position, size - position,
+      "shttpd_perf_requests_total{class=\"%s\"} %lu\n",
+      g_perf_class_names[c], classes[c].requests);
+  for (uint8_t i = 0; i < NB_PERF_COUNTERS && position < size; ++i) {
+    position += snprintf(buffer + position, size - position,
+      "# HELP shttpd_perf_%s_total Hardware %s, by request class and phase.\n"
+      "# TYPE shttpd_perf_%s_total counter\n", g_perf_counter_names[i],
+      g_perf_counter_names[i], g_perf_counter_names[i]);
+    for (uint8_t c = 0; c < NB_PERF_CLASSES && position < size; ++c)
+      for (uint8_t p = 0; p < NB_PERF_PHASES && position < size; ++p)
+        position += snprintf(buffer + position, size - position,
+          "shttpd_perf_%s_total{class=\"%s\",phase=\"%s\"} %lu\n",
+          g_perf_counter_names[i], g_perf_class_names[c], g_perf_phase_names[p],
+          classes[c].counters[p][i]);
+  }
+  return position < size ? position : size - 1;
+}
+
+/**
+ * Called by the event loop, logs per request averages after a SIGUSR1.
+ */
+void perf_tick() {
+  if (!g_perf_dump) return;
+  g_perf_dump = 0;
+  if (!g_perf_enabled) return;
+  perf_class_t classes[NB_PERF_CLASSES];
+  aggregate(classes);
+  LOG_MSG("%-10s %-9s %10s %12s %6s %12s %13s\n", "class", "phase", "requests",
+    "cycles/req", "IPC", "cmisses/req", "bmisses/req");
+  for (uint8_t c = 0; c < NB_PERF_CLASSES; ++c) {
+    if (classes[c].requests == 0) continue;
+    for (uint8_t p = 0; p < NB_PERF_PHASES; ++p) {
+      uint64_t *counters = classes[c].counters[p];
+      double n = classes[c].requests;
+      LOG_MSG("%-10s %-9s %10lu %12.0f %6.2f %12.1f %13.1f\n",
+        g_perf_class_names[c], g_perf_phase_names[p], classes[c].requests,
+        counters[E_PERF_CYCLES] / n,
+        counters[E_PERF_CYCLES] ?
+          (double) counters[E_PERF_INSTRUCTIONS] / counters[E_PERF_CYCLES] : 0,
+        counters[E_PERF_CACHE_MISSES] / n, counters[E_PERF_BRANCH_MISSES] / n);
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+
+#include "defines.h"
+
+// Responses up to that size are small, from that size on they are large
+#define PERF_SMALL_RESPONSE 65536
+#define PERF_LARGE_RESPONSE 1048576
+#define PERF_MAX_THREADS 64
+
+typedef enum {
+  E_PERF_CYCLES = 0,
+  E_PERF_INSTRUCTIONS,
+  E_PERF_CACHE_MISSES,
+  E_PERF_BRANCH_MISSES,
+} perf_counter_e;
+
+typedef enum {
+  E_CLASS_CACHE_HIT = 0,
+  E_CLASS_NOT_FOUND,
+  E_CLASS_ERROR,
+  E_CLASS_SMALL,
+  E_CLASS_MEDIUM,
+  E_CLASS_LARGE,
+  NB_PERF_CLASSES
+} perf_class_e;
+
+typedef struct {
+  uint64_t requests;
+  uint64_t counters[NB_PERF_PHASES][NB_PERF_COUNTERS];
+} perf_class_t;
+
+typedef struct {
+  int fd;
+  // Values at the start of the phases in progress, which are not nested
+  uint64_t start[NB_PERF_PHASES][NB_PERF_COUNTERS];
+  uint8_t started[NB_PERF_PHASES];
+  perf_class_t classes[NB_PERF_CLASSES];
+} perf_thread_t;
+
+extern uint8_t g_perf_enabled;
+extern volatile sig_atomic_t g_perf_dump;
+
+// Count the hardware events of a phase of the request, free when disabled
+#define PERF_BEGIN(request, phase) \
+  { if (g_perf_enabled) perf_phase(request, phase, 0); }
+#define PERF_END(request, phase) \
+  { if (g_perf_enabled) perf_phase(request, phase, 1); }
+
+int8_t perf_enable();
+void perf_phase(request_t *request, perf_phase_e phase, uint8_t end);
+void perf_end_request(request_t *request);
+size_t perf_render(char *buffer, size_t size);
+void perf_tick();
+
+#endif // __PERF_H__
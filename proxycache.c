@@ -0,0 +1,597 @@
+// strptime and timegm
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "pagecache.h"
+#include "sched.h"
+#include "proxycache.h"
+
+/**
+ * Entries are found through a hash table of chains, whether they are in
+ * memory or on disk only. The memory they take, heads and bodies, is kept
+ * under the capacity by moving the least recently used ones to the store.
+ *
+ * The store is a log: records are appended at its head, and when they reach
+ * the end of the file the head goes back to the start, the oldest records
+ * in its way being dropped from the index. The superblock in front of them
+ * tells where the records are; it is marked clean when the process stops,
+ * and a store that was not is started over rather than trusted. It is
+ * locked, and released to the new process on an upgrade.
+ */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  // Records are in [tail, head), or in [tail, wrap) then [start, head)
+  uint64_t head;
+  uint64_t tail;
+  uint64_t wrap;
+  uint64_t seq;
+  uint8_t wrapped;
+  uint8_t clean;
+} superblock_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t key_len;
+  uint32_t head_len;
+  uint32_t body_len;
+  uint64_t seq;
+  int64_t stored;
+  int64_t fresh_until;
+  int64_t stale_until;
+} record_t;
+
+static size_t g_capacity = 0;
+static size_t g_used = 0;
+static proxycache_entry_t *g_buckets[PROXYCACHE_BUCKETS];
+static proxycache_entry_t *g_lru_head = NULL;
+static proxycache_entry_t *g_lru_tail = NULL;
+static int g_store_fd = -1;
+static char *g_store = NULL;
+static superblock_t *g_super = NULL;
+// Of the store, to open it again when an upgrade is aborted
+static const char *g_store_path = NULL;
+static uint64_t g_store_size = 0;
+
+static uint64_t hash(const char *key, size_t len) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (uint8_t) key[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static proxycache_entry_t *find(const char *key, size_t len, uint64_t h) {
+  for (proxycache_entry_t *entry = g_buckets[h % PROXYCACHE_BUCKETS]; entry != NULL;
+    entry = entry->chain)
+    if (entry->hash == h && !strncmp(entry->key, key, len) && entry->key[len] == '\0')
+      return entry;
+  return NULL;
+}
+
+static void lru_unlink(proxycache_entry_t *entry) {
+  if (entry->prev != NULL) entry->prev->next = entry->next;
+  else g_lru_head = entry->next;
+  if (entry->next != NULL) entry->next->prev = entry->prev;
+  else g_lru_tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void lru_push(proxycache_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = g_lru_head;
+  if (g_lru_head != NULL) g_lru_head->prev = entry;
+  else g_lru_tail = entry;
+  g_lru_head = entry;
+}
+
+static void drop(proxycache_entry_t *entry) {
+  proxycache_entry_t **link = &g_buckets[entry->hash % PROXYCACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+  if (entry->data != NULL) {
+    lru_unlink(entry);
+    g_used -= entry->head_len + entry->body_len;
+  }
+  free(entry->key);
+  free(entry->data);
+  free(entry);
+}
+
+static proxycache_entry_t *insert(const char *key, size_t len, uint64_t h) {
+  proxycache_entry_t *entry = calloc(1, sizeof (proxycache_entry_t));
+  if (entry == NULL || (entry->key = strndup(key, len)) == NULL) {
+    perror("calloc");
+    free(entry);
+    return NULL;
+  }
+  entry->hash = h;
+  entry->offset = -1;
+  entry->chain = g_buckets[h % PROXYCACHE_BUCKETS];
+  g_buckets[h % PROXYCACHE_BUCKETS] = entry;
+  return entry;
+}
+
+static size_t record_size(size_t key_len, size_t head_len, size_t body_len) {
+  return (sizeof (record_t) + key_len + head_len + body_len + 7) & ~(size_t) 7;
+}
+
+static record_t *record_at(uint64_t offset) {
+  return (record_t *) (g_store + offset);
+}
+
+/**
+ * Drop the oldest record, and the entry it holds if it is not in memory.
+ */
+static void drop_tail() {
+  record_t *record = record_at(g_super->tail);
+  const char *key = (const char *) (record + 1);
+  proxycache_entry_t *entry = find(key, record->key_len, hash(key, record->key_len));
+  if (entry != NULL && entry->offset == (int64_t) g_super->tail && entry->seq == record->seq) {
+    entry->offset = -1;
+    if (entry->data == NULL) drop(entry);
+  }
+  g_super->tail += record_size(record->key_len, record->head_len, record->body_len);
+}
+
+/**
+ * Make room for len bytes at the head of the store, dropping the oldest
+ * records in the way.
+ */
+static int8_t make_room(size_t len) {
+  if (len > g_super->size - PROXYCACHE_SUPERBLOCK) return ERROR;
+  while (1) {
+    if (!g_super->wrapped) {
+      if (g_super->head + len <= g_super->size) return 0;
+      if (g_super->tail == g_super->head) {
+        g_super->head = g_super->tail = PROXYCACHE_SUPERBLOCK;
+        continue;
+      }
+      g_super->wrap = g_super->head;
+      g_super->head = PROXYCACHE_SUPERBLOCK;
+      g_super->wrapped = 1;
+    } else if (g_super->tail >= g_super->wrap) {
+      // Every record before the wrap was dropped
+      g_super->tail = PROXYCACHE_SUPERBLOCK;
+      g_super->wrapped = 0;
+    } else if (g_super->head + len <= g_super->tail) return 0;
+    else drop_tail();
+  }
+}
+
+static int8_t write_record(proxycache_entry_t *entry) {
+  size_t key_len = strlen(entry->key);
+  size_t len = record_size(key_len, entry->head_len, entry->body_len);
+  if (make_room(len)) return ERROR;
+  record_t *record = record_at(g_super->head);
+  record->magic = PROXYCACHE_MAGIC;
+  record->key_len = key_len;
+  record->head_len = entry->head_len;
+  record->body_len = entry->body_len;
+  record->seq = ++g_super->seq;
+  record->stored = entry->times.stored;
+  record->fresh_until = entry->times.fresh_until;
+  record->stale_until = entry->times.stale_until;
+  char *data = (char *) (record + 1);
+  memcpy(data, entry->key, key_len);
+  memcpy(data + key_len, entry->data, entry->head_len + entry->body_len);
+  entry->offset = g_super->head;
+  entry->seq = record->seq;
+  g_super->head += len;
+  return 0;
+}
+
+/**
+ * Move the entry out of memory, to the store if it is not there already.
+ */
+static void demote(proxycache_entry_t *entry) {
+  if (g_store != NULL && entry->offset < 0) write_record(entry);
+  if (entry->offset < 0) {
+    drop(entry);
+    return;
+  }
+  lru_unlink(entry);
+  g_used -= entry->head_len + entry->body_len;
+  free(entry->data);
+  entry->data = NULL;
+}
+
+// Keep the memory used under the capacity, except for keep
+static void trim(proxycache_entry_t *keep) {
+  while (g_used > g_capacity && g_lru_tail != NULL && g_lru_tail != keep)
+    demote(g_lru_tail);
+}
+
+static int8_t promote(proxycache_entry_t *entry) {
+  record_t *record = record_at(entry->offset);
+  size_t len = entry->head_len + entry->body_len;
+  if (record->magic != PROXYCACHE_MAGIC || record->seq != entry->seq ||
+    (entry->data = malloc(len)) == NULL) return ERROR;
+  memcpy(entry->data, (char *) (record + 1) + record->key_len, len);
+  g_used += len;
+  lru_push(entry);
+  METRIC_INC(proxy_cache_disk_hits);
+  trim(entry);
+  return 0;
+}
+
+/**
+ * Index the records of a region of the store, newer ones replacing the
+ * older ones of the same key. Returns ERROR if one is not valid.
+ */
+static int8_t recover(uint64_t from, uint64_t to, time_t now) {
+  while (from < to) {
+    record_t *record = record_at(from);
+    if (to - from < sizeof (record_t) || record->magic != PROXYCACHE_MAGIC) return ERROR;
+    size_t len = record_size(record->key_len, record->head_len, record->body_len);
+    if (len > to - from) return ERROR;
+    const char *key = (const char *) (record + 1);
+    uint64_t h = hash(key, record->key_len);
+    proxycache_entry_t *entry = find(key, record->key_len, h);
+    if (record->stale_until <= now) {
+      if (entry != NULL) drop(entry);
+    } else if (entry != NULL || (entry = insert(key, record->key_len, h)) != NULL) {
+      entry->times.stored = record->stored;
+      entry->times.fresh_until = record->fresh_until;
+      entry->times.stale_until = record->stale_until;
+      entry->head_len = record->head_len;
+      entry->body_len = record->body_len;
+      entry->offset = from;
+      entry->seq = record->seq;
+    }
+    from += len;
+  }
+  return 0;
+}
+
+static void reset_store(uint64_t size) {
+  memset(g_super, 0, sizeof (superblock_t));
+  g_super->magic = PROXYCACHE_MAGIC;
+  g_super->version = PROXYCACHE_VERSION;
+  g_super->size = size;
+  g_super->head = g_super->tail = PROXYCACHE_SUPERBLOCK;
+}
+
+static void forget_store() {
+  for (uint32_t i = 0; i < PROXYCACHE_BUCKETS; ++i) {
+    proxycache_entry_t *entry = g_buckets[i];
+    while (entry != NULL) {
+      proxycache_entry_t *next = entry->chain;
+      entry->offset = -1;
+      if (entry->data == NULL) drop(entry);
+      entry = next;
+    }
+  }
+}
+
+static int8_t open_store(const char *path, uint64_t size) {
+  if (size < PROXYCACHE_SUPERBLOCK + 2 * PROXYCACHE_MAX_OBJECT) {
+    LOG_ERROR("proxy cache store too small: %lu bytes\n", size);
+    return ERROR;
+  }
+  if ((g_store_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+    LOG_ERROR("cannot open %s: %s\n", path, strerror(errno));
+    return ERROR;
+  }
+  struct stat st;
+  if (flock(g_store_fd, LOCK_EX | LOCK_NB) < 0) {
+    LOG_ERROR("%s is used by another process\n", path);
+    close(g_store_fd);
+    g_store_fd = -1;
+    return ERROR;
+  }
+  if (fstat(g_store_fd, &st) < 0 || ((uint64_t) st.st_size != size &&
+    ftruncate(g_store_fd, size) < 0) || (g_store = mmap(NULL, size,
+      PROT_READ | PROT_WRITE, MAP_SHARED, g_store_fd, 0)) == MAP_FAILED) {
+    LOG_ERROR("cannot map %s: %s\n", path, strerror(errno));
+    close(g_store_fd);
+    g_store_fd = -1;
+    g_store = NULL;
+    return ERROR;
+  }
+  g_super = (superblock_t *) g_store;
+  time_t now = time(NULL);
+  if (g_super->magic != PROXYCACHE_MAGIC || g_super->version != PROXYCACHE_VERSION ||
+    g_super->size != size || !g_super->clean ||
+    recover(g_super->tail, g_super->wrapped ? g_super->wrap : g_super->head, now) ||
+    (g_super->wrapped && recover(PROXYCACHE_SUPERBLOCK, g_super->head, now))) {
+    forget_store();
+    reset_store(size);
+  }
+  // Not to be trusted after a crash
+  g_super->clean = 0;
+  return 0;
+}
+
+int8_t proxycache_init(size_t memory, const char *store, uint64_t store_size) {
+  g_capacity = memory;
+  if (memory == 0) return 0;
+  if (store != NULL && open_store(store, store_size)) return ERROR;
+  g_store_path = store;
+  g_store_size = store_size;
+  size_t entries = 0;
+  for (uint32_t i = 0; i < PROXYCACHE_BUCKETS; ++i)
+    for (proxycache_entry_t *entry = g_buckets[i]; entry != NULL; entry = entry->chain)
+      ++entries;
+  if (store != NULL) {
+    LOG_MSG("caching proxied responses in %lu bytes and %s, %lu entries recovered\n",
+      memory, store, entries);
+  } else LOG_MSG("caching proxied responses in %lu bytes\n", memory);
+  return 0;
+}
+
+/**
+ * Close the store, cleanly, for the new process of an upgrade or the next
+ * start. The entries in memory are written to it, oldest first, and stay.
+ */
+void proxycache_release() {
+  if (g_store == NULL) return;
+  for (proxycache_entry_t *entry = g_lru_tail; entry != NULL; entry = entry->prev)
+    if (entry->offset < 0) write_record(entry);
+  forget_store();
+  g_super->clean = 1;
+  msync(g_store, g_super->size, MS_SYNC);
+  munmap(g_store, g_super->size);
+  close(g_store_fd);
+  g_store = NULL;
+  g_super = NULL;
+  g_store_fd = -1;
+}
+
+/**
+ * Open the store released for a new process again, as the process goes on
+ * serving: the new one did not take over.
+ */
+int8_t proxycache_reopen() {
+  if (g_store_path == NULL || g_store != NULL) return 0;
+  if (open_store(g_store_path, g_store_size)) return ERROR;
+  LOG_MSG("reopened the proxy cache store %s\n", g_store_path);
+  return 0;
+}
+
+void proxycache_stop() {
+  proxycache_release();
+  g_store_path = NULL;
+  while (g_lru_head != NULL) drop(g_lru_head);
+  g_capacity = 0;
+}
+
+uint8_t proxycache_enabled() {
+  return g_capacity > 0;
+}
+
+/**
+ * Whether the response to the request may come from the cache, the
+ * credentials and ranges going to the backend.
+ */
+uint8_t proxycache_cacheable(request_t *request) {
+  return g_capacity > 0 && (request->method == GET || request->method == HEAD) &&
+    request->headers[AUTHORIZATION] == NULL && request->headers[RANGE] == NULL;
+}
+
+/**
+ * The key of the request, its host, path and query, and whether it takes
+ * gzip: the backend is asked for gzip or nothing, as Vary: Accept-Encoding
+ * would otherwise need a key per value. Returns its length, 0 if too long.
+ */
+size_t proxycache_key(request_t *request, size_t path_len, char *key, size_t size) {
+  const char *host = request->headers[HOST];
+  const char *accept = request->headers[ACCEPT_ENCODING];
+  int len = snprintf(key, size, "%s /%.*s%s%s %s", host != NULL ? host : "",
+    (int) path_len, request->path, request->query != NULL ? "?" : "",
+    request->query != NULL ? request->query : "",
+    accept != NULL && strstr(accept, "gzip") != NULL ? "gzip" : "");
+  return len < 0 || (size_t) len >= size ? 0 : (size_t) len;
+}
+
+/**
+ * The entry of the key, brought back to memory, if it is fresh or may be
+ * served stale. state tells which.
+ */
+proxycache_entry_t *proxycache_lookup(const char *key, proxycache_state_e *state) {
+  if (g_capacity == 0) return NULL;
+  size_t len = strlen(key);
+  proxycache_entry_t *entry = find(key, len, hash(key, len));
+  if (entry == NULL) return NULL;
+  time_t now = time(NULL);
+  if (now >= entry->times.stale_until ||
+    (entry->data == NULL && promote(entry) < 0)) {
+    drop(entry);
+    return NULL;
+  }
+  lru_unlink(entry);
+  lru_push(entry);
+  *state = now < entry->times.fresh_until ? PROXYCACHE_FRESH : PROXYCACHE_STALE;
+  return entry;
+}
+
+// Seconds of a directive, or -1
+static int64_t seconds(const char *directive, size_t len, const char *name) {
+  size_t name_len = strlen(name);
+  if (len <= name_len || strncasecmp(directive, name, name_len) || directive[name_len] != '=')
+    return -1;
+  const char *value = directive + name_len + 1;
+  if (*value == '"') ++value;
+  char *end;
+  long long n = strtoll(value, &end, 10);
+  return end == value || n < 0 ? -1 : n;
+}
+
+static time_t http_date(const char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof (tm));
+  const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return end == NULL ? 0 : timegm(&tm);
+}
+
+/**
+ * How long the response may be served from the cache, from its head as it is
+ * sent to the client, NUL terminated. Returns ERROR if it must not be stored:
+ * no explicit freshness, private, with cookies or varying on more than the
+ * encoding.
+ */
+int8_t proxycache_lifetime(const char *head, size_t head_len, uint16_t code,
+  proxycache_times_t *times) {
+  switch (code) {
+  case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 410:
+    break;
+  default:
+    return ERROR;
+  }
+  int64_t max_age = -1, s_maxage = -1, swr = 0, age = 0;
+  uint8_t revalidate = 0;
+  time_t date = 0, expires = -1;
+  const char *line = memchr(head, '\n', head_len);
+  const char *end = head + head_len;
+  while (line != NULL && ++line < end && *line != '\r' && *line != '\n') {
+    const char *eol = memchr(line, '\n', end - line);
+    const char *colon = memchr(line, ':', (eol != NULL ? eol : end) - line);
+    if (colon == NULL) return ERROR;
+    size_t name_len = colon - line;
+    const char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') ++value;
+    size_t value_len = (eol != NULL ? eol : end) - value;
+    while (value_len > 0 && (value[value_len - 1] == '\r' || value[value_len - 1] == ' '))
+      --value_len;
+    if (name_len == 13 && !strncasecmp(line, "Cache-Control", 13)) {
+      for (const char *d = value; d < value + value_len;) {
+        while (d < value + value_len && (*d == ' ' || *d == ',')) ++d;
+        const char *comma = memchr(d, ',', value + value_len - d);
+        size_t len = (comma != NULL ? comma : value + value_len) - d;
+        if ((len >= 8 && !strncasecmp(d, "no-store", 8)) ||
+          (len >= 8 && !strncasecmp(d, "no-cache", 8)) ||
+          (len >= 7 && !strncasecmp(d, "private", 7))) return ERROR;
+        if ((len == 15 && !strncasecmp(d, "must-revalidate", 15)) ||
+          (len == 16 && !strncasecmp(d, "proxy-revalidate", 16))) revalidate = 1;
+        int64_t n;
+        if ((n = seconds(d, len, "max-age")) >= 0) max_age = n;
+        else if ((n = seconds(d, len, "s-maxage")) >= 0) s_maxage = n;
+        else if ((n = seconds(d, len, "stale-while-revalidate")) >= 0) swr = n;
+        d += len;
+      }
+    } else if (name_len == 4 && !strncasecmp(line, "Vary", 4)) {
+      // Accept-Encoding only, which the key covers
+      for (const char *v = value; v < value + value_len;) {
+        while (v < value + value_len && (*v == ' ' || *v == ',')) ++v;
+        const char *comma = memchr(v, ',', value + value_len - v);
+        size_t len = (comma != NULL ? comma : value + value_len) - v;
+        while (len > 0 && v[len - 1] == ' ') --len;
+        if (len > 0 && (len != 15 || strncasecmp(v, "Accept-Encoding", 15))) return ERROR;
+        v = comma != NULL ? comma + 1 : value + value_len;
+      }
+    } else if (name_len == 10 && !strncasecmp(line, "Set-Cookie", 10)) return ERROR;
+    else if (name_len == 7 && !strncasecmp(line, "Expires", 7)) expires = http_date(value);
+    else if (name_len == 4 && !strncasecmp(line, "Date", 4)) date = http_date(value);
+    else if (name_len == 3 && !strncasecmp(line, "Age", 3)) age = strtoll(value, NULL, 10);
+    line = eol;
+  }
+  time_t now = time(NULL);
+  int64_t lifetime;
+  if (s_maxage >= 0) lifetime = s_maxage;
+  else if (max_age >= 0) lifetime = max_age;
+  // An invalid date means already expired
+  else if (expires >= 0) lifetime = expires - (date > 0 ? date : now);
+  else return ERROR;
+  times->stored = now - (age > 0 ? age : 0);
+  times->fresh_until = times->stored + lifetime;
+  times->stale_until = times->fresh_until + (revalidate ? 0 : swr);
+  return times->stale_until > now ? 0 : ERROR;
+}
+
+/**
+ * Turn the head of a response, as sent to the client, into the head to store:
+ * without the Age, which is given when it is served, and without the empty
+ * line. Returns its new length.
+ */
+size_t proxycache_head(char *head, size_t head_len) {
+  size_t len = 0;
+  const char *end = head + head_len;
+  for (const char *line = head; line < end;) {
+    const char *eol = memchr(line, '\n', end - line);
+    size_t line_len = (eol != NULL ? eol + 1 : end) - line;
+    if (line != head && (line[0] == '\r' || line[0] == '\n')) break;
+    if (line_len < 4 || strncasecmp(line, "Age:", 4)) {
+      memmove(head + len, line, line_len);
+      len += line_len;
+    }
+    line += line_len;
+  }
+  return len;
+}
+
+/**
+ * Store a response, its head as given by proxycache_head.
+ */
+int8_t proxycache_store(const char *key, const char *head, size_t head_len,
+  const char *body, size_t body_len, const proxycache_times_t *times) {
+  if (g_capacity == 0 || head_len + body_len > g_capacity) return ERROR;
+  size_t len = strlen(key);
+  uint64_t h = hash(key, len);
+  proxycache_entry_t *entry = find(key, len, h);
+  if (entry != NULL) drop(entry);
+  if ((entry = insert(key, len, h)) == NULL) return ERROR;
+  if ((entry->data = malloc(head_len + body_len)) == NULL) {
+    perror("malloc");
+    drop(entry);
+    return ERROR;
+  }
+  memcpy(entry->data, head, head_len);
+  memcpy(entry->data + head_len, body, body_len);
+  entry->head_len = head_len;
+  entry->body_len = body_len;
+  entry->times = *times;
+  g_used += head_len + body_len;
+  lru_push(entry);
+  METRIC_INC(proxy_cache_stores);
+  trim(entry);
+  return 0;
+}
+
+void proxycache_remove(const char *key) {
+  size_t len = strlen(key);
+  proxycache_entry_t *entry = find(key, len, hash(key, len));
+  if (entry != NULL) drop(entry);
+}
+
+/**
+ * Send a response of the cache, the body only to a GET, with its age.
+ * request->status is set by the caller. Returns ERROR if the connection is
+ * broken.
+ */
+int8_t proxycache_respond(client_t *client, request_t *request, const char *head,
+  size_t head_len, const char *body, size_t body_len, time_t stored) {
+  if (request->method != GET) body_len = 0;
+  char *buffer = malloc(head_len + 32 + body_len);
+  if (buffer == NULL) {
+    perror("malloc");
+    return answer(client->clientfd, request, _500);
+  }
+  time_t age = time(NULL) - stored;
+  memcpy(buffer, head, head_len);
+  size_t len = head_len + sprintf(buffer + head_len, "Age: %ld\r\n\r\n", age > 0 ? age : 0);
+  memcpy(buffer + len, body, body_len);
+  request->cache_hit = 1;
+  METRIC_INC(cache_hits);
+  int8_t ret = sched_start(client, buffer, len + body_len, -1, 0, 0, PAGECACHE_NORMAL);
+  free(buffer);
+  return ret;
+}
@@ -0,0 +1,76 @@
+#ifndef __PROXYCACHE_H__
+#define __PROXYCACHE_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "defines.h"
+
+/**
+ * Cache of the proxied responses: a memory tier whose least recently used
+ * entries are moved to an on-disk store, a ring of records in a file mapped
+ * in memory. An entry found on disk goes back to memory. Only the responses
+ * with an explicit freshness (Cache-Control: max-age or s-maxage, Expires)
+ * are stored; they may be served stale for stale-while-revalidate seconds
+ * while they are fetched again.
+ */
+#define PROXYCACHE_DEFAULT_MEMORY (64 * 1024 * 1024)
+#define PROXYCACHE_DEFAULT_STORE_SIZE (1024 * 1024 * 1024ULL)
+// Larger responses are streamed rather than stored
+#define PROXYCACHE_MAX_OBJECT (1024 * 1024)
+#define PROXYCACHE_BUCKETS 16384
+#define PROXYCACHE_MAX_KEY 2048
+// Ahead of the records of the store
+#define PROXYCACHE_SUPERBLOCK 4096
+#define PROXYCACHE_MAGIC 0x48435053u
+#define PROXYCACHE_VERSION 1
+
+typedef struct {
+  // Wall clock, so that the on-disk store outlives the process
+  time_t stored;
+  time_t fresh_until;
+  time_t stale_until;
+} proxycache_times_t;
+
+typedef struct proxycache_entry_s {
+  char *key;
+  uint64_t hash;
+  proxycache_times_t times;
+  // The head, without its empty line, then the body, NULL while on disk only
+  char *data;
+  size_t head_len;
+  size_t body_len;
+  // The record of the store, -1 if none or overwritten since
+  int64_t offset;
+  uint64_t seq;
+  struct proxycache_entry_s *chain;
+  // Least recently used list of the entries in memory, most recent first
+  struct proxycache_entry_s *prev;
+  struct proxycache_entry_s *next;
+} proxycache_entry_t;
+
+typedef enum {
+  PROXYCACHE_FRESH = 0,
+  // To serve while it is fetched again
+  PROXYCACHE_STALE,
+} proxycache_state_e;
+
+int8_t proxycache_init(size_t memory, const char *store, uint64_t store_size);
+void proxycache_release();
+int8_t proxycache_reopen();
+void proxycache_stop();
+uint8_t proxycache_enabled();
+uint8_t proxycache_cacheable(request_t *request);
+size_t proxycache_key(request_t *request, size_t path_len, char *key, size_t size);
+proxycache_entry_t *proxycache_lookup(const char *key, proxycache_state_e *state);
+int8_t proxycache_lifetime(const char *head, size_t head_len, uint16_t code,
+  proxycache_times_t *times);
+size_t proxycache_head(char *head, size_t head_len);
+int8_t proxycache_store(const char *key, const char *head, size_t head_len,
+  const char *body, size_t body_len, const proxycache_times_t *times);
+void proxycache_remove(const char *key);
+int8_t proxycache_respond(client_t *client, request_t *request, const char *head,
+  size_t head_len, const char *body, size_t body_len, time_t stored);
+
+#endif // __PROXYCACHE_H__
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "ratelimit.h"
+
+/**
+ * A bucket is a key (the client address) and a 64 bits state updated with a
+ * single compare-and-swap: the tokens are refilled lazily from the time of
+ * the last update, so there is no timer per bucket. A key is looked for in
+ * the slots of one cache line; when they are all taken, one of them is
+ * reused, preferably a full bucket (the client was quiet long enough that
+ * forgetting it changes nothing), or one not referenced since the clock hand
+ * last passed. The hand sweeps every shard in the background, freeing the
+ * full buckets and clearing the referenced bits, so that slots are there for
+ * new clients even at millions of addresses.
+ *
+ * A slot reused while another worker updates it may charge one request to
+ * the wrong client, which is the price of not locking.
+ */
+
+#define STAMP(state) ((uint32_t) ((state) >> 32))
+#define TOKENS(state) (((state) >> 1) & 0x7FFFFFFF)
+#define REFERENCED 1ULL
+// Between two sweeps, a whole pass over the table takes RATELIMIT_PASS_MS
+#define RATELIMIT_SWEEP_MS 100
+#define RATELIMIT_PASS_MS 10000
+
+uint8_t g_ratelimit_trust_forwarded = 0;
+
+static ratelimit_shard_t g_shards[RATELIMIT_SHARDS];
+static uint32_t g_shard_mask = 0;
+// Requests per second, and the bucket size in thousandths of a request
+static uint64_t g_rate = 0;
+static uint64_t g_burst = 0;
+static uint64_t g_last_sweep_ms = 0;
+
+static char g_429[BUFFER_SIZE];
+static size_t g_429_len = 0;
+
+static inline uint64_t pack_state(uint32_t ms, uint64_t tokens, uint64_t referenced) {
+  return (uint64_t) ms << 32 | tokens << 1 | referenced;
+}
+
+// Tokens of a bucket at ms, a state of 0 being a new bucket
+static inline uint64_t refill(uint64_t state, uint32_t ms) {
+  if (state == 0) return g_burst;
+  uint64_t tokens = TOKENS(state) + (uint64_t) (uint32_t) (ms - STAMP(state)) * g_rate;
+  return tokens > g_burst ? g_burst : tokens;
+}
+
+static inline uint64_t mix(uint64_t key) {
+  // splitmix64 finalizer
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+/**
+ * Cap clients to rate requests per second, in bursts of up to burst, with a
+ * table of about slots buckets. A rate of 0 disables the limit.
+ */
+int8_t ratelimit_init(uint64_t rate, uint64_t burst, uint64_t slots) {
+  if (rate == 0) return 0;
+  uint64_t per_shard = RATELIMIT_WAYS;
+  while (per_shard * RATELIMIT_SHARDS < slots) per_shard <<= 1;
+  for (uint8_t i = 0; i < RATELIMIT_SHARDS; ++i) {
+    if ((g_shards[i].slots = calloc(per_shard, sizeof (ratelimit_slot_t))) == NULL) {
+      perror("calloc");
+      return ERROR;
+    }
+  }
+  g_shard_mask = per_shard - 1;
+  g_rate = rate;
+  g_burst = (burst ? burst : rate) * 1000;
+  if (g_burst > 0x7FFFFFFF) g_burst = 0x7FFFFFFF;
+  // Every response is the same, made once
+  g_429_len = snprintf(g_429, BUFFER_SIZE,
+    "HTTP/1.1 429 Too Many Requests\n"
+    "Server: shttpd/%i.%i.%i\n"
+    "Retry-After: 1\n"
+    "Content-length: 0\n"
+    "\n",
+    VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+  LOG_MSG("limiting clients to %lu requests per second, %lu buckets\n", rate,
+    per_shard * RATELIMIT_SHARDS);
+  return 0;
+}
+
+/**
+ * Free the slot if it still holds key.
+ */
+static void release(ratelimit_slot_t *slot, uint64_t key) {
+  if (__atomic_compare_exchange_n(&slot->key, &key, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    __atomic_store_n(&slot->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Slot of key in the ways starting at first, taken if it is not there.
+ * NULL if every way is in use.
+ */
+static ratelimit_slot_t *lookup(ratelimit_slot_t *first, uint64_t key, uint32_t ms) {
+  for (uint8_t i = 0; i < RATELIMIT_WAYS; ++i)
+    if (__atomic_load_n(&first[i].key, __ATOMIC_ACQUIRE) == key) return &first[i];
+  for (uint8_t i = 0; i < RATELIMIT_WAYS; ++i) {
+    uint64_t expected = 0;
+    if (__atomic_compare_exchange_n(&first[i].key, &expected, key, 0, __ATOMIC_ACQ_REL,
+      __ATOMIC_RELAXED)) return &first[i];
+  }
+  // A full bucket first, then one not referenced lately
+  ratelimit_slot_t *victim = NULL;
+  for (uint8_t i = 0; i < RATELIMIT_WAYS && victim == NULL; ++i)
+    if (refill(__atomic_load_n(&first[i].state, __ATOMIC_ACQUIRE), ms) == g_burst)
+      victim = &first[i];
+  for (uint8_t i = 0; i < RATELIMIT_WAYS && victim == NULL; ++i)
+    if (!(__atomic_load_n(&first[i].state, __ATOMIC_ACQUIRE) & REFERENCED)) {
+      victim = &first[i];
+      METRIC_INC(rate_limit_evictions);
+    }
+  if (victim == NULL) return NULL;
+  uint64_t old = __atomic_load_n(&victim->key, __ATOMIC_ACQUIRE);
+  if (!__atomic_compare_exchange_n(&victim->key, &old, key, 0, __ATOMIC_ACQ_REL,
+    __ATOMIC_RELAXED)) return NULL;
+  __atomic_store_n(&victim->state, 0, __ATOMIC_RELEASE);
+  return victim;
+}
+
+/**
+ * Advance the clock hand of every shard, so that a pass over the table
+ * takes RATELIMIT_PASS_MS.
+ */
+static void sweep(uint32_t ms) {
+  uint32_t steps = (g_shard_mask + 1) / (RATELIMIT_PASS_MS / RATELIMIT_SWEEP_MS);
+  if (steps == 0) steps = 1;
+  for (uint8_t s = 0; s < RATELIMIT_SHARDS; ++s) {
+    ratelimit_shard_t *shard = &g_shards[s];
+    uint32_t hand = __atomic_fetch_add(&shard->hand, steps, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < steps; ++i) {
+      ratelimit_slot_t *slot = &shard->slots[(hand + i) & g_shard_mask];
+      uint64_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+      if (key == 0) continue;
+      uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+      if (refill(state, ms) == g_burst) release(slot, key);
+      else if (state & REFERENCED)
+        __atomic_compare_exchange_n(&slot->state, &state, state & ~REFERENCED, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Take a token from the bucket of key. Returns ERROR if it is empty. Clients
+ * are let through when the table has no room for them.
+ */
+int8_t ratelimit_allow(uint64_t key, uint64_t now_ms) {
+  uint32_t ms = now_ms;
+  uint64_t last = __atomic_load_n(&g_last_sweep_ms, __ATOMIC_RELAXED);
+  if (now_ms - last >= RATELIMIT_SWEEP_MS && __atomic_compare_exchange_n(&g_last_sweep_ms,
+    &last, now_ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) sweep(ms);
+  uint64_t h = mix(key);
+  ratelimit_shard_t *shard = &g_shards[h >> 58];
+  ratelimit_slot_t *slot = lookup(&shard->slots[h & g_shard_mask & ~(RATELIMIT_WAYS - 1)],
+    key, ms);
+  if (slot == NULL) return 0;
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  while (1) {
+    uint64_t tokens = refill(state, ms);
+    uint8_t allowed = tokens >= 1000;
+    if (allowed) tokens -= 1000;
+    if (__atomic_compare_exchange_n(&slot->state, &state, pack_state(ms, tokens, REFERENCED),
+      0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return allowed ? 0 : ERROR;
+  }
+}
+
+static uint64_t forwarded_key(const char *forwarded) {
+  // The load balancer appends the address it got the request from
+  const char *last = strrchr(forwarded, ',');
+  last = last != NULL ? last + 1 : forwarded;
+  while (*last == ' ') ++last;
+  char address[INET6_ADDRSTRLEN];
+  size_t len = strcspn(last, " ");
+  if (len == 0 || len >= sizeof (address)) return 0;
+  memcpy(address, last, len);
+  address[len] = 0;
+  struct in_addr v4;
+  struct in6_addr v6;
+  if (inet_pton(AF_INET, address, &v4) == 1) return 1ULL << 32 | v4.s_addr;
+  if (inet_pton(AF_INET6, address, &v6) != 1) return 0;
+  uint64_t high;
+  uint64_t low;
+  memcpy(&high, v6.s6_addr, 8);
+  memcpy(&low, v6.s6_addr + 8, 8);
+  return mix(high ^ mix(low)) | 1ULL << 63;
+}
+
+/**
+ * Key of the client of a request: its address, or the one the load balancer
+ * forwarded if trusted.
+ */
+uint64_t ratelimit_key(client_t *client, request_t *request) {
+  uint64_t key = 0;
+  if (g_ratelimit_trust_forwarded && request->headers[X_FORWARDED_FOR] != NULL)
+    key = forwarded_key(request->headers[X_FORWARDED_FOR]);
+  if (key == 0 && client->client_addr != NULL)
+    key = 1ULL << 32 | ((struct sockaddr_in *) client->client_addr)->sin_addr.s_addr;
+  return key;
+}
+
+/**
+ * Returns 1 if the client of the request is over its rate.
+ */
+int8_t ratelimit_check(client_t *client, request_t *request) {
+  if (g_rate == 0) return 0;
+  uint64_t key = ratelimit_key(client, request);
+  return key != 0 && ratelimit_allow(key, now_ns() / 1000000) < 0;
+}
+
+/**
+ * Free the buckets of the clients, no request is limited afterwards.
+ */
+void ratelimit_stop() {
+  for (uint8_t i = 0; i < RATELIMIT_SHARDS; ++i) {
+    free(g_shards[i].slots);
+    g_shards[i].slots = NULL;
+  }
+  g_rate = 0;
+}
+
+/**
+ * Answer a request over its rate.
+ */
+int8_t ratelimit_reject(int32_t clientfd, request_t *request) {
+  request->status = _429;
+  return send_response(clientfd, g_429, g_429_len);
+}
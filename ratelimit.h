@@ -0,0 +1,43 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdint.h>
+
+#include "defines.h"
+
+/**
+ * Request rate of every client capped by a token bucket. The buckets live in
+ * a fixed size table, split in shards that each have their own clock hand,
+ * and are updated with compare-and-swap so that workers share the table
+ * without a lock.
+ */
+#define RATELIMIT_SHARDS 64
+#define RATELIMIT_DEFAULT_SLOTS (1 << 20)
+// A key is looked for in the slots of its cache line
+#define RATELIMIT_WAYS 4
+// Slots the clock hand visits at most to free one
+#define RATELIMIT_MAX_SWEEP 64
+
+typedef struct {
+  // 0 for a free slot
+  uint64_t key;
+  // Last refill in ms (32 bits), tokens in thousandths (31 bits), referenced
+  // since the clock hand last passed (1 bit)
+  uint64_t state;
+} ratelimit_slot_t;
+
+typedef struct {
+  ratelimit_slot_t *slots;
+  uint32_t hand;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ratelimit_shard_t;
+
+extern uint8_t g_ratelimit_trust_forwarded;
+
+int8_t ratelimit_init(uint64_t rate, uint64_t burst, uint64_t slots);
+void ratelimit_stop();
+int8_t ratelimit_allow(uint64_t key, uint64_t now_ms);
+uint64_t ratelimit_key(client_t *client, request_t *request);
+int8_t ratelimit_check(client_t *client, request_t *request);
+int8_t ratelimit_reject(int32_t clientfd, request_t *request);
+
+#endif // __RATELIMIT_H__
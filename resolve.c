@@ -0,0 +1,154 @@
+// O_PATH
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "defines.h"
+#include "negcache.h"
+#include "resolve.h"
+
+/**
+ * Requests are resolved with openat2(RESOLVE_BENEATH), the kernel refuses
+ * any ".." or symbolic link that would lead out of the docroot (EXDEV), and
+ * the /proc magic links (ELOOP). Kernels without openat2 get an openat that
+ * refuses the paths with a ".." component.
+ *
+ * A cached directory descriptor keeps pointing to the directory after it is
+ * moved or removed, so directories are only cached while the docroot is
+ * watched (see negcache.c), which calls resolve_forget.
+ */
+
+static int g_docroot_fd = -1;
+// Cleared once by whichever thread finds the kernel lacks them, the loop or
+// the file operations pool, so only read and written atomically
+static uint8_t g_has_openat2 = 1;
+static uint8_t g_has_resolve_cached = 1;
+static resolve_entry_t g_cache[RESOLVE_CACHE_SIZE];
+
+static uint32_t hash(const char *path, size_t len) {
+  // FNV-1a
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (uint8_t) path[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static uint8_t has_dotdot(const char *path) {
+  for (const char *p = path; (p = strstr(p, "..")) != NULL; p += 2)
+    if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) return 1;
+  return 0;
+}
+
+/**
+ * With nowait, fails with EAGAIN rather than reading from the disk
+ * (RESOLVE_CACHED), and always does without openat2.
+ */
+static int open_beneath(int dirfd, const char *path, int flags, uint8_t nowait) {
+  if (__atomic_load_n(&g_has_openat2, __ATOMIC_RELAXED)) {
+    uint8_t cached = nowait && __atomic_load_n(&g_has_resolve_cached, __ATOMIC_RELAXED);
+    struct open_how how;
+    memset(&how, 0, sizeof (how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    if (cached) how.resolve |= RESOLVE_CACHED;
+    int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof (how));
+    if (fd < 0 && errno == EINVAL && cached) {
+      if (__atomic_exchange_n(&g_has_resolve_cached, 0, __ATOMIC_RELAXED))
+        LOG_WARNING("RESOLVE_CACHED not supported, every open goes to the pool%s\n", "");
+    } else if (fd < 0 && errno == ENOSYS) {
+      if (__atomic_exchange_n(&g_has_openat2, 0, __ATOMIC_RELAXED))
+        LOG_WARNING("openat2 not supported, falling back to openat%s\n", "");
+    } else if (!nowait || cached) return fd;
+  }
+  if (nowait) {
+    errno = EAGAIN;
+    return ERROR;
+  }
+  if (path[0] == '/' || has_dotdot(path)) {
+    errno = EXDEV;
+    return ERROR;
+  }
+  return openat(dirfd, path, flags | O_CLOEXEC);
+}
+
+int8_t resolve_init(const char *docroot) {
+  for (uint16_t i = 0; i < RESOLVE_CACHE_SIZE; ++i) g_cache[i].fd = -1;
+  if ((g_docroot_fd = open(docroot, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror("open");
+    return ERROR;
+  }
+  return 0;
+}
+
+/**
+ * Descriptor of the directory of a file. On failure errno is left to 0 if
+ * the directory cannot be cached.
+ */
+static int directory(const char *path, size_t len, uint8_t nowait) {
+  errno = 0;
+  if (!g_negcache_enabled || len >= RESOLVE_MAX_PATH) return ERROR;
+  resolve_entry_t *entry = &g_cache[hash(path, len) % RESOLVE_CACHE_SIZE];
+  if (entry->fd >= 0 && !strncmp(entry->path, path, len) && entry->path[len] == '\0')
+    return entry->fd;
+  char dir[RESOLVE_MAX_PATH];
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  int fd = open_beneath(g_docroot_fd, dir, O_PATH | O_DIRECTORY, nowait);
+  if (fd < 0) return ERROR;
+  if (entry->fd >= 0) close(entry->fd);
+  entry->fd = fd;
+  strcpy(entry->path, dir);
+  return fd;
+}
+
+/**
+ * Open a path relative to the docroot, from the event loop. Fails with EXDEV
+ * when the path leads out of it, and with EAGAIN if nowait is set and the
+ * lookup would block.
+ */
+int resolve_open(const char *path, int flags, uint8_t nowait) {
+  const char *name = strrchr(path, '/');
+  if (name != NULL && name != path) {
+    int dirfd = directory(path, name - path, nowait);
+    if (dirfd >= 0) {
+      int fd = open_beneath(dirfd, name + 1, flags, nowait);
+      // A symbolic link may lead to another directory of the docroot
+      if (fd >= 0 || errno != EXDEV) return fd;
+    // The walk from the docroot would fail the same way
+    } else if (errno == ENOENT || errno == ENOTDIR || errno == EXDEV) return ERROR;
+  }
+  return open_beneath(g_docroot_fd, path, flags, nowait);
+}
+
+/**
+ * Same without the cache of directories, for the other threads.
+ */
+int resolve_open_beneath(const char *path, int flags) {
+  return open_beneath(g_docroot_fd, path, flags, 0);
+}
+
+/**
+ * Close the cached directories at or below path, after it was moved or
+ * removed.
+ */
+void resolve_forget(const char *path) {
+  size_t len = strlen(path);
+  for (uint16_t i = 0; i < RESOLVE_CACHE_SIZE; ++i) {
+    resolve_entry_t *entry = &g_cache[i];
+    if (entry->fd >= 0 && !strncmp(entry->path, path, len) &&
+      (entry->path[len] == '\0' || entry->path[len] == '/' || len == 0)) {
+      close(entry->fd);
+      entry->fd = -1;
+    }
+  }
+}
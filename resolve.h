@@ -0,0 +1,24 @@
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include <stdint.h>
+
+/**
+ * Files are opened relative to a descriptor of the docroot, without ever
+ * leaving it. The directories of the requested files are kept open (O_PATH)
+ * in a direct mapped cache so that the kernel only walks the last component.
+ */
+#define RESOLVE_CACHE_SIZE 256
+#define RESOLVE_MAX_PATH 128
+
+typedef struct {
+  int fd;
+  char path[RESOLVE_MAX_PATH];
+} resolve_entry_t;
+
+int8_t resolve_init(const char *docroot);
+int resolve_open(const char *path, int flags, uint8_t nowait);
+int resolve_open_beneath(const char *path, int flags);
+void resolve_forget(const char *path);
+
+#endif // __RESOLVE_H__
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "trace.h"
+#include "sched.h"
+#include "fileio.h"
+#include "pagecache.h"
+#include "tls.h"
+#include "h2.h"
+#include "upstream.h"
+#include "chunked.h"
+
+/**
+ * Responses that cannot be written at once are queued on their connection
+ * and sent from the event loop, a quantum at a time, so that a large download
+ * never holds the loop for longer than one quantum. Each writable transfer
+ * gets a quantum of credit per turn (deficit round robin), the short ones
+ * first. Optional token buckets cap the rate of each connection and of the
+ * whole server; throttled transfers leave the poll set until they can send.
+ *
+ * An HTTP/2 connection takes its turns as a whole, its streams sharing them
+ * (see h2_send); the transfer of its client only holds its credit and tokens.
+ *
+ * The body of a proxied response comes from its upstream connection as it
+ * arrives (see upstream_send) rather than from a file, a generated one from
+ * its streaming writer (see chunked_send); its transfer waits out of the
+ * poll set while there is nothing to send.
+ */
+
+// Bytes per second, 0 for no limit
+uint64_t g_sched_connection_rate = 0;
+uint64_t g_sched_global_rate = 0;
+
+static double g_global_tokens = 0;
+static uint64_t g_global_refill_ns = 0;
+static uint64_t g_global_resume_ns = 0;
+// Earliest time a throttled transfer can resume, refreshed by sched_events
+static uint64_t g_next_resume_ns = 0;
+
+static double burst(uint64_t rate) {
+  double size = (double) rate / SCHED_BURST_DIVISOR;
+  return size < SCHED_MIN_BURST ? SCHED_MIN_BURST : size;
+}
+
+static void refill(double *tokens, uint64_t *refill_ns, uint64_t rate, uint64_t now) {
+  if (*refill_ns == 0) *tokens = burst(rate);
+  else *tokens += (double) (now - *refill_ns) * rate / 1e9;
+  if (*tokens > burst(rate)) *tokens = burst(rate);
+  *refill_ns = now;
+}
+
+// Time at which a bucket will hold the given amount of tokens
+static uint64_t resume_time(double tokens, double wanted, uint64_t rate, uint64_t now) {
+  return now + (uint64_t) ((wanted - tokens) * 1e9 / rate) + 1;
+}
+
+static void finish(client_t *client) {
+  transfer_t *transfer = &client->transfer;
+  upstream_finish(client);
+  chunked_finish(client);
+  pagecache_drop(transfer, 1);
+  // A pending O_DIRECT read keeps its buffer and descriptor, see
+  // fileio_complete
+  if (transfer->filefd >= 0) close(transfer->filefd);
+  free(transfer->head);
+  free(transfer->buffer);
+  METRIC_ADD(queued_bytes, -(transfer->remaining + transfer->head_len - transfer->head_sent));
+  METRIC_DEC(active_transfers);
+  memset(transfer, 0, sizeof (transfer_t));
+  transfer->filefd = -1;
+}
+
+/**
+ * Account for the bytes an O_DIRECT read put in the buffer of the transfer.
+ */
+static int8_t direct_read(transfer_t *transfer, ssize_t len) {
+  // The file shrunk under our feet
+  if (len <= 0) return ERROR;
+  // Only the last read may end unaligned, the next one starts where it ends:
+  // a short one is cut down to the alignment, and read again if that leaves
+  // nothing
+  if ((size_t) len > transfer->remaining) len = transfer->remaining;
+  else if ((size_t) len < transfer->remaining) len &= ~(ssize_t) (PAGECACHE_ALIGN - 1);
+  transfer->buffered = len;
+  transfer->buffer_sent = 0;
+  transfer->offset += len;
+  METRIC_ADD(direct_io_bytes, len);
+  return 0;
+}
+
+/**
+ * Fill the buffer of an O_DIRECT transfer, through the file operations pool
+ * when there is one (client->io_pending is then set).
+ */
+static int8_t read_direct(client_t *client) {
+  transfer_t *transfer = &client->transfer;
+  if (transfer->buffer == NULL && posix_memalign((void **) &transfer->buffer,
+      PAGECACHE_ALIGN, PAGECACHE_DIRECT_CHUNK) != 0) {
+    transfer->buffer = NULL;
+    return ERROR;
+  }
+  transfer->buffered = transfer->buffer_sent = 0;
+  if (fileio_submit_read(client, transfer->filefd, transfer->buffer,
+      PAGECACHE_DIRECT_CHUNK, transfer->offset) == 0) {
+    // Both belong to the read until it completes
+    transfer->buffer = NULL;
+    transfer->filefd = -1;
+    return 0;
+  }
+  ssize_t len;
+  while ((len = pread(transfer->filefd, transfer->buffer, PAGECACHE_DIRECT_CHUNK,
+    transfer->offset)) < 0 && errno == EINTR);
+  return direct_read(transfer, len);
+}
+
+/**
+ * Resume an O_DIRECT transfer once the pool read its next chunk.
+ */
+void sched_read_complete(client_t *client, int fd, char *buffer, ssize_t len, int err,
+  client_t **clients) {
+  client->io_pending = 0;
+  client->transfer.filefd = fd;
+  client->transfer.buffer = buffer;
+  if (direct_read(&client->transfer, len) < 0) {
+    LOG_DEBUG("read for %i failed: %s\n", client->clientfd, strerror(err));
+    finish(client);
+    finish_request(client);
+    delete_client(client->clientfd, clients);
+  }
+}
+
+/**
+ * Send up to budget bytes of the transfer. Returns the number of bytes sent
+ * or ERROR if the connection is broken.
+ */
+static ssize_t step(client_t *client, size_t budget) {
+  transfer_t *transfer = &client->transfer;
+  size_t sent = 0;
+  uint8_t head_pending = transfer->head_sent < transfer->head_len;
+  while (transfer->head_sent < transfer->head_len && sent < budget) {
+    ssize_t len = tls_write(client->clientfd, transfer->head + transfer->head_sent,
+      transfer->head_len - transfer->head_sent);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return sent;
+      return ERROR;
+    }
+    transfer->head_sent += len;
+    sent += len;
+  }
+  if (head_pending && transfer->head_sent == transfer->head_len)
+    TRACE_MARK(&client->request, TRACE_HEADERS);
+  if (client->upstream != NULL && transfer->head_sent == transfer->head_len && sent < budget) {
+    ssize_t len = upstream_send(client, budget - sent);
+    if (len < 0) return ERROR;
+    sent += len;
+  }
+  if (client->chunked != NULL && transfer->head_sent == transfer->head_len && sent < budget) {
+    ssize_t len = chunked_send(client, budget - sent);
+    if (len < 0) return ERROR;
+    sent += len;
+  }
+  while (transfer->policy == PAGECACHE_DIRECT && transfer->remaining > 0 &&
+    sent < budget) {
+    if (transfer->buffer_sent == transfer->buffered) {
+      if (read_direct(client) < 0) return ERROR;
+      // A short read is tried again on the next turn
+      if (client->io_pending || transfer->buffered == 0) break;
+    }
+    size_t count = transfer->buffered - transfer->buffer_sent;
+    if (count > budget - sent) count = budget - sent;
+    ssize_t len = tls_write(client->clientfd, transfer->buffer + transfer->buffer_sent, count);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return ERROR;
+    }
+    transfer->buffer_sent += len;
+    transfer->remaining -= len;
+    sent += len;
+  }
+  while (transfer->policy != PAGECACHE_DIRECT && transfer->remaining > 0 &&
+    sent < budget) {
+    size_t count = budget - sent < transfer->remaining ? budget - sent : transfer->remaining;
+    ssize_t len = tls_sendfile(client->clientfd, transfer->filefd, &transfer->offset, count);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return ERROR;
+    }
+    // The file shrunk under our feet
+    if (len == 0) return ERROR;
+    transfer->remaining -= len;
+    sent += len;
+    pagecache_sent(transfer, len);
+  }
+  client->request.bytes_sent += sent;
+  METRIC_ADD(queued_bytes, -sent);
+  if (sent > 0) transfer->progress_ns = now_ns();
+  return sent;
+}
+
+static uint8_t done(client_t *client) {
+  transfer_t *transfer = &client->transfer;
+  return transfer->head_sent == transfer->head_len && transfer->remaining == 0 &&
+    (client->upstream == NULL || upstream_done(client)) &&
+    (client->chunked == NULL || chunked_done(client));
+}
+
+/**
+ * Start sending a response made of head followed by size bytes of filefd
+ * (-1 for none) from offset, read according to its page cache policy. The
+ * transfer closes filefd. Short responses are written right away; whatever the socket
+ * does not take is queued. Returns ERROR if the connection is broken,
+ * otherwise 0 and client->transfer.active tells whether it was queued.
+ */
+int8_t sched_start(client_t *client, const char *head, size_t head_len,
+  int32_t filefd, off_t offset, size_t size, uint8_t policy) {
+  // The response of a stream
+  if (client->h2 != NULL) return h2_respond(client, head, head_len, filefd, offset, size, policy);
+  transfer_t *transfer = &client->transfer;
+  memset(transfer, 0, sizeof (transfer_t));
+  transfer->policy = policy;
+  transfer->offset = transfer->dropped = offset;
+  transfer->head = (char *) head;
+  transfer->head_len = head_len;
+  transfer->filefd = filefd;
+  transfer->remaining = filefd >= 0 ? size : 0;
+  transfer->active = 1;
+  transfer->start_ns = transfer->progress_ns = now_ns();
+  METRIC_INC(active_transfers);
+  METRIC_ADD(queued_bytes, head_len + transfer->remaining);
+  // Rate limited responses go through the scheduler from the first byte
+  if (!g_sched_connection_rate && !g_sched_global_rate) {
+    size_t budget = head_len + transfer->remaining <= SCHED_SHORT_RESPONSE ?
+      SCHED_SHORT_RESPONSE : head_len;
+    if (step(client, budget) < 0) {
+      transfer->head = NULL;
+      finish(client);
+      return ERROR;
+    }
+  }
+  if (done(client)) {
+    TRACE_MARK(&client->request, TRACE_BODY);
+    transfer->head = NULL;
+    finish(client);
+    return 0;
+  }
+  // Keep what is left of the headers, the caller owns head
+  size_t left = head_len - transfer->head_sent;
+  transfer->head = malloc(left ? left : 1);
+  if (transfer->head == NULL) {
+    perror("malloc");
+    finish(client);
+    return ERROR;
+  }
+  memcpy(transfer->head, head + transfer->head_sent, left);
+  transfer->head_len = left;
+  transfer->head_sent = 0;
+  return 0;
+}
+
+void sched_cancel(client_t *client) {
+  if (client->transfer.active) finish(client);
+  // Still waiting for the response head of its upstream or of its writer
+  else {
+    upstream_finish(client);
+    chunked_finish(client);
+  }
+}
+
+static uint8_t throttled(transfer_t *transfer, uint64_t now) {
+  uint64_t resume = transfer->resume_ns > g_global_resume_ns ?
+    transfer->resume_ns : g_global_resume_ns;
+  if (resume <= now) return 0;
+  if (g_next_resume_ns == 0 || resume < g_next_resume_ns) g_next_resume_ns = resume;
+  return 1;
+}
+
+/**
+ * Events to poll for on a connection: writability while it has a transfer
+ * that is not throttled, readability otherwise. HTTP/2 connections are read
+ * while they send, proxied and generated responses wait for their body.
+ */
+short sched_events(client_t *client, uint64_t now) {
+  transfer_t *transfer = &client->transfer;
+  if (client->h2 != NULL) {
+    short events = h2_events(client);
+    return events & POLLOUT && throttled(transfer, now) ? events & ~POLLOUT : events;
+  }
+  if (!transfer->active)
+    return client->upstream != NULL || client->chunked != NULL ? 0 : POLLIN;
+  if (throttled(transfer, now)) return 0;
+  if (client->upstream != NULL && transfer->head_sent == transfer->head_len &&
+    !upstream_ready(client)) return 0;
+  if (client->chunked != NULL && transfer->head_sent == transfer->head_len &&
+    !chunked_ready(client)) return 0;
+  return POLLOUT;
+}
+
+/**
+ * Milliseconds until a throttled transfer may resume, -1 if none is. To be
+ * called once sched_events was called for every connection.
+ */
+int sched_timeout() {
+  if (g_next_resume_ns == 0) return -1;
+  uint64_t now = now_ns();
+  int timeout = g_next_resume_ns > now ? (g_next_resume_ns - now + 999999) / 1000000 : 0;
+  g_next_resume_ns = 0;
+  return timeout;
+}
+
+/**
+ * Bytes the transfer is allowed to send now, 0 if throttled, in which case
+ * its resume time is set.
+ */
+static size_t allowance(transfer_t *transfer, uint64_t now) {
+  size_t budget = transfer->deficit;
+  if (g_sched_connection_rate) {
+    refill(&transfer->tokens, &transfer->refill_ns, g_sched_connection_rate, now);
+    if (transfer->tokens < 1) {
+      transfer->resume_ns = resume_time(transfer->tokens, SCHED_MIN_BURST,
+        g_sched_connection_rate, now);
+      return 0;
+    }
+    if (budget > transfer->tokens) budget = transfer->tokens;
+  }
+  if (g_sched_global_rate) {
+    if (g_global_tokens < 1) {
+      g_global_resume_ns = resume_time(g_global_tokens, SCHED_MIN_BURST,
+        g_sched_global_rate, now);
+      return 0;
+    }
+    if (budget > g_global_tokens) budget = g_global_tokens;
+  }
+  return budget;
+}
+
+static void turn(client_t *client, client_t **clients, uint64_t now) {
+  transfer_t *transfer = &client->transfer;
+  transfer->deficit += SCHED_QUANTUM;
+  // Credit is not hoarded by a transfer the socket keeps blocking
+  if (transfer->deficit > 2 * SCHED_QUANTUM) transfer->deficit = 2 * SCHED_QUANTUM;
+  size_t budget = allowance(transfer, now);
+  if (budget == 0) return;
+  ssize_t sent = client->h2 != NULL ? h2_send(client, budget) : step(client, budget);
+  if (sent < 0) {
+    LOG_DEBUG("transfer to %i failed: %s\n", client->clientfd, strerror(errno));
+    if (client->h2 == NULL) {
+      finish(client);
+      finish_request(client);
+    }
+    delete_client(client->clientfd, clients);
+    return;
+  }
+  transfer->deficit -= sent;
+  if (g_sched_connection_rate) transfer->tokens -= sent;
+  if (g_sched_global_rate) g_global_tokens -= sent;
+  if (client->h2 == NULL && done(client)) {
+    TRACE_MARK(&client->request, TRACE_BODY);
+    finish(client);
+    finish_request(client);
+  }
+}
+
+/**
+ * Give a turn to every writable transfer, the short ones first.
+ */
+void sched_run(struct pollfd *fds, size_t nfds, client_t **clients) {
+  uint64_t now = now_ns();
+  if (g_sched_global_rate)
+    refill(&g_global_tokens, &g_global_refill_ns, g_sched_global_rate, now);
+  for (uint8_t pass = 0; pass < 2; ++pass) {
+    for (size_t i = SOCKET_INDEX + 1; i < nfds; ++i) {
+      if (!(fds[i].revents & POLLOUT)) continue;
+      client_t *client = find_client(fds[i].fd);
+      if (client == NULL || (client->h2 == NULL && !client->transfer.active)) continue;
+      uint8_t short_response = client->h2 == NULL && client->transfer.remaining +
+        client->transfer.head_len - client->transfer.head_sent <= SCHED_SHORT_RESPONSE;
+      if (short_response != (pass == 0)) continue;
+      turn(client, clients, now);
+    }
+  }
+}
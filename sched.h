@@ -0,0 +1,33 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "defines.h"
+
+/**
+ * Bytes a transfer may send each time it gets its turn (deficit round
+ * robin). Responses up to SCHED_SHORT_RESPONSE bytes are sent inline when the
+ * socket allows it, and are served first when they have to be queued.
+ */
+#define SCHED_QUANTUM 65536
+#define SCHED_SHORT_RESPONSE 65536
+// Bucket size of the bandwidth caps, as a fraction of a second of traffic
+#define SCHED_BURST_DIVISOR 10
+#define SCHED_MIN_BURST 16384
+
+extern uint64_t g_sched_connection_rate;
+extern uint64_t g_sched_global_rate;
+
+int8_t sched_start(client_t *client, const char *head, size_t head_len,
+  int32_t filefd, off_t offset, size_t size, uint8_t policy);
+void sched_read_complete(client_t *client, int fd, char *buffer, ssize_t len, int err,
+  client_t **clients);
+short sched_events(client_t *client, uint64_t now);
+int sched_timeout();
+void sched_run(struct pollfd *fds, size_t nfds, client_t **clients);
+void sched_cancel(client_t *client);
+
+#endif // __SCHED_H__
@@ -0,0 +1,434 @@
+// strcasestr
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "defines.h"
+#include "hpack.h"
+#include "h2.h"
+
+/**
+ * Soak test: open connections to a server, make a request on each and keep
+ * them idle, then report the memory the server uses per connection. On the
+ * loopback the connections come from 127.0.0.1, 127.0.0.2... in turn, a
+ * source address only having some 28000 ephemeral ports.
+ *
+ * With -l, it loads pages of assets instead, the way a browser would: over
+ * HTTP/1.1 on PAGE_CONNECTIONS keep-alive connections each taking a request
+ * at a time, then over a single HTTP/2 connection (prior knowledge) with
+ * every asset requested at once, and compares their load times.
+ */
+
+#define DEFAULT_CONNECTIONS 100000
+#define CONNECTIONS_PER_SOURCE 20000
+#define DEFAULT_PAGES 100
+// Connections a browser opens to a host over HTTP/1.1
+#define PAGE_CONNECTIONS 6
+
+typedef struct {
+  uint32_t connections;
+  pid_t pid;
+  uint32_t hold;
+  const char *path;
+  // Assets of a page, 0 to hold idle connections
+  uint32_t assets;
+  uint32_t pages;
+} soak_options_t;
+
+// Resident memory of a process in KB, from /proc
+static long rss_kb(pid_t pid) {
+  char path[64];
+  char line[256];
+  long rss = -1;
+  snprintf(path, sizeof (path), "/proc/%i/status", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return -1;
+  while (fgets(line, sizeof (line), f) != NULL)
+    if (sscanf(line, "VmRSS: %ld kB", &rss) == 1) break;
+  fclose(f);
+  return rss;
+}
+
+// Memory of the TCP sockets of the whole system in pages
+static long tcp_pages() {
+  char line[256];
+  long pages = -1;
+  FILE *f = fopen("/proc/net/sockstat", "r");
+  if (f == NULL) return -1;
+  while (fgets(line, sizeof (line), f) != NULL) {
+    char *mem = strstr(line, " mem ");
+    if (!strncmp(line, "TCP:", 4) && mem != NULL) pages = strtol(mem + 5, NULL, 10);
+  }
+  fclose(f);
+  return pages;
+}
+
+static int request(struct sockaddr_in *addr, uint32_t i, const char *path) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return ERROR;
+  if ((ntohl(addr->sin_addr.s_addr) >> 24) == 127) {
+    struct sockaddr_in source;
+    memset(&source, 0, sizeof (source));
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(0x7f000001 + i / CONNECTIONS_PER_SOURCE);
+    // The port is picked by connect, a bind searching for one is quadratic
+    int one = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof (one));
+    if (bind(fd, (struct sockaddr *) &source, sizeof (source)) < 0) {
+      close(fd);
+      return ERROR;
+    }
+  }
+  char buffer[BUFFER_SIZE];
+  int len = snprintf(buffer, BUFFER_SIZE, "GET %s HTTP/1.1\r\nHost: soak\r\n\r\n", path);
+  if (connect(fd, (struct sockaddr *) addr, sizeof (*addr)) < 0 ||
+    write(fd, buffer, len) != len || read(fd, buffer, BUFFER_SIZE) <= 0) {
+    close(fd);
+    return ERROR;
+  }
+  return fd;
+}
+
+/** Page loads */
+
+static int page_connect(struct sockaddr_in *addr) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) addr, sizeof (*addr)) < 0) {
+    close(fd);
+    return ERROR;
+  }
+  return fd;
+}
+
+static int8_t write_all(int fd, const void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) return ERROR;
+    data = (const char *) data + n;
+    len -= n;
+  }
+  return 0;
+}
+
+typedef struct {
+  int fd;
+  // Next asset of the connection, then every PAGE_CONNECTIONS
+  uint32_t next;
+  char head[BUFFER_SIZE];
+  size_t head_len;
+  // Of the body being read, -1 while the head is
+  int64_t remaining;
+} page_conn_t;
+
+static int8_t h1_request(page_conn_t *conn, const char *format) {
+  char path[BUFFER_SIZE];
+  char request[BUFFER_SIZE];
+  snprintf(path, sizeof (path), format, conn->next);
+  int len = snprintf(request, sizeof (request), "GET %s HTTP/1.1\r\nHost: soak\r\n\r\n", path);
+  conn->head_len = 0;
+  conn->remaining = -1;
+  return write_all(conn->fd, request, len);
+}
+
+/**
+ * Read what arrived of the response on the connection. Returns 1 once it is
+ * complete, ERROR if it is not a 200 or the connection broke.
+ */
+static int8_t h1_response(page_conn_t *conn) {
+  if (conn->remaining >= 0) {
+    char body[65536];
+    ssize_t n = read(conn->fd, body, sizeof (body));
+    if (n <= 0) return ERROR;
+    conn->remaining -= n;
+    return conn->remaining <= 0;
+  }
+  ssize_t n = read(conn->fd, conn->head + conn->head_len, sizeof (conn->head) - 1 - conn->head_len);
+  if (n <= 0) return ERROR;
+  conn->head_len += n;
+  conn->head[conn->head_len] = '\0';
+  char *end = strstr(conn->head, "\r\n\r\n");
+  char *lf = strstr(conn->head, "\n\n");
+  size_t head_len;
+  if (end != NULL && (lf == NULL || end < lf)) head_len = end + 4 - conn->head;
+  else if (lf != NULL) head_len = lf + 2 - conn->head;
+  else return conn->head_len < sizeof (conn->head) - 1 ? 0 : ERROR;
+  char *length = strcasestr(conn->head, "Content-length:");
+  if (strncmp(conn->head + 8, " 200", 4) || length == NULL) return ERROR;
+  conn->remaining = strtoll(length + 15, NULL, 10) - (int64_t) (conn->head_len - head_len);
+  return conn->remaining <= 0;
+}
+
+/**
+ * Load the assets over HTTP/1.1, a request at a time on each connection.
+ * Returns the number of connections, ERROR if a request failed.
+ */
+static int8_t h1_page(struct sockaddr_in *addr, const char *format, uint32_t assets) {
+  page_conn_t conns[PAGE_CONNECTIONS];
+  struct pollfd fds[PAGE_CONNECTIONS];
+  uint32_t nconns = assets < PAGE_CONNECTIONS ? assets : PAGE_CONNECTIONS;
+  int8_t ret = 0;
+  uint32_t open = 0;
+  for (; open < nconns; ++open) {
+    conns[open].next = open;
+    if ((conns[open].fd = page_connect(addr)) < 0 || h1_request(&conns[open], format) < 0) {
+      if (conns[open].fd >= 0) close(conns[open].fd);
+      ret = ERROR;
+      break;
+    }
+  }
+  uint32_t busy = open;
+  while (ret == 0 && busy > 0) {
+    for (uint32_t i = 0; i < nconns; ++i) {
+      fds[i].fd = conns[i].next < assets ? conns[i].fd : -1;
+      fds[i].events = POLLIN;
+    }
+    if (poll(fds, nconns, -1) < 0 && errno != EINTR) ret = ERROR;
+    for (uint32_t i = 0; ret == 0 && i < nconns; ++i) {
+      if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      int8_t done = h1_response(&conns[i]);
+      if (done < 0) ret = ERROR;
+      else if (done && (conns[i].next += PAGE_CONNECTIONS) >= assets) --busy;
+      else if (done && h1_request(&conns[i], format) < 0) ret = ERROR;
+    }
+  }
+  for (uint32_t i = 0; i < open; ++i) close(conns[i].fd);
+  return ret < 0 ? ERROR : (int8_t) nconns;
+}
+
+static size_t h2_frame(uint8_t *out, uint8_t type, uint8_t flags, uint32_t id, size_t len) {
+  out[0] = len >> 16;
+  out[1] = len >> 8;
+  out[2] = len;
+  out[3] = type;
+  out[4] = flags;
+  out[5] = id >> 24;
+  out[6] = id >> 16;
+  out[7] = id >> 8;
+  out[8] = id;
+  return H2_FRAME_HEADER;
+}
+
+static size_t put_u32(uint8_t *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+  return 4;
+}
+
+/**
+ * Load the assets over one HTTP/2 connection, all of them requested at once
+ * and the windows opened so that the server is never held back. Returns 1,
+ * the number of connections, ERROR if a request failed.
+ */
+static int8_t h2_page(struct sockaddr_in *addr, const char *format, uint32_t assets) {
+  static uint8_t out[H2_MAX_STREAMS * (H2_FRAME_HEADER + 2 * BUFFER_SIZE) + 256];
+  static uint8_t in[2 * (H2_FRAME_HEADER + H2_MAX_FRAME)];
+  size_t len = 0;
+  memcpy(out, H2_PREFACE, H2_PREFACE_LEN);
+  len += H2_PREFACE_LEN;
+  len += h2_frame(out + len, H2_SETTINGS, 0, 0, 6);
+  out[len++] = 0;
+  out[len++] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+  len += put_u32(out + len, H2_MAX_WINDOW);
+  len += h2_frame(out + len, H2_WINDOW_UPDATE, 0, 0, 4);
+  len += put_u32(out + len, H2_MAX_WINDOW - H2_DEFAULT_WINDOW);
+  for (uint32_t i = 0; i < assets; ++i) {
+    char path[BUFFER_SIZE];
+    int path_len = snprintf(path, sizeof (path), format, i);
+    uint8_t *header = out + len;
+    size_t block = H2_FRAME_HEADER;
+    block += hpack_encode_header(header + block, BUFFER_SIZE, ":method", 7, "GET", 3);
+    block += hpack_encode_header(header + block, BUFFER_SIZE, ":scheme", 7, "http", 4);
+    block += hpack_encode_header(header + block, BUFFER_SIZE, ":authority", 10, "soak", 4);
+    block += hpack_encode_header(header + block, BUFFER_SIZE, ":path", 5, path, path_len);
+    h2_frame(header, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, 2 * i + 1,
+      block - H2_FRAME_HEADER);
+    len += block;
+  }
+  int fd = page_connect(addr);
+  if (fd < 0 || write_all(fd, out, len) < 0) {
+    if (fd >= 0) close(fd);
+    return ERROR;
+  }
+  uint32_t done = 0;
+  size_t in_len = 0;
+  while (done < assets) {
+    ssize_t n = read(fd, in + in_len, sizeof (in) - in_len);
+    if (n <= 0) break;
+    in_len += n;
+    size_t position = 0;
+    while (in_len - position >= H2_FRAME_HEADER) {
+      uint8_t *frame = in + position;
+      size_t frame_len = frame[0] << 16 | frame[1] << 8 | frame[2];
+      if (in_len - position < H2_FRAME_HEADER + frame_len) break;
+      uint8_t type = frame[3];
+      uint8_t flags = frame[4];
+      if (type == H2_RST_STREAM || type == H2_GOAWAY) {
+        close(fd);
+        return ERROR;
+      }
+      // A 200 HEADERS frame starts with the indexed :status 200
+      if (type == H2_HEADERS && (frame_len == 0 || frame[H2_FRAME_HEADER] != 0x88)) {
+        close(fd);
+        return ERROR;
+      }
+      if ((type == H2_DATA || type == H2_HEADERS) && flags & H2_FLAG_END_STREAM) ++done;
+      if (type == H2_SETTINGS && !(flags & H2_FLAG_ACK)) {
+        uint8_t ack[H2_FRAME_HEADER];
+        h2_frame(ack, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+        write_all(fd, ack, sizeof (ack));
+      }
+      position += H2_FRAME_HEADER + frame_len;
+    }
+    memmove(in, in + position, in_len - position);
+    in_len -= position;
+  }
+  close(fd);
+  return done == assets ? 1 : ERROR;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Load the pages with load, and report their load times. Returns ERROR if a
+ * page failed.
+ */
+static int8_t load_pages(const char *name, struct sockaddr_in *addr,
+  soak_options_t *options, int8_t (*load)(struct sockaddr_in *, const char *, uint32_t)) {
+  uint64_t *times = calloc(options->pages, sizeof (uint64_t));
+  if (times == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  int8_t connections = 0;
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < options->pages; ++i) {
+    uint64_t page_start = now_ns();
+    if ((connections = load(addr, options->path, options->assets)) < 0) {
+      fprintf(stderr, "%s page %u failed\n", name, i);
+      free(times);
+      return ERROR;
+    }
+    times[i] = now_ns() - page_start;
+  }
+  uint64_t elapsed = now_ns() - start;
+  qsort(times, options->pages, sizeof (uint64_t), compare_u64);
+  printf("%s: %u pages of %u assets on %i connections each, load time p50 %.2f ms "
+    "p99 %.2f ms, %.0f requests/s\n", name, options->pages, options->assets, connections,
+    times[options->pages / 2] / 1e6, times[options->pages * 99 / 100] / 1e6,
+    (double) options->pages * options->assets * 1e9 / elapsed);
+  free(times);
+  return 0;
+}
+
+void usage(char **argv) {
+  fprintf(stderr, "usage: %s [-n connections] [-p server_pid] [-t seconds] "
+    "[-r path] [-l assets [-i pages]] ip port\n", argv[0]);
+  fprintf(stderr, "  -n n     connections to open (default %i)\n", DEFAULT_CONNECTIONS);
+  fprintf(stderr, "  -p pid   measure the memory of that server process\n");
+  fprintf(stderr, "  -t s     keep the connections idle for s seconds\n");
+  fprintf(stderr, "  -r path  path requested on each connection (default /), with -l a\n"
+    "           format given the number of the asset (e.g. /assets/%%u.js)\n");
+  fprintf(stderr, "  -l n     load pages of n assets (at most %i) over HTTP/1.1 then HTTP/2\n",
+    H2_MAX_STREAMS);
+  fprintf(stderr, "  -i n     pages to load (default %i)\n", DEFAULT_PAGES);
+}
+
+int main(int argc, char **argv) {
+  soak_options_t options = { DEFAULT_CONNECTIONS, 0, 0, "/", 0, DEFAULT_PAGES };
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:t:r:l:i:")) != -1) {
+    switch (opt) {
+    case 'n': options.connections = strtoul(optarg, NULL, 10); break;
+    case 'p': options.pid = atoi(optarg); break;
+    case 't': options.hold = strtoul(optarg, NULL, 10); break;
+    case 'r': options.path = optarg; break;
+    case 'l': options.assets = strtoul(optarg, NULL, 10); break;
+    case 'i': options.pages = strtoul(optarg, NULL, 10); break;
+    default:
+      usage(argv);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || options.connections == 0 || options.assets > H2_MAX_STREAMS ||
+    options.pages == 0) {
+    usage(argv);
+    return 1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(argv[optind + 1]));
+  if (!inet_aton(argv[optind], &addr.sin_addr)) {
+    fprintf(stderr, "invalid address %s\n", argv[optind]);
+    return 1;
+  }
+  if (options.assets > 0)
+    return load_pages("HTTP/1.1", &addr, &options, h1_page) ||
+      load_pages("HTTP/2", &addr, &options, h2_page);
+  // This side needs a descriptor per connection too
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < options.connections + 16) {
+    options.connections = limit.rlim_cur - 16;
+    fprintf(stderr, "RLIMIT_NOFILE only allows %u connections\n", options.connections);
+  }
+
+  int *fds = calloc(options.connections, sizeof (int));
+  if (fds == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  long rss_before = options.pid ? rss_kb(options.pid) : -1;
+  long pages_before = tcp_pages();
+  uint32_t opened = 0;
+  for (uint32_t i = 0; i < options.connections; ++i) {
+    if ((fds[opened] = request(&addr, i, options.path)) < 0) {
+      fprintf(stderr, "connection %u failed: %s\n", i, strerror(errno));
+      break;
+    }
+    ++opened;
+    if (opened % 10000 == 0) fprintf(stderr, "%u connections\n", opened);
+  }
+  if (options.hold) sleep(options.hold);
+
+  // The server is expected to have kept all of them open, the rest of a
+  // response may still be waiting to be read
+  uint32_t alive = 0;
+  char buffer[BUFFER_SIZE];
+  for (uint32_t i = 0; i < opened; ++i) {
+    ssize_t n;
+    while ((n = recv(fds[i], buffer, BUFFER_SIZE, MSG_DONTWAIT)) > 0);
+    if (n < 0 && errno == EAGAIN) ++alive;
+  }
+  long rss_after = options.pid ? rss_kb(options.pid) : -1;
+  long pages_after = tcp_pages();
+  printf("%u connections opened, %u idle and open\n", opened, alive);
+  if (options.pid && rss_before >= 0 && rss_after >= 0 && opened > 0)
+    printf("server RSS %ld KB -> %ld KB, %.0f bytes per connection\n", rss_before,
+      rss_after, (rss_after - rss_before) * 1024.0 / opened);
+  if (pages_before >= 0 && pages_after >= 0 && opened > 0)
+    printf("kernel TCP memory %+ld KB, %.0f bytes per connection (both ends)\n",
+      (pages_after - pages_before) * 4, (pages_after - pages_before) * 4096.0 / opened);
+  for (uint32_t i = 0; i < opened; ++i) close(fds[i]);
+  free(fds);
+  return alive == options.connections ? 0 : 1;
+}
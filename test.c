@@ -1,8 +1,35 @@
+// memmem
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include "httpd.h"
+#include "metrics.h"
+#include "negcache.h"
+#include "resolve.h"
+#include "ratelimit.h"
+#include "admission.h"
+#include "hpack.h"
+#include "h2.h"
+#include "upstream.h"
+#include "proxycache.h"
+#include "gateway.h"
+#include "chunked.h"
+#include "accesslog.h"
 
 #define FAIL() { \
   ++totalres; \
@@ -108,8 +135,1334 @@ int8_t test_get_extension() {
   return totalres;
 }
 
+int8_t test_normalize_path() {
+  int8_t totalres = 0;
+  const char *cases[][3] = {
+    // target, path, query
+    { "/", "/", NULL },
+    { "/index.html", "/index.html", NULL },
+    { "/a%20b.html", "/a b.html", NULL },
+    { "/x/../index.html", "/index.html", NULL },
+    { "/?v=1", "/", "v=1" },
+    { "/a/b.css?v=1#top", "/a/b.css", "v=1" },
+    { "//a///b//", "/a/b/", NULL },
+    { "/a/./b/.", "/a/b/", NULL },
+    { "/a/b/..", "/a/", NULL },
+    { "/../../etc/passwd", "/etc/passwd", NULL },
+    { "/%2e%2e/%2E%2E/etc/passwd", "/etc/passwd", NULL },
+    { "/static/javascripts/application.js", "/static/javascripts/application.js", NULL },
+    { "/very/long/segment%2Fwith/encoded..slashes", "/very/long/segment/with/encoded..slashes", NULL },
+  };
+  for (uint8_t i = 0; i < sizeof (cases) / sizeof (cases[0]); ++i) {
+    char buffer[BUFFER_SIZE];
+    strcpy(buffer, cases[i][0]);
+    char *query;
+    ssize_t len = normalize_path(buffer, strlen(buffer), &query);
+    if (len != (ssize_t) strlen(cases[i][1]) || strcmp(buffer, cases[i][1])) FAIL();
+    if ((query == NULL) != (cases[i][2] == NULL)) FAIL();
+    if (query != NULL && cases[i][2] != NULL && strcmp(query, cases[i][2])) FAIL();
+  }
+
+  const char *malformed[] = { "", "index.html", "/a%2", "/a%zz", "/a%00b",
+    "/a%0Ab", "/a%0d%0a", "/%1B[31m", "/a%7F", "/a%1f" };
+  for (uint8_t i = 0; i < sizeof (malformed) / sizeof (malformed[0]); ++i) {
+    char buffer[BUFFER_SIZE];
+    strcpy(buffer, malformed[i]);
+    char *query;
+    if (normalize_path(buffer, strlen(buffer), &query) >= 0) FAIL();
+  }
+
+  return totalres;
+}
+
+int8_t test_latency_bucket() {
+  int8_t totalres = 0;
+
+  if (latency_bucket(0) != 0) FAIL();
+  if (latency_bucket(3) != 3) FAIL();
+  if (latency_bucket(4) != 4) FAIL();
+  if (latency_bucket(7) != 7) FAIL();
+  if (latency_bucket(8) != 8) FAIL();
+  if (latency_bucket(9) != 8) FAIL();
+  if (latency_bucket(10) != 9) FAIL();
+  if (latency_bucket(UINT64_MAX) != NB_LATENCY_BUCKETS - 1) FAIL();
+
+  // Every value falls below the upper bound of its bucket and above the
+  // upper bound of the previous one
+  uint64_t values[] = { 5, 100, 1000, 65535, 65536, 1000000007, 1ULL << 40 };
+  for (uint8_t i = 0; i < sizeof (values) / sizeof (values[0]); ++i) {
+    uint16_t bucket = latency_bucket(values[i]);
+    if (values[i] > latency_bucket_upper_bound(bucket)) FAIL();
+    if (values[i] <= latency_bucket_upper_bound(bucket - 1)) FAIL();
+  }
+
+  return totalres;
+}
+
+int8_t test_negcache() {
+  int8_t totalres = 0;
+  g_negcache_enabled = 1;
+
+  negcache_insert("wp-admin/setup.php");
+  negcache_insert("wp-admin/install.php");
+  negcache_insert("wp-admin.php");
+  if (!negcache_lookup("wp-admin/setup.php")) FAIL();
+  if (negcache_lookup("wp-admin/setup")) FAIL();
+  if (negcache_lookup("index.html")) FAIL();
+
+  // Creating a directory invalidates everything below it, not its siblings
+  negcache_invalidate("wp-admin");
+  if (negcache_lookup("wp-admin/setup.php")) FAIL();
+  if (negcache_lookup("wp-admin/install.php")) FAIL();
+  if (!negcache_lookup("wp-admin.php")) FAIL();
+
+  g_negcache_enabled = 0;
+  return totalres;
+}
+
+int8_t test_resolve_open() {
+  int8_t totalres = 0;
+  // The tests run from the source directory
+  if (resolve_init(".")) FAIL();
+
+  int fd = resolve_open("httpd.c", O_RDONLY, 0);
+  if (fd < 0) FAIL();
+  close(fd);
+  if (resolve_open("../etc/passwd", O_RDONLY, 0) >= 0 || errno != EXDEV) FAIL();
+  if (resolve_open("/etc/passwd", O_RDONLY, 0) >= 0 || errno != EXDEV) FAIL();
+  if (resolve_open("missing/../../httpd.c", O_RDONLY, 0) >= 0) FAIL();
+
+  return totalres;
+}
+
+int8_t test_parse_headers() {
+  int8_t totalres = 0;
+  request_t request;
+  memset(&request, 0, sizeof (request_t));
+  char s[] = "Host: localhost\r\nAccept-Encoding: deflate, gzip  \r\nReferer:\r\n\r\n";
+  if (parse_headers(s, &request) < 0) FAIL();
+  if (request.headers[HOST] == NULL || strcmp(request.headers[HOST], "localhost")) FAIL();
+  if (request.headers[ACCEPT_ENCODING] == NULL ||
+    strcmp(request.headers[ACCEPT_ENCODING], "deflate, gzip")) FAIL();
+  if (request.headers[REFERER] == NULL || strcmp(request.headers[REFERER], "")) FAIL();
+  for (uint8_t i = 0; i < NB_HEADERS; ++i) free(request.headers[i]);
+  // Longer than what an int8_t counts
+  memset(&request, 0, sizeof (request_t));
+  char upgrade[] = "Host: 127.0.0.1:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n"
+    "Connection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\n"
+    "HTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n\r\n";
+  if (parse_headers(upgrade, &request) != (ssize_t) strlen(upgrade)) FAIL();
+  if (request.headers[HTTP2_SETTINGS] == NULL ||
+    strcmp(request.headers[HTTP2_SETTINGS], "AAMAAABkAAQCAAAAAAIAAAAA")) FAIL();
+  for (uint8_t i = 0; i < NB_HEADERS; ++i) free(request.headers[i]);
+  return totalres;
+}
+
+int8_t test_ratelimit() {
+  int8_t totalres = 0;
+  // 2 requests per second, bursts of 3
+  if (ratelimit_init(2, 3, 256)) FAIL();
+  uint64_t a = 1ULL << 32 | 0x0100007f;
+  uint64_t b = 1ULL << 32 | 0x0200007f;
+  for (uint8_t i = 0; i < 3; ++i)
+    if (ratelimit_allow(a, 1000)) FAIL();
+  if (!ratelimit_allow(a, 1000)) FAIL();
+  // Buckets are independent
+  if (ratelimit_allow(b, 1000)) FAIL();
+  // Refilled at the rate, one token in 500ms
+  if (!ratelimit_allow(a, 1400)) FAIL();
+  if (ratelimit_allow(a, 1500)) FAIL();
+  if (!ratelimit_allow(a, 1500)) FAIL();
+  // But never above the burst
+  for (uint8_t i = 0; i < 3; ++i)
+    if (ratelimit_allow(a, 60000)) FAIL();
+  if (!ratelimit_allow(a, 60000)) FAIL();
+  ratelimit_stop();
+  return totalres;
+}
+
+int8_t test_admission() {
+  int8_t totalres = 0;
+  request_t first = { 0 };
+  request_t second = { 0 };
+  g_admission_max_in_flight = 1;
+  if (admission_check(&first)) FAIL();
+  if (!admission_check(&second)) FAIL();
+  // A shed request is not counted
+  admission_done(&second);
+  if (!admission_check(&second)) FAIL();
+  admission_done(&first);
+  if (admission_check(&second)) FAIL();
+  admission_done(&second);
+  g_admission_max_in_flight = 0;
+  return totalres;
+}
+
+static int8_t collect_header(void *context, const char *name, size_t name_len,
+  const char *value, size_t value_len) {
+  char *fields = context;
+  size_t len = strlen(fields);
+  snprintf(fields + len, BUFFER_SIZE - len, "%.*s: %.*s\n", (int) name_len, name,
+    (int) value_len, value);
+  return 0;
+}
+
+int8_t test_hpack() {
+  int8_t totalres = 0;
+  hpack_table_t table;
+  hpack_init(&table);
+  char fields[BUFFER_SIZE];
+  // The requests with Huffman coding of RFC 7541 C.4, on the same table
+  const uint8_t first[] = { 0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5,
+    0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff };
+  fields[0] = 0;
+  if (hpack_decode(&table, first, sizeof (first), collect_header, fields)) FAIL();
+  if (strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n"
+    ":authority: www.example.com\n")) FAIL();
+  if (table.count != 1 || table.size != 57) FAIL();
+  const uint8_t second[] = { 0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10,
+    0x64, 0x9c, 0xbf };
+  fields[0] = 0;
+  if (hpack_decode(&table, second, sizeof (second), collect_header, fields)) FAIL();
+  if (strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n"
+    ":authority: www.example.com\ncache-control: no-cache\n")) FAIL();
+  if (table.count != 2 || table.size != 110) FAIL();
+  const uint8_t third[] = { 0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49,
+    0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8,
+    0xb4, 0xbf };
+  fields[0] = 0;
+  if (hpack_decode(&table, third, sizeof (third), collect_header, fields)) FAIL();
+  if (strcmp(fields, ":method: GET\n:scheme: https\n:path: /index.html\n"
+    ":authority: www.example.com\ncustom-key: custom-value\n")) FAIL();
+  if (table.count != 3 || table.size != 164) FAIL();
+  // An index past the table and a padding that is not the EOS code
+  const uint8_t unknown[] = { 0xc1 };
+  if (!hpack_decode(&table, unknown, sizeof (unknown), collect_header, fields)) FAIL();
+  const uint8_t padding[] = { 0x82, 0x04, 0x81, 0x00 };
+  if (!hpack_decode(&table, padding, sizeof (padding), collect_header, fields)) FAIL();
+  hpack_free(&table);
+  if (table.count != 0 || table.size != 0) FAIL();
+
+  // What the encoder writes, the decoder reads
+  uint8_t block[256];
+  size_t len = hpack_encode_status(block, 200);
+  if (len != 1 || block[0] != 0x88) FAIL();
+  len += hpack_encode_status(block + len, 503);
+  len += hpack_encode_header(block + len, sizeof (block) - len, "content-type", 12,
+    "text/html", 9);
+  len += hpack_encode_header(block + len, sizeof (block) - len, "x-shttpd", 8, "1", 1);
+  hpack_init(&table);
+  fields[0] = 0;
+  if (hpack_decode(&table, block, len, collect_header, fields)) FAIL();
+  if (strcmp(fields, ":status: 200\n:status: 503\ncontent-type: text/html\n"
+    "x-shttpd: 1\n")) FAIL();
+  if (table.count != 0) FAIL();
+  if (hpack_encode_header(block, 16, "content-type", 12, "text/html", 9) != 0) FAIL();
+  return totalres;
+}
+
+int8_t test_h2_preface() {
+  int8_t totalres = 0;
+  if (h2_preface(H2_PREFACE, H2_PREFACE_LEN) != 1) FAIL();
+  // Frames may follow the preface in the same read
+  if (h2_preface(H2_PREFACE "\0\0\0\4", H2_PREFACE_LEN + 4) != 1) FAIL();
+  // A part of the preface waits for the rest
+  if (h2_preface("PRI * HTTP/2.0\r\n\r\n", 18) != 0) FAIL();
+  if (h2_preface("PRI", 3) != 0) FAIL();
+  if (h2_preface("GET / HTTP/1.1\r\n\r\n", 18) != ERROR) FAIL();
+  if (h2_preface("PRI * HTTP/2.0\r\n\r\nXX\r\n\r\n", H2_PREFACE_LEN) != ERROR) FAIL();
+  return totalres;
+}
+
+/**
+ * A server in the test process, turned by pump as by the loop of main: the
+ * listening socket first in g_server, then its clients.
+ */
+static client_t *g_server = NULL;
+static struct pollfd *g_fds = NULL;
+
+// A listening socket on the loopback, on port or any. Returns its port, 0 if
+// it failed.
+static uint16_t listen_loopback(int32_t *socketfd, uint16_t port) {
+  int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  socklen_t len = sizeof (addr);
+  if (fd < 0 || prepare_socket(fd, addr) < 0 ||
+    getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  *socketfd = fd;
+  return ntohs(addr.sin_port);
+}
+
+// Once the routes and pools are added. Returns the port, 0 if it failed.
+static uint16_t server_start() {
+  static uint8_t initialized = 0;
+  if (!initialized && clients_init()) return 0;
+  initialized = 1;
+  // Clients going away are seen as write errors
+  signal(SIGPIPE, SIG_IGN);
+  int32_t socketfd;
+  uint16_t port = listen_loopback(&socketfd, 0);
+  if (port == 0 || (g_fds = calloc(g_max_clients + 2 + upstream_max_fds() +
+    gateway_max_fds(), sizeof (struct pollfd))) == NULL) return 0;
+  add_client(socketfd, NULL, &g_server);
+  return port;
+}
+
+static void server_stop() {
+  delete_all_clients(&g_server);
+  free(g_fds);
+  g_fds = NULL;
+}
+
+static void pump(int timeout) {
+  size_t nclients = rebuild_fds(g_fds, g_server);
+  size_t nupstream = upstream_fds(&g_fds[nclients]);
+  size_t ngateway = gateway_fds(&g_fds[nclients + nupstream]);
+  poll_(g_fds, nclients + nupstream + ngateway, timeout);
+  serve(g_fds, nclients, g_server);
+  upstream_run(&g_fds[nclients], nupstream, &g_server);
+  gateway_run(&g_fds[nclients + nupstream], ngateway, &g_server);
+  upstream_tick(&g_server);
+  gateway_tick(&g_server);
+}
+
+// Send len bytes on the connection of a client, while the server turns
+static int8_t client_write_len(int32_t fd, const void *data, size_t len) {
+  for (uint8_t i = 0; i < 100; ++i) {
+    if (write(fd, data, len) == (ssize_t) len) return 0;
+    pump(1);
+  }
+  return ERROR;
+}
+
+static int8_t client_write(int32_t fd, const char *request) {
+  return client_write_len(fd, request, strlen(request));
+}
+
+// A client of the server, which has sent request. Its receive buffer is
+// rcvbuf bytes unless 0.
+static int32_t client_connect(uint16_t port, const char *request, int rcvbuf) {
+  int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (fd < 0 || (connect(fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 &&
+    errno != EINPROGRESS)) return ERROR;
+  if (client_write(fd, request) == 0) return fd;
+  close(fd);
+  return ERROR;
+}
+
+static int32_t client_send(uint16_t port, const char *request) {
+  return client_connect(port, request, 0);
+}
+
+// Value of the header of the response, NULL if none
+static const char *header_of(const char *response, size_t head_len, const char *name) {
+  size_t len = strlen(name);
+  for (const char *line = response; line != NULL && line < response + head_len;
+    line = memchr(line, '\n', response + head_len - line)) {
+    if (*line == '\n') ++line;
+    if (!strncasecmp(line, name, len) && line[len] == ':') return line + len + 2;
+  }
+  return NULL;
+}
+
+/**
+ * Read the next response of the client while the server turns, for
+ * timeout_ms at most: its head, then its Content-length or up to the end of
+ * the connection. Returns its length, 0 if it did not come.
+ */
+static size_t client_receive(int32_t fd, char *response, size_t size, uint64_t timeout_ms) {
+  size_t len = 0;
+  uint64_t deadline = now_ns() + timeout_ms * 1000000;
+  while (now_ns() < deadline) {
+    pump(5);
+    ssize_t n = 0;
+    while (len < size - 1 && (n = read(fd, response + len, size - 1 - len)) > 0) len += n;
+    response[len] = '\0';
+    const char *end = memmem(response, len, "\n\n", 2);
+    const char *crlf = memmem(response, len, "\n\r\n", 3);
+    if (end == NULL || (crlf != NULL && crlf < end)) end = crlf != NULL ? crlf + 3 : NULL;
+    else end += 2;
+    if (end == NULL) {
+      if (n == 0) return 0;
+      continue;
+    }
+    size_t head_len = end - response;
+    const char *length = header_of(response, head_len, "Content-length");
+    if (length != NULL && len >= head_len + strtoul(length, NULL, 10))
+      return head_len + strtoul(length, NULL, 10);
+    if (n == 0) return length == NULL ? len : 0;
+  }
+  return 0;
+}
+
+static uint16_t status_of_response(const char *response, size_t len) {
+  return len > 12 ? strtoul(response + 9, NULL, 10) : 0;
+}
+
+// What a stream of an HTTP/2 client received
+typedef struct {
+  // First byte of the header block, 0x88 for a 200
+  uint8_t status;
+  uint8_t ended;
+  size_t len;
+  // The DATA frames of the connection received before the last one of the
+  // stream
+  uint32_t last_frame;
+  char body[65536];
+} h2_body_t;
+
+/**
+ * An HTTP/2 client of the test server, speaking frames. The streams are 1, 3,
+ * 5 and 7.
+ */
+typedef struct {
+  int32_t fd;
+  uint8_t input[H2_FRAME_HEADER + H2_MAX_FRAME];
+  size_t input_len;
+  // Length of the frame returned last, still at the start of input
+  size_t frame_len;
+  uint32_t data_frames;
+  // Turns from a stream to another in the DATA frames
+  uint32_t switches;
+  uint32_t last_stream;
+  uint8_t settings_acks;
+  uint8_t ping_acks;
+  int64_t goaway;
+  h2_body_t streams[4];
+} h2_peer_t;
+
+static h2_peer_t g_peer;
+
+static int8_t peer_write(uint8_t type, uint8_t flags, uint32_t id, const void *payload,
+  size_t len) {
+  uint8_t frame[H2_FRAME_HEADER + H2_MAX_FRAME];
+  frame[0] = len >> 16;
+  frame[1] = len >> 8;
+  frame[2] = len;
+  frame[3] = type;
+  frame[4] = flags;
+  frame[5] = id >> 24;
+  frame[6] = id >> 16;
+  frame[7] = id >> 8;
+  frame[8] = id;
+  if (len > 0) memcpy(frame + H2_FRAME_HEADER, payload, len);
+  return client_write_len(g_peer.fd, frame, H2_FRAME_HEADER + len);
+}
+
+// A WINDOW_UPDATE or a RST_STREAM
+static int8_t peer_write_u32(uint8_t type, uint32_t id, uint32_t value) {
+  uint8_t payload[4] = { value >> 24, value >> 16, value >> 8, value };
+  return peer_write(type, 0, id, payload, 4);
+}
+
+static int8_t peer_setting(uint16_t key, uint32_t value) {
+  uint8_t payload[6] = { key >> 8, key, value >> 24, value >> 16, value >> 8, value };
+  return peer_write(H2_SETTINGS, 0, 0, payload, 6);
+}
+
+static size_t request_block(uint8_t *block, size_t size, const char *path) {
+  size_t len = hpack_encode_header(block, size, ":method", 7, "GET", 3);
+  len += hpack_encode_header(block + len, size - len, ":scheme", 7, "http", 4);
+  len += hpack_encode_header(block + len, size - len, ":authority", 10, "localhost", 9);
+  return len + hpack_encode_header(block + len, size - len, ":path", 5, path, strlen(path));
+}
+
+static int8_t peer_request(uint32_t id, const char *path) {
+  uint8_t block[256];
+  size_t len = request_block(block, sizeof (block), path);
+  return peer_write(H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, id, block, len);
+}
+
+// Connect with the preface, the server starting the connection
+static int8_t peer_open(uint16_t port, int rcvbuf) {
+  memset(&g_peer, 0, sizeof (h2_peer_t));
+  g_peer.goaway = -1;
+  if ((g_peer.fd = client_connect(port, H2_PREFACE, rcvbuf)) < 0) return ERROR;
+  for (uint8_t i = 0; i < 100; ++i) {
+    for (client_t *client = g_server; client != NULL; client = client->next)
+      if (client->h2 != NULL) return 0;
+    pump(1);
+  }
+  return ERROR;
+}
+
+static void peer_close() {
+  close(g_peer.fd);
+  for (uint8_t i = 0; i < 10; ++i) pump(1);
+}
+
+// The HTTP/2 connection of the server, NULL if none
+static h2_conn_t *server_conn() {
+  for (client_t *client = g_server; client != NULL; client = client->next)
+    if (client->h2 != NULL) return client->h2;
+  return NULL;
+}
+
+/**
+ * The next frame from the server, read within timeout_ms while the server
+ * turns. Returns its type, or ERROR if none came whole.
+ */
+static int16_t peer_frame(uint8_t *flags, uint32_t *id, uint8_t **payload, uint32_t *len,
+  uint64_t timeout_ms) {
+  h2_peer_t *peer = &g_peer;
+  memmove(peer->input, peer->input + peer->frame_len, peer->input_len - peer->frame_len);
+  peer->input_len -= peer->frame_len;
+  peer->frame_len = 0;
+  uint64_t deadline = now_ns() + timeout_ms * 1000000;
+  while (1) {
+    if (peer->input_len >= H2_FRAME_HEADER) {
+      uint8_t *frame = peer->input;
+      uint32_t size = (uint32_t) frame[0] << 16 | frame[1] << 8 | frame[2];
+      if (size > H2_MAX_FRAME) return ERROR;
+      if (peer->input_len >= H2_FRAME_HEADER + size) {
+        *flags = frame[4];
+        *id = ((uint32_t) frame[5] << 24 | frame[6] << 16 | frame[7] << 8 | frame[8]) &
+          H2_MAX_WINDOW;
+        *payload = frame + H2_FRAME_HEADER;
+        *len = size;
+        peer->frame_len = H2_FRAME_HEADER + size;
+        return frame[3];
+      }
+    }
+    if (now_ns() >= deadline) return ERROR;
+    pump(1);
+    ssize_t n = read(peer->fd, peer->input + peer->input_len,
+      sizeof (peer->input) - peer->input_len);
+    if (n == 0) return ERROR;
+    if (n > 0) peer->input_len += n;
+  }
+}
+
+/**
+ * Take the frames of the server until none came for quiet_ms. Returns ERROR
+ * if one of them was not for a stream of the client.
+ */
+static int8_t peer_receive(uint64_t quiet_ms) {
+  h2_peer_t *peer = &g_peer;
+  uint8_t flags;
+  uint32_t id;
+  uint8_t *payload;
+  uint32_t len;
+  int16_t type;
+  while ((type = peer_frame(&flags, &id, &payload, &len, quiet_ms)) >= 0) {
+    if (id >= 2 * sizeof (peer->streams) / sizeof (peer->streams[0]) || (id && !(id & 1)))
+      return ERROR;
+    h2_body_t *stream = &peer->streams[id / 2];
+    if (type == H2_SETTINGS && (flags & H2_FLAG_ACK)) ++peer->settings_acks;
+    else if (type == H2_PING && (flags & H2_FLAG_ACK)) ++peer->ping_acks;
+    else if (type == H2_GOAWAY && len >= 8)
+      peer->goaway = (uint32_t) payload[4] << 24 | payload[5] << 16 | payload[6] << 8 | payload[7];
+    else if (type == H2_HEADERS && len > 0) stream->status = payload[0];
+    else if (type == H2_DATA) {
+      if (id == 0) return ERROR;
+      if (stream->len + len <= sizeof (stream->body))
+        memcpy(stream->body + stream->len, payload, len);
+      stream->len += len;
+      stream->last_frame = peer->data_frames++;
+      if (peer->last_stream != 0 && peer->last_stream != id) ++peer->switches;
+      peer->last_stream = id;
+    }
+    if ((type == H2_HEADERS || type == H2_DATA) && (flags & H2_FLAG_END_STREAM))
+      stream->ended = 1;
+  }
+  return 0;
+}
+
+// Whether a stream received the content of the file
+static uint8_t received_file(h2_body_t *stream, const char *filename) {
+  static char content[65536];
+  int fd = open(filename, O_RDONLY);
+  ssize_t len = fd >= 0 ? read(fd, content, sizeof (content)) : -1;
+  if (fd >= 0) close(fd);
+  return stream->ended && len >= 0 && stream->len == (size_t) len &&
+    !memcmp(stream->body, content, len);
+}
+
+int8_t test_h2_streams() {
+  int8_t totalres = 0;
+  uint16_t port = server_start();
+  if (port == 0 || peer_open(port, 0)) {
+    FAIL();
+    server_stop();
+    return totalres;
+  }
+  h2_body_t *first = &g_peer.streams[0];
+  h2_body_t *second = &g_peer.streams[1];
+
+  // The streams stop at their windows
+  if (peer_setting(H2_SETTINGS_INITIAL_WINDOW_SIZE, 4096) || peer_request(1, "/httpd.c") ||
+    peer_request(3, "/h2.c") || peer_receive(200)) FAIL();
+  if (g_peer.settings_acks != 1 || first->status != 0x88 || second->status != 0x88) FAIL();
+  if (first->len != 4096 || second->len != 4096 || first->ended || second->ended) FAIL();
+  // A new initial window applies to the open streams
+  if (peer_setting(H2_SETTINGS_INITIAL_WINDOW_SIZE, 8192) || peer_receive(200)) FAIL();
+  if (g_peer.settings_acks != 2 || first->len != 8192 || second->len != 8192) FAIL();
+  // Then the window of the connection
+  if (peer_write_u32(H2_WINDOW_UPDATE, 1, 1 << 20) ||
+    peer_write_u32(H2_WINDOW_UPDATE, 3, 1 << 20) || peer_receive(200)) FAIL();
+  if (first->len + second->len != H2_DEFAULT_WINDOW || (first->ended && second->ended)) FAIL();
+  // The streams take turns until their ends
+  if (peer_write_u32(H2_WINDOW_UPDATE, 0, 1 << 20) || peer_receive(200)) FAIL();
+  if (!received_file(first, "httpd.c") || !received_file(second, "h2.c")) FAIL();
+  if (g_peer.switches < 4 || g_peer.goaway >= 0) FAIL();
+  if (server_conn() == NULL || server_conn()->streams != NULL) FAIL();
+  peer_close();
+
+  // A block split in CONTINUATION frames, in the middle of a field
+  uint8_t block[256];
+  size_t len = request_block(block, sizeof (block), "/README.md");
+  if (peer_open(port, 0) || peer_write(H2_HEADERS, H2_FLAG_END_STREAM, 1, block, 5) ||
+    peer_write(H2_CONTINUATION, 0, 1, block + 5, 20) ||
+    peer_write(H2_CONTINUATION, H2_FLAG_END_HEADERS, 1, block + 25, len - 25) ||
+    peer_receive(200)) FAIL();
+  if (g_peer.streams[0].status != 0x88 || !received_file(&g_peer.streams[0], "README.md"))
+    FAIL();
+  // Nothing comes between them
+  uint8_t ping[8] = { 0 };
+  if (peer_write(H2_HEADERS, H2_FLAG_END_STREAM, 3, block, 5) ||
+    peer_write(H2_PING, 0, 0, ping, 8)) FAIL();
+  peer_receive(200);
+  if (g_peer.goaway != H2_PROTOCOL_ERROR || g_peer.ping_acks != 0) FAIL();
+  peer_close();
+
+  server_stop();
+  return totalres;
+}
+
+int8_t test_h2_reset() {
+  int8_t totalres = 0;
+  uint16_t port = server_start();
+  // Small socket buffers, for a DATA frame to be cut short by a full socket
+  int size = 4096;
+  h2_conn_t *conn = port != 0 && peer_open(port, size) == 0 ? server_conn() : NULL;
+  if (conn == NULL) {
+    FAIL();
+    server_stop();
+    return totalres;
+  }
+  for (client_t *client = g_server; client != NULL; client = client->next)
+    if (client->h2 == conn)
+      setsockopt(client->clientfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+  if (peer_request(1, "/httpd.c")) FAIL();
+  for (uint16_t i = 0; i < 100; ++i) pump(1);
+  h2_stream_t *stream = conn->sending;
+  if (stream == NULL || stream->id != 1 || !conn->frame_left) FAIL();
+
+  // The frame being sent is finished, the others are not sent
+  if (peer_write_u32(H2_RST_STREAM, 1, H2_NO_ERROR)) FAIL();
+  for (uint16_t i = 0; i < 100 && conn->sending == stream && stream->transfer.remaining > 0;
+    ++i) pump(1);
+  if (stream == NULL || conn->sending != stream || stream->transfer.remaining > 0) FAIL();
+  // And the frames that follow it can be read
+  uint8_t ping[8] = { 0 };
+  if (peer_write(H2_PING, 0, 0, ping, 8) || peer_request(3, "/README.md") ||
+    peer_receive(200)) FAIL();
+  if (g_peer.streams[0].ended || g_peer.streams[0].len >= 37019) FAIL();
+  if (g_peer.ping_acks != 1 || !received_file(&g_peer.streams[1], "README.md")) FAIL();
+  if (conn->sending != NULL || conn->streams != NULL || g_peer.goaway >= 0) FAIL();
+  peer_close();
+
+  server_stop();
+  return totalres;
+}
+
+#define BACKEND_BIG_SIZE 1048576
+static char g_big[BACKEND_BIG_SIZE];
+
+static void backend_write(int32_t fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) _exit(1);
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * Answer the requests of a connection to a stand-in backend by the end of
+ * their path: /slow after 300ms, /hang never, /garbage with no HTTP, /big
+ * with g_big; /drop-next has the next request of the connection dropped by
+ * closing it. The others get "ok", all of them telling the backend and the
+ * connection, and those under /cached may be cached for a minute.
+ */
+static void backend_serve(int32_t fd, char name, uint32_t serial) {
+  char request[4096];
+  size_t len = 0;
+  uint8_t drop = 0;
+  while (1) {
+    ssize_t n = read(fd, request + len, sizeof (request) - 1 - len);
+    if (n <= 0) _exit(0);
+    len += n;
+    request[len] = '\0';
+    if (strstr(request, "\r\n\r\n") == NULL) continue;
+    if (drop) _exit(0);
+    if (strstr(request, "/slow ") != NULL) usleep(300000);
+    if (strstr(request, "/hang ") != NULL) pause();
+    if (strstr(request, "/garbage ") != NULL) {
+      backend_write(fd, "garbage\r\n\r\n", 11);
+      _exit(0);
+    }
+    uint8_t big = strstr(request, "/big ") != NULL;
+    char head[256];
+    int head_len = snprintf(head, sizeof (head), "HTTP/1.0 200 OK\r\n"
+      "Content-Length: %i\r\nConnection: keep-alive\r\n"
+      "X-Backend: %c\r\nX-Connection: %u\r\n%s\r\n", big ? BACKEND_BIG_SIZE : 2, name, serial,
+      strstr(request, " /cached/") != NULL ? "Cache-Control: max-age=60\r\n" : "");
+    backend_write(fd, head, head_len);
+    backend_write(fd, big ? g_big : "ok", big ? BACKEND_BIG_SIZE : 2);
+    drop = strstr(request, "/drop-next ") != NULL;
+    len = 0;
+  }
+}
+
+/**
+ * Start a stand-in backend accepting on socketfd, a process per connection
+ * in the process group of the backend, so that it is stopped as a whole.
+ */
+static pid_t backend_start(int32_t socketfd, char name) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  setpgid(0, 0);
+  signal(SIGCHLD, SIG_IGN);
+  fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) & ~O_NONBLOCK);
+  for (uint32_t serial = 1; ; ++serial) {
+    int32_t fd = accept(socketfd, NULL, NULL);
+    if (fd < 0) _exit(1);
+    if (fork() == 0) backend_serve(fd, name, serial);
+    close(fd);
+  }
+}
+
+static void backend_stop(pid_t pid) {
+  kill(-pid, SIGKILL);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+static int32_t g_busy[UPSTREAM_MAX_CONNECTIONS];
+
+int8_t test_upstream() {
+  int8_t totalres = 0;
+  for (size_t i = 0; i < BACKEND_BIG_SIZE; ++i) g_big[i] = 'a' + i % 23;
+  int32_t fda, fdb, fdc, fdd;
+  uint16_t a = listen_loopback(&fda, 0);
+  uint16_t b = listen_loopback(&fdb, 0);
+  uint16_t c = listen_loopback(&fdc, 0);
+  // Down until it is started
+  uint16_t d = listen_loopback(&fdd, 0);
+  if (!a || !b || !c || !d) {
+    FAIL();
+    return totalres;
+  }
+  close(fdd);
+  pid_t backend_a = backend_start(fda, 'a');
+  pid_t backend_b = backend_start(fdb, 'b');
+  pid_t backend_c = backend_start(fdc, 'c');
+  pid_t backend_d = -1;
+  close(fda);
+  close(fdb);
+  close(fdc);
+  char spec[128];
+  snprintf(spec, sizeof (spec), "/pool=127.0.0.1:%u", a);
+  if (upstream_add_route(spec)) FAIL();
+  snprintf(spec, sizeof (spec), "/pair=127.0.0.1:%u,127.0.0.1:%u", a, b);
+  if (upstream_add_route(spec)) FAIL();
+  snprintf(spec, sizeof (spec), "/busy=127.0.0.1:%u", c);
+  if (upstream_add_route(spec)) FAIL();
+  snprintf(spec, sizeof (spec), "/flaky=127.0.0.1:%u,127.0.0.1:%u", d, b);
+  if (upstream_add_route(spec)) FAIL();
+  snprintf(spec, sizeof (spec), "/down=127.0.0.1:%u", d);
+  if (upstream_add_route(spec)) FAIL();
+  uint16_t port;
+  if (upstream_init() || (port = server_start()) == 0) {
+    FAIL();
+    upstream_stop();
+    backend_stop(backend_a);
+    backend_stop(backend_b);
+    backend_stop(backend_c);
+    return totalres;
+  }
+  static char response[BACKEND_BIG_SIZE + 1024];
+  size_t len;
+  const char *value;
+
+  // The connection goes back to the pool and is taken again
+  int32_t fd = client_send(port, "GET /pool/ok HTTP/1.1\r\n\r\n");
+  if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 || strcmp(response + len - 2, "ok") ||
+    (value = header_of(response, len, "X-Connection")) == NULL) FAIL();
+  uint32_t first = value != NULL ? strtoul(value, NULL, 10) : 0;
+  if (client_write(fd, "GET /pool/drop-next HTTP/1.1\r\n\r\n")) FAIL();
+  if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 ||
+    (value = header_of(response, len, "X-Connection")) == NULL ||
+    strtoul(value, NULL, 10) != first) FAIL();
+  // The backend closes it as the next request comes, which is sent again on
+  // a new connection
+  if (client_write(fd, "GET /pool/ok HTTP/1.1\r\n\r\n")) FAIL();
+  if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 ||
+    (value = header_of(response, len, "X-Connection")) == NULL ||
+    strtoul(value, NULL, 10) == first) FAIL();
+  // Spliced to the client
+  if (client_write(fd, "GET /pool/big HTTP/1.1\r\n\r\n")) FAIL();
+  if ((len = client_receive(fd, response, sizeof (response), 5000)) < BACKEND_BIG_SIZE ||
+    status_of_response(response, len) != 200 ||
+    memcmp(response + len - BACKEND_BIG_SIZE, g_big, BACKEND_BIG_SIZE)) FAIL();
+  close(fd);
+  fd = client_send(port, "GET /pool/garbage HTTP/1.1\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 2000)) != 502)
+    FAIL();
+  close(fd);
+
+  // The least loaded backend is picked: the first request holds one, the
+  // next ones go to the other, turns or not
+  int32_t slow = client_send(port, "GET /pair/slow HTTP/1.1\r\n\r\n");
+  for (uint8_t i = 0; i < 10; ++i) pump(1);
+  char other = 0;
+  for (uint8_t i = 0; i < 2; ++i) {
+    fd = client_send(port, "GET /pair/ok HTTP/1.1\r\n\r\n");
+    if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+      (value = header_of(response, len, "X-Backend")) == NULL ||
+      (other != 0 && *value != other)) FAIL();
+    if (value != NULL) other = *value;
+    close(fd);
+  }
+  if ((len = client_receive(slow, response, sizeof (response), 2000)) == 0 ||
+    (value = header_of(response, len, "X-Backend")) == NULL || *value == other) FAIL();
+  close(slow);
+
+  // A backend with as many requests as connections allowed takes no more
+  for (uint32_t i = 0; i < UPSTREAM_MAX_CONNECTIONS; ++i)
+    g_busy[i] = client_send(port, "GET /busy/hang HTTP/1.1\r\n\r\n");
+  for (uint8_t i = 0; i < 20; ++i) pump(5);
+  fd = client_send(port, "GET /busy/ok HTTP/1.1\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 2000)) != 503)
+    FAIL();
+  close(fd);
+  for (uint32_t i = 0; i < UPSTREAM_MAX_CONNECTIONS; ++i) close(g_busy[i]);
+  // Nor a response head in time
+  g_upstream_timeout_ms = 300;
+  fd = client_send(port, "GET /pool/hang HTTP/1.1\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 2000)) != 504)
+    FAIL();
+  close(fd);
+  g_upstream_timeout_ms = UPSTREAM_TIMEOUT_MS;
+
+  // A backend down is left out, or retried on another one
+  fd = client_send(port, "GET /flaky/ok HTTP/1.1\r\n\r\n");
+  if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 ||
+    (value = header_of(response, len, "X-Backend")) == NULL || *value != 'b') FAIL();
+  close(fd);
+  fd = client_send(port, "GET /down/ok HTTP/1.1\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 2000)) != 502)
+    FAIL();
+  close(fd);
+  // And back once the health check connects to it
+  if (listen_loopback(&fdd, d) != d) {
+    FAIL();
+  } else {
+    backend_d = backend_start(fdd, 'd');
+    close(fdd);
+  }
+  uint64_t deadline = now_ns() + (UPSTREAM_HEALTH_INTERVAL_MS + 1000) * 1000000ULL;
+  uint16_t status = 0;
+  while (status != 200 && now_ns() < deadline) {
+    fd = client_send(port, "GET /down/ok HTTP/1.1\r\n\r\n");
+    status = status_of_response(response, client_receive(fd, response, sizeof (response), 2000));
+    close(fd);
+    for (uint8_t i = 0; status != 200 && i < 20; ++i) pump(5);
+  }
+  if (status != 200) FAIL();
+
+  server_stop();
+  upstream_stop();
+  backend_stop(backend_a);
+  backend_stop(backend_b);
+  backend_stop(backend_c);
+  if (backend_d > 0) backend_stop(backend_d);
+  return totalres;
+}
+
+int8_t test_upstream_match() {
+  int8_t totalres = 0;
+  request_t request;
+  memset(&request, 0, sizeof (request_t));
+  if (upstream_add_route("api=127.0.0.1:8080") != ERROR) FAIL();
+  if (upstream_add_route("/api") != ERROR) FAIL();
+  if (upstream_add_route("/api=") != ERROR) FAIL();
+  if (upstream_add_route("/api=nowhere:8080") != ERROR) FAIL();
+  upstream_stop();
+  if (upstream_add_route("/api/=127.0.0.1:8080,localhost:8081")) FAIL();
+  if (upstream_add_route("/api/v2=127.0.0.1:8082")) FAIL();
+  request.path = "api/users";
+  if (!upstream_match(&request)) FAIL();
+  request.path = "api";
+  if (!upstream_match(&request)) FAIL();
+  // Whole path segments only
+  request.path = "apiary/index.html";
+  if (upstream_match(&request)) FAIL();
+  request.path = "static/api";
+  if (upstream_match(&request)) FAIL();
+  // The index appended to the directories is not part of the prefix
+  request.path = "api/" DEFAULT_INDEX;
+  request.directory = 1;
+  if (!upstream_match(&request)) FAIL();
+  request.path = DEFAULT_INDEX;
+  if (upstream_match(&request)) FAIL();
+  upstream_stop();
+  request.path = "api/users";
+  request.directory = 0;
+  if (upstream_match(&request)) FAIL();
+  return totalres;
+}
+
+int8_t test_proxycache() {
+  int8_t totalres = 0;
+  proxycache_times_t times;
+  const char *head = "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=60\r\n"
+    "Vary: Accept-Encoding\r\nAge: 10\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times)) FAIL();
+  if (times.fresh_until - times.stored != 60 || times.stale_until != times.fresh_until) FAIL();
+  if (time(NULL) - times.stored < 10) FAIL();
+  if (proxycache_lifetime(head, strlen(head), 206, &times) != ERROR) FAIL();
+  head = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, s-maxage=5, "
+    "stale-while-revalidate=30\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times)) FAIL();
+  if (times.fresh_until - times.stored != 5 || times.stale_until - times.fresh_until != 30) FAIL();
+  head = "HTTP/1.1 200 OK\r\nCache-Control: max-age=0, must-revalidate, "
+    "stale-while-revalidate=30\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times) != ERROR) FAIL();
+  head = "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "Expires: Sun, 06 Nov 1994 08:50:37 GMT\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times)) FAIL();
+  if (times.fresh_until - times.stored != 60) FAIL();
+  head = "HTTP/1.1 200 OK\r\nExpires: 0\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times) != ERROR) FAIL();
+  head = "HTTP/1.1 200 OK\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times) != ERROR) FAIL();
+  head = "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times) != ERROR) FAIL();
+  head = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nSet-Cookie: a=b\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times) != ERROR) FAIL();
+  head = "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nVary: Cookie\r\n\r\n";
+  if (proxycache_lifetime(head, strlen(head), 200, &times) != ERROR) FAIL();
+
+  char response[] = "HTTP/1.1 200 OK\r\nAge: 3\r\nContent-Length: 5\r\n\r\n";
+  size_t len = proxycache_head(response, strlen(response));
+  if (len != 36 || strncmp(response, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n", len)) FAIL();
+  proxycache_state_e state;
+  if (proxycache_init(1024, NULL, 0)) FAIL();
+  times.stored = time(NULL);
+  times.fresh_until = times.stored + 60;
+  times.stale_until = times.fresh_until;
+  if (proxycache_store("a", response, len, "hello", 5, &times)) FAIL();
+  proxycache_entry_t *entry = proxycache_lookup("a", &state);
+  if (entry == NULL || state != PROXYCACHE_FRESH || entry->body_len != 5 ||
+    strncmp(entry->data + entry->head_len, "hello", 5)) FAIL();
+  times.fresh_until = times.stored - 1;
+  times.stale_until = times.stored + 60;
+  if (proxycache_store("b", response, len, "hello", 5, &times)) FAIL();
+  if (proxycache_lookup("b", &state) == NULL || state != PROXYCACHE_STALE) FAIL();
+  // Too large for the memory, without a store
+  char body[1024];
+  memset(body, 'x', sizeof (body));
+  if (proxycache_store("c", response, len, body, sizeof (body), &times) != ERROR) FAIL();
+  if (proxycache_store("c", response, len, body, 960, &times)) FAIL();
+  if (proxycache_lookup("c", &state) == NULL) FAIL();
+  // The least recently used entries made room
+  if (proxycache_lookup("a", &state) != NULL || proxycache_lookup("b", &state) != NULL) FAIL();
+  proxycache_remove("c");
+  if (proxycache_lookup("c", &state) != NULL) FAIL();
+  proxycache_stop();
+  return totalres;
+}
+
+#define STORE_TEST_BODY (400 * 1024)
+static char g_store_body[STORE_TEST_BODY];
+
+int8_t test_proxycache_store() {
+  int8_t totalres = 0;
+  char path[] = "/tmp/shttpd-store-XXXXXX";
+  int32_t fd = mkstemp(path);
+  if (fd < 0) {
+    FAIL();
+    return totalres;
+  }
+  close(fd);
+  // Room for five records, and for one entry in memory
+  uint64_t size = PROXYCACHE_SUPERBLOCK + 2 * PROXYCACHE_MAX_OBJECT;
+  size_t memory = STORE_TEST_BODY + STORE_TEST_BODY / 2;
+  const char *head = "HTTP/1.1 200 OK\r\n";
+  proxycache_times_t times;
+  times.stored = time(NULL);
+  times.fresh_until = times.stale_until = times.stored + 60;
+  proxycache_state_e state;
+  proxycache_entry_t *entry;
+  if (proxycache_init(memory, path, size)) FAIL();
+  // Each one moves the previous one to the store, which wraps
+  char key[2] = { 0, 0 };
+  for (key[0] = '0'; key[0] <= '9'; ++key[0]) {
+    memset(g_store_body, key[0], STORE_TEST_BODY);
+    if (proxycache_store(key, head, strlen(head), g_store_body, STORE_TEST_BODY, &times))
+      FAIL();
+  }
+  // The oldest records were overwritten, the others come back to memory
+  if (proxycache_lookup("0", &state) != NULL || proxycache_lookup("1", &state) != NULL) FAIL();
+  for (key[0] = '9'; key[0] >= '7'; --key[0]) {
+    if ((entry = proxycache_lookup(key, &state)) == NULL || state != PROXYCACHE_FRESH ||
+      entry->body_len != STORE_TEST_BODY || entry->data[entry->head_len] != key[0] ||
+      entry->data[entry->head_len + STORE_TEST_BODY - 1] != key[0]) FAIL();
+  }
+  // Released cleanly, the store is found again by the next process
+  proxycache_stop();
+  if (proxycache_init(memory, path, size)) FAIL();
+  for (key[0] = '9'; key[0] >= '7'; --key[0]) {
+    if ((entry = proxycache_lookup(key, &state)) == NULL ||
+      entry->body_len != STORE_TEST_BODY || entry->data[entry->head_len] != key[0] ||
+      entry->data[entry->head_len + STORE_TEST_BODY - 1] != key[0]) FAIL();
+  }
+  if (proxycache_lookup("0", &state) != NULL) FAIL();
+  proxycache_stop();
+  // But not after a crash
+  pid_t pid = fork();
+  if (pid == 0) _exit(proxycache_init(memory, path, size) ? 1 : 0);
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+    WEXITSTATUS(status) != 0) FAIL();
+  if (proxycache_init(memory, path, size)) FAIL();
+  if (proxycache_lookup("9", &state) != NULL) FAIL();
+  proxycache_stop();
+  unlink(path);
+  return totalres;
+}
+
+int8_t test_proxycache_flights() {
+  int8_t totalres = 0;
+  int32_t socketfd;
+  uint16_t port = listen_loopback(&socketfd, 0);
+  char spec[64];
+  snprintf(spec, sizeof (spec), "/cached=127.0.0.1:%u", port);
+  if (port == 0 || upstream_add_route(spec)) {
+    FAIL();
+    return totalres;
+  }
+  pid_t backend = backend_start(socketfd, 'a');
+  close(socketfd);
+  if (proxycache_init(PROXYCACHE_MAX_OBJECT, NULL, 0) || upstream_init() ||
+    (port = server_start()) == 0) {
+    FAIL();
+    proxycache_stop();
+    upstream_stop();
+    backend_stop(backend);
+    return totalres;
+  }
+  static char response[4096];
+  size_t len;
+  const char *value;
+  // The second request misses the cache while the first one is fetched,
+  // and waits for its response rather than going to the backend
+  int32_t first = client_send(port, "GET /cached/slow HTTP/1.1\r\n\r\n");
+  for (uint8_t i = 0; i < 10; ++i) pump(1);
+  int32_t second = client_send(port, "GET /cached/slow HTTP/1.1\r\n\r\n");
+  uint32_t connection = 0;
+  if ((len = client_receive(first, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 || strcmp(response + len - 2, "ok") ||
+    (value = header_of(response, len, "X-Connection")) == NULL) FAIL();
+  if (value != NULL) connection = strtoul(value, NULL, 10);
+  if ((len = client_receive(second, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 || strcmp(response + len - 2, "ok") ||
+    (value = header_of(response, len, "X-Connection")) == NULL ||
+    strtoul(value, NULL, 10) != connection) FAIL();
+  close(second);
+  // Then it is in the cache
+  uint64_t start = now_ns();
+  if (client_write(first, "GET /cached/slow HTTP/1.1\r\n\r\n")) FAIL();
+  if ((len = client_receive(first, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 || now_ns() - start > 200000000 ||
+    (value = header_of(response, len, "X-Connection")) == NULL ||
+    strtoul(value, NULL, 10) != connection) FAIL();
+  close(first);
+  server_stop();
+  upstream_stop();
+  proxycache_stop();
+  backend_stop(backend);
+  return totalres;
+}
+
+int8_t test_gateway() {
+  int8_t totalres = 0;
+  char frame[GATEWAY_FRAME_HEADER];
+  gateway_frame_header(frame, GATEWAY_DATA, 0x0102, 0x03040506);
+  if (memcmp(frame, "\x04\x00\x01\x02\x03\x04\x05\x06", GATEWAY_FRAME_HEADER)) FAIL();
+  if (gateway_add_pool("app=sh") != ERROR) FAIL();
+  if (gateway_add_pool("/app") != ERROR) FAIL();
+  if (gateway_add_pool("/app=") != ERROR) FAIL();
+  if (gateway_add_pool("/cgi-bin/=./app")) FAIL();
+  request_t request;
+  memset(&request, 0, sizeof (request_t));
+  request.path = "cgi-bin/users";
+  if (!gateway_match(&request)) FAIL();
+  request.path = "cgi-binary";
+  if (gateway_match(&request)) FAIL();
+  gateway_stop();
+  request.path = "cgi-bin/users";
+  if (gateway_match(&request)) FAIL();
+  char out[256];
+  uint16_t code;
+  const char *head = "Status: 404 Not Found\nContent-Type: text/plain\r\n"
+    "Content-Length: 3\nConnection: keep-alive\n";
+  ssize_t len = gateway_response_head(head, strlen(head), 1, out, sizeof (out), &code);
+  const char *expected = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+    "Transfer-Encoding: chunked\r\n\r\n";
+  if (code != 404 || len != (ssize_t) strlen(expected) || memcmp(out, expected, len)) FAIL();
+  // 200 by default, the reason of a known status filled in
+  len = gateway_response_head("X-A: 1", 6, 0, out, sizeof (out), &code);
+  expected = "HTTP/1.1 200 OK\r\nX-A: 1\r\nConnection: close\r\n\r\n";
+  if (code != 200 || len != (ssize_t) strlen(expected) || memcmp(out, expected, len)) FAIL();
+  len = gateway_response_head("Status: 304", 11, 1, out, sizeof (out), &code);
+  expected = "HTTP/1.1 304 Not Modified\r\n\r\n";
+  if (code != 304 || len != (ssize_t) strlen(expected) || memcmp(out, expected, len)) FAIL();
+  if (gateway_response_head("Status: 100", 11, 1, out, sizeof (out), &code) != ERROR) FAIL();
+  if (gateway_response_head("Status: 20x", 11, 1, out, sizeof (out), &code) != ERROR) FAIL();
+  if (gateway_response_head("no colon", 8, 1, out, sizeof (out), &code) != ERROR) FAIL();
+  if (gateway_response_head("X-A: 1", 6, 1, out, 16, &code) != ERROR) FAIL();
+  return totalres;
+}
+
+/**
+ * A worker in sh for test_gateway_workers: its frames read with dd and od,
+ * written with printf. /crash has it exit, /hold waits for the ABORT of the
+ * request to END it, the others get "ok" with its pid and the ABORT frames
+ * it got.
+ */
+static const char *g_worker =
+  "aborts=0\n"
+  "read_frame() {\n"
+  "  set -- $(dd bs=8 count=1 iflag=fullblock 2>/dev/null | od -An -tu1)\n"
+  "  [ $# -eq 8 ] || exit 0\n"
+  "  type=$1 id=$(($3 * 256 + $4)) len=$(($7 * 256 + $8)) payload=\n"
+  "  [ $len -eq 0 ] || payload=$(dd bs=$len count=1 iflag=fullblock 2>/dev/null | tr '\\0' '\\n')\n"
+  "}\n"
+  "frame() {\n"
+  "  printf \"$(printf '\\\\%03o\\\\000\\\\%03o\\\\%03o\\\\000\\\\000\\\\%03o\\\\%03o' $1 $(($2 >> 8)) \\\n"
+  "    $(($2 & 255)) $((${#3} >> 8)) $((${#3} & 255)))%s\" \"$3\"\n"
+  "}\n"
+  "while read_frame; do\n"
+  "  [ $type -eq 1 ] || continue\n"
+  "  case \"$payload\" in\n"
+  "  *PATH_INFO=/crash*) exit 1 ;;\n"
+  "  *PATH_INFO=/hold*) read_frame; [ $type -eq 2 ] && aborts=$((aborts + 1)); frame 5 $id '' ;;\n"
+  "  *) frame 3 $id \"X-Pid: $$\nX-Aborts: $aborts\"; frame 4 $id ok; frame 5 $id '' ;;\n"
+  "  esac\n"
+  "done\n";
+
+static int32_t g_queued[GATEWAY_MAX_QUEUE];
+
+int8_t test_gateway_workers() {
+  int8_t totalres = 0;
+  char script[] = "/tmp/shttpd-worker-XXXXXX";
+  int32_t fd = mkstemp(script);
+  if (fd < 0 || write(fd, g_worker, strlen(g_worker)) != (ssize_t) strlen(g_worker)) {
+    FAIL();
+    if (fd >= 0) close(fd);
+    return totalres;
+  }
+  close(fd);
+  char spec[64];
+  snprintf(spec, sizeof (spec), "/app=sh %s", script);
+  // A request at a time
+  g_gateway_processes = 1;
+  g_gateway_concurrency = 1;
+  g_gateway_timeout_ms = 500;
+  uint16_t port;
+  if (gateway_add_pool(spec) || gateway_init() || (port = server_start()) == 0) {
+    FAIL();
+    gateway_stop();
+    unlink(script);
+    return totalres;
+  }
+  static char response[4096];
+  size_t len;
+  const char *value;
+
+  fd = client_send(port, "GET /app/ok HTTP/1.0\r\n\r\n");
+  if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 || strcmp(response + len - 2, "ok") ||
+    (value = header_of(response, len, "X-Pid")) == NULL) FAIL();
+  pid_t pid = value != NULL ? strtol(value, NULL, 10) : 0;
+  close(fd);
+  // No response head in time, the worker is told to abort the request
+  fd = client_send(port, "GET /app/hold HTTP/1.0\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 2000)) != 504)
+    FAIL();
+  close(fd);
+  // And keeps working once it ENDs it
+  fd = client_send(port, "GET /app/ok HTTP/1.0\r\n\r\n");
+  if ((len = client_receive(fd, response, sizeof (response), 2000)) == 0 ||
+    status_of_response(response, len) != 200 ||
+    (value = header_of(response, len, "X-Pid")) == NULL || strtol(value, NULL, 10) != pid ||
+    (value = header_of(response, len, "X-Aborts")) == NULL || *value != '1') FAIL();
+  close(fd);
+
+  // The worker busy, the requests wait in the queue up to its size, then
+  // for a worker up to the timeout
+  g_gateway_timeout_ms = 1000;
+  int32_t hold = client_send(port, "GET /app/hold HTTP/1.0\r\n\r\n");
+  for (uint8_t i = 0; i < 10; ++i) pump(1);
+  for (uint32_t i = 0; i < GATEWAY_MAX_QUEUE; ++i)
+    g_queued[i] = client_send(port, "GET /app/ok HTTP/1.0\r\n\r\n");
+  for (uint8_t i = 0; i < 20; ++i) pump(5);
+  fd = client_send(port, "GET /app/ok HTTP/1.0\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 500)) != 503)
+    FAIL();
+  close(fd);
+  if (status_of_response(response, client_receive(g_queued[0], response, sizeof (response),
+    3000)) != 504) FAIL();
+  if (status_of_response(response, client_receive(hold, response, sizeof (response), 3000)) != 504)
+    FAIL();
+  for (uint32_t i = 0; i < GATEWAY_MAX_QUEUE; ++i) close(g_queued[i]);
+  close(hold);
+
+  // The requests of a worker that exits get a 502, the next ones wait for
+  // it to be started again
+  g_gateway_timeout_ms = 3000;
+  fd = client_send(port, "GET /app/crash HTTP/1.0\r\n\r\n");
+  if (status_of_response(response, client_receive(fd, response, sizeof (response), 2000)) != 502)
+    FAIL();
+  close(fd);
+  fd = client_send(port, "GET /app/ok HTTP/1.0\r\n\r\n");
+  if ((len = client_receive(fd, response, sizeof (response), GATEWAY_RESPAWN_MS + 2000)) == 0 ||
+    status_of_response(response, len) != 200 ||
+    (value = header_of(response, len, "X-Pid")) == NULL || strtol(value, NULL, 10) == pid)
+    FAIL();
+  close(fd);
+
+  server_stop();
+  gateway_stop();
+  g_gateway_processes = GATEWAY_DEFAULT_PROCESSES;
+  g_gateway_concurrency = GATEWAY_DEFAULT_CONCURRENCY;
+  g_gateway_timeout_ms = GATEWAY_TIMEOUT_MS;
+  unlink(script);
+  return totalres;
+}
+
+int8_t test_chunked() {
+  int8_t totalres = 0;
+  if (chunked_mode(HTTP_1_1, 200) != CHUNKED_FRAMED) FAIL();
+  if (chunked_mode(HTTP_1_0, 200) != CHUNKED_UNTIL_CLOSE) FAIL();
+  if (chunked_mode(HTTP_1_1, 304) != CHUNKED_BODILESS) FAIL();
+  if (strcmp(chunked_header(CHUNKED_FRAMED), "Transfer-Encoding: chunked")) FAIL();
+  if (chunked_header(CHUNKED_BODILESS) != NULL) FAIL();
+  client_t client;
+  memset(&client, 0, sizeof (client_t));
+  client.request.method = GET;
+  chunked_t *writer = chunked_open(&client, NULL, NULL, NULL);
+  if (writer == NULL || client.chunked != writer) FAIL();
+  writer->buffer = malloc(CHUNKED_BUFFER_SIZE);
+  if (chunked_write(writer, "hello, world", 12)) FAIL();
+  if (chunked_end(writer, "X-A: 1\r\n", 8)) FAIL();
+  const char *expected = "c\r\nhello, world\r\n0\r\nX-A: 1\r\n\r\n";
+  if (writer->buffered != strlen(expected) || memcmp(writer->buffer, expected, writer->buffered)) FAIL();
+  // Past the bound the owner waits for the client to take the buffer
+  writer->ended = 0;
+  char piece[CHUNKED_BUFFER_SIZE / 2];
+  memset(piece, 'a', sizeof (piece));
+  if (chunked_write(writer, piece, sizeof (piece))) FAIL();
+  if (chunked_write(writer, piece, sizeof (piece)) != 1) FAIL();
+  writer->buffer_sent = writer->buffered;
+  if (chunked_write(writer, piece, sizeof (piece))) FAIL();
+  // Nothing is buffered for HTTP/1.0 clients but the data
+  writer->mode = CHUNKED_UNTIL_CLOSE;
+  writer->buffered = writer->buffer_sent = 0;
+  if (chunked_write(writer, "abc", 3) || chunked_end(writer, "X-A: 1\r\n", 8)) FAIL();
+  if (writer->buffered != 3 || memcmp(writer->buffer, "abc", 3)) FAIL();
+  writer->buffer_sent = writer->buffered;
+  writer->started = 1;
+  if (!chunked_done(&client)) FAIL();
+  client.clientfd = -1;
+  chunked_finish(&client);
+  if (client.chunked != NULL) FAIL();
+  return totalres;
+}
+
+int8_t test_accesslog() {
+  int8_t totalres = 0;
+  char out[64];
+  if (accesslog_escape(out, sizeof (out), "index.html") != 10 || strcmp(out, "index.html")) FAIL();
+  accesslog_escape(out, sizeof (out), "a\nb\rc\x1b\x7f");
+  if (strcmp(out, "a\\x0ab\\x0dc\\x1b\\x7f")) FAIL();
+  accesslog_escape(out, sizeof (out), "\" 200 0 \\");
+  if (strcmp(out, "\\x22 200 0 \\x5c")) FAIL();
+  // An escape is never cut in half
+  if (accesslog_escape(out, 7, "a\n\n") != 5 || strcmp(out, "a\\x0a")) FAIL();
+
+  // A decoded path cannot add a line of its own to the log
+  char filename[] = "/tmp/testshttpd-accessXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0) FAIL();
+  close(fd);
+  if (accesslog_open(filename, E_ACCESSLOG_COMMON, 1)) FAIL();
+  request_t request;
+  memset(&request, 0, sizeof (request_t));
+  request.method = GET;
+  request.http_version = HTTP_1_1;
+  char path[] = "a\n127.0.0.1 - - \"GET /b";
+  request.path = path;
+  accesslog_record(NULL, &request);
+  accesslog_close();
+  char line[ACCESSLOG_MAX_LINE];
+  fd = open(filename, O_RDONLY);
+  ssize_t len = read(fd, line, sizeof (line) - 1);
+  close(fd);
+  unlink(filename);
+  if (len <= 0) FAIL()
+  else {
+    line[len] = 0;
+    if (memchr(line, '\n', len) != line + len - 1) FAIL();
+    if (strstr(line, "\"GET /a\\x0a127.0.0.1 - - \\x22GET /b HTTP/1.1\"") == NULL) FAIL();
+  }
+  return totalres;
+}
+
 int main() {
+  // Only the errors the tests expect
+  g_log_level = LOG_LEVEL_ERROR;
   return test_next_token() +
     test_end_of_header() +
-    test_get_extension();
+    test_parse_headers() +
+    test_get_extension() +
+    test_normalize_path() +
+    test_latency_bucket() +
+    test_negcache() +
+    test_resolve_open() +
+    test_ratelimit() +
+    test_admission() +
+    test_hpack() +
+    test_h2_preface() +
+    test_h2_streams() +
+    test_h2_reset() +
+    test_upstream_match() +
+    test_upstream() +
+    test_proxycache() +
+    test_proxycache_store() +
+    test_proxycache_flights() +
+    test_gateway() +
+    test_gateway_workers() +
+    test_chunked() +
+    test_accesslog();
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "tls.h"
+#include "upstream.h"
+#include "gateway.h"
+
+/**
+ * The sockets stay non-blocking: OpenSSL tells it would block with
+ * SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE, turned into EAGAIN so that the
+ * callers handle TLS connections as the others. The handshake is driven by
+ * the POLLIN events of the connection, its flights fit in the socket buffer.
+ *
+ * Sessions are resumed from a server side cache (TLS 1.2) or from tickets,
+ * so that returning clients skip the key exchange. Clients offering h2 in
+ * ALPN get HTTP/2, the others HTTP/1.1.
+ */
+
+// NULL when serving plain HTTP
+static SSL_CTX *g_ctx = NULL;
+
+static void log_errors(const char *what) {
+  char message[256];
+  unsigned long err;
+  while ((err = ERR_get_error()) != 0) {
+    ERR_error_string_n(err, message, sizeof (message));
+    LOG_ERROR("%s: %s\n", what, message);
+  }
+}
+
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+  const unsigned char *in, unsigned int inlen, void *arg) {
+  (void) ssl;
+  (void) arg;
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+  // Proxied and gateway routes are only served over HTTP/1.x
+  size_t skip = upstream_enabled() || gateway_enabled() ? 3 : 0;
+  if (SSL_select_next_proto((unsigned char **) out, outlen, protocols + skip,
+    sizeof (protocols) - 1 - skip, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Serve HTTPS with the certificate chain and the private key of these PEM
+ * files.
+ */
+int8_t tls_init(const char *cert, const char *key) {
+  if ((g_ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+    log_errors("SSL_CTX_new");
+    return ERROR;
+  }
+  SSL_CTX_set_min_proto_version(g_ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(g_ctx, SSL_OP_ENABLE_KTLS);
+  // Writes may be retried from another buffer with the same content, and
+  // idle connections give their buffers back
+  SSL_CTX_set_mode(g_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_cache_mode(g_ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(g_ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_session_id_context(g_ctx, (const unsigned char *) "shttpd", 6);
+  SSL_CTX_set_alpn_select_cb(g_ctx, select_protocol, NULL);
+  if (SSL_CTX_use_certificate_chain_file(g_ctx, cert) != 1 ||
+    SSL_CTX_use_PrivateKey_file(g_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+    SSL_CTX_check_private_key(g_ctx) != 1) {
+    log_errors(cert);
+    SSL_CTX_free(g_ctx);
+    g_ctx = NULL;
+    return ERROR;
+  }
+  LOG_MSG("serving HTTPS with %s\n", cert);
+  return 0;
+}
+
+/**
+ * Start a TLS session on a new connection.
+ */
+int8_t tls_accept(client_t *client) {
+  if (g_ctx == NULL) return 0;
+  SSL *ssl = SSL_new(g_ctx);
+  if (ssl == NULL || SSL_set_fd(ssl, client->clientfd) != 1) {
+    log_errors("SSL_new");
+    SSL_free(ssl);
+    return ERROR;
+  }
+  SSL_set_accept_state(ssl);
+  client->tls = ssl;
+  client->tls_pending = 0;
+  return 0;
+}
+
+void tls_free(client_t *client) {
+  if (client->tls == NULL) return;
+  SSL *ssl = client->tls;
+  // Best effort close_notify, the socket does not wait for it
+  if (SSL_is_init_finished(ssl)) SSL_shutdown(ssl);
+  SSL_free(ssl);
+  client->tls = NULL;
+  ERR_clear_error();
+}
+
+/**
+ * Map the failure of an OpenSSL call to the result of a system call.
+ */
+static ssize_t fail(SSL *ssl, int ret) {
+  switch (SSL_get_error(ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0) errno = ECONNRESET;
+    return -1;
+  default:
+    ERR_clear_error();
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+/**
+ * Advance the handshake of a connection. Returns 1 once it is done (or for
+ * plain HTTP), 0 while it goes on, ERROR if it failed.
+ */
+int32_t tls_handshake(client_t *client) {
+  SSL *ssl = client->tls;
+  if (ssl == NULL || SSL_is_init_finished(ssl)) return 1;
+  ERR_clear_error();
+  int ret = SSL_do_handshake(ssl);
+  if (ret != 1) {
+    if (fail(ssl, ret) < 0 && errno == EAGAIN) return 0;
+    LOG_DEBUG("handshake with %i failed\n", client->clientfd);
+    return ERROR;
+  }
+  METRIC_INC(tls_handshakes);
+  if (SSL_session_reused(ssl)) METRIC_INC(tls_resumptions);
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl))) METRIC_INC(ktls_connections);
+  LOG_DEBUG("%s with %i, %s, kTLS %s\n", SSL_get_version(ssl), client->clientfd,
+    SSL_get_cipher_name(ssl), BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "on" : "off");
+  return 1;
+}
+
+/**
+ * Whether the client picked HTTP/2 during the handshake.
+ */
+uint8_t tls_alpn_h2(client_t *client) {
+  if (client->tls == NULL) return 0;
+  const unsigned char *protocol;
+  unsigned int len;
+  SSL_get0_alpn_selected(client->tls, &protocol, &len);
+  return len == 2 && !memcmp(protocol, "h2", 2);
+}
+
+/**
+ * Whether bytes can be written to the socket without OpenSSL, with splice:
+ * plain HTTP, or kTLS which encrypts them in the kernel.
+ */
+uint8_t tls_kernel_send(client_t *client) {
+  return client->tls == NULL || BIO_get_ktls_send(SSL_get_wbio(client->tls));
+}
+
+static client_t *session(int32_t fd) {
+  client_t *client = find_client(fd);
+  return client != NULL && client->tls != NULL ? client : NULL;
+}
+
+/**
+ * Write len bytes with OpenSSL. A write which would block must be retried
+ * with at least the same bytes, even when the budget of the scheduler is
+ * lower by then: the callers retry from the same place in their buffer, which
+ * still holds them.
+ */
+static ssize_t write_record(client_t *client, const void *buffer, size_t len) {
+  SSL *ssl = client->tls;
+  if (len < client->tls_pending) len = client->tls_pending;
+  size_t done;
+  if (!SSL_write_ex(ssl, buffer, len, &done)) {
+    ssize_t ret = fail(ssl, 0);
+    client->tls_pending = ret < 0 && errno == EAGAIN ? len : 0;
+    return ret;
+  }
+  client->tls_pending = 0;
+  return done;
+}
+
+ssize_t tls_read(int32_t fd, void *buffer, size_t len) {
+  client_t *client = session(fd);
+  if (client == NULL) return read(fd, buffer, len);
+  SSL *ssl = client->tls;
+  ERR_clear_error();
+  size_t done;
+  if (!SSL_read_ex(ssl, buffer, len, &done)) return fail(ssl, 0);
+  return done;
+}
+
+ssize_t tls_write(int32_t fd, const void *buffer, size_t len) {
+  client_t *client = session(fd);
+  if (client == NULL) return write(fd, buffer, len);
+  ERR_clear_error();
+  return write_record(client, buffer, len);
+}
+
+/**
+ * sendfile, encrypted by the kernel with kTLS. Otherwise a record is read and
+ * encrypted by OpenSSL: a write retried after EAGAIN reads the same bytes
+ * again since the offset did not move, and at least as many.
+ */
+ssize_t tls_sendfile(int32_t fd, int32_t filefd, off_t *offset, size_t count) {
+  client_t *client = session(fd);
+  if (client == NULL) return sendfile(fd, filefd, offset, count);
+  SSL *ssl = client->tls;
+  ERR_clear_error();
+  if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+    ossl_ssize_t len = SSL_sendfile(ssl, filefd, *offset, count, 0);
+    if (len < 0) return fail(ssl, -1);
+    *offset += len;
+    return len;
+  }
+  char buffer[TLS_CHUNK];
+  if (count < client->tls_pending) count = client->tls_pending;
+  ssize_t len = pread(filefd, buffer, count < TLS_CHUNK ? count : TLS_CHUNK, *offset);
+  if (len <= 0) return len;
+  // The file shrunk under the pending record
+  if ((size_t) len < client->tls_pending) {
+    errno = EIO;
+    return -1;
+  }
+  ssize_t done = write_record(client, buffer, len);
+  if (done > 0) *offset += done;
+  return done;
+}
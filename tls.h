@@ -0,0 +1,83 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+
+#include "defines.h"
+
+/**
+ * HTTPS, built with make TLS=1: the handshake is done by OpenSSL, which then
+ * hands the keys to the kernel (kTLS) when it can, so that files are still
+ * sent with sendfile and encrypted in the kernel. Otherwise OpenSSL encrypts
+ * them in user space.
+ *
+ * The I/O on the connections goes through tls_read, tls_write and
+ * tls_sendfile, which are the system calls in a build without TLS.
+ */
+// Size of the reads when OpenSSL encrypts a file, a TLS record
+#define TLS_CHUNK 16384
+#define TLS_SESSION_CACHE_SIZE 20480
+
+#ifdef WITH_TLS
+
+int8_t tls_init(const char *cert, const char *key);
+int8_t tls_accept(client_t *client);
+int32_t tls_handshake(client_t *client);
+void tls_free(client_t *client);
+uint8_t tls_alpn_h2(client_t *client);
+uint8_t tls_kernel_send(client_t *client);
+ssize_t tls_read(int32_t fd, void *buffer, size_t len);
+ssize_t tls_write(int32_t fd, const void *buffer, size_t len);
+ssize_t tls_sendfile(int32_t fd, int32_t filefd, off_t *offset, size_t count);
+
+#else
+
+static inline int8_t tls_init(const char *cert, const char *key) {
+  (void) cert;
+  (void) key;
+  LOG_ERROR("built without TLS, see make TLS=1%s\n", "");
+  return ERROR;
+}
+
+static inline int8_t tls_accept(client_t *client) {
+  (void) client;
+  return 0;
+}
+
+static inline int32_t tls_handshake(client_t *client) {
+  (void) client;
+  return 1;
+}
+
+static inline void tls_free(client_t *client) {
+  (void) client;
+}
+
+static inline uint8_t tls_alpn_h2(client_t *client) {
+  (void) client;
+  return 0;
+}
+
+static inline uint8_t tls_kernel_send(client_t *client) {
+  (void) client;
+  return 1;
+}
+
+static inline ssize_t tls_read(int32_t fd, void *buffer, size_t len) {
+  return read(fd, buffer, len);
+}
+
+static inline ssize_t tls_write(int32_t fd, const void *buffer, size_t len) {
+  return write(fd, buffer, len);
+}
+
+static inline ssize_t tls_sendfile(int32_t fd, int32_t filefd, off_t *offset, size_t count) {
+  return sendfile(fd, filefd, offset, count);
+}
+
+#endif // WITH_TLS
+
+#endif // __TLS_H__
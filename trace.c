@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "defines.h"
+#include "trace.h"
+
+/**
+ * Requests slower than a threshold keep the timestamps of their phases in a
+ * ring buffer. The ring is exported in the Chrome trace event format, which
+ * chrome://tracing and https://ui.perfetto.dev open directly: one lane per
+ * request, one slice per phase.
+ */
+
+uint8_t g_tracing = 0;
+uint64_t g_wakeup_ns = 0;
+// Path of the trace endpoint, without the leading '/'. NULL if disabled
+char *g_trace_path = NULL;
+
+static uint64_t g_trace_threshold_ns = 0;
+static trace_record_t g_trace_ring[TRACE_RING_SIZE];
+static uint64_t g_trace_count = 0;
+static pthread_mutex_t g_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Name of the phase ending at each point
+static const char g_phase_names[NB_TRACE_POINTS][16] = {
+  "accept",
+  "wait request",
+  "event queue",
+  "read headers",
+  "parse",
+  "open",
+  "write headers",
+  "sendfile",
+  "finish",
+};
+
+void trace_enable(uint64_t threshold_us) {
+  g_trace_threshold_ns = threshold_us * 1000;
+  g_tracing = 1;
+}
+
+void trace_start_request(client_t *client, request_t *request) {
+  if (!g_tracing) return;
+  // The time spent waiting for the first request only makes sense once
+  if (client != NULL && client->nb_requests == 0)
+    request->trace[TRACE_ACCEPT] = client->accept_ns;
+  request->trace[TRACE_WAKEUP] = g_wakeup_ns;
+  request->trace[TRACE_START] = request->start_ns;
+}
+
+static uint64_t first_point(uint64_t *points) {
+  for (uint8_t i = 0; i < NB_TRACE_POINTS; ++i)
+    if (points[i]) return points[i];
+  return 0;
+}
+
+void trace_end_request(request_t *request) {
+  if (!g_tracing) return;
+  request->trace[TRACE_END] = now_ns();
+  if (request->trace[TRACE_END] - first_point(request->trace) < g_trace_threshold_ns)
+    return;
+  pthread_mutex_lock(&g_trace_mutex);
+  trace_record_t *record = &g_trace_ring[g_trace_count % TRACE_RING_SIZE];
+  record->id = g_trace_count++;
+  memcpy(record->points, request->trace, sizeof (record->points));
+  if (request->path != NULL) {
+    strncpy(record->path, request->path, TRACE_MAX_PATH - 1);
+    record->path[TRACE_MAX_PATH - 1] = 0;
+    // Paths are not escaped when rendered, replace what would break the JSON
+    for (char *c = record->path; *c; ++c)
+      if (*c == '"' || *c == '\\' || (unsigned char) *c < 0x20) *c = '_';
+  } else record->path[0] = 0;
+  record->method = request->method;
+  record->status = g_status_code[request->status].code;
+  record->bytes_sent = request->bytes_sent;
+  pthread_mutex_unlock(&g_trace_mutex);
+}
+
+int8_t is_trace_request(request_t *request) {
+  return g_trace_path != NULL && request->path != NULL &&
+    !strcmp(request->path, g_trace_path);
+}
+
+static size_t render_record(char *buffer, size_t size, trace_record_t *record,
+  uint8_t first) {
+  size_t position = 0;
+  uint64_t start = first_point(record->points);
+  uint64_t end = record->points[TRACE_END];
+  position += snprintf(buffer + position, size - position,
+    "%s{\"name\":\"%s /%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,"
+    "\"dur\":%.3f,\"args\":{\"status\":%u,\"bytes\":%lu}}",
+    first ? "" : ",\n", g_methods[record->method], record->path, record->id,
+    start / 1e3, (end - start) / 1e3, record->status, record->bytes_sent);
+  uint64_t previous = start;
+  for (uint8_t i = 0; i < NB_TRACE_POINTS && position < size; ++i) {
+    if (record->points[i] == 0) continue;
+    if (record->points[i] > previous) {
+      position += snprintf(buffer + position, size - position,
+        ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+        g_phase_names[i], record->id, previous / 1e3,
+        (record->points[i] - previous) / 1e3);
+    }
+    previous = record->points[i];
+  }
+  return position < size ? position : size - 1;
+}
+
+// Where a streamed export is in the ring
+typedef struct {
+  uint64_t next;
+  uint64_t end;
+  uint64_t rendered;
+  uint8_t opened;
+} trace_cursor_t;
+
+/**
+ * Render the next requests of the export in the writer, as long as it has
+ * room for a chunk.
+ */
+static int8_t produce(chunked_t *writer) {
+  trace_cursor_t *cursor = writer->context;
+  char chunk[TRACE_CHUNK_RECORDS * TRACE_MAX_JSON_RECORD + 64];
+  while (!writer->ended && chunked_room(writer) >= sizeof (chunk)) {
+    size_t len = 0;
+    if (!cursor->opened) len = snprintf(chunk, sizeof (chunk),
+      "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    cursor->opened = 1;
+    pthread_mutex_lock(&g_trace_mutex);
+    // Those overwritten since the export started are skipped
+    if (g_trace_count - cursor->next > TRACE_RING_SIZE)
+      cursor->next = g_trace_count - TRACE_RING_SIZE;
+    for (uint8_t i = 0; i < TRACE_CHUNK_RECORDS && cursor->next < cursor->end; ++i)
+      len += render_record(chunk + len, TRACE_MAX_JSON_RECORD,
+        &g_trace_ring[cursor->next++ % TRACE_RING_SIZE], cursor->rendered++ == 0);
+    pthread_mutex_unlock(&g_trace_mutex);
+    if (cursor->next >= cursor->end) len += snprintf(chunk + len, sizeof (chunk) - len, "\n]}\n");
+    if (chunked_write(writer, chunk, len)) return ERROR;
+    if (cursor->next >= cursor->end) chunked_end(writer, NULL, 0);
+  }
+  return 0;
+}
+
+static void closed(chunked_t *writer, uint8_t complete) {
+  (void) complete;
+  free(writer->context);
+}
+
+/**
+ * Open a streaming writer for the client rendering the requests sampled so
+ * far, as trace_render does, a few at a time as the client takes them.
+ * Returns NULL if out of memory.
+ */
+chunked_t *trace_open(client_t *client) {
+  trace_cursor_t *cursor = calloc(1, sizeof (trace_cursor_t));
+  if (cursor == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  pthread_mutex_lock(&g_trace_mutex);
+  cursor->end = g_trace_count;
+  cursor->next = g_trace_count < TRACE_RING_SIZE ? 0 : g_trace_count - TRACE_RING_SIZE;
+  pthread_mutex_unlock(&g_trace_mutex);
+  chunked_t *writer = chunked_open(client, produce, closed, cursor);
+  if (writer == NULL) free(cursor);
+  return writer;
+}
+
+/**
+ * Render the sampled requests as a Chrome trace JSON document. Returns a
+ * buffer to be freed by the caller, its length is stored in *len.
+ */
+char *trace_render(size_t *len) {
+  pthread_mutex_lock(&g_trace_mutex);
+  uint64_t count = g_trace_count < TRACE_RING_SIZE ? g_trace_count : TRACE_RING_SIZE;
+  size_t size = (count + 1) * TRACE_MAX_JSON_RECORD;
+  char *buffer = malloc(size);
+  if (buffer == NULL) {
+    pthread_mutex_unlock(&g_trace_mutex);
+    perror("malloc");
+    return NULL;
+  }
+  size_t position = snprintf(buffer, size, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (uint64_t i = g_trace_count - count; i < g_trace_count; ++i) {
+    position += render_record(buffer + position, TRACE_MAX_JSON_RECORD,
+      &g_trace_ring[i % TRACE_RING_SIZE], i == g_trace_count - count);
+  }
+  pthread_mutex_unlock(&g_trace_mutex);
+  position += snprintf(buffer + position, size - position, "\n]}\n");
+  *len = position;
+  return buffer;
+}
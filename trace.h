@@ -0,0 +1,46 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "defines.h"
+#include "chunked.h"
+
+// Slow requests kept for export, the oldest ones are overwritten
+#define TRACE_RING_SIZE 1024
+#define DEFAULT_TRACE_THRESHOLD_US 10000
+#define TRACE_MAX_PATH 96
+// Upper bound of the JSON rendering of one request
+#define TRACE_MAX_JSON_RECORD 2048
+// Requests rendered per chunk of a streamed export
+#define TRACE_CHUNK_RECORDS 8
+
+typedef struct {
+  uint64_t id;
+  uint64_t points[NB_TRACE_POINTS];
+  char path[TRACE_MAX_PATH];
+  uint8_t method;
+  uint16_t status;
+  size_t bytes_sent;
+} trace_record_t;
+
+extern uint8_t g_tracing;
+extern uint64_t g_wakeup_ns;
+extern char *g_trace_path;
+
+// Timestamp a phase of a request, costs a branch when tracing is disabled
+#define TRACE_MARK(request, point) \
+  { if (g_tracing) (request)->trace[point] = now_ns(); }
+
+// Called by the event loop when poll returns
+#define TRACE_WAKEUP() { if (g_tracing) g_wakeup_ns = now_ns(); }
+
+void trace_enable(uint64_t threshold_us);
+void trace_start_request(client_t *client, request_t *request);
+void trace_end_request(request_t *request);
+int8_t is_trace_request(request_t *request);
+char *trace_render(size_t *len);
+chunked_t *trace_open(client_t *client);
+
+#endif // __TRACE_H__
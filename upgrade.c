@@ -0,0 +1,215 @@
+// pipe2, execvpe
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "upgrade.h"
+#include "h2.h"
+#include "proxycache.h"
+
+/**
+ * The new process inherits the listening socket, so that the connections
+ * queued in the backlog are accepted by one process or the other and none is
+ * refused. It tells it is ready by writing a byte on a pipe: the old process
+ * then closes its copy of the socket and drains. If the new process exits
+ * first, the pipe is closed without that byte and the old one goes on.
+ *
+ * The signal handlers only set flags, handled by the event loop.
+ */
+
+extern char **environ;
+
+// Set from the signal handlers
+volatile sig_atomic_t g_upgrade_requested = 0;
+volatile sig_atomic_t g_stop_requested = 0;
+uint64_t g_upgrade_drain_timeout_ms = UPGRADE_DRAIN_TIMEOUT_MS;
+
+// The new process, and the end of the pipe it writes on, -1 if none
+static pid_t g_child = -1;
+static int32_t g_ready_fd = -1;
+// A new process which exited before being ready, still to reap
+static pid_t g_failed = -1;
+// 0 while serving
+static uint64_t g_drain_ns = 0;
+
+/**
+ * The listening socket passed by the old process, -1 if none.
+ */
+int32_t upgrade_inherited_socket() {
+  const char *value = getenv(UPGRADE_LISTEN_ENV);
+  if (value == NULL) return -1;
+  int32_t socketfd = atoi(value);
+  unsetenv(UPGRADE_LISTEN_ENV);
+  int listening = 0;
+  socklen_t len = sizeof (listening);
+  if (getsockopt(socketfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening) {
+    LOG_ERROR("%s=%s is not a listening socket\n", UPGRADE_LISTEN_ENV, value);
+    return -1;
+  }
+  fcntl(socketfd, F_SETFD, FD_CLOEXEC);
+  return socketfd;
+}
+
+/**
+ * Called once the process accepts connections, tells the old one to drain.
+ */
+void upgrade_notify_ready() {
+  const char *value = getenv(UPGRADE_READY_ENV);
+  if (value == NULL) return;
+  int32_t fd = atoi(value);
+  unsetenv(UPGRADE_READY_ENV);
+  if (write(fd, "1", 1) < 0) perror("write");
+  close(fd);
+}
+
+/**
+ * Start the binary of argv again with the listening socket.
+ */
+static int8_t spawn(int32_t socketfd, char **argv) {
+  int ready[2];
+  if (pipe2(ready, O_CLOEXEC | O_NONBLOCK) < 0) {
+    perror("pipe2");
+    return ERROR;
+  }
+  // The environment is built before forking, the other threads may hold the
+  // allocator lock
+  size_t count = 0;
+  while (environ[count] != NULL) ++count;
+  char **envp = calloc(count + 3, sizeof (char *));
+  char listen_var[64];
+  char ready_var[64];
+  if (envp == NULL) {
+    perror("calloc");
+    close(ready[0]);
+    close(ready[1]);
+    return ERROR;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i)
+    if (strncmp(environ[i], UPGRADE_LISTEN_ENV "=", sizeof (UPGRADE_LISTEN_ENV)) &&
+      strncmp(environ[i], UPGRADE_READY_ENV "=", sizeof (UPGRADE_READY_ENV)))
+      envp[n++] = environ[i];
+  snprintf(listen_var, sizeof (listen_var), "%s=%i", UPGRADE_LISTEN_ENV, socketfd);
+  snprintf(ready_var, sizeof (ready_var), "%s=%i", UPGRADE_READY_ENV, ready[1]);
+  envp[n++] = listen_var;
+  envp[n++] = ready_var;
+  // The new process takes the on-disk store of the proxy cache over, it is
+  // opened again if the upgrade is aborted
+  proxycache_release();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Only these two survive the exec
+    fcntl(socketfd, F_SETFD, 0);
+    fcntl(ready[1], F_SETFD, 0);
+    execvpe(argv[0], argv, envp);
+    _exit(127);
+  }
+  free(envp);
+  close(ready[1]);
+  if (pid < 0) {
+    perror("fork");
+    close(ready[0]);
+    proxycache_reopen();
+    return ERROR;
+  }
+  g_child = pid;
+  g_ready_fd = ready[0];
+  LOG_MSG("upgrading, started %s as %i\n", argv[0], pid);
+  return 0;
+}
+
+/**
+ * Stop accepting, the connections are closed as their responses end.
+ */
+static void start_drain(client_t **clients) {
+  g_drain_ns = now_ns();
+  stop_accepting(*clients);
+  LOG_MSG("draining %lu connections\n", g_nb_clients - 1);
+}
+
+/**
+ * Handle the answer of the new process, if any.
+ */
+static void check_child(client_t **clients) {
+  char byte;
+  ssize_t ret = read(g_ready_fd, &byte, 1);
+  if (ret < 0 && (errno == EAGAIN || errno == EINTR)) return;
+  close(g_ready_fd);
+  g_ready_fd = -1;
+  if (ret == 1) {
+    LOG_MSG("process %i took over\n", g_child);
+    start_drain(clients);
+  } else {
+    LOG_ERROR("process %i exited before listening, upgrade aborted\n", g_child);
+    g_failed = g_child;
+  }
+  g_child = -1;
+}
+
+/**
+ * Close the connections between two requests, the HTTP/2 ones once their
+ * streams are answered (with a GOAWAY, see h2_free).
+ */
+static void close_idle(client_t **clients) {
+  client_t *client = (*clients)->next;
+  while (client != NULL) {
+    client_t *next = client->next;
+    if (client->h2 != NULL ? h2_idle(client) :
+      !client->transfer.active && !client->io_pending && client->upstream == NULL &&
+      client->chunked == NULL && client->header == NULL)
+      delete_client(client->clientfd, clients);
+    client = next;
+  }
+}
+
+/**
+ * Called by the event loop, handles the signals and drains. Returns 1 once
+ * the process is to exit.
+ */
+int8_t upgrade_tick(char **argv, client_t **clients) {
+  static sig_atomic_t stops = 0;
+  if (g_stop_requested != stops) {
+    stops = g_stop_requested;
+    // A second signal does not wait
+    if (g_drain_ns) return 1;
+    start_drain(clients);
+  }
+  if (g_upgrade_requested) {
+    g_upgrade_requested = 0;
+    if (g_drain_ns || g_child >= 0 || g_failed >= 0) {
+      LOG_WARNING("already upgrading or draining%s\n", "");
+    } else spawn((*clients)->clientfd, argv);
+  }
+  if (g_ready_fd >= 0) check_child(clients);
+  // Its lock on the store of the proxy cache is gone once it is reaped
+  if (g_failed >= 0 && waitpid(g_failed, NULL, WNOHANG) != 0) {
+    g_failed = -1;
+    proxycache_reopen();
+  }
+  if (!g_drain_ns) return 0;
+  close_idle(clients);
+  if (g_nb_clients <= 1) return 1;
+  if (now_ns() - g_drain_ns > g_upgrade_drain_timeout_ms * 1000000) {
+    LOG_WARNING("drain timeout, closing %lu connections\n", g_nb_clients - 1);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Milliseconds until the next check while upgrading or draining, -1
+ * otherwise.
+ */
+int upgrade_timeout() {
+  return g_drain_ns || g_ready_fd >= 0 || g_failed >= 0 ? UPGRADE_TICK_MS : -1;
+}
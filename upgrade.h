@@ -0,0 +1,33 @@
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "defines.h"
+
+/**
+ * Binary upgrade and graceful shutdown: on SIGUSR2 a new process is started
+ * with the listening socket, and once it is listening the old one stops
+ * accepting and drains. On SIGTERM or SIGINT the process drains too. A
+ * draining process closes its idle connections and lets the responses in
+ * flight finish, at most for the drain timeout.
+ */
+#define UPGRADE_DRAIN_TIMEOUT_MS 30000
+// Connections are checked that often while draining or upgrading
+#define UPGRADE_TICK_MS 100
+// Set for the new process to the listening socket and the end of a pipe to
+// tell it is ready on
+#define UPGRADE_LISTEN_ENV "SHTTPD_LISTEN_FD"
+#define UPGRADE_READY_ENV "SHTTPD_READY_FD"
+
+extern volatile sig_atomic_t g_upgrade_requested;
+extern volatile sig_atomic_t g_stop_requested;
+extern uint64_t g_upgrade_drain_timeout_ms;
+
+int32_t upgrade_inherited_socket();
+void upgrade_notify_ready();
+int8_t upgrade_tick(char **argv, client_t **clients);
+int upgrade_timeout();
+
+#endif // __UPGRADE_H__
@@ -0,0 +1,1179 @@
+// splice, pipe2 and F_SETPIPE_SZ
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "defines.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "pagecache.h"
+#include "sched.h"
+#include "tls.h"
+#include "upstream.h"
+
+/**
+ * A proxied request takes a connection of the chosen backend, from its pool
+ * or newly connected, and waits (client->upstream set, its connection out of
+ * the poll set) while the request head is sent and the response head read.
+ * Requests go out as HTTP/1.0 with Connection: keep-alive, so that backends
+ * answer with a Content-Length or by closing, never chunked. The response
+ * head, rewritten for the client, starts a transfer of the scheduler whose
+ * body is spliced from the upstream socket to a pipe as the pipe has room,
+ * and from the pipe to the client as the scheduler gives it turns. With TLS
+ * but no kTLS the body goes through a buffer for OpenSSL instead.
+ *
+ * Connections that fail before the response starts are retried on another
+ * backend (every method served is idempotent), or on a new connection when
+ * the backend had closed the pooled one. A backend is marked down when a
+ * connection to it fails, and probed with a connect every
+ * UPSTREAM_HEALTH_INTERVAL_MS to tell when it is back.
+ *
+ * With the proxy cache, a GET missing it joins the flight of its key, the
+ * fetch started by the first one: the waiters are attached to its
+ * connection (client->upstream set, conn->client NULL). A response that can
+ * be cached is read in memory, stored and sent to every waiter; otherwise
+ * it is streamed to the first waiter, and the others are forwarded on their
+ * own. A stale entry is served while a flight without waiters refreshes it.
+ */
+
+uint64_t g_upstream_timeout_ms = UPSTREAM_TIMEOUT_MS;
+
+static upstream_route_t g_routes[UPSTREAM_MAX_ROUTES];
+static uint32_t g_nb_routes = 0;
+static upstream_backend_t *g_backends[UPSTREAM_MAX_BACKENDS];
+static uint32_t g_nb_backends = 0;
+// Every connection, the closed ones until the next upstream_fds
+static upstream_conn_t *g_conns = NULL;
+// Connections in the order of their entries in the poll set
+static upstream_conn_t **g_polled = NULL;
+static upstream_flight_t *g_flights = NULL;
+static uint64_t g_last_sweep_ns = 0;
+
+static upstream_backend_t *add_backend(const char *address) {
+  const char *colon = strrchr(address, ':');
+  char host[16];
+  if (colon == NULL || colon == address || (size_t) (colon - address) >= sizeof (host))
+    return NULL;
+  memcpy(host, address, colon - address);
+  host[colon - address] = '\0';
+  if (!strcmp(host, "localhost")) strcpy(host, "127.0.0.1");
+  char *end;
+  unsigned long port = strtoul(colon + 1, &end, 10);
+  struct in_addr inp;
+  if (*end != '\0' || end == colon + 1 || port == 0 || port > MAX_PORT_NO ||
+    !inet_aton(host, &inp)) return NULL;
+  // Routes to the same backend share its pool
+  for (uint32_t i = 0; i < g_nb_backends; ++i)
+    if (g_backends[i]->addr.sin_addr.s_addr == inp.s_addr &&
+      g_backends[i]->addr.sin_port == htons(port)) return g_backends[i];
+  if (g_nb_backends >= UPSTREAM_MAX_BACKENDS) return NULL;
+  upstream_backend_t *backend = calloc(1, sizeof (upstream_backend_t));
+  if (backend == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  backend->addr.sin_family = AF_INET;
+  backend->addr.sin_addr = inp;
+  backend->addr.sin_port = htons(port);
+  snprintf(backend->name, sizeof (backend->name), "%s:%lu", host, port);
+  backend->healthy = 1;
+  g_backends[g_nb_backends++] = backend;
+  return backend;
+}
+
+/**
+ * Add a route from its option, prefix=address:port[,address:port...].
+ */
+int8_t upstream_add_route(const char *spec) {
+  const char *equal = strchr(spec, '=');
+  if (equal == NULL || spec[0] != '/' || g_nb_routes >= UPSTREAM_MAX_ROUTES) {
+    LOG_ERROR("invalid upstream route: %s\n", spec);
+    return ERROR;
+  }
+  upstream_route_t *route = &g_routes[g_nb_routes];
+  memset(route, 0, sizeof (upstream_route_t));
+  size_t len;
+  char *list = strdup(equal + 1);
+  if ((route->prefix = route_prefix(spec, equal, &len)) == NULL || list == NULL) {
+    perror("strdup");
+    free(route->prefix);
+    free(list);
+    return ERROR;
+  }
+  route->prefix_len = len;
+  char *save;
+  for (char *address = strtok_r(list, ",", &save); address != NULL;
+    address = strtok_r(NULL, ",", &save)) {
+    upstream_backend_t *backend = add_backend(address);
+    if (backend == NULL || route->nb_backends >= UPSTREAM_MAX_BACKENDS) {
+      LOG_ERROR("invalid upstream: %s\n", address);
+      free(list);
+      free(route->prefix);
+      return ERROR;
+    }
+    route->backends[route->nb_backends++] = backend;
+  }
+  free(list);
+  if (route->nb_backends == 0) {
+    LOG_ERROR("no upstream for %s\n", spec);
+    free(route->prefix);
+    return ERROR;
+  }
+  ++g_nb_routes;
+  return 0;
+}
+
+uint8_t upstream_enabled() {
+  return g_nb_routes > 0;
+}
+
+// Connections to poll at most: those of the pools and the health probes
+size_t upstream_max_fds() {
+  return g_nb_backends * (UPSTREAM_MAX_CONNECTIONS + 1);
+}
+
+int8_t upstream_init() {
+  if (g_nb_routes == 0) return 0;
+  if ((g_polled = calloc(upstream_max_fds(), sizeof (upstream_conn_t *))) == NULL) {
+    perror("calloc");
+    return ERROR;
+  }
+  for (uint32_t i = 0; i < g_nb_routes; ++i)
+    LOG_MSG("proxying /%s to %u backends\n", g_routes[i].prefix, g_routes[i].nb_backends);
+  return 0;
+}
+
+static void mark_down(upstream_backend_t *backend, const char *reason) {
+  if (backend->healthy) LOG_WARNING("upstream %s down: %s\n", backend->name, reason);
+  backend->healthy = 0;
+}
+
+static void mark_up(upstream_backend_t *backend) {
+  if (!backend->healthy) LOG_MSG("upstream %s up\n", backend->name);
+  backend->healthy = 1;
+}
+
+/**
+ * Start connecting to the backend, for a request or to probe it.
+ */
+static upstream_conn_t *open_conn(upstream_backend_t *backend, upstream_state_e state) {
+  int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return NULL;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  if (connect(fd, (struct sockaddr *) &backend->addr, sizeof (backend->addr)) < 0 &&
+    errno != EINPROGRESS) {
+    mark_down(backend, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  upstream_conn_t *conn = calloc(1, sizeof (upstream_conn_t));
+  if (conn == NULL) {
+    perror("calloc");
+    close(fd);
+    return NULL;
+  }
+  conn->fd = fd;
+  conn->state = state;
+  conn->backend = backend;
+  conn->pipe[0] = conn->pipe[1] = -1;
+  conn->deadline_ns = now_ns() + g_upstream_timeout_ms * 1000000;
+  conn->next = g_conns;
+  g_conns = conn;
+  if (state != UPSTREAM_PROBING) {
+    ++backend->connections;
+    METRIC_INC(upstream_connections);
+  }
+  return conn;
+}
+
+/**
+ * Close the connection. It stays in the list until the next upstream_fds,
+ * its entry of the current poll set may still be looked at.
+ */
+static void close_conn(upstream_conn_t *conn) {
+  if (conn->state == UPSTREAM_CLOSED) return;
+  upstream_backend_t *backend = conn->backend;
+  if (conn->state == UPSTREAM_IDLE) {
+    upstream_conn_t **link = &backend->idle;
+    while (*link != conn) link = &(*link)->next_idle;
+    *link = conn->next_idle;
+    --backend->nb_idle;
+  }
+  if (conn->state == UPSTREAM_PROBING) backend->probe = NULL;
+  else --backend->connections;
+  close(conn->fd);
+  if (conn->pipe[0] >= 0) {
+    close(conn->pipe[0]);
+    close(conn->pipe[1]);
+  }
+  free(conn->head);
+  free(conn->buffer);
+  conn->head = conn->buffer = NULL;
+  conn->fd = -1;
+  conn->state = UPSTREAM_CLOSED;
+}
+
+static void reap() {
+  upstream_conn_t **link = &g_conns;
+  while (*link != NULL) {
+    upstream_conn_t *conn = *link;
+    if (conn->state != UPSTREAM_CLOSED) {
+      link = &conn->next;
+      continue;
+    }
+    *link = conn->next;
+    free(conn);
+  }
+}
+
+static void idle(upstream_conn_t *conn) {
+  upstream_backend_t *backend = conn->backend;
+  if (backend->nb_idle >= UPSTREAM_MAX_IDLE) {
+    close_conn(conn);
+    return;
+  }
+  conn->state = UPSTREAM_IDLE;
+  conn->deadline_ns = now_ns() + UPSTREAM_IDLE_TIMEOUT_MS * 1000000ULL;
+  conn->next_idle = backend->idle;
+  backend->idle = conn;
+  ++backend->nb_idle;
+}
+
+/**
+ * A connection to the backend for a request: an idle one the backend did not
+ * close meanwhile, or a new one.
+ */
+static upstream_conn_t *take(upstream_backend_t *backend) {
+  while (backend->idle != NULL) {
+    upstream_conn_t *conn = backend->idle;
+    backend->idle = conn->next_idle;
+    --backend->nb_idle;
+    conn->state = UPSTREAM_SENDING;
+    // Readable means closed, or bytes the backend should not have sent
+    char byte;
+    if (recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn->reused = 1;
+      METRIC_INC(upstream_reuses);
+      return conn;
+    }
+    close_conn(conn);
+  }
+  if (backend->connections >= UPSTREAM_MAX_CONNECTIONS) return NULL;
+  return open_conn(backend, UPSTREAM_CONNECTING);
+}
+
+/**
+ * The healthy backend of the route with the fewest requests outstanding.
+ * saturated is set if one was left out for having too many.
+ */
+static upstream_backend_t *pick(upstream_route_t *route, uint8_t *saturated) {
+  upstream_backend_t *best = NULL;
+  *saturated = 0;
+  for (uint32_t i = 0; i < route->nb_backends; ++i) {
+    upstream_backend_t *backend = route->backends[(route->next + i) % route->nb_backends];
+    if (!backend->healthy) continue;
+    if (backend->outstanding >= UPSTREAM_MAX_CONNECTIONS) {
+      *saturated = 1;
+      continue;
+    }
+    if (best == NULL || backend->outstanding < best->outstanding) best = backend;
+  }
+  route->next = (route->next + 1) % route->nb_backends;
+  return best;
+}
+
+static upstream_route_t *find_route(request_t *request, size_t len) {
+  upstream_route_t *found = NULL;
+  for (uint32_t i = 0; i < g_nb_routes; ++i) {
+    upstream_route_t *route = &g_routes[i];
+    if (!route_match(request, len, route->prefix, route->prefix_len)) continue;
+    // The longest prefix wins
+    if (found == NULL || route->prefix_len > found->prefix_len) found = route;
+  }
+  return found;
+}
+
+uint8_t upstream_match(request_t *request) {
+  return g_nb_routes > 0 && request->path != NULL &&
+    find_route(request, request_path_len(request)) != NULL;
+}
+
+static void put(char *buffer, size_t size, size_t *position, const char *format, ...) {
+  if (*position >= size) return;
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer + *position, size - *position, format, args);
+  va_end(args);
+  if (len > 0) *position += len;
+}
+
+// Set by the proxy itself, or only meaningful between the client and us
+static uint8_t forwarded(uint8_t header, uint8_t cache) {
+  switch (header) {
+  // The response of a flight is for every client of the key, see
+  // proxycache_key
+  case IF_MATCH:
+  case IF_MODIFIED_SINCE:
+  case IF_NONE_MATCH:
+  case IF_RANGE:
+  case IF_UNMODIFIED_SINCE:
+  case ACCEPT_ENCODING:
+    return !cache;
+  case CONNECTION:
+  case PROXY_CONNECTION:
+  case UPGRADE:
+  case TE:
+  case HTTP2_SETTINGS:
+  // Request bodies are not forwarded
+  case EXPECT:
+  case CONTENT_LENGTH:
+  case X_FORWARDED_FOR:
+  case X_FORWARDED_HOST:
+  case X_FORWARDED_PROTO:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+/**
+ * Write the request head of the client for a backend in buffer, of
+ * UPSTREAM_HEAD_SIZE bytes: the normalized path, encoded again, and the
+ * parsed headers, with the X-Forwarded-* ones added. host is used if the
+ * client gave none. The flights of the cache (cache set) are GETs, even when
+ * a stale HEAD starts them, as they fetch the body for every client of the
+ * key. Returns its length, ERROR if it does not fit.
+ */
+static ssize_t request_head(client_t *client, const char *host, char *buffer,
+  uint8_t cache) {
+  request_t *request = &client->request;
+  size_t size = UPSTREAM_HEAD_SIZE;
+  size_t position = 0;
+  put(buffer, size, &position, "%s /", g_methods[cache ? GET : request->method]);
+  size_t len = request_path_len(request);
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = request->path[i];
+    if (isalnum(c) || strchr("-._~!$&'()*+,;=:@/", c) != NULL) put(buffer, size, &position, "%c", c);
+    else put(buffer, size, &position, "%%%02X", c);
+  }
+  if (request->query != NULL) put(buffer, size, &position, "?%s", request->query);
+  put(buffer, size, &position, " HTTP/1.0\r\n");
+  for (uint8_t i = 0; i < NB_HEADERS; ++i)
+    if (request->headers[i] != NULL && forwarded(i, cache))
+      put(buffer, size, &position, "%s: %s\r\n", g_headers[i], request->headers[i]);
+  const char *accept = request->headers[ACCEPT_ENCODING];
+  if (cache && accept != NULL && strstr(accept, "gzip") != NULL)
+    put(buffer, size, &position, "Accept-Encoding: gzip\r\n");
+  if (request->headers[HOST] == NULL) put(buffer, size, &position, "Host: %s\r\n", host);
+  else put(buffer, size, &position, "X-Forwarded-Host: %s\r\n", request->headers[HOST]);
+  const char *address = inet_ntoa(((struct sockaddr_in *) client->client_addr)->sin_addr);
+  if (request->headers[X_FORWARDED_FOR] != NULL)
+    put(buffer, size, &position, "X-Forwarded-For: %s, %s\r\n",
+      request->headers[X_FORWARDED_FOR], address);
+  else put(buffer, size, &position, "X-Forwarded-For: %s\r\n", address);
+  put(buffer, size, &position, "X-Forwarded-Proto: %s\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n", client->tls != NULL ? "https" : "http");
+  return position < size ? (ssize_t) position : ERROR;
+}
+
+/**
+ * Give the connection the request of the client, or the one of the flight.
+ */
+static int8_t attach(upstream_conn_t *conn, client_t *client, upstream_flight_t *flight,
+  upstream_route_t *route, uint8_t tries) {
+  conn->client = client;
+  conn->flight = flight;
+  conn->route = route;
+  conn->tries = tries;
+  conn->body_left = 0;
+  conn->until_close = conn->eof = conn->keep_alive = 0;
+  conn->deadline_ns = now_ns() + g_upstream_timeout_ms * 1000000;
+  ++conn->backend->outstanding;
+  if (flight != NULL) {
+    flight->conn = conn;
+    for (uint32_t i = 0; i < flight->nb_waiters; ++i) flight->waiters[i]->upstream = conn;
+  } else client->upstream = conn;
+  if ((conn->head = malloc(UPSTREAM_HEAD_SIZE)) == NULL) {
+    perror("malloc");
+    return ERROR;
+  }
+  conn->head_sent = 0;
+  if (flight != NULL) {
+    memcpy(conn->head, flight->head, flight->head_len);
+    conn->head_len = flight->head_len;
+    return 0;
+  }
+  ssize_t len = request_head(client, conn->backend->name, conn->head, 0);
+  conn->head_len = len > 0 ? len : 0;
+  return len < 0 ? ERROR : 0;
+}
+
+static void detach(upstream_conn_t *conn) {
+  upstream_flight_t *flight = conn->flight;
+  if (flight != NULL) {
+    flight->conn = NULL;
+    for (uint32_t i = 0; i < flight->nb_waiters; ++i) flight->waiters[i]->upstream = NULL;
+  } else conn->client->upstream = NULL;
+  conn->client = NULL;
+  conn->flight = NULL;
+  --conn->backend->outstanding;
+  free(conn->head);
+  conn->head = NULL;
+}
+
+/**
+ * Send what is left of the request head. Returns ERROR if the connection is
+ * broken.
+ */
+static int8_t send_request(upstream_conn_t *conn) {
+  while (conn->head_sent < conn->head_len) {
+    ssize_t len = send(conn->fd, conn->head + conn->head_sent,
+      conn->head_len - conn->head_sent, MSG_NOSIGNAL);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return ERROR;
+    }
+    conn->head_sent += len;
+  }
+  // The buffer now takes the response head
+  conn->state = UPSTREAM_WAITING;
+  conn->head_len = 0;
+  return 0;
+}
+
+/**
+ * Give the request of the client, or the one of the flight, to a backend of
+ * the route. Returns ERROR with the status to answer if none could take it.
+ */
+static int8_t assign(client_t *client, upstream_flight_t *flight, upstream_route_t *route,
+  uint8_t tries, status_code_e *status) {
+  while (tries < UPSTREAM_MAX_TRIES) {
+    uint8_t saturated;
+    upstream_backend_t *backend = pick(route, &saturated);
+    if (backend == NULL) {
+      *status = saturated ? _503 : _502;
+      return ERROR;
+    }
+    upstream_conn_t *conn = take(backend);
+    if (conn == NULL) {
+      ++tries;
+      continue;
+    }
+    if (attach(conn, client, flight, route, tries) < 0) {
+      detach(conn);
+      close_conn(conn);
+      *status = _500;
+      return ERROR;
+    }
+    if (conn->state == UPSTREAM_CONNECTING || send_request(conn) == 0) return 0;
+    // A pooled connection closed by the backend, which does not count
+    detach(conn);
+    close_conn(conn);
+  }
+  *status = _502;
+  return ERROR;
+}
+
+static void free_flight(upstream_flight_t *flight) {
+  upstream_flight_t **link = &g_flights;
+  while (*link != flight) link = &(*link)->next;
+  *link = flight->next;
+  free(flight->key);
+  free(flight->head);
+  free(flight->waiters);
+  free(flight->response);
+  free(flight->body);
+  free(flight);
+}
+
+/**
+ * The flight is over: answer its waiters with the response read, or with
+ * status if it failed.
+ */
+static void land(upstream_flight_t *flight, status_code_e status, client_t **clients) {
+  for (uint32_t i = 0; i < flight->nb_waiters; ++i) {
+    client_t *client = flight->waiters[i];
+    request_t *request = &client->request;
+    client->upstream = NULL;
+    if (!flight->done) {
+      answer_later(client, status, clients);
+      continue;
+    }
+    request->status = status_of(flight->code);
+    answered_later(client, proxycache_respond(client, request, flight->response,
+      flight->response_len, flight->body, flight->body_len, flight->times.stored), clients);
+  }
+  free_flight(flight);
+}
+
+static void fail(upstream_conn_t *conn, status_code_e status, client_t **clients) {
+  client_t *client = conn->client;
+  upstream_flight_t *flight = conn->flight;
+  METRIC_INC(upstream_errors);
+  detach(conn);
+  close_conn(conn);
+  if (flight != NULL) land(flight, status, clients);
+  else answer_later(client, status, clients);
+}
+
+/**
+ * The connection failed before the response started: try the request again,
+ * counting it as a try unless the backend had closed a pooled connection.
+ */
+static void retry(upstream_conn_t *conn, uint8_t counts, client_t **clients) {
+  client_t *client = conn->client;
+  upstream_flight_t *flight = conn->flight;
+  upstream_route_t *route = conn->route;
+  uint8_t tries = conn->tries + counts;
+  status_code_e status = _502;
+  if (counts) METRIC_INC(upstream_errors);
+  detach(conn);
+  close_conn(conn);
+  if (tries < UPSTREAM_MAX_TRIES && assign(client, flight, route, tries, &status) == 0) return;
+  if (flight != NULL) land(flight, status, clients);
+  else answer_later(client, status, clients);
+}
+
+static upstream_flight_t *find_flight(const char *key) {
+  for (upstream_flight_t *flight = g_flights; flight != NULL; flight = flight->next)
+    if (!strcmp(flight->key, key)) return flight;
+  return NULL;
+}
+
+static int8_t add_waiter(upstream_flight_t *flight, client_t *client) {
+  if (flight->nb_waiters == flight->size) {
+    uint32_t size = flight->size ? flight->size * 2 : 4;
+    client_t **waiters = realloc(flight->waiters, size * sizeof (client_t *));
+    if (waiters == NULL) {
+      perror("realloc");
+      return ERROR;
+    }
+    flight->waiters = waiters;
+    flight->size = size;
+  }
+  flight->waiters[flight->nb_waiters++] = client;
+  client->upstream = flight->conn;
+  return 0;
+}
+
+/**
+ * Fetch the response of the key with the request of the client, for it if
+ * wait is set. Returns ERROR with the status to answer if no backend could
+ * take it.
+ */
+static int8_t start_flight(client_t *client, upstream_route_t *route, const char *key,
+  uint8_t wait, status_code_e *status) {
+  upstream_flight_t *flight = calloc(1, sizeof (upstream_flight_t));
+  *status = _500;
+  if (flight == NULL || (flight->key = strdup(key)) == NULL ||
+    (flight->head = malloc(UPSTREAM_HEAD_SIZE)) == NULL) {
+    perror("malloc");
+    if (flight != NULL) free(flight->key);
+    free(flight);
+    return ERROR;
+  }
+  flight->route = route;
+  flight->next = g_flights;
+  g_flights = flight;
+  ssize_t len = request_head(client, route->backends[0]->name, flight->head, 1);
+  if (len < 0 || (wait && add_waiter(flight, client) < 0)) {
+    free_flight(flight);
+    return ERROR;
+  }
+  flight->head_len = len;
+  METRIC_INC(upstream_requests);
+  if (assign(NULL, flight, route, 0, status) == 0) return 0;
+  client->upstream = NULL;
+  free_flight(flight);
+  return ERROR;
+}
+
+/**
+ * Answer the request from the cache, or from the flight of its key, started
+ * if there is none. Returns 0 if it has to be forwarded on its own, as a
+ * HEAD missing the cache, 1 otherwise with the result in *ret.
+ */
+static uint8_t cached(client_t *client, request_t *request, upstream_route_t *route,
+  int8_t *ret) {
+  char key[PROXYCACHE_MAX_KEY];
+  if (!proxycache_cacheable(request) ||
+    proxycache_key(request, request_path_len(request), key, sizeof (key)) == 0) return 0;
+  proxycache_state_e state;
+  status_code_e status;
+  proxycache_entry_t *entry = proxycache_lookup(key, &state);
+  if (entry != NULL) {
+    if (state == PROXYCACHE_FRESH) METRIC_INC(proxy_cache_hits);
+    else {
+      METRIC_INC(proxy_cache_stale_hits);
+      // Before the request is answered, and freed
+      if (find_flight(key) == NULL) start_flight(client, route, key, 0, &status);
+    }
+    request->status = status_of(strtoul(entry->data + 9, NULL, 10));
+    *ret = proxycache_respond(client, request, entry->data, entry->head_len,
+      entry->data + entry->head_len, entry->body_len, entry->times.stored);
+    return 1;
+  }
+  // Flights only answer a whole connection
+  if (request->method != GET || client->h2 != NULL) return 0;
+  METRIC_INC(proxy_cache_misses);
+  upstream_flight_t *flight = find_flight(key);
+  if (flight != NULL) {
+    METRIC_INC(proxy_cache_coalesced);
+    *ret = add_waiter(flight, client) < 0 ? answer(client->clientfd, request, _500) : 0;
+    return 1;
+  }
+  *ret = start_flight(client, route, key, 1, &status) < 0 ?
+    answer(client->clientfd, request, status) : 0;
+  return 1;
+}
+
+/**
+ * Forward the request to a backend of its route, or answer why it cannot be,
+ * unless the cache has its response. Returns ERROR when the connection of
+ * the client is broken. HTTP/2 streams, whose responses are framed from
+ * memory or files only, get a 502 when the response is not cached.
+ */
+int8_t upstream_forward(client_t *client, request_t *request) {
+  upstream_route_t *route = find_route(request, request_path_len(request));
+  int8_t ret;
+  if (cached(client, request, route, &ret)) return ret;
+  if (client->h2 != NULL) {
+    LOG_DEBUG("not proxying %s over HTTP/2\n", request->path);
+    return answer(client->clientfd, request, _502);
+  }
+  METRIC_INC(upstream_requests);
+  status_code_e status;
+  if (assign(client, NULL, route, 0, &status) == 0) return 0;
+  return answer(client->clientfd, request, status);
+}
+
+// Length of the head up to the empty line included, 0 if not there yet
+static size_t head_end(const char *head, size_t len) {
+  for (size_t i = 1; i < len; ++i) {
+    if (head[i] != '\n') continue;
+    if (head[i - 1] == '\n' || (i >= 2 && head[i - 1] == '\r' && head[i - 2] == '\n'))
+      return i + 1;
+  }
+  return 0;
+}
+
+/**
+ * Rewrite the response head of the backend for the client: HTTP/1.1, without
+ * the hop-by-hop headers. Sets the status code and how the body ends, and
+ * whether the connection can go back to the pool. Returns the length of the
+ * new head, ERROR if the response cannot be forwarded.
+ */
+static ssize_t response_head(upstream_conn_t *conn, char *out, size_t size,
+  uint16_t *code) {
+  char *head = conn->head;
+  head[conn->head_len] = '\0';
+  if (strncmp(head, "HTTP/1.", 7) || (head[7] != '0' && head[7] != '1') || head[8] != ' ')
+    return ERROR;
+  char *end;
+  unsigned long status = strtoul(head + 9, &end, 10);
+  // No interim response is expected, the request has no body
+  if (end != head + 12 || status < 200 || status > 599) return ERROR;
+  *code = status;
+  uint8_t keep_alive = head[7] == '1';
+  int64_t length = -1;
+  size_t position = 0;
+  char *eol = strchr(head, '\n');
+  size_t len = eol - head;
+  if (head[len - 1] == '\r') --len;
+  put(out, size, &position, "HTTP/1.1%.*s\r\n", (int) (len - 8), head + 8);
+  for (char *line = eol + 1; *line != '\r' && *line != '\n'; line = eol + 1) {
+    eol = strchr(line, '\n');
+    len = eol - line;
+    if (len > 0 && line[len - 1] == '\r') --len;
+    line[len] = '\0';
+    char *colon = strchr(line, ':');
+    if (colon == NULL) return ERROR;
+    size_t name_len = colon - line;
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') ++value;
+    if (name_len == 10 && !strncasecmp(line, "Connection", 10)) {
+      if (strcasestr(value, "close") != NULL) keep_alive = 0;
+      else if (strcasestr(value, "keep-alive") != NULL) keep_alive = 1;
+      continue;
+    }
+    if (name_len == 14 && !strncasecmp(line, "Content-Length", 14)) {
+      length = strtoll(value, &end, 10);
+      if (end == value || length < 0) return ERROR;
+    }
+    // Chunked, which an HTTP/1.0 request does not allow
+    if (name_len == 17 && !strncasecmp(line, "Transfer-Encoding", 17)) return ERROR;
+    if ((name_len == 10 && !strncasecmp(line, "Keep-Alive", 10)) ||
+      (name_len == 16 && !strncasecmp(line, "Proxy-Connection", 16)) ||
+      (name_len == 7 && !strncasecmp(line, "Upgrade", 7)) ||
+      (name_len == 2 && !strncasecmp(line, "TE", 2))) continue;
+    put(out, size, &position, "%s\r\n", line);
+  }
+  // Flights are GETs, see request_head
+  uint8_t bodiless = (conn->client != NULL && conn->client->request.method == HEAD) ||
+    status == 204 || status == 304;
+  conn->until_close = !bodiless && length < 0;
+  conn->body_left = bodiless || length < 0 ? 0 : length;
+  conn->keep_alive = keep_alive && !conn->until_close;
+  // The end of the body is told by closing the connection
+  if (conn->until_close) put(out, size, &position, "Connection: close\r\n");
+  put(out, size, &position, "\r\n");
+  return position < size ? (ssize_t) position : ERROR;
+}
+
+static int8_t prepare_body(upstream_conn_t *conn) {
+  if (!conn->until_close && conn->body_left == 0) return 0;
+  conn->piped = conn->buffered = conn->buffer_sent = 0;
+  conn->pipe_full = 0;
+  if (!conn->splice) {
+    if (conn->buffer == NULL && (conn->buffer = malloc(UPSTREAM_BUFFER_SIZE)) == NULL) {
+      perror("malloc");
+      return ERROR;
+    }
+    return 0;
+  }
+  // Kept with the connection, empty between the responses
+  if (conn->pipe[0] >= 0) return 0;
+  if (pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    perror("pipe2");
+    conn->pipe[0] = conn->pipe[1] = -1;
+    return ERROR;
+  }
+  int size = fcntl(conn->pipe[1], F_SETPIPE_SZ, UPSTREAM_PIPE_SIZE);
+  if (size < 0) size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+  conn->pipe_size = size > 0 ? size : 65536;
+  return 0;
+}
+
+/**
+ * The whole body of the response of a flight was read: store it, and send it
+ * to the waiters.
+ */
+static void filled(upstream_conn_t *conn, client_t **clients) {
+  upstream_flight_t *flight = conn->flight;
+  flight->done = 1;
+  proxycache_store(flight->key, flight->response, flight->response_len, flight->body,
+    flight->body_len, &flight->times);
+  detach(conn);
+  if (conn->keep_alive) idle(conn);
+  else close_conn(conn);
+  land(flight, _500, clients);
+}
+
+/**
+ * The response head of a flight arrived. A response that can be cached is
+ * read in memory; any other is streamed to the first waiter as if it had been
+ * forwarded on its own, the others being forwarded now. Returns 0 in that
+ * case, 1 if the flight goes on or is over.
+ */
+static uint8_t fill(upstream_conn_t *conn, char *head, size_t len, uint16_t code,
+  client_t **clients) {
+  upstream_flight_t *flight = conn->flight;
+  if (!conn->until_close && conn->body_left <= PROXYCACHE_MAX_OBJECT &&
+    proxycache_lifetime(head, len, code, &flight->times) == 0) {
+    if ((flight->response = malloc(len)) == NULL ||
+      (flight->body = malloc(conn->body_left ? conn->body_left : 1)) == NULL) {
+      perror("malloc");
+      fail(conn, _500, clients);
+      return 1;
+    }
+    memcpy(flight->response, head, len);
+    flight->response_len = proxycache_head(flight->response, len);
+    flight->code = code;
+    free(conn->head);
+    conn->head = NULL;
+    conn->state = UPSTREAM_FILLING;
+    conn->deadline_ns = now_ns() + g_upstream_timeout_ms * 1000000;
+    if (conn->body_left == 0) filled(conn, clients);
+    return 1;
+  }
+  // Not to be served stale either
+  proxycache_remove(flight->key);
+  if (flight->nb_waiters == 0) {
+    detach(conn);
+    close_conn(conn);
+    free_flight(flight);
+    return 1;
+  }
+  client_t **waiters = flight->waiters;
+  uint32_t nb_waiters = flight->nb_waiters;
+  upstream_route_t *route = flight->route;
+  flight->waiters = NULL;
+  flight->nb_waiters = 0;
+  free_flight(flight);
+  conn->flight = NULL;
+  conn->client = waiters[0];
+  for (uint32_t i = 1; i < nb_waiters; ++i) {
+    status_code_e status;
+    waiters[i]->upstream = NULL;
+    METRIC_INC(upstream_requests);
+    if (assign(waiters[i], NULL, route, 0, &status) < 0) answer_later(waiters[i], status, clients);
+  }
+  free(waiters);
+  return 0;
+}
+
+/**
+ * The response head arrived: send the rewritten head to the client, the body
+ * follows through the scheduler.
+ */
+static void start_response(upstream_conn_t *conn, client_t **clients) {
+  char head[UPSTREAM_HEAD_SIZE + 64];
+  uint16_t code;
+  ssize_t len = response_head(conn, head, sizeof (head), &code);
+  if (len < 0) {
+    LOG_WARNING("invalid response from upstream %s\n", conn->backend->name);
+    fail(conn, _502, clients);
+    return;
+  }
+  mark_up(conn->backend);
+  if (conn->flight != NULL && fill(conn, head, len, code, clients)) return;
+  client_t *client = conn->client;
+  client->request.status = status_of(code);
+  free(conn->head);
+  conn->head = NULL;
+  conn->state = UPSTREAM_BODY;
+  // Straight to the socket unless OpenSSL encrypts it
+  conn->splice = tls_kernel_send(client);
+  if (prepare_body(conn) < 0) {
+    fail(conn, _500, clients);
+    return;
+  }
+  // The connection may be back in the pool, or closed, from there on
+  if (sched_start(client, head, len, -1, 0, 0, PAGECACHE_NORMAL) < 0) {
+    finish_request(client);
+    delete_client(client->clientfd, clients);
+  } else if (!client->transfer.active) finish_request(client);
+}
+
+/**
+ * Read the response head, without taking any byte of the body from the
+ * socket: what arrived is peeked at, and only the head consumed.
+ */
+static void read_head(upstream_conn_t *conn, client_t **clients) {
+  ssize_t len = recv(conn->fd, conn->head + conn->head_len,
+    UPSTREAM_HEAD_SIZE - 1 - conn->head_len, MSG_PEEK);
+  if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (len <= 0) {
+    // A pooled connection the backend closed as the request went out
+    uint8_t stale = conn->reused && conn->head_len == 0;
+    if (!stale) LOG_WARNING("upstream %s closed without a response\n", conn->backend->name);
+    retry(conn, !stale, clients);
+    return;
+  }
+  size_t end = head_end(conn->head, conn->head_len + len);
+  size_t count = end ? end - conn->head_len : (size_t) len;
+  if (recv(conn->fd, conn->head + conn->head_len, count, 0) != (ssize_t) count) {
+    fail(conn, _502, clients);
+    return;
+  }
+  conn->head_len += count;
+  if (end) start_response(conn, clients);
+  else if (conn->head_len >= UPSTREAM_HEAD_SIZE - 1) {
+    LOG_WARNING("response head from upstream %s too long\n", conn->backend->name);
+    fail(conn, _502, clients);
+  }
+}
+
+static void read_body(upstream_conn_t *conn, client_t **clients) {
+  size_t want = conn->splice ? conn->pipe_size - conn->piped : UPSTREAM_BUFFER_SIZE;
+  if (!conn->until_close && want > conn->body_left) want = conn->body_left;
+  ssize_t len = conn->splice ?
+    splice(conn->fd, NULL, conn->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK) :
+    read(conn->fd, conn->buffer, want);
+  if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // The socket was readable: the pipe is full, in pages rather than bytes
+    if (errno != EINTR && conn->piped > 0) conn->pipe_full = 1;
+    return;
+  }
+  if (len == 0 && conn->until_close) {
+    conn->eof = 1;
+    return;
+  }
+  if (len <= 0) {
+    LOG_WARNING("upstream %s cut a response short\n", conn->backend->name);
+    METRIC_INC(upstream_errors);
+    delete_client(conn->client->clientfd, clients);
+    return;
+  }
+  if (conn->splice) conn->piped += len;
+  else {
+    conn->buffered = len;
+    conn->buffer_sent = 0;
+  }
+  if (!conn->until_close) conn->body_left -= len;
+  METRIC_ADD(queued_bytes, len);
+  METRIC_ADD(upstream_bytes, len);
+}
+
+static void read_fill(upstream_conn_t *conn, client_t **clients) {
+  upstream_flight_t *flight = conn->flight;
+  ssize_t len = read(conn->fd, flight->body + flight->body_len, conn->body_left);
+  if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (len <= 0) {
+    LOG_WARNING("upstream %s cut a response short\n", conn->backend->name);
+    fail(conn, _502, clients);
+    return;
+  }
+  flight->body_len += len;
+  conn->body_left -= len;
+  conn->deadline_ns = now_ns() + g_upstream_timeout_ms * 1000000;
+  METRIC_ADD(upstream_bytes, len);
+  if (conn->body_left == 0) filled(conn, clients);
+}
+
+static void probed(upstream_conn_t *conn) {
+  int err = 0;
+  socklen_t len = sizeof (err);
+  getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err) mark_down(conn->backend, strerror(err));
+  else mark_up(conn->backend);
+  close_conn(conn);
+}
+
+static void connected(upstream_conn_t *conn, client_t **clients) {
+  int err = 0;
+  socklen_t len = sizeof (err);
+  getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err) {
+    mark_down(conn->backend, strerror(err));
+    retry(conn, 1, clients);
+    return;
+  }
+  conn->state = UPSTREAM_SENDING;
+  if (send_request(conn) < 0) retry(conn, 1, clients);
+}
+
+// Whether the body may be read from the backend now
+static uint8_t has_room(upstream_conn_t *conn) {
+  if (conn->eof || (!conn->until_close && conn->body_left == 0)) return 0;
+  return conn->splice ? !conn->pipe_full && conn->piped < conn->pipe_size :
+    conn->buffered == 0;
+}
+
+/**
+ * Fill fds with the connections to the backends. Returns the number of
+ * entries, upstream_max_fds() at most.
+ */
+size_t upstream_fds(struct pollfd *fds) {
+  reap();
+  size_t n = 0;
+  for (upstream_conn_t *conn = g_conns; conn != NULL && n < upstream_max_fds();
+    conn = conn->next) {
+    short events = 0;
+    switch (conn->state) {
+    case UPSTREAM_CONNECTING:
+    case UPSTREAM_SENDING:
+    case UPSTREAM_PROBING:
+      events = POLLOUT;
+      break;
+    // An idle connection is only readable when the backend closes it
+    case UPSTREAM_WAITING:
+    case UPSTREAM_FILLING:
+    case UPSTREAM_IDLE:
+      events = POLLIN;
+      break;
+    case UPSTREAM_BODY:
+      events = has_room(conn) ? POLLIN : 0;
+      break;
+    default:
+      break;
+    }
+    // Left out entirely, so that a hang up does not wake the loop until the
+    // client makes room
+    fds[n].fd = events ? conn->fd : -1;
+    fds[n].events = events;
+    fds[n].revents = 0;
+    g_polled[n++] = conn;
+  }
+  return n;
+}
+
+/**
+ * Handle the events of the connections to the backends, the nfds entries
+ * filled by upstream_fds.
+ */
+void upstream_run(struct pollfd *fds, size_t nfds, client_t **clients) {
+  for (size_t i = 0; i < nfds; ++i) {
+    upstream_conn_t *conn = g_polled[i];
+    // Closed since the poll
+    if (fds[i].revents == 0 || fds[i].fd != conn->fd) continue;
+    switch (conn->state) {
+    case UPSTREAM_PROBING:
+      probed(conn);
+      break;
+    case UPSTREAM_CONNECTING:
+      connected(conn, clients);
+      break;
+    case UPSTREAM_SENDING:
+      if (send_request(conn) < 0) retry(conn, !conn->reused, clients);
+      break;
+    case UPSTREAM_WAITING:
+      read_head(conn, clients);
+      break;
+    case UPSTREAM_BODY:
+      if (has_room(conn)) read_body(conn, clients);
+      break;
+    case UPSTREAM_FILLING:
+      read_fill(conn, clients);
+      break;
+    case UPSTREAM_IDLE:
+      close_conn(conn);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/**
+ * Called by the event loop: times the requests out, closes the connections
+ * idle for too long and probes the backends.
+ */
+void upstream_tick(client_t **clients) {
+  if (g_nb_routes == 0) return;
+  uint64_t now = now_ns();
+  if (now - g_last_sweep_ns < UPSTREAM_SWEEP_MS * 1000000ULL) return;
+  g_last_sweep_ns = now;
+  for (upstream_conn_t *conn = g_conns; conn != NULL; conn = conn->next) {
+    if (now < conn->deadline_ns) continue;
+    switch (conn->state) {
+    case UPSTREAM_CONNECTING:
+      mark_down(conn->backend, "connect timeout");
+      // fall through
+    case UPSTREAM_SENDING:
+    case UPSTREAM_WAITING:
+    case UPSTREAM_FILLING:
+      LOG_WARNING("upstream %s timed out\n", conn->backend->name);
+      fail(conn, _504, clients);
+      break;
+    case UPSTREAM_PROBING:
+      mark_down(conn->backend, "connect timeout");
+      close_conn(conn);
+      break;
+    case UPSTREAM_IDLE:
+      close_conn(conn);
+      break;
+    default:
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < g_nb_backends; ++i) {
+    upstream_backend_t *backend = g_backends[i];
+    if (backend->probe != NULL || now < backend->check_ns) continue;
+    backend->check_ns = now + UPSTREAM_HEALTH_INTERVAL_MS * 1000000ULL;
+    backend->probe = open_conn(backend, UPSTREAM_PROBING);
+  }
+}
+
+/**
+ * Milliseconds until upstream_tick has something to do, -1 without routes.
+ */
+int upstream_timeout() {
+  if (g_nb_routes == 0) return -1;
+  for (upstream_conn_t *conn = g_conns; conn != NULL; conn = conn->next)
+    if (conn->state != UPSTREAM_IDLE && conn->state != UPSTREAM_CLOSED) return UPSTREAM_SWEEP_MS;
+  return UPSTREAM_HEALTH_INTERVAL_MS;
+}
+
+// Whether the whole body went to the client
+uint8_t upstream_done(client_t *client) {
+  upstream_conn_t *conn = client->upstream;
+  return conn->state == UPSTREAM_BODY && conn->piped == 0 &&
+    conn->buffer_sent == conn->buffered &&
+    (conn->until_close ? conn->eof : conn->body_left == 0);
+}
+
+// Whether the client has something to send, or the end of the body to see
+uint8_t upstream_ready(client_t *client) {
+  upstream_conn_t *conn = client->upstream;
+  return conn->piped > 0 || conn->buffer_sent < conn->buffered || upstream_done(client);
+}
+
+/**
+ * Send up to budget bytes of the body to the client. Returns the number of
+ * bytes sent or ERROR if the connection is broken.
+ */
+ssize_t upstream_send(client_t *client, size_t budget) {
+  upstream_conn_t *conn = client->upstream;
+  size_t sent = 0;
+  while (sent < budget) {
+    size_t count = conn->splice ? conn->piped : conn->buffered - conn->buffer_sent;
+    if (count == 0) break;
+    if (count > budget - sent) count = budget - sent;
+    ssize_t len = conn->splice ?
+      splice(conn->pipe[0], NULL, client->clientfd, NULL, count,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK) :
+      tls_write(client->clientfd, conn->buffer + conn->buffer_sent, count);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return ERROR;
+    }
+    if (len == 0) break;
+    if (conn->splice) {
+      conn->piped -= len;
+      conn->pipe_full = 0;
+    } else if ((conn->buffer_sent += len) == conn->buffered)
+      conn->buffered = conn->buffer_sent = 0;
+    sent += len;
+  }
+  return sent;
+}
+
+/**
+ * The response of the client is over, sent or given up on: its connection
+ * goes back to the pool if the body was read entirely, it is closed
+ * otherwise.
+ */
+void upstream_finish(client_t *client) {
+  upstream_conn_t *conn = client->upstream;
+  if (conn == NULL) return;
+  // Waiting for a flight, which goes on for the cache
+  if (conn->flight != NULL) {
+    upstream_flight_t *flight = conn->flight;
+    for (uint32_t i = 0; i < flight->nb_waiters; ++i) {
+      if (flight->waiters[i] != client) continue;
+      flight->waiters[i] = flight->waiters[--flight->nb_waiters];
+      break;
+    }
+    client->upstream = NULL;
+    return;
+  }
+  uint8_t complete = upstream_done(client);
+  METRIC_ADD(queued_bytes, -(conn->piped + conn->buffered - conn->buffer_sent));
+  detach(conn);
+  if (complete && conn->until_close) shutdown(client->clientfd, SHUT_WR);
+  if (complete && conn->keep_alive) idle(conn);
+  else close_conn(conn);
+}
+
+void upstream_stop() {
+  for (upstream_conn_t *conn = g_conns; conn != NULL; conn = conn->next) close_conn(conn);
+  reap();
+  while (g_flights != NULL) free_flight(g_flights);
+  for (uint32_t i = 0; i < g_nb_routes; ++i) free(g_routes[i].prefix);
+  for (uint32_t i = 0; i < g_nb_backends; ++i) free(g_backends[i]);
+  g_nb_routes = g_nb_backends = 0;
+  free(g_polled);
+  g_polled = NULL;
+}
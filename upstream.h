@@ -0,0 +1,156 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "defines.h"
+#include "proxycache.h"
+
+/**
+ * Reverse proxy: the requests under a path prefix are forwarded to a set of
+ * backends (app servers) instead of being served from the docroot. Each
+ * backend keeps a pool of keep-alive connections; a request goes to the
+ * healthy backend with the fewest requests outstanding. Response bodies go
+ * from the upstream socket to the client socket through a pipe with splice,
+ * without being copied to user space.
+ */
+#define UPSTREAM_MAX_ROUTES 16
+#define UPSTREAM_MAX_BACKENDS 32
+// Connections open to a backend, busy or idle, at most
+#define UPSTREAM_MAX_CONNECTIONS 64
+// Idle connections kept per backend
+#define UPSTREAM_MAX_IDLE 16
+#define UPSTREAM_IDLE_TIMEOUT_MS 30000
+// Connect, send the request and receive the response head within that, by
+// default
+#define UPSTREAM_TIMEOUT_MS 30000
+#define UPSTREAM_HEALTH_INTERVAL_MS 2000
+#define UPSTREAM_SWEEP_MS 100
+// Backends tried for a request, failing connections to a stale pooled
+// connection not counting
+#define UPSTREAM_MAX_TRIES 2
+// Request and response heads
+#define UPSTREAM_HEAD_SIZE 8192
+#define UPSTREAM_PIPE_SIZE 262144
+// Reads of the bodies OpenSSL encrypts, without kTLS
+#define UPSTREAM_BUFFER_SIZE 16384
+
+typedef enum {
+  UPSTREAM_CONNECTING = 0,
+  UPSTREAM_SENDING,
+  UPSTREAM_WAITING,
+  UPSTREAM_BODY,
+  // Reading the body of a response to cache
+  UPSTREAM_FILLING,
+  UPSTREAM_IDLE,
+  UPSTREAM_PROBING,
+  UPSTREAM_CLOSED,
+} upstream_state_e;
+
+typedef struct upstream_backend_s {
+  struct sockaddr_in addr;
+  // address:port, the Host of the requests without one
+  char name[32];
+  uint8_t healthy;
+  // Requests assigned, and connections open
+  uint32_t outstanding;
+  uint32_t connections;
+  struct upstream_conn_s *idle;
+  uint32_t nb_idle;
+  struct upstream_conn_s *probe;
+  uint64_t check_ns;
+} upstream_backend_t;
+
+typedef struct {
+  // Relative to the docroot, like the request paths
+  char *prefix;
+  size_t prefix_len;
+  upstream_backend_t *backends[UPSTREAM_MAX_BACKENDS];
+  uint32_t nb_backends;
+  // Where the search for the least loaded backend starts, so that ties take
+  // turns
+  uint32_t next;
+} upstream_route_t;
+
+/**
+ * The fetch of a cacheable response, which the clients missing the cache
+ * for the same key wait for rather than going to the backends each.
+ */
+typedef struct upstream_flight_s {
+  char *key;
+  upstream_route_t *route;
+  // The request for the backends, kept for the retries
+  char *head;
+  size_t head_len;
+  // None when it refreshes a stale entry
+  client_t **waiters;
+  uint32_t nb_waiters;
+  uint32_t size;
+  struct upstream_conn_s *conn;
+  // The response read, see proxycache_head
+  uint8_t done;
+  uint16_t code;
+  char *response;
+  size_t response_len;
+  char *body;
+  size_t body_len;
+  proxycache_times_t times;
+  struct upstream_flight_s *next;
+} upstream_flight_t;
+
+typedef struct upstream_conn_s {
+  int32_t fd;
+  upstream_state_e state;
+  upstream_backend_t *backend;
+  // Request being forwarded, NULL while idle or fetching for a flight
+  client_t *client;
+  upstream_flight_t *flight;
+  upstream_route_t *route;
+  uint8_t tries;
+  // Taken from the pool rather than connected for the request
+  uint8_t reused;
+  uint64_t deadline_ns;
+  // The request head being sent, then the response head being read
+  char *head;
+  size_t head_len;
+  size_t head_sent;
+  // Response body: still to read, or read until the backend closes
+  size_t body_left;
+  uint8_t until_close;
+  uint8_t eof;
+  uint8_t keep_alive;
+  // Body bytes go through the pipe, or through the buffer for OpenSSL
+  uint8_t splice;
+  int32_t pipe[2];
+  size_t pipe_size;
+  size_t piped;
+  uint8_t pipe_full;
+  char *buffer;
+  size_t buffered;
+  size_t buffer_sent;
+  struct upstream_conn_s *next_idle;
+  struct upstream_conn_s *next;
+} upstream_conn_t;
+
+extern uint64_t g_upstream_timeout_ms;
+
+int8_t upstream_add_route(const char *spec);
+int8_t upstream_init();
+void upstream_stop();
+uint8_t upstream_enabled();
+uint8_t upstream_match(request_t *request);
+int8_t upstream_forward(client_t *client, request_t *request);
+size_t upstream_max_fds();
+size_t upstream_fds(struct pollfd *fds);
+void upstream_run(struct pollfd *fds, size_t nfds, client_t **clients);
+void upstream_tick(client_t **clients);
+int upstream_timeout();
+uint8_t upstream_ready(client_t *client);
+uint8_t upstream_done(client_t *client);
+ssize_t upstream_send(client_t *client, size_t budget);
+void upstream_finish(client_t *client);
+
+#endif // __UPSTREAM_H__
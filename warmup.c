@@ -0,0 +1,261 @@
+// readahead
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "defines.h"
+#include "pagecache.h"
+#include "resolve.h"
+#include "warmup.h"
+
+/**
+ * The threads first read in the files of the manifest, in order, then share
+ * a stack of the directories left to scan. The warm-up is over when the
+ * stack is empty and no thread is scanning, a directory being able to push
+ * more. Paths are relative to the docroot, the working directory.
+ *
+ * The manifest lists a path per line, optionally preceded by its number of
+ * requests (the output of uniq -c), and is sorted by that number.
+ */
+
+typedef struct {
+  uint64_t count;
+  // In the manifest, qsort is not stable
+  uint32_t line;
+  char *path;
+} hot_file_t;
+
+typedef struct dir_s {
+  char *path;
+  struct dir_s *next;
+} dir_t;
+
+static pthread_t g_threads[WARMUP_MAX_THREADS];
+static uint8_t g_nb_threads = 0;
+
+static hot_file_t *g_hot = NULL;
+static uint32_t g_nb_hot = 0;
+static uint32_t g_next_hot = 0;
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static dir_t *g_dirs = NULL;
+static uint8_t g_scanning = 0;
+static uint8_t g_exited = 0;
+static uint64_t g_end_ns = 0;
+
+// Only used by the event loop
+static uint8_t g_active = 0;
+static uint64_t g_start_ns = 0;
+static uint64_t g_report_ns = 0;
+// Updated by the threads, read by warmup_tick
+static uint64_t g_nb_dirs = 0;
+static uint64_t g_nb_files = 0;
+static uint64_t g_nb_read = 0;
+static uint64_t g_bytes_read = 0;
+
+static void read_in(int fd, size_t size) {
+  if (readahead(fd, 0, size) == 0) {
+    __atomic_add_fetch(&g_nb_read, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_bytes_read, size, __ATOMIC_RELAXED);
+  }
+}
+
+static void push(char *path) {
+  dir_t *dir = malloc(sizeof (dir_t));
+  if (dir == NULL) {
+    perror("malloc");
+    free(path);
+    return;
+  }
+  dir->path = path;
+  pthread_mutex_lock(&g_mutex);
+  dir->next = g_dirs;
+  g_dirs = dir;
+  pthread_cond_signal(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static void warm_hot_files() {
+  uint32_t i;
+  while ((i = __atomic_fetch_add(&g_next_hot, 1, __ATOMIC_RELAXED)) < g_nb_hot) {
+    int fd = resolve_open_beneath(g_hot[i].path, O_RDONLY);
+    if (fd < 0) continue;
+    struct stat st;
+    // The files streamed when served would not stay in the cache
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (uint64_t) st.st_size < g_pagecache_stream_size) read_in(fd, st.st_size);
+    close(fd);
+  }
+}
+
+static void scan(const char *path) {
+  DIR *d = opendir(path);
+  if (d == NULL) return;
+  __atomic_add_fetch(&g_nb_dirs, 1, __ATOMIC_RELAXED);
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' ||
+      (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) continue;
+    struct stat st;
+    // Symbolic links are not followed, against loops and escapes
+    if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+    if (S_ISDIR(st.st_mode)) {
+      char *sub = malloc(PATH_MAX);
+      if (sub == NULL) continue;
+      if (snprintf(sub, PATH_MAX, "%s/%s", path, entry->d_name) >= PATH_MAX) free(sub);
+      else push(sub);
+    } else if (S_ISREG(st.st_mode)) {
+      __atomic_add_fetch(&g_nb_files, 1, __ATOMIC_RELAXED);
+      if (st.st_size == 0 || st.st_size > WARMUP_SMALL_FILE) continue;
+      int fd = openat(dirfd(d), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd < 0) continue;
+      read_in(fd, st.st_size);
+      close(fd);
+    }
+  }
+  closedir(d);
+}
+
+static void *warmup_loop(void *arg) {
+  (void) arg;
+  warm_hot_files();
+  pthread_mutex_lock(&g_mutex);
+  while (1) {
+    while (g_dirs == NULL && g_scanning > 0) pthread_cond_wait(&g_cond, &g_mutex);
+    if (g_dirs == NULL) break;
+    dir_t *dir = g_dirs;
+    g_dirs = dir->next;
+    ++g_scanning;
+    pthread_mutex_unlock(&g_mutex);
+    scan(dir->path);
+    free(dir->path);
+    free(dir);
+    pthread_mutex_lock(&g_mutex);
+    --g_scanning;
+  }
+  ++g_exited;
+  g_end_ns = now_ns();
+  // Wakes up the threads waiting for more directories, and warmup_wait
+  pthread_cond_broadcast(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+  return NULL;
+}
+
+static int compare_hot(const void *a, const void *b) {
+  const hot_file_t *x = a;
+  const hot_file_t *y = b;
+  if (x->count != y->count) return x->count > y->count ? -1 : 1;
+  return x->line < y->line ? -1 : 1;
+}
+
+static int8_t load_manifest(const char *manifest) {
+  FILE *f = fopen(manifest, "r");
+  if (f == NULL) {
+    LOG_ERROR("cannot open manifest %s: %s\n", manifest, strerror(errno));
+    return ERROR;
+  }
+  char line[PATH_MAX + 32];
+  while (fgets(line, sizeof (line), f) != NULL) {
+    char *path = line;
+    uint64_t count = strtoull(line, &path, 10);
+    while (*path == ' ' || *path == '\t') ++path;
+    // Paths are relative to the docroot, without the query
+    if (*path == '/') ++path;
+    path[strcspn(path, "?\r\n")] = 0;
+    if (*path == 0) continue;
+    hot_file_t *hot = realloc(g_hot, (g_nb_hot + 1) * sizeof (hot_file_t));
+    if (hot == NULL || (hot[g_nb_hot].path = strdup(path)) == NULL) {
+      perror("malloc");
+      if (hot != NULL) g_hot = hot;
+      break;
+    }
+    g_hot = hot;
+    g_hot[g_nb_hot].line = g_nb_hot;
+    g_hot[g_nb_hot++].count = count;
+  }
+  fclose(f);
+  qsort(g_hot, g_nb_hot, sizeof (hot_file_t), compare_hot);
+  return 0;
+}
+
+/**
+ * Start nb_threads threads warming the caches up, the files of the manifest
+ * (NULL for none) first.
+ */
+int8_t warmup_start(uint8_t nb_threads, const char *manifest) {
+  if (nb_threads == 0) return 0;
+  if (nb_threads > WARMUP_MAX_THREADS) nb_threads = WARMUP_MAX_THREADS;
+  if (manifest != NULL && load_manifest(manifest)) return ERROR;
+  char *root = strdup(".");
+  if (root == NULL) return ERROR;
+  push(root);
+  g_start_ns = g_report_ns = now_ns();
+  for (uint8_t i = 0; i < nb_threads; ++i) {
+    int ret;
+    if ((ret = pthread_create(&g_threads[i], NULL, warmup_loop, NULL)) != 0) {
+      errno = ret;
+      perror("pthread_create");
+      if (i == 0) return ERROR;
+      break;
+    }
+    ++g_nb_threads;
+  }
+  g_active = 1;
+  LOG_MSG("warming up with %u threads, %u files in the manifest\n", g_nb_threads, g_nb_hot);
+  return 0;
+}
+
+uint8_t warmup_running() {
+  return g_active;
+}
+
+/**
+ * Block until the warm-up is over.
+ */
+void warmup_wait() {
+  if (!g_active) return;
+  pthread_mutex_lock(&g_mutex);
+  while (g_exited < g_nb_threads) pthread_cond_wait(&g_cond, &g_mutex);
+  pthread_mutex_unlock(&g_mutex);
+  warmup_tick();
+}
+
+/**
+ * Called by the event loop, reports the progress of the warm-up every second
+ * and its end.
+ */
+void warmup_tick() {
+  if (!g_active) return;
+  uint64_t now = now_ns();
+  pthread_mutex_lock(&g_mutex);
+  uint8_t done = g_exited == g_nb_threads;
+  uint64_t end = done ? g_end_ns : now;
+  pthread_mutex_unlock(&g_mutex);
+  if (!done && now - g_report_ns < WARMUP_REPORT_MS * 1000000ULL) return;
+  g_report_ns = now;
+  LOG_MSG("warm-up %s: %lu directories, %lu files, %lu read in (%lu KB) in %lu ms\n",
+    done ? "done" : "in progress",
+    __atomic_load_n(&g_nb_dirs, __ATOMIC_RELAXED),
+    __atomic_load_n(&g_nb_files, __ATOMIC_RELAXED),
+    __atomic_load_n(&g_nb_read, __ATOMIC_RELAXED),
+    __atomic_load_n(&g_bytes_read, __ATOMIC_RELAXED) / 1024,
+    (end - g_start_ns) / 1000000);
+  if (!done) return;
+  g_active = 0;
+  for (uint8_t i = 0; i < g_nb_threads; ++i) pthread_join(g_threads[i], NULL);
+  for (uint32_t i = 0; i < g_nb_hot; ++i) free(g_hot[i].path);
+  free(g_hot);
+  g_hot = NULL;
+  g_nb_hot = 0;
+}
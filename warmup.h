@@ -0,0 +1,22 @@
+#ifndef __WARMUP_H__
+#define __WARMUP_H__
+
+#include <stdint.h>
+
+/**
+ * Warm-up of the caches at startup: threads walk the docroot, stat every
+ * entry (dentry and inode caches) and read the small files in (page cache),
+ * after the files of a manifest, hottest first. The server listens
+ * meanwhile, unless asked to wait for the end of the warm-up.
+ */
+#define WARMUP_MAX_THREADS 64
+// Files up to that size are read in by the scan
+#define WARMUP_SMALL_FILE (64 * 1024)
+#define WARMUP_REPORT_MS 1000
+
+int8_t warmup_start(uint8_t nb_threads, const char *manifest);
+uint8_t warmup_running();
+void warmup_wait();
+void warmup_tick();
+
+#endif // __WARMUP_H__